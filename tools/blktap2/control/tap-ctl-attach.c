@@ -34,7 +34,7 @@
 #include "tap-ctl.h"
 
 int
-tap_ctl_attach(const int id, const int minor)
+tap_ctl_attach(const int id, const int minor, const int thread)
 {
 	int err;
 	tapdisk_message_t message;
@@ -43,6 +43,11 @@ tap_ctl_attach(const int id, const int minor)
 	message.type = TAPDISK_MESSAGE_ATTACH;
 	message.cookie = minor;
 
+	if (thread >= 0) {
+		message.u.params.flags  = TAPDISK_MESSAGE_FLAG_THREAD;
+		message.u.params.thread = thread;
+	}
+
 	err = tap_ctl_connect_send_and_receive(id, &message, 5);
 	if (err)
 		return err;
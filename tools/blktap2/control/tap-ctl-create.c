@@ -49,11 +49,11 @@ tap_ctl_create(const char *params, char **devname)
 		goto destroy;
 	}
 
-	err = tap_ctl_attach(id, minor);
+	err = tap_ctl_attach(id, minor, -1);
 	if (err)
 		goto destroy;
 
-	err = tap_ctl_open(id, minor, params);
+	err = tap_ctl_open(id, minor, params, 0);
 	if (err)
 		goto detach;
 
@@ -371,19 +371,20 @@ usage:
 static void
 tap_cli_attach_usage(FILE *stream)
 {
-	fprintf(stream, "usage: attach <-p pid> <-m minor>\n");
+	fprintf(stream, "usage: attach <-p pid> <-m minor> [-t thread]\n");
 }
 
 static int
 tap_cli_attach(int argc, char **argv)
 {
-	int c, pid, minor;
+	int c, pid, minor, thread;
 
-	pid   = -1;
-	minor = -1;
+	pid    = -1;
+	minor  = -1;
+	thread = -1;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "p:m:h")) != -1) {
+	while ((c = getopt(argc, argv, "p:m:t:h")) != -1) {
 		switch (c) {
 		case 'p':
 			pid = atoi(optarg);
@@ -391,6 +392,9 @@ tap_cli_attach(int argc, char **argv)
 		case 'm':
 			minor = atoi(optarg);
 			break;
+		case 't':
+			thread = atoi(optarg);
+			break;
 		case '?':
 			goto usage;
 		case 'h':
@@ -402,7 +406,7 @@ tap_cli_attach(int argc, char **argv)
 	if (pid == -1 || minor == -1)
 		goto usage;
 
-	return tap_ctl_attach(pid, minor);
+	return tap_ctl_attach(pid, minor, thread);
 
 usage:
 	tap_cli_attach_usage(stderr);
@@ -633,21 +637,22 @@ usage:
 static void
 tap_cli_open_usage(FILE *stream)
 {
-	fprintf(stream, "usage: open <-p pid> <-m minor> <-a args>\n");
+	fprintf(stream, "usage: open <-p pid> <-m minor> <-a args> [-z]\n");
 }
 
 static int
 tap_cli_open(int argc, char **argv)
 {
 	const char *args;
-	int c, pid, minor;
+	int c, pid, minor, flags;
 
 	pid   = -1;
 	minor = -1;
+	flags = 0;
 	args  = NULL;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "a:m:p:h")) != -1) {
+	while ((c = getopt(argc, argv, "a:m:p:zh")) != -1) {
 		switch (c) {
 		case 'p':
 			pid = atoi(optarg);
@@ -658,6 +663,9 @@ tap_cli_open(int argc, char **argv)
 		case 'a':
 			args = optarg;
 			break;
+		case 'z':
+			flags |= TAPDISK_MESSAGE_FLAG_ZERO_DETECT;
+			break;
 		case '?':
 			goto usage;
 		case 'h':
@@ -669,7 +677,7 @@ tap_cli_open(int argc, char **argv)
 	if (pid == -1 || minor == -1 || !args)
 		goto usage;
 
-	return tap_ctl_open(pid, minor, args);
+	return tap_ctl_open(pid, minor, args, flags);
 
 usage:
 	tap_cli_open_usage(stderr);
@@ -702,6 +710,191 @@ usage:
 	return EINVAL;
 }
 
+static void
+tap_cli_qos_usage(FILE *stream)
+{
+	fprintf(stream, "usage: qos <-p pid> <-m minor> [-i iops] "
+		"[-b bytes/s] [-P priority] [-l latency target usecs]\n"
+		"(0 lifts a limit or target)\n");
+}
+
+static int
+tap_cli_qos(int argc, char **argv)
+{
+	int c, pid, minor;
+	tapdisk_message_qos_t qos;
+
+	pid   = -1;
+	minor = -1;
+	memset(&qos, 0, sizeof(qos));
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:i:b:P:l:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'i':
+			qos.iops = strtoull(optarg, NULL, 10);
+			qos.flags |= TAPDISK_MESSAGE_QOS_IOPS;
+			break;
+		case 'b':
+			qos.bps = strtoull(optarg, NULL, 10);
+			qos.flags |= TAPDISK_MESSAGE_QOS_BPS;
+			break;
+		case 'P':
+			qos.priority = atoi(optarg);
+			qos.flags |= TAPDISK_MESSAGE_QOS_PRIORITY;
+			break;
+		case 'l':
+			qos.latency_target = strtoul(optarg, NULL, 10);
+			qos.flags |= TAPDISK_MESSAGE_QOS_LATENCY;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_qos_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1 || !qos.flags)
+		goto usage;
+
+	return tap_ctl_qos(pid, minor, &qos);
+
+usage:
+	tap_cli_qos_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_stats_usage(FILE *stream)
+{
+	fprintf(stream, "usage: stats <-p pid> <-m minor>\n");
+}
+
+static int
+tap_cli_stats(int argc, char **argv)
+{
+	int c, i, pid, minor, err;
+	tapdisk_message_stats_t stats;
+
+	pid   = -1;
+	minor = -1;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_stats_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1)
+		goto usage;
+
+	err = tap_ctl_stats(pid, minor, &stats);
+	if (err)
+		return err;
+
+	printf("iops=%llu bps=%llu priority=%d latency_target=%u\n",
+	       (unsigned long long)stats.qos.iops,
+	       (unsigned long long)stats.qos.bps,
+	       stats.qos.priority, stats.qos.latency_target);
+	printf("queued=%u inflight=%u throttled=%llu cap=%llu "
+	       "p50=%u p99=%u\n", stats.queued, stats.inflight,
+	       (unsigned long long)stats.throttled,
+	       (unsigned long long)stats.cap, stats.p50, stats.p99);
+
+	for (i = 0; i < TAPDISK_MESSAGE_STATS_BUCKETS; i++) {
+		if (!stats.hist[i])
+			continue;
+
+		if (i == TAPDISK_MESSAGE_STATS_BUCKETS - 1)
+			printf("lat>=%uus=%llu\n", 1U << i,
+			       (unsigned long long)stats.hist[i]);
+		else
+			printf("lat<%uus=%llu\n", 2U << i,
+			       (unsigned long long)stats.hist[i]);
+	}
+
+	return 0;
+
+usage:
+	tap_cli_stats_usage(stderr);
+	return EINVAL;
+}
+
+static void
+tap_cli_coalesce_usage(FILE *stream)
+{
+	fprintf(stream, "usage: coalesce <-p pid> <-m minor> <-n name> "
+		"[-t reader threads] [-b MB/s]\n"
+		"(name is a read-only vhd in the chain; its parent is written)\n");
+}
+
+static int
+tap_cli_coalesce(int argc, char **argv)
+{
+	int c, pid, minor, threads;
+	uint64_t bandwidth;
+	const char *name;
+
+	pid       = -1;
+	minor     = -1;
+	threads   = 0;
+	bandwidth = 0;
+	name      = NULL;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "p:m:n:t:b:h")) != -1) {
+		switch (c) {
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'm':
+			minor = atoi(optarg);
+			break;
+		case 'n':
+			name = optarg;
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'b':
+			bandwidth = strtoull(optarg, NULL, 10) << 20;
+			break;
+		case '?':
+			goto usage;
+		case 'h':
+			tap_cli_coalesce_usage(stdout);
+			return 0;
+		}
+	}
+
+	if (pid == -1 || minor == -1 || !name || threads < 0)
+		goto usage;
+
+	return tap_ctl_coalesce(pid, minor, name, threads, bandwidth);
+
+usage:
+	tap_cli_coalesce_usage(stderr);
+	return EINVAL;
+}
+
 struct command commands[] = {
 	{ .name = "list",         .func = tap_cli_list          },
 	{ .name = "allocate",     .func = tap_cli_allocate      },
@@ -717,6 +910,9 @@ struct command commands[] = {
 	{ .name = "unpause",      .func = tap_cli_unpause       },
 	{ .name = "major",        .func = tap_cli_major         },
 	{ .name = "check",        .func = tap_cli_check         },
+	{ .name = "qos",          .func = tap_cli_qos           },
+	{ .name = "stats",        .func = tap_cli_stats         },
+	{ .name = "coalesce",     .func = tap_cli_coalesce      },
 };
 
 #define print_commands()					\
@@ -87,15 +87,23 @@ int tap_ctl_destroy(const int id, const int minor);
 int tap_ctl_spawn(void);
 pid_t tap_ctl_get_pid(const int id);
 
-int tap_ctl_attach(const int id, const int minor);
+int tap_ctl_attach(const int id, const int minor, const int thread);
 int tap_ctl_detach(const int id, const int minor);
 
-int tap_ctl_open(const int id, const int minor, const char *params);
+int tap_ctl_open(const int id, const int minor, const char *params,
+		 const int flags);
 int tap_ctl_close(const int id, const int minor, const int force);
 
 int tap_ctl_pause(const int id, const int minor);
 int tap_ctl_unpause(const int id, const int minor, const char *params);
 
+int tap_ctl_qos(const int id, const int minor,
+		const tapdisk_message_qos_t *qos);
+int tap_ctl_stats(const int id, const int minor,
+		  tapdisk_message_stats_t *stats);
+int tap_ctl_coalesce(const int id, const int minor, const char *path,
+		     const int threads, const uint64_t bandwidth);
+
 int tap_ctl_blk_major(void);
 
 #endif
@@ -54,6 +54,7 @@ struct aio_request {
 struct tdaio_state {
 	int                  fd;
 	td_driver_t         *driver;
+	int                  zero_detect;
 
 	int                  aio_free_count;	
 	struct aio_request   aio_requests[MAX_AIO_REQS];
@@ -155,6 +156,17 @@ int tdaio_open(td_driver_t *driver, const char *name, td_flag_t flags)
 
         prv->fd = fd;
 
+	/*
+	 * only holes in regular files are guaranteed to read back as
+	 * zeros, so zero-write detection is limited to those.
+	 */
+	if (flags & TD_OPEN_ZERO_DETECT) {
+		struct stat st;
+
+		if (!fstat(fd, &st) && S_ISREG(st.st_mode))
+			prv->zero_detect = 1;
+	}
+
 done:
 	return ret;	
 }
@@ -188,6 +200,7 @@ void tdaio_queue_read(td_driver_t *driver, td_request_t treq)
 
 	td_prep_read(&aio->tiocb, prv->fd, treq.buf,
 		     size, offset, tdaio_complete, aio);
+	aio->tiocb.flags |= TIOCB_FLAG_READAHEAD;
 	td_queue_tiocb(driver, &aio->tiocb);
 
 	return;
@@ -196,6 +209,37 @@ fail:
 	td_complete_request(treq, -EBUSY);
 }
 
+/*
+ * punch a hole in place of a page-aligned all-zero write.  falls back
+ * to the regular write path if the filesystem can't deallocate.
+ */
+static int tdaio_write_zeros(td_driver_t *driver, td_request_t treq,
+			     uint64_t offset, int size)
+{
+	int err;
+	struct tdaio_state *prv = (struct tdaio_state *)driver->data;
+
+	if ((offset | size) & (getpagesize() - 1))
+		return 0;
+
+	if (!tapdisk_buffer_is_zero(treq.buf, size))
+		return 0;
+
+	err = tapdisk_discard(prv->fd, offset, size);
+	td_invalidate_io(driver, prv->fd, offset, size);
+	if (err) {
+		if (err == -EOPNOTSUPP) {
+			DPRINTF("block-aio: no hole punching, zero detection "
+				"disabled\n");
+			prv->zero_detect = 0;
+		}
+		return 0;
+	}
+
+	td_complete_request(treq, 0);
+	return 1;
+}
+
 void tdaio_queue_write(td_driver_t *driver, td_request_t treq)
 {
 	int size;
@@ -207,6 +251,9 @@ void tdaio_queue_write(td_driver_t *driver, td_request_t treq)
 	size    = treq.secs * driver->info.sector_size;
 	offset  = treq.sec  * (uint64_t)driver->info.sector_size;
 
+	if (prv->zero_detect && tdaio_write_zeros(driver, treq, offset, size))
+		return;
+
 	if (prv->aio_free_count == 0)
 		goto fail;
 
@@ -224,10 +271,31 @@ fail:
 	td_complete_request(treq, -EBUSY);
 }
 
+void tdaio_queue_discard(td_driver_t *driver, td_request_t treq)
+{
+	int err;
+	uint64_t offset, size;
+	struct tdaio_state *prv;
+
+	prv    = (struct tdaio_state *)driver->data;
+	offset = treq.sec  * (uint64_t)driver->info.sector_size;
+	size   = treq.secs * (uint64_t)driver->info.sector_size;
+
+	err = tapdisk_discard(prv->fd, offset, size);
+	td_invalidate_io(driver, prv->fd, offset, size);
+
+	/* discard is only a hint: the data simply stays allocated */
+	if (err == -EOPNOTSUPP)
+		err = 0;
+
+	td_complete_request(treq, err);
+}
+
 int tdaio_close(td_driver_t *driver)
 {
 	struct tdaio_state *prv = (struct tdaio_state *)driver->data;
 	
+	td_invalidate_io(driver, prv->fd, 0, 0);
 	close(prv->fd);
 
 	return 0;
@@ -255,4 +323,5 @@ struct tap_disk tapdisk_aio = {
 	.td_get_parent_id   = tdaio_get_parent_id,
 	.td_validate_parent = tdaio_validate_parent,
 	.td_debug           = NULL,
+	.td_queue_discard   = tdaio_queue_discard,
 };
@@ -29,14 +29,20 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
+#include "libvhd.h"
 #include "tapdisk.h"
 #include "tapdisk-utils.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
 #include "tapdisk-interface.h"
 
+/* vhd.h turns on DEBUG for everyone including it; keep DBG() quiet here. */
+#undef DEBUG
+
 #ifdef DEBUG
 #define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
 #else
@@ -58,6 +64,18 @@
 #define BLOCK_CACHE_REQUESTS            (TAPDISK_DATA_REQUESTS << 3)
 #define BLOCK_CACHE_PAGE_IDLETIME       60
 
+/*
+ * The shared cache: one POSIX shm segment per host, mapped by every
+ * tapdisk that asks for it, caching 4K pages of read-only parents by
+ * (id, page).  The last tapdisk to let go of it removes it.
+ */
+#define BLOCK_CACHE_SHM_NAME            "/tapdisk-block-cache"
+#define BLOCK_CACHE_SHM_MAGIC           0x7464626c6b636163ULL
+#define BLOCK_CACHE_SHM_VERSION         2
+#define BLOCK_CACHE_SHM_WAIT_US         10000
+#define BLOCK_CACHE_SHM_WAIT_TRIES      100
+#define BLOCK_CACHE_SHM_NIL             ((uint32_t)~0U)
+
 typedef struct radix_tree               radix_tree_t;
 typedef struct radix_tree_node          radix_tree_node_t;
 typedef struct radix_tree_link          radix_tree_link_t;
@@ -68,6 +86,10 @@ typedef struct block_cache              block_cache_t;
 typedef struct block_cache_request      block_cache_request_t;
 typedef struct block_cache_stats        block_cache_stats_t;
 
+typedef struct block_cache_id           block_cache_id_t;
+typedef struct block_cache_slot         block_cache_slot_t;
+typedef struct block_cache_shm          block_cache_shm_t;
+
 struct radix_tree_page {
 	char                           *buf;
 	size_t                          size;
@@ -108,6 +130,59 @@ struct block_cache_request {
 	uint64_t                        secs;
 	td_request_t                    treq;
 	block_cache_t                  *cache;
+	td_request_t                    clone;  /* shared cache only */
+};
+
+/*
+ * Names the contents of an image: the VHD uuid where there is one, else
+ * the device and inode.  Either way the modification and change times
+ * go in too, to the nanosecond, so that a parent written since (by a
+ * coalesce, say) is not served from stale pages.
+ */
+struct block_cache_id {
+	uint8_t                         uuid[16];
+	uint64_t                        dev;
+	uint64_t                        ino;
+	uint64_t                        mtime;
+	uint64_t                        ctime;
+};
+
+struct block_cache_slot {
+	block_cache_id_t                id;
+	uint64_t                        page;
+	uint32_t                        hash_next;
+	uint32_t                        lru_prev;
+	uint32_t                        lru_next;
+	uint32_t                        used;
+};
+
+/*
+ * Followed by the hash buckets, the slots, and then (page aligned) the
+ * page data.  Everything is guarded by a robust process-shared mutex;
+ * a tapdisk dying with it held leaves the cache to be reset.
+ */
+struct block_cache_shm {
+	uint64_t                        magic;
+	uint32_t                        version;
+	uint32_t                        ready;
+
+	uint64_t                        size;
+	uint32_t                        nr_slots;
+	uint32_t                        nr_buckets;
+	uint64_t                        data_offset;
+
+	pthread_mutex_t                 lock;
+	uint32_t                        users;
+
+	uint32_t                        lru_head;  /* most recently used */
+	uint32_t                        lru_tail;
+	uint32_t                        free_head;
+
+	uint64_t                        hits;
+	uint64_t                        misses;
+	uint64_t                        inserts;
+	uint64_t                        evictions;
+	uint64_t                        resets;
 };
 
 struct block_cache_stats {
@@ -131,6 +206,9 @@ struct block_cache {
 
 	radix_tree_t                    tree;
 
+	block_cache_shm_t              *shm;
+	block_cache_id_t                id;
+
 	block_cache_stats_t             stats;
 };
 
@@ -488,6 +566,492 @@ radix_tree_free(radix_tree_t *tree)
 	radix_tree_destroy(tree);
 }
 
+static inline uint32_t *
+block_cache_shm_buckets(block_cache_shm_t *shm)
+{
+	return (uint32_t *)(shm + 1);
+}
+
+static inline block_cache_slot_t *
+block_cache_shm_slots(block_cache_shm_t *shm)
+{
+	return (block_cache_slot_t *)(block_cache_shm_buckets(shm) +
+				      shm->nr_buckets);
+}
+
+static inline char *
+block_cache_shm_page(block_cache_shm_t *shm, uint32_t slot)
+{
+	return (char *)shm + shm->data_offset +
+		((uint64_t)slot << RADIX_TREE_PAGE_SHIFT);
+}
+
+static uint64_t
+block_cache_shm_layout(uint32_t nr_slots, uint32_t nr_buckets,
+		       uint64_t *data_offset)
+{
+	uint64_t off;
+
+	off  = sizeof(block_cache_shm_t);
+	off += (uint64_t)nr_buckets * sizeof(uint32_t);
+	off += (uint64_t)nr_slots * sizeof(block_cache_slot_t);
+	off  = (off + RADIX_TREE_PAGE_SIZE - 1) &
+		~((uint64_t)RADIX_TREE_PAGE_SIZE - 1);
+
+	*data_offset = off;
+	return off + ((uint64_t)nr_slots << RADIX_TREE_PAGE_SHIFT);
+}
+
+static uint32_t
+block_cache_shm_hash(block_cache_shm_t *shm,
+		     const block_cache_id_t *id, uint64_t page)
+{
+	int i;
+	uint64_t hash;
+	const uint8_t *p;
+
+	/* FNV-1a */
+	hash = 14695981039346656037ULL;
+	p    = (const uint8_t *)id;
+	for (i = 0; i < sizeof(*id); i++)
+		hash = (hash ^ p[i]) * 1099511628211ULL;
+	for (i = 0; i < sizeof(page); i++, page >>= 8)
+		hash = (hash ^ (page & 0xff)) * 1099511628211ULL;
+
+	return (uint32_t)(hash ^ (hash >> 32)) & (shm->nr_buckets - 1);
+}
+
+static void
+block_cache_shm_reset(block_cache_shm_t *shm)
+{
+	uint32_t i, *buckets;
+	block_cache_slot_t *slots;
+
+	buckets = block_cache_shm_buckets(shm);
+	slots   = block_cache_shm_slots(shm);
+
+	for (i = 0; i < shm->nr_buckets; i++)
+		buckets[i] = BLOCK_CACHE_SHM_NIL;
+
+	/* free slots are chained through hash_next */
+	for (i = 0; i < shm->nr_slots; i++) {
+		memset(slots + i, 0, sizeof(block_cache_slot_t));
+		slots[i].hash_next = (i + 1 < shm->nr_slots ?
+				      i + 1 : BLOCK_CACHE_SHM_NIL);
+		slots[i].lru_prev  = BLOCK_CACHE_SHM_NIL;
+		slots[i].lru_next  = BLOCK_CACHE_SHM_NIL;
+	}
+
+	shm->free_head = (shm->nr_slots ? 0 : BLOCK_CACHE_SHM_NIL);
+	shm->lru_head  = BLOCK_CACHE_SHM_NIL;
+	shm->lru_tail  = BLOCK_CACHE_SHM_NIL;
+}
+
+static int
+block_cache_shm_lock(block_cache_shm_t *shm)
+{
+	int err;
+
+	err = pthread_mutex_lock(&shm->lock);
+	if (err == EOWNERDEAD) {
+		/* the owner died mid-update: start over */
+		WARN("shared block cache lock owner died, resetting\n");
+		block_cache_shm_reset(shm);
+		shm->resets++;
+		pthread_mutex_consistent(&shm->lock);
+		err = 0;
+	}
+
+	return -err;
+}
+
+static inline void
+block_cache_shm_unlock(block_cache_shm_t *shm)
+{
+	pthread_mutex_unlock(&shm->lock);
+}
+
+static uint32_t
+block_cache_shm_find(block_cache_shm_t *shm,
+		     const block_cache_id_t *id, uint64_t page)
+{
+	uint32_t i;
+	block_cache_slot_t *slots;
+
+	slots = block_cache_shm_slots(shm);
+
+	for (i = block_cache_shm_buckets(shm)[block_cache_shm_hash(shm, id, page)];
+	     i != BLOCK_CACHE_SHM_NIL; i = slots[i].hash_next)
+		if (slots[i].page == page &&
+		    !memcmp(&slots[i].id, id, sizeof(*id)))
+			return i;
+
+	return BLOCK_CACHE_SHM_NIL;
+}
+
+static void
+block_cache_shm_unhash(block_cache_shm_t *shm, uint32_t slot)
+{
+	uint32_t *p;
+	block_cache_slot_t *slots;
+
+	slots = block_cache_shm_slots(shm);
+	p     = block_cache_shm_buckets(shm) +
+		block_cache_shm_hash(shm, &slots[slot].id, slots[slot].page);
+
+	for (; *p != BLOCK_CACHE_SHM_NIL; p = &slots[*p].hash_next)
+		if (*p == slot) {
+			*p = slots[slot].hash_next;
+			break;
+		}
+
+	slots[slot].hash_next = BLOCK_CACHE_SHM_NIL;
+	slots[slot].used      = 0;
+}
+
+static void
+block_cache_shm_lru_del(block_cache_shm_t *shm, uint32_t slot)
+{
+	block_cache_slot_t *slots, *s;
+
+	slots = block_cache_shm_slots(shm);
+	s     = slots + slot;
+
+	if (s->lru_prev != BLOCK_CACHE_SHM_NIL)
+		slots[s->lru_prev].lru_next = s->lru_next;
+	else
+		shm->lru_head = s->lru_next;
+
+	if (s->lru_next != BLOCK_CACHE_SHM_NIL)
+		slots[s->lru_next].lru_prev = s->lru_prev;
+	else
+		shm->lru_tail = s->lru_prev;
+
+	s->lru_prev = s->lru_next = BLOCK_CACHE_SHM_NIL;
+}
+
+static void
+block_cache_shm_lru_add(block_cache_shm_t *shm, uint32_t slot)
+{
+	block_cache_slot_t *slots, *s;
+
+	slots = block_cache_shm_slots(shm);
+	s     = slots + slot;
+
+	s->lru_prev = BLOCK_CACHE_SHM_NIL;
+	s->lru_next = shm->lru_head;
+
+	if (shm->lru_head != BLOCK_CACHE_SHM_NIL)
+		slots[shm->lru_head].lru_prev = slot;
+	else
+		shm->lru_tail = slot;
+
+	shm->lru_head = slot;
+}
+
+/*
+ * copy @n pages from @page on out of the cache: all of them, or none
+ */
+static int
+block_cache_shm_get(block_cache_t *cache, uint64_t page, int n, char *buf)
+{
+	int i;
+	uint32_t slot[2];
+	block_cache_shm_t *shm = cache->shm;
+
+	if (block_cache_shm_lock(shm))
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		slot[i] = block_cache_shm_find(shm, &cache->id, page + i);
+		if (slot[i] == BLOCK_CACHE_SHM_NIL) {
+			shm->misses++;
+			block_cache_shm_unlock(shm);
+			return 0;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		memcpy(buf + (i << RADIX_TREE_PAGE_SHIFT),
+		       block_cache_shm_page(shm, slot[i]), RADIX_TREE_PAGE_SIZE);
+		block_cache_shm_lru_del(shm, slot[i]);
+		block_cache_shm_lru_add(shm, slot[i]);
+	}
+
+	shm->hits++;
+	block_cache_shm_unlock(shm);
+
+	return 1;
+}
+
+static void
+block_cache_shm_put(block_cache_t *cache, uint64_t page, const char *buf)
+{
+	uint32_t slot, *bucket;
+	block_cache_slot_t *slots;
+	block_cache_shm_t *shm = cache->shm;
+
+	if (block_cache_shm_lock(shm))
+		return;
+
+	slots = block_cache_shm_slots(shm);
+
+	slot = block_cache_shm_find(shm, &cache->id, page);
+	if (slot != BLOCK_CACHE_SHM_NIL) {
+		/* another reader got there first */
+		block_cache_shm_lru_del(shm, slot);
+		block_cache_shm_lru_add(shm, slot);
+		goto out;
+	}
+
+	if (shm->free_head != BLOCK_CACHE_SHM_NIL) {
+		slot = shm->free_head;
+		shm->free_head = slots[slot].hash_next;
+	} else {
+		slot = shm->lru_tail;
+		if (slot == BLOCK_CACHE_SHM_NIL)
+			goto out;
+
+		block_cache_shm_lru_del(shm, slot);
+		block_cache_shm_unhash(shm, slot);
+		shm->evictions++;
+	}
+
+	slots[slot].id   = cache->id;
+	slots[slot].page = page;
+	slots[slot].used = 1;
+	memcpy(block_cache_shm_page(shm, slot), buf, RADIX_TREE_PAGE_SIZE);
+
+	bucket = block_cache_shm_buckets(shm) +
+		block_cache_shm_hash(shm, &cache->id, page);
+	slots[slot].hash_next = *bucket;
+	*bucket = slot;
+
+	block_cache_shm_lru_add(shm, slot);
+	shm->inserts++;
+
+out:
+	block_cache_shm_unlock(shm);
+}
+
+static int
+block_cache_shm_init(block_cache_shm_t *shm, uint64_t size,
+		     uint32_t nr_slots, uint32_t nr_buckets,
+		     uint64_t data_offset)
+{
+	int err;
+	pthread_mutexattr_t attr;
+
+	shm->size        = size;
+	shm->nr_slots    = nr_slots;
+	shm->nr_buckets  = nr_buckets;
+	shm->data_offset = data_offset;
+
+	err = pthread_mutexattr_init(&attr);
+	if (err)
+		return -err;
+
+	err = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	if (!err)
+		err = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	if (!err)
+		err = pthread_mutex_init(&shm->lock, &attr);
+
+	pthread_mutexattr_destroy(&attr);
+	if (err)
+		return -err;
+
+	block_cache_shm_reset(shm);
+
+	shm->magic   = BLOCK_CACHE_SHM_MAGIC;
+	shm->version = BLOCK_CACHE_SHM_VERSION;
+	__sync_synchronize();
+	shm->ready   = 1;
+
+	return 0;
+}
+
+/*
+ * Map the host's shared cache, creating it if this is the first tapdisk
+ * to get here.  The shared cache is off unless TAPDISK_BLOCK_CACHE_MB
+ * is set, which sizes a new cache.  Returns NULL if there's no usable
+ * shared cache, leaving the caller to cache privately.
+ */
+static block_cache_shm_t *
+block_cache_shm_map(void)
+{
+	char *env;
+	struct stat st;
+	block_cache_shm_t *shm;
+	int i, fd, err, created;
+	uint64_t size, mb, data_offset;
+	uint32_t nr_slots, nr_buckets;
+
+	env = getenv("TAPDISK_BLOCK_CACHE_MB");
+	mb  = env ? strtoull(env, NULL, 10) : 0;
+	if (!mb)
+		return NULL;
+
+	created = 1;
+	fd = shm_open(BLOCK_CACHE_SHM_NAME, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd == -1) {
+		if (errno != EEXIST)
+			goto fail_open;
+
+		created = 0;
+		fd = shm_open(BLOCK_CACHE_SHM_NAME, O_RDWR, 0);
+		if (fd == -1)
+			goto fail_open;
+	}
+
+	if (created) {
+		nr_slots = (mb << 20) >> RADIX_TREE_PAGE_SHIFT;
+		for (nr_buckets = 2; nr_buckets < nr_slots; nr_buckets <<= 1)
+			;
+
+		size = block_cache_shm_layout(nr_slots, nr_buckets,
+					      &data_offset);
+		if (ftruncate(fd, size)) {
+			err = -errno;
+			goto fail;
+		}
+	} else {
+		/* the creator may not have sized it yet */
+		for (i = 0;; i++) {
+			if (fstat(fd, &st)) {
+				err = -errno;
+				goto fail;
+			}
+			if (st.st_size >= sizeof(block_cache_shm_t))
+				break;
+			if (i == BLOCK_CACHE_SHM_WAIT_TRIES) {
+				err = -ETIMEDOUT;
+				goto fail;
+			}
+			usleep(BLOCK_CACHE_SHM_WAIT_US);
+		}
+		size = st.st_size;
+	}
+
+	shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED) {
+		err = -errno;
+		goto fail;
+	}
+
+	close(fd);
+
+	if (mlock(shm, size))
+		DPRINTF("mlock of shared block cache failed: %d\n", -errno);
+
+	if (created) {
+		err = block_cache_shm_init(shm, size, nr_slots,
+					   nr_buckets, data_offset);
+		if (err) {
+			munmap(shm, size);
+			shm_unlink(BLOCK_CACHE_SHM_NAME);
+			goto out;
+		}
+
+		DPRINTF("created shared block cache: %u pages\n", nr_slots);
+		goto get;
+	}
+
+	for (i = 0; !shm->ready; i++) {
+		if (i == BLOCK_CACHE_SHM_WAIT_TRIES) {
+			/* the creator died; let the next one start over */
+			shm_unlink(BLOCK_CACHE_SHM_NAME);
+			err = -ETIMEDOUT;
+			goto fail_map;
+		}
+		usleep(BLOCK_CACHE_SHM_WAIT_US);
+	}
+	__sync_synchronize();
+
+	if (shm->magic != BLOCK_CACHE_SHM_MAGIC ||
+	    shm->version != BLOCK_CACHE_SHM_VERSION ||
+	    shm->size != size) {
+		err = -EINVAL;
+		goto fail_map;
+	}
+
+get:
+	err = block_cache_shm_lock(shm);
+	if (err)
+		goto fail_map;
+	shm->users++;
+	block_cache_shm_unlock(shm);
+
+	return shm;
+
+fail_map:
+	munmap(shm, size);
+	goto out;
+fail_open:
+	err = -errno;
+	goto out;
+fail:
+	close(fd);
+	if (created)
+		shm_unlink(BLOCK_CACHE_SHM_NAME);
+out:
+	DPRINTF("no shared block cache: %d\n", err);
+	return NULL;
+}
+
+/*
+ * A tapdisk that dies without getting here leaves the count high, and
+ * with it the segment, until the host reboots or it is removed by hand.
+ * A tapdisk mapping the segment just as the last user unlinks it ends
+ * up with a cache of its own, which goes when it closes.
+ */
+static void
+block_cache_shm_unmap(block_cache_shm_t *shm)
+{
+	int last;
+
+	last = 0;
+	if (!block_cache_shm_lock(shm)) {
+		last = !--shm->users;
+		if (last)
+			shm_unlink(BLOCK_CACHE_SHM_NAME);
+		block_cache_shm_unlock(shm);
+	}
+
+	if (last)
+		DPRINTF("removed shared block cache\n");
+
+	munmap(shm, shm->size);
+}
+
+static int
+block_cache_get_id(const char *name, block_cache_id_t *id)
+{
+	struct stat st;
+	vhd_context_t vhd;
+
+	memset(id, 0, sizeof(*id));
+
+	if (stat(name, &st))
+		return -errno;
+
+	id->dev   = st.st_dev;
+	id->ino   = st.st_ino;
+	id->mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL +
+		st.st_mtim.tv_nsec;
+	id->ctime = (uint64_t)st.st_ctim.tv_sec * 1000000000ULL +
+		st.st_ctim.tv_nsec;
+
+	if (!vhd_open(&vhd, name, VHD_OPEN_RDONLY | VHD_OPEN_IGNORE_DISABLED)) {
+		memcpy(id->uuid, &vhd.footer.uuid,
+		       MIN(sizeof(id->uuid), sizeof(vhd.footer.uuid)));
+		id->dev = id->ino = 0;
+		vhd_close(&vhd);
+	}
+
+	return 0;
+}
+
 static void
 block_cache_prune_event(event_id_t id, char mode, void *private)
 {
@@ -554,12 +1118,12 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 	if (cache->timeout_id < 0)
 		goto fail;
 
-	DPRINTF("opening cache for %s, sectors: %"PRIu64", "
-		"tree: %p, height: %d\n",
-		cache->name, cache->sectors, tree, tree->height);
+	if (!block_cache_get_id(name, &cache->id))
+		cache->shm = block_cache_shm_map();
 
-	if (mlockall(MCL_CURRENT | MCL_FUTURE))
-		DPRINTF("mlockall failed: %d\n", -errno);
+	DPRINTF("opening cache for %s, sectors: %"PRIu64", "
+		"tree: %p, height: %d, shared: %d\n",
+		cache->name, cache->sectors, tree, tree->height, !!cache->shm);
 
 	return 0;
 
@@ -584,6 +1148,9 @@ block_cache_close(td_driver_t *driver)
 	radix_tree_free(tree);
 	free(cache->name);
 
+	if (cache->shm)
+		block_cache_shm_unmap(cache->shm);
+
 	return 0;
 }
 
@@ -706,6 +1273,100 @@ out:
 	td_forward_request(clone);
 }
 
+static void
+block_cache_shm_populate(td_request_t clone, int err)
+{
+	int i;
+	off_t off;
+	uint64_t page;
+	block_cache_t *cache;
+	block_cache_request_t *breq;
+
+	breq        = (block_cache_request_t *)clone.cb_data;
+	cache       = breq->cache;
+	breq->secs -= clone.secs;
+	breq->err   = (breq->err ? breq->err : err);
+
+	if (breq->secs)
+		return;
+
+	if (!breq->err) {
+		off = (breq->treq.sec - breq->clone.sec) << RADIX_TREE_NODE_SHIFT;
+		memcpy(breq->treq.buf, breq->buf + off,
+		       breq->treq.secs << RADIX_TREE_NODE_SHIFT);
+
+		/* a short page at the end of the disk is not cached */
+		page = breq->clone.sec / BLOCK_CACHE_NODES_PER_PAGE;
+		for (i = 0; i < breq->clone.secs / BLOCK_CACHE_NODES_PER_PAGE; i++)
+			block_cache_shm_put(cache, page + i,
+					    breq->buf + (i << RADIX_TREE_PAGE_SHIFT));
+	}
+
+	free(breq->buf);
+	td_complete_request(breq->treq, breq->err);
+	block_cache_put_request(cache, breq);
+}
+
+/*
+ * The shared cache holds whole pages, so a miss reads the pages
+ * around the request.
+ */
+static void
+block_cache_shm_queue_read(block_cache_t *cache, td_request_t treq)
+{
+	int n;
+	char *buf;
+	off_t off;
+	uint64_t first, last;
+	td_request_t clone;
+	block_cache_request_t *breq;
+	char pages[2 * RADIX_TREE_PAGE_SIZE];
+
+	first = treq.sec / BLOCK_CACHE_NODES_PER_PAGE;
+	last  = (treq.sec + treq.secs - 1) / BLOCK_CACHE_NODES_PER_PAGE;
+	n     = last - first + 1;
+	off   = (treq.sec - first * BLOCK_CACHE_NODES_PER_PAGE) <<
+		RADIX_TREE_NODE_SHIFT;
+
+	if (block_cache_shm_get(cache, first, n, pages)) {
+		cache->stats.hits += treq.secs;
+		memcpy(treq.buf, pages + off, treq.secs << RADIX_TREE_NODE_SHIFT);
+		td_complete_request(treq, 0);
+		return;
+	}
+
+	cache->stats.misses += treq.secs;
+
+	breq = block_cache_get_request(cache);
+	if (!breq)
+		return td_forward_request(treq);
+
+	clone      = treq;
+	clone.sec  = first * BLOCK_CACHE_NODES_PER_PAGE;
+	clone.secs = n * BLOCK_CACHE_NODES_PER_PAGE;
+	if (clone.sec + clone.secs > cache->sectors)
+		clone.secs = cache->sectors - clone.sec;
+
+	if (posix_memalign((void **)&buf, RADIX_TREE_PAGE_SIZE,
+			   clone.secs << RADIX_TREE_NODE_SHIFT)) {
+		block_cache_put_request(cache, breq);
+		return td_forward_request(treq);
+	}
+
+	clone.buf     = buf;
+	clone.cb      = block_cache_shm_populate;
+	clone.cb_data = breq;
+
+	breq->treq    = treq;
+	breq->clone   = clone;
+	breq->secs    = clone.secs;
+	breq->err     = 0;
+	breq->buf     = buf;
+	breq->cache   = cache;
+
+	td_forward_request(clone);
+}
+
 static void
 block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 {
@@ -722,6 +1383,9 @@ block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 	if (treq.secs > BLOCK_CACHE_NODES_PER_PAGE)
 		return td_forward_request(treq);
 
+	if (cache->shm)
+		return block_cache_shm_queue_read(cache, treq);
+
 	for (i = 0; i < treq.secs; i++) {
 		iov[i] = radix_tree_find_leaf(tree, treq.sec + i);
 		if (!iov[i])
@@ -771,6 +1435,15 @@ block_cache_debug(td_driver_t *driver)
 	WARN("BLOCK CACHE %s\n", cache->name);
 	WARN("reads: %"PRIu64", hits: %"PRIu64", misses: %"PRIu64", prunes: %"PRIu64"\n",
 	     stats->reads, stats->hits, stats->misses, stats->prunes);
+
+	if (cache->shm) {
+		block_cache_shm_t *shm = cache->shm;
+
+		WARN("shared: pages: %u, hits: %"PRIu64", misses: %"PRIu64", "
+		     "inserts: %"PRIu64", evictions: %"PRIu64", "
+		     "resets: %"PRIu64"\n", shm->nr_slots, shm->hits,
+		     shm->misses, shm->inserts, shm->evictions, shm->resets);
+	}
 }
 
 struct tap_disk tapdisk_block_cache = {
@@ -0,0 +1,1729 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * qcow2 images (versions 2 and 3), read and written natively.
+ *
+ * The L1 table lives in memory; L2 tables are loaded asynchronously into
+ * an LRU cache.  Requests for a table being loaded wait on it, which
+ * keeps it from being evicted before they have used it.  Unallocated
+ * clusters are read from the parent through td_forward_request.
+ *
+ * A write to an unallocated cluster allocates a new one: the whole
+ * cluster is assembled (parent data, or zeros, around the guest's
+ * sectors), written, and then recorded in the cached L2 table.  Each
+ * table has at most one write in flight, which carries every entry made
+ * ready since the previous one, so a burst of allocations costs one
+ * metadata write per table rather than one per cluster.  A guest write
+ * completes only once its L2 entry is on disk.
+ *
+ * Clusters are appended to the end of the file.  Their refcounts are
+ * set in batches, ahead of use, with one synchronous refcount block
+ * write per batch; a crash can leak the unused part of a batch but never
+ * hand out a cluster twice.
+ *
+ * Encryption, internal snapshots (other than read-only) and refcount
+ * widths other than 16 bits are not supported.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <libgen.h>
+#include <zlib.h>
+#include <sys/stat.h>
+
+#include "bswap.h"
+#include "tapdisk.h"
+#include "tapdisk-driver.h"
+#include "tapdisk-interface.h"
+#include "tapdisk-disktype.h"
+
+#ifndef O_LARGEFILE
+#define O_LARGEFILE 0
+#endif
+
+#define MIN(a, b)                  (((a) < (b)) ? (a) : (b))
+#define MAX(a, b)                  (((a) > (b)) ? (a) : (b))
+
+#define QCOW2_MAGIC                (('Q' << 24) | ('F' << 16) | ('I' << 8) | 0xfb)
+#define QCOW1_VERSION              1
+
+#define QCOW2_OFLAG_COPIED         (1ULL << 63)
+#define QCOW2_OFLAG_COMPRESSED     (1ULL << 62)
+#define QCOW2_OFLAG_ZERO           (1ULL << 0)
+#define QCOW2_OFFSET_MASK          0x00fffffffffffe00ULL
+#define QCOW2_RT_OFFSET_MASK       0xfffffffffffffe00ULL
+
+#define QCOW2_MIN_CLUSTER_BITS     9
+#define QCOW2_MAX_CLUSTER_BITS     21
+#define QCOW2_REFCOUNT_ORDER       4
+#define QCOW2_MAX_L1_ENTRIES       (1 << 22) /* a 32MB table, as qemu */
+
+#define QCOW2_SECTOR_SIZE          512
+#define QCOW2_ALIGN                4096
+
+#define QCOW2_L2_CACHE_SIZE        32      /* tables */
+#define QCOW2_L2_CACHE_MIN         4
+#define QCOW2_L2_CACHE_MAX         4096
+#define QCOW2_ALLOCS               64      /* allocations in flight */
+#define QCOW2_RESERVE_BATCH        256     /* clusters per refcount write */
+
+#define QCOW2_L2_LOADING           0x01
+#define QCOW2_L2_WRITING           0x02
+#define QCOW2_L2_NEW               0x04    /* no L1 entry yet */
+
+/* a request which must wait for a table or cluster in transit */
+#define QCOW2_BLOCKED              (-EAGAIN)
+/* a request queued on a table being loaded */
+#define QCOW2_QUEUED               1
+
+struct qcow2_header {
+	uint32_t                   magic;
+	uint32_t                   version;
+	uint64_t                   backing_file_offset;
+	uint32_t                   backing_file_size;
+	uint32_t                   cluster_bits;
+	uint64_t                   size;
+	uint32_t                   crypt_method;
+	uint32_t                   l1_size;
+	uint64_t                   l1_table_offset;
+	uint64_t                   refcount_table_offset;
+	uint32_t                   refcount_table_clusters;
+	uint32_t                   nb_snapshots;
+	uint64_t                   snapshots_offset;
+
+	/* version 3 */
+	uint64_t                   incompatible_features;
+	uint64_t                   compatible_features;
+	uint64_t                   autoclear_features;
+	uint32_t                   refcount_order;
+	uint32_t                   header_length;
+} __attribute__((packed));
+
+struct tdqcow2_state;
+
+struct qcow2_request {
+	td_request_t               treq;
+	struct tiocb               tiocb;
+	struct tdqcow2_state      *state;
+	struct qcow2_request      *next;
+};
+
+struct qcow2_alloc;
+
+struct qcow2_l2 {
+	int                        index;    /* L1 index, -1 if unused */
+	int                        flags;
+	uint64_t                   offset;
+	uint64_t                   used;     /* lru clock */
+	struct qcow2_request      *waiting;  /* requests for a loading table */
+
+	uint64_t                  *table;    /* as on disk */
+	uint64_t                  *wbuf;     /* sectors being written */
+
+	int                        allocs;   /* allocations in progress */
+	struct qcow2_alloc        *ready;    /* entries for the next write */
+	struct qcow2_alloc        *writing;  /* entries in the current one */
+
+	struct tiocb               tiocb;
+	struct tdqcow2_state      *state;
+};
+
+struct qcow2_alloc {
+	int                        inuse;
+	int                        error;
+	uint64_t                   cluster;  /* guest cluster */
+	uint64_t                   offset;   /* host cluster */
+	uint64_t                   old;      /* previous L2 entry, as on disk */
+
+	int                        pending;  /* parent sectors outstanding */
+	int                        fill;     /* sectors of cluster on disk */
+	char                      *buf;
+	char                      *data;     /* what gets written */
+
+	td_request_t               treq;
+	struct qcow2_l2           *l2;
+	struct qcow2_alloc        *next;
+
+	struct tiocb               tiocb;
+	struct tdqcow2_state      *state;
+};
+
+struct tdqcow2_state {
+	int                        fd;
+	char                      *name;
+	td_driver_t               *driver;
+	int                        rdonly;
+
+	int                        version;
+	int                        cluster_bits;
+	uint64_t                   cluster_size;
+	int                        cluster_secs;
+	int                        l2_bits;
+	uint64_t                   size;
+	uint64_t                   backing_file_offset;
+	uint32_t                   backing_file_size;
+	char                      *header;   /* first sector, as on disk */
+
+	uint32_t                   l1_size;
+	uint64_t                   l1_offset;
+	uint64_t                  *l1;       /* as on disk */
+
+	int                        l2_cache_size;
+	struct qcow2_l2           *l2_cache;
+	int                       *l2_map;   /* L1 index -> cache slot */
+	uint64_t                   l2_clock;
+
+	uint64_t                   rt_offset;
+	uint32_t                   rt_clusters;
+	uint64_t                  *rt;       /* refcount table, as on disk */
+	uint16_t                  *rb;       /* refcount block, as on disk */
+	int64_t                    rb_index;
+	uint64_t                   next_cluster;
+	uint64_t                   rsv_next; /* refcounted but unused */
+	uint64_t                   rsv_end;
+
+	char                      *zbuf;     /* compressed cluster */
+	char                      *zcache;   /* ... and its contents */
+	uint64_t                   zcache_entry;
+
+	struct qcow2_alloc         allocs[QCOW2_ALLOCS];
+
+	int                        nr_reqs;
+	int                        req_free_count;
+	struct qcow2_request      *reqs;
+	struct qcow2_request     **req_free_list;
+
+	uint64_t                   l2_hits;
+	uint64_t                   l2_misses;
+	uint64_t                   l2_evictions;
+	uint64_t                   l2_writes;
+	uint64_t                   l2_updates;
+	uint64_t                   allocations;
+	uint64_t                   cow_reads;
+	uint64_t                   reservations;
+	uint64_t                   compressed_reads;
+};
+
+static inline uint64_t
+qcow2_round_up(uint64_t n, uint64_t align)
+{
+	return (n + align - 1) & ~(align - 1);
+}
+
+static inline uint32_t
+qcow2_l1_index(struct tdqcow2_state *s, uint64_t cluster)
+{
+	return cluster >> s->l2_bits;
+}
+
+static inline uint32_t
+qcow2_l2_index(struct tdqcow2_state *s, uint64_t cluster)
+{
+	return cluster & ((1ULL << s->l2_bits) - 1);
+}
+
+static inline uint64_t
+qcow2_cluster(struct tdqcow2_state *s, td_sector_t sec)
+{
+	return sec >> (s->cluster_bits - 9);
+}
+
+static void *
+qcow2_alloc_buffer(size_t size)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, QCOW2_ALIGN, size))
+		return NULL;
+
+	memset(buf, 0, size);
+	return buf;
+}
+
+static int
+qcow2_pread(struct tdqcow2_state *s, void *buf, size_t size, uint64_t off)
+{
+	ssize_t ret;
+
+	ret = pread(s->fd, buf, size, off);
+	if (ret == size)
+		return 0;
+
+	return (ret == -1 ? -errno : -EIO);
+}
+
+/*
+ * metadata is written synchronously, outside the queue, so any
+ * read-ahead the queue holds for the range must go
+ */
+static int
+qcow2_pwrite(struct tdqcow2_state *s, void *buf, size_t size, uint64_t off)
+{
+	ssize_t ret;
+
+	td_invalidate_io(s->driver, s->fd, off, size);
+
+	ret = pwrite(s->fd, buf, size, off);
+	if (ret == size)
+		return 0;
+
+	return (ret == -1 ? -errno : -EIO);
+}
+
+static int
+qcow2_write_header(struct tdqcow2_state *s)
+{
+	return qcow2_pwrite(s, s->header, QCOW2_SECTOR_SIZE, 0);
+}
+
+static int
+qcow2_read_header(struct tdqcow2_state *s)
+{
+	int err;
+	uint64_t l1_min, entries;
+	struct qcow2_header *h;
+
+	s->header = qcow2_alloc_buffer(QCOW2_SECTOR_SIZE);
+	if (!s->header)
+		return -ENOMEM;
+
+	err = qcow2_pread(s, s->header, QCOW2_SECTOR_SIZE, 0);
+	if (err) {
+		EPRINTF("%s: failed to read header: %d\n", s->name, err);
+		return err;
+	}
+
+	h = (struct qcow2_header *)s->header;
+
+	if (be32_to_cpu(h->magic) != QCOW2_MAGIC) {
+		EPRINTF("%s: not a qcow image\n", s->name);
+		return -EINVAL;
+	}
+
+	s->version = be32_to_cpu(h->version);
+	if (s->version != 2 && s->version != 3) {
+		EPRINTF("%s: unsupported qcow version %d\n",
+			s->name, s->version);
+		return -EINVAL;
+	}
+
+	if (be32_to_cpu(h->crypt_method)) {
+		EPRINTF("%s: encrypted images are not supported\n", s->name);
+		return -EINVAL;
+	}
+
+	if (s->version >= 3) {
+		if (be64_to_cpu(h->incompatible_features)) {
+			EPRINTF("%s: unsupported incompatible features "
+				"0x%"PRIx64"\n", s->name,
+				be64_to_cpu(h->incompatible_features));
+			return -EINVAL;
+		}
+
+		if (be32_to_cpu(h->refcount_order) != QCOW2_REFCOUNT_ORDER) {
+			EPRINTF("%s: unsupported refcount order %u\n",
+				s->name, be32_to_cpu(h->refcount_order));
+			return -EINVAL;
+		}
+	}
+
+	if (be32_to_cpu(h->nb_snapshots) && !s->rdonly) {
+		EPRINTF("%s: images with snapshots can only be read\n",
+			s->name);
+		return -EINVAL;
+	}
+
+	s->cluster_bits = be32_to_cpu(h->cluster_bits);
+	if (s->cluster_bits < QCOW2_MIN_CLUSTER_BITS ||
+	    s->cluster_bits > QCOW2_MAX_CLUSTER_BITS) {
+		EPRINTF("%s: bad cluster size 2^%d\n",
+			s->name, s->cluster_bits);
+		return -EINVAL;
+	}
+
+	s->cluster_size = 1ULL << s->cluster_bits;
+	s->cluster_secs = s->cluster_size >> 9;
+	s->l2_bits      = s->cluster_bits - 3;
+	s->size         = be64_to_cpu(h->size);
+
+	s->backing_file_offset = be64_to_cpu(h->backing_file_offset);
+	s->backing_file_size   = be32_to_cpu(h->backing_file_size);
+
+	s->l1_size   = be32_to_cpu(h->l1_size);
+	s->l1_offset = be64_to_cpu(h->l1_table_offset);
+
+	/*
+	 * The table may be longer than the virtual size calls for (it is
+	 * grown for internal snapshots and kept by a shrinking resize), but
+	 * it is read in whole, so one larger than any sane image has is
+	 * refused.
+	 */
+	entries = s->cluster_size << s->l2_bits;
+	l1_min  = s->size / entries + !!(s->size % entries);
+	if (s->l1_size < l1_min || s->l1_size > QCOW2_MAX_L1_ENTRIES ||
+	    s->l1_offset & (s->cluster_size - 1)) {
+		EPRINTF("%s: bad L1 table: %u entries at 0x%"PRIx64"\n",
+			s->name, s->l1_size, s->l1_offset);
+		return -EINVAL;
+	}
+
+	s->rt_offset   = be64_to_cpu(h->refcount_table_offset);
+	s->rt_clusters = be32_to_cpu(h->refcount_table_clusters);
+
+	return 0;
+}
+
+static int
+qcow2_load_l1(struct tdqcow2_state *s)
+{
+	size_t size;
+
+	size  = qcow2_round_up((uint64_t)s->l1_size * sizeof(uint64_t),
+			       QCOW2_SECTOR_SIZE);
+	size  = MAX(size, QCOW2_SECTOR_SIZE);
+	s->l1 = qcow2_alloc_buffer(size);
+	if (!s->l1)
+		return -ENOMEM;
+
+	if (!s->l1_size)
+		return 0;
+
+	return qcow2_pread(s, s->l1, size, s->l1_offset);
+}
+
+static int
+qcow2_write_l1(struct tdqcow2_state *s, uint32_t idx, uint64_t offset)
+{
+	int err;
+	uint64_t sec, old;
+
+	old        = s->l1[idx];
+	s->l1[idx] = cpu_to_be64(offset | QCOW2_OFLAG_COPIED);
+
+	sec = (idx * sizeof(uint64_t)) & ~(uint64_t)(QCOW2_SECTOR_SIZE - 1);
+	err = qcow2_pwrite(s, (char *)s->l1 + sec,
+			   QCOW2_SECTOR_SIZE, s->l1_offset + sec);
+	if (err)
+		s->l1[idx] = old;
+
+	return err;
+}
+
+/*
+ * refcounts are only needed for allocating, so read-only opens skip
+ * them.  New clusters come from the end of the file.
+ */
+static int
+qcow2_load_refcounts(struct tdqcow2_state *s)
+{
+	int err;
+	off_t end;
+	size_t size;
+
+	if (!s->rt_clusters || s->rt_offset & (s->cluster_size - 1)) {
+		EPRINTF("%s: bad refcount table: %u clusters at 0x%"PRIx64"\n",
+			s->name, s->rt_clusters, s->rt_offset);
+		return -EINVAL;
+	}
+
+	size  = (size_t)s->rt_clusters << s->cluster_bits;
+	s->rt = qcow2_alloc_buffer(size);
+	if (!s->rt)
+		return -ENOMEM;
+
+	err = qcow2_pread(s, s->rt, size, s->rt_offset);
+	if (err)
+		return err;
+
+	s->rb = qcow2_alloc_buffer(s->cluster_size);
+	if (!s->rb)
+		return -ENOMEM;
+
+	s->rb_index = -1;
+
+	end = lseek(s->fd, 0, SEEK_END);
+	if (end == (off_t)-1)
+		return -errno;
+
+	s->next_cluster = qcow2_round_up(end, s->cluster_size) >>
+		s->cluster_bits;
+
+	return 0;
+}
+
+/*
+ * a new refcount table, twice the size, goes after a new refcount
+ * block which covers both; the old table is leaked.
+ */
+static int
+qcow2_grow_refcount_table(struct tdqcow2_state *s)
+{
+	int err;
+	char *table;
+	struct qcow2_header *h;
+	uint64_t per_block, per_cluster, idx, block, base, clusters, i;
+
+	per_block   = s->cluster_size / sizeof(uint16_t);
+	per_cluster = s->cluster_size / sizeof(uint64_t);
+
+	idx = s->next_cluster;
+
+	for (;;) {
+		block    = idx / per_block;
+		base     = block * per_block;
+		clusters = MAX((uint64_t)s->rt_clusters * 2,
+			       (block + per_cluster) / per_cluster);
+
+		if (1 + clusters > per_block) {
+			EPRINTF("%s: refcount table too large\n", s->name);
+			return -ENOSPC;
+		}
+
+		if (idx + 1 + clusters <= base + per_block)
+			break;
+
+		idx = base + per_block;
+	}
+
+	table = qcow2_alloc_buffer(clusters << s->cluster_bits);
+	if (!table)
+		return -ENOMEM;
+
+	memset(s->rb, 0, s->cluster_size);
+	for (i = idx; i < idx + 1 + clusters; i++)
+		s->rb[i - base] = cpu_to_be16(1);
+	s->rb_index = -1;
+
+	err = qcow2_pwrite(s, s->rb, s->cluster_size, idx << s->cluster_bits);
+	if (err)
+		goto fail;
+
+	memcpy(table, s->rt, (size_t)s->rt_clusters << s->cluster_bits);
+	((uint64_t *)table)[block] = cpu_to_be64(idx << s->cluster_bits);
+
+	err = qcow2_pwrite(s, table, clusters << s->cluster_bits,
+			   (idx + 1) << s->cluster_bits);
+	if (err)
+		goto fail;
+
+	h = (struct qcow2_header *)s->header;
+	h->refcount_table_offset   = cpu_to_be64((idx + 1) << s->cluster_bits);
+	h->refcount_table_clusters = cpu_to_be32(clusters);
+
+	err = qcow2_write_header(s);
+	if (err) {
+		h->refcount_table_offset   = cpu_to_be64(s->rt_offset);
+		h->refcount_table_clusters = cpu_to_be32(s->rt_clusters);
+		goto fail;
+	}
+
+	DPRINTF("%s: refcount table moved to 0x%"PRIx64", %"PRIu64
+		" clusters\n", s->name, (idx + 1) << s->cluster_bits, clusters);
+
+	free(s->rt);
+	s->rt           = (uint64_t *)table;
+	s->rt_offset    = (idx + 1) << s->cluster_bits;
+	s->rt_clusters  = clusters;
+	s->rb_index     = block;
+	s->next_cluster = idx + 1 + clusters;
+	return 0;
+
+fail:
+	free(table);
+	s->next_cluster = idx + 1 + clusters;
+	return err;
+}
+
+/*
+ * sets the refcounts of the next batch of free clusters at the end of
+ * the file, with a single write of the refcount block which covers
+ * them.  Clusters already counted (e.g. a previous batch that was
+ * interrupted) are skipped.
+ */
+static int
+qcow2_reserve_clusters(struct tdqcow2_state *s)
+{
+	int err, new;
+	uint64_t per_block, idx, block, base, end, first, rb_offset, sec;
+
+	per_block = s->cluster_size / sizeof(uint16_t);
+
+	for (;;) {
+		idx   = s->next_cluster;
+		block = idx / per_block;
+		base  = block * per_block;
+		end   = base + per_block;
+
+		if (block >= ((uint64_t)s->rt_clusters << (s->cluster_bits - 3))) {
+			err = qcow2_grow_refcount_table(s);
+			if (err)
+				return err;
+			continue;
+		}
+
+		new       = 0;
+		rb_offset = be64_to_cpu(s->rt[block]) & QCOW2_RT_OFFSET_MASK;
+
+		if (!rb_offset) {
+			/* the new block describes itself */
+			memset(s->rb, 0, s->cluster_size);
+			rb_offset   = idx << s->cluster_bits;
+			s->rb[idx - base] = cpu_to_be16(1);
+			s->rb_index = block;
+			new = 1;
+			idx++;
+		} else if (s->rb_index != block) {
+			s->rb_index = -1;
+			err = qcow2_pread(s, s->rb, s->cluster_size, rb_offset);
+			if (err)
+				return err;
+			s->rb_index = block;
+		}
+
+		while (idx < end && s->rb[idx - base])
+			idx++;
+
+		first = idx;
+		while (idx < end && idx - first < QCOW2_RESERVE_BATCH &&
+		       !s->rb[idx - base]) {
+			s->rb[idx - base] = cpu_to_be16(1);
+			idx++;
+		}
+
+		s->next_cluster = idx;
+
+		if (new) {
+			err = qcow2_pwrite(s, s->rb,
+					   s->cluster_size, rb_offset);
+			if (err)
+				goto fail;
+
+			s->rt[block] = cpu_to_be64(rb_offset);
+			sec = (block * sizeof(uint64_t)) &
+				~(uint64_t)(QCOW2_SECTOR_SIZE - 1);
+			err = qcow2_pwrite(s, (char *)s->rt + sec,
+					   QCOW2_SECTOR_SIZE, s->rt_offset + sec);
+			if (err) {
+				s->rt[block] = 0;
+				goto fail;
+			}
+		} else if (idx > first) {
+			uint64_t lo, hi;
+
+			lo  = ((first - base) * sizeof(uint16_t)) &
+				~(uint64_t)(QCOW2_SECTOR_SIZE - 1);
+			hi  = qcow2_round_up((idx - base) * sizeof(uint16_t),
+					     QCOW2_SECTOR_SIZE);
+			err = qcow2_pwrite(s, (char *)s->rb + lo,
+					   hi - lo, rb_offset + lo);
+			if (err)
+				goto fail;
+		}
+
+		if (idx > first) {
+			s->rsv_next = first;
+			s->rsv_end  = idx;
+			s->reservations++;
+			return 0;
+		}
+	}
+
+fail:
+	/* the clusters stay unused: leaked, at worst */
+	s->rb_index = -1;
+	return err;
+}
+
+static int
+qcow2_get_cluster(struct tdqcow2_state *s, uint64_t *offset)
+{
+	int err;
+
+	if (s->rsv_next == s->rsv_end) {
+		err = qcow2_reserve_clusters(s);
+		if (err) {
+			EPRINTF("%s: failed to reserve clusters: %d\n",
+				s->name, err);
+			return err;
+		}
+	}
+
+	*offset = s->rsv_next++ << s->cluster_bits;
+	return 0;
+}
+
+static int
+qcow2_l2_cache_size(struct tdqcow2_state *s)
+{
+	int size;
+	char *env;
+
+	env  = getenv("TAPDISK_QCOW2_L2_CACHE");
+	size = env ? atoi(env) : QCOW2_L2_CACHE_SIZE;
+
+	size = MIN(size, QCOW2_L2_CACHE_MAX);
+	size = MIN(size, (int)s->l1_size);
+	size = MAX(size, QCOW2_L2_CACHE_MIN);
+
+	return size;
+}
+
+static int
+qcow2_init_l2_cache(struct tdqcow2_state *s)
+{
+	int i;
+	struct qcow2_l2 *l2;
+
+	s->l2_cache_size = qcow2_l2_cache_size(s);
+
+	s->l2_cache = calloc(s->l2_cache_size, sizeof(struct qcow2_l2));
+	s->l2_map   = malloc(MAX(s->l1_size, 1) * sizeof(int));
+	if (!s->l2_cache || !s->l2_map)
+		return -ENOMEM;
+
+	for (i = 0; i < s->l1_size; i++)
+		s->l2_map[i] = -1;
+
+	for (i = 0; i < s->l2_cache_size; i++) {
+		l2        = s->l2_cache + i;
+		l2->index = -1;
+		l2->state = s;
+		l2->table = qcow2_alloc_buffer(s->cluster_size);
+		if (!l2->table)
+			return -ENOMEM;
+
+		if (!s->rdonly) {
+			l2->wbuf = qcow2_alloc_buffer(s->cluster_size);
+			if (!l2->wbuf)
+				return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static void
+qcow2_free_l2_cache(struct tdqcow2_state *s)
+{
+	int i;
+
+	if (s->l2_cache)
+		for (i = 0; i < s->l2_cache_size; i++) {
+			free(s->l2_cache[i].table);
+			free(s->l2_cache[i].wbuf);
+		}
+
+	free(s->l2_cache);
+	free(s->l2_map);
+	s->l2_cache = NULL;
+	s->l2_map   = NULL;
+}
+
+static void
+qcow2_drop_l2(struct tdqcow2_state *s, struct qcow2_l2 *l2)
+{
+	if (l2->index >= 0)
+		s->l2_map[l2->index] = -1;
+
+	l2->index = -1;
+	l2->flags = 0;
+}
+
+/*
+ * the least recently used table which has no I/O in flight and no
+ * allocations pending, or NULL if every slot is busy
+ */
+static struct qcow2_l2 *
+qcow2_evict_l2(struct tdqcow2_state *s)
+{
+	int i;
+	struct qcow2_l2 *l2, *lru;
+
+	lru = NULL;
+
+	for (i = 0; i < s->l2_cache_size; i++) {
+		l2 = s->l2_cache + i;
+
+		if (l2->index < 0)
+			return l2;
+
+		/* a new table nothing refers to yet can just go */
+		if ((l2->flags & ~QCOW2_L2_NEW) || l2->allocs || l2->waiting)
+			continue;
+
+		if (!lru || l2->used < lru->used)
+			lru = l2;
+	}
+
+	if (lru) {
+		s->l2_evictions++;
+		qcow2_drop_l2(s, lru);
+	}
+
+	return lru;
+}
+
+static int qcow2_read_cluster(struct tdqcow2_state *, td_request_t);
+static int qcow2_write_cluster(struct tdqcow2_state *, td_request_t);
+static void qcow2_fail(td_request_t, int);
+
+static void
+qcow2_l2_loaded(void *arg, struct tiocb *tiocb, int err)
+{
+	int ret;
+	td_request_t treq;
+	struct qcow2_request *req, *next;
+	struct qcow2_l2 *l2     = (struct qcow2_l2 *)arg;
+	struct tdqcow2_state *s = l2->state;
+
+	req         = l2->waiting;
+	l2->waiting = NULL;
+	l2->flags  &= ~QCOW2_L2_LOADING;
+
+	if (err) {
+		EPRINTF("%s: failed to read L2 table 0x%"PRIx64": %d\n",
+			s->name, l2->offset, err);
+		qcow2_drop_l2(s, l2);
+	}
+
+	for (; req; req = next) {
+		next = req->next;
+		treq = req->treq;
+		s->req_free_list[s->req_free_count++] = req;
+
+		ret = err;
+		if (!ret)
+			ret = (treq.op == TD_OP_WRITE ?
+			       qcow2_write_cluster(s, treq) :
+			       qcow2_read_cluster(s, treq));
+
+		if (ret < 0)
+			qcow2_fail(treq, ret);
+	}
+}
+
+/* queues treq, for one cluster, until its table is loaded */
+static int
+qcow2_wait_l2(struct tdqcow2_state *s, struct qcow2_l2 *l2, td_request_t treq)
+{
+	struct qcow2_request *req;
+
+	if (!s->req_free_count)
+		return -EBUSY;
+
+	req         = s->req_free_list[--s->req_free_count];
+	req->treq   = treq;
+	req->state  = s;
+	req->next   = l2->waiting;
+	l2->waiting = req;
+
+	return QCOW2_QUEUED;
+}
+
+/*
+ * the cached L2 table covering treq's cluster.  Returns NULL if the
+ * cluster has no table; NULL with *err set if it has one which is not
+ * in memory, in which case treq has been queued on it (QCOW2_QUEUED),
+ * or must be retried (< 0).
+ */
+static struct qcow2_l2 *
+qcow2_get_l2(struct tdqcow2_state *s, td_request_t treq, int *err)
+{
+	uint32_t idx;
+	uint64_t offset;
+	struct qcow2_l2 *l2;
+
+	*err = 0;
+	idx  = qcow2_l1_index(s, qcow2_cluster(s, treq.sec));
+
+	if (s->l2_map[idx] >= 0) {
+		l2 = s->l2_cache + s->l2_map[idx];
+
+		if (l2->flags & QCOW2_L2_LOADING) {
+			*err = qcow2_wait_l2(s, l2, treq);
+			return NULL;
+		}
+
+		s->l2_hits++;
+		l2->used = ++s->l2_clock;
+		return l2;
+	}
+
+	offset = be64_to_cpu(s->l1[idx]) & QCOW2_OFFSET_MASK;
+	if (!offset)
+		return NULL;
+
+	if (!s->req_free_count) {
+		*err = -EBUSY;
+		return NULL;
+	}
+
+	l2 = qcow2_evict_l2(s);
+	if (!l2) {
+		*err = QCOW2_BLOCKED;
+		return NULL;
+	}
+
+	s->l2_misses++;
+	s->l2_map[idx] = l2 - s->l2_cache;
+	l2->index      = idx;
+	l2->offset     = offset;
+	l2->flags      = QCOW2_L2_LOADING;
+	l2->used       = ++s->l2_clock;
+
+	*err = qcow2_wait_l2(s, l2, treq);
+
+	td_prep_read(&l2->tiocb, s->fd, (char *)l2->table,
+		     s->cluster_size, offset, qcow2_l2_loaded, l2);
+	td_queue_tiocb(s->driver, &l2->tiocb);
+
+	return NULL;
+}
+
+/*
+ * a table for an L1 entry which has none.  It stays in the cache until
+ * its first write completes, after which the L1 entry is set.
+ */
+static struct qcow2_l2 *
+qcow2_new_l2(struct tdqcow2_state *s, uint64_t cluster, int *err)
+{
+	uint64_t offset;
+	struct qcow2_l2 *l2;
+
+	l2 = qcow2_evict_l2(s);
+	if (!l2) {
+		*err = QCOW2_BLOCKED;
+		return NULL;
+	}
+
+	*err = qcow2_get_cluster(s, &offset);
+	if (*err)
+		return NULL;
+
+	memset(l2->table, 0, s->cluster_size);
+
+	l2->index  = qcow2_l1_index(s, cluster);
+	l2->offset = offset;
+	l2->flags  = QCOW2_L2_NEW;
+	l2->used   = ++s->l2_clock;
+	s->l2_map[l2->index] = l2 - s->l2_cache;
+
+	return l2;
+}
+
+static void
+qcow2_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	td_request_t treq;
+	struct qcow2_request *req = (struct qcow2_request *)arg;
+	struct tdqcow2_state *s   = req->state;
+
+	treq = req->treq;
+	s->req_free_list[s->req_free_count++] = req;
+
+	td_complete_request(treq, err);
+}
+
+static int
+qcow2_aio(struct tdqcow2_state *s, td_request_t treq,
+	  uint64_t offset, int write)
+{
+	struct qcow2_request *req;
+
+	if (!s->req_free_count)
+		return -EBUSY;
+
+	req        = s->req_free_list[--s->req_free_count];
+	req->treq  = treq;
+	req->state = s;
+
+	if (write)
+		td_prep_write(&req->tiocb, s->fd, treq.buf,
+			      treq.secs << 9, offset, qcow2_complete, req);
+	else {
+		td_prep_read(&req->tiocb, s->fd, treq.buf,
+			     treq.secs << 9, offset, qcow2_complete, req);
+		req->tiocb.flags |= TIOCB_FLAG_READAHEAD;
+	}
+
+	td_queue_tiocb(s->driver, &req->tiocb);
+	return 0;
+}
+
+/*
+ * compressed clusters are rare enough (images converted with -c) to be
+ * read synchronously; the last one is kept.
+ */
+static int
+qcow2_decompress(struct tdqcow2_state *s, uint64_t entry)
+{
+	int ret, shift;
+	z_stream strm;
+	uint64_t coffset, start, csize, nsecs;
+
+	if (s->zcache && s->zcache_entry == entry)
+		return 0;
+
+	if (!s->zcache) {
+		s->zbuf   = qcow2_alloc_buffer(s->cluster_size * 2);
+		s->zcache = qcow2_alloc_buffer(s->cluster_size);
+		if (!s->zbuf || !s->zcache)
+			return -ENOMEM;
+	}
+
+	shift   = 62 - (s->cluster_bits - 8);
+	coffset = entry & ((1ULL << shift) - 1);
+	nsecs   = ((entry >> shift) & ((1ULL << (s->cluster_bits - 8)) - 1)) + 1;
+	start   = coffset & ~(uint64_t)(QCOW2_SECTOR_SIZE - 1);
+	csize   = nsecs * QCOW2_SECTOR_SIZE - (coffset - start);
+
+	ret = pread(s->fd, s->zbuf, nsecs * QCOW2_SECTOR_SIZE, start);
+	if (ret < (int)(coffset - start + 1))
+		return (ret == -1 ? -errno : -EIO);
+
+	csize = MIN(csize, ret - (coffset - start));
+	s->compressed_reads++;
+	s->zcache_entry = 0;
+
+	memset(&strm, 0, sizeof(strm));
+	strm.next_in   = (Bytef *)s->zbuf + (coffset - start);
+	strm.avail_in  = csize;
+	strm.next_out  = (Bytef *)s->zcache;
+	strm.avail_out = s->cluster_size;
+
+	if (inflateInit2(&strm, -12) != Z_OK)
+		return -ENOMEM;
+
+	ret = inflate(&strm, Z_FINISH);
+	inflateEnd(&strm);
+
+	if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) || strm.avail_out) {
+		EPRINTF("%s: bad compressed cluster 0x%"PRIx64": %d\n",
+			s->name, coffset, ret);
+		return -EIO;
+	}
+
+	s->zcache_entry = entry;
+	return 0;
+}
+
+static inline int
+qcow2_entry_is_zero(struct tdqcow2_state *s, uint64_t entry)
+{
+	return s->version >= 3 && !(entry & QCOW2_OFLAG_COMPRESSED) &&
+		(entry & QCOW2_OFLAG_ZERO);
+}
+
+/* treq lies within one cluster */
+static int
+qcow2_read_cluster(struct tdqcow2_state *s, td_request_t treq)
+{
+	int err;
+	struct qcow2_l2 *l2;
+	uint64_t cluster, entry, offset;
+
+	cluster = qcow2_cluster(s, treq.sec);
+
+	l2 = qcow2_get_l2(s, treq, &err);
+	if (err)
+		return (err == QCOW2_QUEUED ? 0 : err);
+
+	entry = l2 ? be64_to_cpu(l2->table[qcow2_l2_index(s, cluster)]) : 0;
+
+	if (entry & QCOW2_OFLAG_COMPRESSED) {
+		err = qcow2_decompress(s, entry);
+		if (err)
+			return err;
+
+		offset = (treq.sec & (s->cluster_secs - 1)) << 9;
+		memcpy(treq.buf, s->zcache + offset, treq.secs << 9);
+		td_complete_request(treq, 0);
+		return 0;
+	}
+
+	if (qcow2_entry_is_zero(s, entry)) {
+		memset(treq.buf, 0, treq.secs << 9);
+		td_complete_request(treq, 0);
+		return 0;
+	}
+
+	offset = entry & QCOW2_OFFSET_MASK;
+	if (!offset) {
+		td_forward_request(treq);
+		return 0;
+	}
+
+	offset += (treq.sec & (s->cluster_secs - 1)) << 9;
+	return qcow2_aio(s, treq, offset, 0);
+}
+
+static struct qcow2_alloc *
+qcow2_find_alloc(struct tdqcow2_state *s, uint64_t cluster)
+{
+	int i;
+
+	for (i = 0; i < QCOW2_ALLOCS; i++)
+		if (s->allocs[i].inuse && s->allocs[i].cluster == cluster)
+			return s->allocs + i;
+
+	return NULL;
+}
+
+static struct qcow2_alloc *
+qcow2_get_alloc(struct tdqcow2_state *s)
+{
+	int i;
+
+	for (i = 0; i < QCOW2_ALLOCS; i++)
+		if (!s->allocs[i].inuse)
+			return s->allocs + i;
+
+	return NULL;
+}
+
+static void
+qcow2_put_alloc(struct qcow2_alloc *a)
+{
+	if (a->l2)
+		a->l2->allocs--;
+
+	a->inuse = 0;
+	a->l2    = NULL;
+	a->next  = NULL;
+}
+
+static void
+qcow2_finish_alloc(struct qcow2_alloc *a, int err)
+{
+	td_request_t treq = a->treq;
+
+	qcow2_put_alloc(a);
+	td_complete_request(treq, err);
+}
+
+static void
+qcow2_schedule_l2_write(struct tdqcow2_state *s, struct qcow2_l2 *l2);
+
+/*
+ * the L1 entry of a new table is only set once the whole table is on
+ * disk, so a crash never exposes an uninitialized table
+ */
+static void
+qcow2_l2_written(void *arg, struct tiocb *tiocb, int err)
+{
+	uint32_t idx;
+	struct qcow2_alloc *a, *next;
+	struct qcow2_l2 *l2     = (struct qcow2_l2 *)arg;
+	struct tdqcow2_state *s = l2->state;
+
+	l2->flags &= ~QCOW2_L2_WRITING;
+
+	if (!err && (l2->flags & QCOW2_L2_NEW)) {
+		err = qcow2_write_l1(s, l2->index, l2->offset);
+		if (!err)
+			l2->flags &= ~QCOW2_L2_NEW;
+	}
+
+	if (err)
+		EPRINTF("%s: failed to write L2 table 0x%"PRIx64": %d\n",
+			s->name, l2->offset, err);
+
+	a           = l2->writing;
+	l2->writing = NULL;
+
+	while (a) {
+		next = a->next;
+
+		if (err) {
+			idx = qcow2_l2_index(s, a->cluster);
+			l2->table[idx] = a->old;
+		}
+
+		qcow2_finish_alloc(a, err);
+		a = next;
+	}
+
+	qcow2_schedule_l2_write(s, l2);
+}
+
+/*
+ * writes out the entries made ready since the last write: the sectors
+ * of the table which hold them, or the whole table if it is new
+ */
+static void
+qcow2_schedule_l2_write(struct tdqcow2_state *s, struct qcow2_l2 *l2)
+{
+	struct qcow2_alloc *a;
+	uint64_t first, last, lo, hi;
+
+	if ((l2->flags & QCOW2_L2_WRITING) || !l2->ready)
+		return;
+
+	first = ULLONG_MAX;
+	last  = 0;
+
+	for (a = l2->ready; a; a = a->next) {
+		first = MIN(first, qcow2_l2_index(s, a->cluster));
+		last  = MAX(last, qcow2_l2_index(s, a->cluster));
+		s->l2_updates++;
+	}
+
+	if (l2->flags & QCOW2_L2_NEW) {
+		lo = 0;
+		hi = s->cluster_size;
+	} else {
+		lo = (first * sizeof(uint64_t)) &
+			~(uint64_t)(QCOW2_SECTOR_SIZE - 1);
+		hi = qcow2_round_up((last + 1) * sizeof(uint64_t),
+				    QCOW2_SECTOR_SIZE);
+	}
+
+	memcpy((char *)l2->wbuf + lo, (char *)l2->table + lo, hi - lo);
+
+	l2->writing = l2->ready;
+	l2->ready   = NULL;
+	l2->flags  |= QCOW2_L2_WRITING;
+	s->l2_writes++;
+
+	td_prep_write(&l2->tiocb, s->fd, (char *)l2->wbuf + lo,
+		      hi - lo, l2->offset + lo, qcow2_l2_written, l2);
+	td_queue_tiocb(s->driver, &l2->tiocb);
+}
+
+static void
+qcow2_alloc_written(void *arg, struct tiocb *tiocb, int err)
+{
+	uint32_t idx;
+	struct qcow2_alloc *a   = (struct qcow2_alloc *)arg;
+	struct tdqcow2_state *s = a->state;
+	struct qcow2_l2 *l2     = a->l2;
+
+	if (err) {
+		EPRINTF("%s: failed to write cluster 0x%"PRIx64": %d\n",
+			s->name, a->offset, err);
+		qcow2_finish_alloc(a, err);
+		return;
+	}
+
+	idx            = qcow2_l2_index(s, a->cluster);
+	a->old         = l2->table[idx];
+	l2->table[idx] = cpu_to_be64(a->offset | QCOW2_OFLAG_COPIED);
+
+	a->next   = l2->ready;
+	l2->ready = a;
+
+	qcow2_schedule_l2_write(s, l2);
+}
+
+static void
+qcow2_alloc_write(struct qcow2_alloc *a)
+{
+	struct tdqcow2_state *s = a->state;
+
+	td_prep_write(&a->tiocb, s->fd, a->data, a->fill << 9,
+		      a->offset, qcow2_alloc_written, a);
+	td_queue_tiocb(s->driver, &a->tiocb);
+}
+
+/* lays the guest's sectors over the cluster's previous contents */
+static void
+qcow2_alloc_merge(struct qcow2_alloc *a)
+{
+	struct tdqcow2_state *s = a->state;
+	uint64_t offset;
+
+	offset = (a->treq.sec & (s->cluster_secs - 1)) << 9;
+	memcpy(a->buf + offset, a->treq.buf, a->treq.secs << 9);
+
+	a->data = a->buf;
+	qcow2_alloc_write(a);
+}
+
+static void
+qcow2_alloc_filled(td_request_t clone, int err)
+{
+	struct qcow2_alloc *a = (struct qcow2_alloc *)clone.cb_data;
+
+	a->pending -= clone.secs;
+	if (err && !a->error)
+		a->error = err;
+
+	if (a->pending)
+		return;
+
+	if (a->error) {
+		qcow2_finish_alloc(a, a->error);
+		return;
+	}
+
+	qcow2_alloc_merge(a);
+}
+
+/*
+ * treq lies within one guest cluster, which has no cluster of its own
+ * (or a compressed or zeroed one)
+ */
+static int
+qcow2_alloc_cluster(struct tdqcow2_state *s, struct qcow2_l2 *l2,
+		    td_request_t treq, uint64_t entry)
+{
+	int err;
+	td_request_t clone;
+	uint64_t cluster, sec;
+	struct qcow2_alloc *a;
+
+	cluster = qcow2_cluster(s, treq.sec);
+
+	a = qcow2_get_alloc(s);
+	if (!a)
+		return QCOW2_BLOCKED;
+
+	if (!l2) {
+		l2 = qcow2_new_l2(s, cluster, &err);
+		if (!l2)
+			return err;
+	}
+
+	err = qcow2_get_cluster(s, &a->offset);
+	if (err) {
+		if ((l2->flags & QCOW2_L2_NEW) && !l2->allocs)
+			qcow2_drop_l2(s, l2);
+		return err;
+	}
+
+	a->inuse   = 1;
+	a->error   = 0;
+	a->pending = 0;
+	a->cluster = cluster;
+	a->treq    = treq;
+	a->state   = s;
+	a->l2      = l2;
+	a->next    = NULL;
+	l2->allocs++;
+	s->allocations++;
+
+	/*
+	 * the tail of a cluster past the end of the disk is never read,
+	 * and need not be written
+	 */
+	sec     = cluster << (s->cluster_bits - 9);
+	a->fill = MIN((uint64_t)s->cluster_secs, (s->size >> 9) - sec);
+
+	if (treq.secs == s->cluster_secs ||
+	    (treq.sec == sec && treq.secs == a->fill)) {
+		a->data = treq.buf;
+		qcow2_alloc_write(a);
+		return 0;
+	}
+
+	if (!a->buf) {
+		a->buf = qcow2_alloc_buffer(s->cluster_size);
+		if (!a->buf) {
+			qcow2_put_alloc(a);
+			return -ENOMEM;
+		}
+	}
+
+	if (entry & QCOW2_OFLAG_COMPRESSED) {
+		err = qcow2_decompress(s, entry);
+		if (err) {
+			qcow2_put_alloc(a);
+			return err;
+		}
+
+		memcpy(a->buf, s->zcache, s->cluster_size);
+		qcow2_alloc_merge(a);
+		return 0;
+	}
+
+	if (qcow2_entry_is_zero(s, entry) || !s->backing_file_offset) {
+		memset(a->buf, 0, s->cluster_size);
+		qcow2_alloc_merge(a);
+		return 0;
+	}
+
+	s->cow_reads++;
+	a->pending   = a->fill;
+
+	clone        = treq;
+	clone.op     = TD_OP_READ;
+	clone.buf    = a->buf;
+	clone.sec    = sec;
+	clone.secs   = a->fill;
+	clone.cb     = qcow2_alloc_filled;
+	clone.cb_data = a;
+
+	td_forward_request(clone);
+	return 0;
+}
+
+/* treq lies within one cluster */
+static int
+qcow2_write_cluster(struct tdqcow2_state *s, td_request_t treq)
+{
+	int err;
+	struct qcow2_l2 *l2;
+	uint64_t cluster, entry, offset;
+
+	cluster = qcow2_cluster(s, treq.sec);
+
+	if (qcow2_find_alloc(s, cluster))
+		return QCOW2_BLOCKED;
+
+	l2 = qcow2_get_l2(s, treq, &err);
+	if (err)
+		return (err == QCOW2_QUEUED ? 0 : err);
+
+	entry  = l2 ? be64_to_cpu(l2->table[qcow2_l2_index(s, cluster)]) : 0;
+	offset = entry & QCOW2_OFFSET_MASK;
+
+	if (!offset || (entry & QCOW2_OFLAG_COMPRESSED) ||
+	    qcow2_entry_is_zero(s, entry))
+		return qcow2_alloc_cluster(s, l2, treq, entry);
+
+	offset += (treq.sec & (s->cluster_secs - 1)) << 9;
+	return qcow2_aio(s, treq, offset, 1);
+}
+
+static void
+qcow2_fail(td_request_t treq, int err)
+{
+	if (err == QCOW2_BLOCKED) {
+		treq.blocked = 1;
+		err = -EBUSY;
+	}
+
+	td_complete_request(treq, err);
+}
+
+static void
+qcow2_queue(td_driver_t *driver, td_request_t treq,
+	    int (*fn)(struct tdqcow2_state *, td_request_t))
+{
+	int err;
+	td_request_t clone;
+	struct tdqcow2_state *s = (struct tdqcow2_state *)driver->data;
+
+	while (treq.secs) {
+		clone      = treq;
+		clone.secs = MIN(treq.secs, s->cluster_secs -
+				 (int)(treq.sec & (s->cluster_secs - 1)));
+
+		err = fn(s, clone);
+		if (err) {
+			qcow2_fail(treq, err);
+			return;
+		}
+
+		treq.sec  += clone.secs;
+		treq.buf  += clone.secs << 9;
+		treq.secs -= clone.secs;
+	}
+}
+
+static void
+tdqcow2_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	qcow2_queue(driver, treq, qcow2_read_cluster);
+}
+
+static void
+tdqcow2_queue_write(td_driver_t *driver, td_request_t treq)
+{
+	qcow2_queue(driver, treq, qcow2_write_cluster);
+}
+
+static int
+qcow2_init_requests(struct tdqcow2_state *s)
+{
+	int i;
+
+	s->nr_reqs = TAPDISK_DATA_REQUESTS *
+		((getpagesize() >> s->cluster_bits) + 1);
+
+	s->reqs          = calloc(s->nr_reqs, sizeof(struct qcow2_request));
+	s->req_free_list = calloc(s->nr_reqs, sizeof(struct qcow2_request *));
+	if (!s->reqs || !s->req_free_list)
+		return -ENOMEM;
+
+	for (i = 0; i < s->nr_reqs; i++)
+		s->req_free_list[i] = s->reqs + i;
+	s->req_free_count = s->nr_reqs;
+
+	return 0;
+}
+
+static void
+qcow2_free(struct tdqcow2_state *s)
+{
+	int i;
+
+	qcow2_free_l2_cache(s);
+
+	for (i = 0; i < QCOW2_ALLOCS; i++)
+		free(s->allocs[i].buf);
+
+	free(s->reqs);
+	free(s->req_free_list);
+	free(s->zbuf);
+	free(s->zcache);
+	free(s->rt);
+	free(s->rb);
+	free(s->l1);
+	free(s->header);
+	free(s->name);
+
+	if (s->fd != -1) {
+		td_invalidate_io(s->driver, s->fd, 0, 0);
+		close(s->fd);
+	}
+}
+
+static int
+tdqcow2_open(td_driver_t *driver, const char *name, td_flag_t flags)
+{
+	int err, o_flags;
+	struct qcow2_header *h;
+	struct tdqcow2_state *s = (struct tdqcow2_state *)driver->data;
+
+	memset(s, 0, sizeof(*s));
+	s->fd     = -1;
+	s->driver = driver;
+	s->rdonly = !!(flags & TD_OPEN_RDONLY);
+
+	s->name = strdup(name);
+	if (!s->name)
+		return -ENOMEM;
+
+	o_flags = O_DIRECT | O_LARGEFILE | (s->rdonly ? O_RDONLY : O_RDWR);
+
+	s->fd = open(name, o_flags);
+	if (s->fd == -1 && errno == EINVAL) {
+		/* no O_DIRECT on this filesystem */
+		s->fd = open(name, o_flags & ~O_DIRECT);
+		if (s->fd != -1)
+			DPRINTF("WARNING: accessing %s without O_DIRECT\n",
+				name);
+	}
+
+	if (s->fd == -1) {
+		err = -errno;
+		EPRINTF("%s: failed to open: %d\n", name, err);
+		goto fail;
+	}
+
+	err = qcow2_read_header(s);
+	if (err)
+		goto fail;
+
+	err = qcow2_load_l1(s);
+	if (err)
+		goto fail;
+
+	if (!s->rdonly) {
+		err = qcow2_load_refcounts(s);
+		if (err)
+			goto fail;
+
+		/* nothing we do keeps autoclear features valid */
+		h = (struct qcow2_header *)s->header;
+		if (s->version >= 3 && h->autoclear_features) {
+			h->autoclear_features = 0;
+			err = qcow2_write_header(s);
+			if (err)
+				goto fail;
+		}
+	}
+
+	err = qcow2_init_l2_cache(s);
+	if (err)
+		goto fail;
+
+	err = qcow2_init_requests(s);
+	if (err)
+		goto fail;
+
+	driver->info.size        = s->size >> 9;
+	driver->info.sector_size = 512;
+	driver->info.info        = 0;
+
+	DPRINTF("%s: qcow2 v%d, %"PRIu64" bytes, %"PRIu64"K clusters, "
+		"%d L2 tables cached%s\n", name, s->version, s->size,
+		s->cluster_size >> 10, s->l2_cache_size,
+		s->backing_file_offset ? ", backed" : "");
+
+	return 0;
+
+fail:
+	qcow2_free(s);
+	s->fd = -1;
+	return err;
+}
+
+static int
+tdqcow2_close(td_driver_t *driver)
+{
+	struct tdqcow2_state *s = (struct tdqcow2_state *)driver->data;
+
+	qcow2_free(s);
+	s->fd = -1;
+
+	return 0;
+}
+
+/* the driver for an image, from its first sector */
+static int
+qcow2_probe_type(const char *path)
+{
+	int fd, type;
+	char buf[QCOW2_SECTOR_SIZE];
+	struct qcow2_header *h = (struct qcow2_header *)buf;
+
+	fd = open(path, O_RDONLY | O_LARGEFILE);
+	if (fd == -1)
+		return -errno;
+
+	type = DISK_TYPE_AIO;
+
+	if (pread(fd, buf, sizeof(buf), 0) == sizeof(buf)) {
+		if (be32_to_cpu(h->magic) == QCOW2_MAGIC)
+			type = (be32_to_cpu(h->version) == QCOW1_VERSION ?
+				DISK_TYPE_QCOW : DISK_TYPE_QCOW2);
+		else if (!memcmp(buf, "conectix", 8))
+			type = DISK_TYPE_VHD;
+	}
+
+	close(fd);
+	return type;
+}
+
+static int
+tdqcow2_get_parent_id(td_driver_t *driver, td_disk_id_t *id)
+{
+	int fd, err, type;
+	char *name, *path, *dir;
+	struct tdqcow2_state *s = (struct tdqcow2_state *)driver->data;
+
+	if (!s->backing_file_offset)
+		return TD_NO_PARENT;
+
+	if (!s->backing_file_size || s->backing_file_size > PATH_MAX)
+		return -EINVAL;
+
+	name = calloc(1, s->backing_file_size + 1);
+	if (!name)
+		return -ENOMEM;
+
+	path = NULL;
+	err  = -errno;
+
+	fd = open(s->name, O_RDONLY | O_LARGEFILE);
+	if (fd == -1)
+		goto out;
+
+	err = pread(fd, name, s->backing_file_size, s->backing_file_offset);
+	err = (err == s->backing_file_size ? 0 : (err == -1 ? -errno : -EIO));
+	close(fd);
+	if (err)
+		goto out;
+
+	if (name[0] == '/')
+		path = strdup(name);
+	else {
+		/* relative to the image */
+		dir = strdup(s->name);
+		if (!dir || asprintf(&path, "%s/%s", dirname(dir), name) == -1)
+			path = NULL;
+		free(dir);
+	}
+
+	err = -ENOMEM;
+	if (!path)
+		goto out;
+
+	type = qcow2_probe_type(path);
+	if (type < 0) {
+		err = type;
+		EPRINTF("%s: failed to open parent %s: %d\n",
+			s->name, path, err);
+		free(path);
+		goto out;
+	}
+
+	id->name       = path;
+	id->drivertype = type;
+	err            = 0;
+
+out:
+	free(name);
+	return err;
+}
+
+/* qcow2 parents need not match in size: the vbd zero-fills past theirs */
+static int
+tdqcow2_validate_parent(td_driver_t *driver,
+			td_driver_t *pdriver, td_flag_t flags)
+{
+	return 0;
+}
+
+static void
+tdqcow2_debug(td_driver_t *driver)
+{
+	struct tdqcow2_state *s = (struct tdqcow2_state *)driver->data;
+
+	DPRINTF("%s: L2 CACHE: size: %d, hits: %"PRIu64", misses: %"
+	    PRIu64", evictions: %"PRIu64"\n", s->name, s->l2_cache_size,
+	    s->l2_hits, s->l2_misses, s->l2_evictions);
+	DPRINTF("ALLOCATIONS: %"PRIu64", COW READS: %"PRIu64
+	    ", L2 WRITES: %"PRIu64" (%"PRIu64" entries), RESERVATIONS: %"
+	    PRIu64", next: 0x%"PRIx64"\n", s->allocations, s->cow_reads,
+	    s->l2_writes, s->l2_updates, s->reservations,
+	    s->rsv_next << s->cluster_bits);
+	DPRINTF("COMPRESSED READS: %"PRIu64", FREE REQUESTS: %d/%d\n",
+	    s->compressed_reads, s->req_free_count, s->nr_reqs);
+}
+
+struct tap_disk tapdisk_qcow2 = {
+	.disk_type           = "tapdisk_qcow2",
+	.flags               = 0,
+	.private_data_size   = sizeof(struct tdqcow2_state),
+	.td_open             = tdqcow2_open,
+	.td_close            = tdqcow2_close,
+	.td_queue_read       = tdqcow2_queue_read,
+	.td_queue_write      = tdqcow2_queue_write,
+	.td_get_parent_id    = tdqcow2_get_parent_id,
+	.td_validate_parent  = tdqcow2_validate_parent,
+	.td_debug            = tdqcow2_debug,
+};
@@ -46,6 +46,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -53,6 +54,7 @@
 #include <string.h>    /* for memset.                                 */
 #include <libaio.h>
 #include <sys/mman.h>
+#include <pthread.h>
 
 #include "libvhd.h"
 #include "tapdisk.h"
@@ -60,8 +62,6 @@
 #include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
 
-unsigned int SPB;
-
 #define DEBUGGING   2
 #define ASSERTING   1
 #define MICROSOFT_COMPAT
@@ -72,10 +72,10 @@ unsigned int SPB;
 	do {								\
 		DBG(TLOG_DBG, "%s: QUEUED: %" PRIu64 ", COMPLETED: %"	\
 		    PRIu64", RETURNED: %" PRIu64 ", DATA_ALLOCATED: "	\
-		    "%lu, BBLK: 0x%04x\n",				\
+		    "%lu, BAT_PENDING: %d\n",				\
 		    s->vhd.file, s->queued, s->completed, s->returned,	\
 		    VHD_REQS_DATA - s->vreq_free_count,			\
-		    s->bat.pbw_blk);					\
+		    s->bat.nr_pending);					\
 	} while(0)
 
 #define __ASSERT(_p)							\
@@ -109,11 +109,13 @@ unsigned int SPB;
 #endif
 
 /******VHD DEFINES******/
-#define VHD_CACHE_SIZE               32
+#define VHD_CACHE_SIZE               256  /* bitmaps, by default */
+#define VHD_CACHE_MIN                8
+#define VHD_CACHE_MAX                8192
+#define VHD_PRELOAD_DEPTH            4    /* preload reads in flight */
+#define VHD_BAT_PENDING_MAX          32   /* block allocations in flight */
 
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
-#define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
-#define VHD_REQS_TOTAL               (VHD_REQS_DATA + VHD_REQS_META)
 
 #define VHD_OP_BAT_WRITE             0
 #define VHD_OP_DATA_READ             1
@@ -135,19 +137,23 @@ unsigned int SPB;
 #define VHD_FLAG_OPEN_STRICT         8
 #define VHD_FLAG_OPEN_QUERY          16
 #define VHD_FLAG_OPEN_PREALLOCATE    32
+#define VHD_FLAG_OPEN_ZERO_DETECT    64
 
-#define VHD_FLAG_BAT_LOCKED          1
 #define VHD_FLAG_BAT_WRITE_STARTED   2
 
 #define VHD_FLAG_BM_UPDATE_BAT       1
 #define VHD_FLAG_BM_WRITE_PENDING    2
 #define VHD_FLAG_BM_READ_PENDING     4
 #define VHD_FLAG_BM_LOCKED           8
+#define VHD_FLAG_BM_BAT_READY        16
+#define VHD_FLAG_BM_BAT_WRITE        32
+#define VHD_FLAG_BM_BAT_WAIT         64
 
 #define VHD_FLAG_REQ_UPDATE_BAT      1
 #define VHD_FLAG_REQ_UPDATE_BITMAP   2
 #define VHD_FLAG_REQ_QUEUED          4
 #define VHD_FLAG_REQ_FINISHED        8
+#define VHD_FLAG_REQ_PRELOAD         16
 
 #define VHD_FLAG_TX_LIVE             1
 #define VHD_FLAG_TX_UPDATE_BAT       2
@@ -156,6 +162,7 @@ typedef uint8_t vhd_flag_t;
 
 struct vhd_state;
 struct vhd_request;
+struct vhd_bitmap_cache;
 
 struct vhd_req_list {
 	struct vhd_request       *head;
@@ -182,15 +189,23 @@ struct vhd_request {
 	struct vhd_transaction   *tx;
 };
 
+/*
+ * Blocks are allocated concurrently: each reserves its space and zeroes
+ * its bitmap on its own, and is then ready for its bat entry.  Only one
+ * bat write is in flight at a time, and it carries every ready entry in
+ * its sector, so allocations arriving meanwhile are committed together.
+ */
 struct vhd_bat_state {
 	vhd_bat_t                 bat;
 	vhd_batmap_t              batmap;
 	vhd_flag_t                status;
-	uint32_t                  pbw_blk;     /* blk num of pending write */
-	uint64_t                  pbw_offset;  /* file offset of same */
+	struct vhd_bitmap        *pending;     /* blocks being allocated */
+	int                       nr_pending;
+	int                       max_pending;
 	struct vhd_request        req;         /* for writing bat table */
-	struct vhd_request        zero_req;    /* for initializing bitmaps */
 	char                     *bat_buf;
+	uint64_t                  writes;      /* bat sector writes */
+	uint64_t                  updates;     /* entries they carried */
 };
 
 struct vhd_bitmap {
@@ -213,6 +228,28 @@ struct vhd_bitmap {
 					        * be serviced until this bitmap
 					        * is read from disk */
 	struct vhd_request        req;
+
+	u64                       pbw_offset;  /* file offset of pending
+						* bat entry */
+	int                       pbw_error;   /* error writing it */
+	struct vhd_bitmap        *pbw_next;    /* pending allocations */
+	struct vhd_request        zero_req;    /* for initializing bitmap */
+
+	int                       cached;      /* in the lookup hash */
+	struct vhd_bitmap        *hash_next;
+	struct vhd_bitmap_cache  *cache;
+};
+
+/*
+ * The bitmaps are allocated apart from the vhd_state, so that a close
+ * with preload reads still in flight can leave them to the last of those
+ * reads to free.
+ */
+struct vhd_bitmap_cache {
+	int                       size;
+	int                       preloading;  /* preload reads in flight */
+	int                       orphaned;    /* image closed under them */
+	struct vhd_bitmap        *list;
 };
 
 struct vhd_state {
@@ -229,17 +266,24 @@ struct vhd_state {
 
 	u64                       bm_lru;      /* lru sequence number */
 	u32                       bm_secs;     /* size of bitmap, in sectors */
-	struct vhd_bitmap        *bitmap[VHD_CACHE_SIZE];
+	struct vhd_bitmap_cache  *bm_cache;
+	struct vhd_bitmap       **bm_hash;     /* cached bitmaps, by block */
+	u32                       bm_hash_mask;
 
 	int                       bm_free_count;
-	struct vhd_bitmap        *bitmap_free[VHD_CACHE_SIZE];
-	struct vhd_bitmap         bitmap_list[VHD_CACHE_SIZE];
+	struct vhd_bitmap       **bitmap_free;
+
+	u32                       bm_preload;  /* next block to preload */
+	uint64_t                  bm_hits;
+	uint64_t                  bm_misses;
+	uint64_t                  bm_preloaded;
 
 	int                       vreq_free_count;
 	struct vhd_request       *vreq_free[VHD_REQS_DATA];
 	struct vhd_request        vreq_list[VHD_REQS_DATA];
 
 	td_driver_t              *driver;
+	char                     *zeros;       /* shared, see vhd_initialize */
 
 	uint64_t                  queued;
 	uint64_t                  completed;
@@ -248,6 +292,8 @@ struct vhd_state {
 	uint64_t                  read_size;
 	uint64_t                  writes;
 	uint64_t                  write_size;
+	uint64_t                  zero_writes;  /* skipped, in sectors */
+	uint64_t                  discards;     /* blocks deallocated */
 };
 
 #define test_vhd_flag(word, flag)  ((word) & (flag))
@@ -258,59 +304,78 @@ struct vhd_state {
 
 static void vhd_complete(void *, struct tiocb *, int);
 static void finish_data_transaction(struct vhd_state *, struct vhd_bitmap *);
+static void vhd_preload_bitmaps(struct vhd_state *);
 
-static struct vhd_state  *_vhd_master;
+/*
+ * One read-only buffer of zeroes, big enough for preallocating a block,
+ * is shared by every vhd in the process.  VBDs open and close on their
+ * own loop threads, so it is reference counted under a lock; each
+ * vhd_state holds a reference in s->zeros while it is open.
+ */
+static pthread_mutex_t    _vhd_zeros_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int       _vhd_zeros_users;
 static unsigned long      _vhd_zsize;
 static char              *_vhd_zeros;
 
 static int
 vhd_initialize(struct vhd_state *s)
 {
-	if (_vhd_zeros)
-		return 0;
+	int err = 0;
 
-	_vhd_zsize = 2 * getpagesize();
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE))
-		_vhd_zsize += VHD_BLOCK_SIZE;
+	pthread_mutex_lock(&_vhd_zeros_lock);
 
-	_vhd_zeros = mmap(0, _vhd_zsize, PROT_READ,
-			  MAP_SHARED | MAP_ANON, -1, 0);
-	if (_vhd_zeros == MAP_FAILED) {
-		EPRINTF("vhd_initialize failed: %d\n", -errno);
-		_vhd_zeros = NULL;
-		_vhd_zsize = 0;
-		return -errno;
+	if (!_vhd_zeros) {
+		_vhd_zsize = 2 * getpagesize() + VHD_BLOCK_SIZE;
+		_vhd_zeros = mmap(0, _vhd_zsize, PROT_READ,
+				  MAP_SHARED | MAP_ANON, -1, 0);
+		if (_vhd_zeros == MAP_FAILED) {
+			err = -errno;
+			EPRINTF("vhd_initialize failed: %d\n", err);
+			_vhd_zeros = NULL;
+			_vhd_zsize = 0;
+			goto out;
+		}
 	}
 
-	_vhd_master = s;
-	return 0;
+	_vhd_zeros_users++;
+	s->zeros = _vhd_zeros;
+
+out:
+	pthread_mutex_unlock(&_vhd_zeros_lock);
+	return err;
 }
 
 static void
 vhd_free(struct vhd_state *s)
 {
-	if (_vhd_master != s || !_vhd_zeros)
+	if (!s->zeros)
 		return;
 
-	munmap(_vhd_zeros, _vhd_zsize);
-	_vhd_zsize  = 0;
-	_vhd_zeros  = NULL;
-	_vhd_master = NULL;
+	pthread_mutex_lock(&_vhd_zeros_lock);
+
+	s->zeros = NULL;
+	if (!--_vhd_zeros_users) {
+		munmap(_vhd_zeros, _vhd_zsize);
+		_vhd_zsize = 0;
+		_vhd_zeros = NULL;
+	}
+
+	pthread_mutex_unlock(&_vhd_zeros_lock);
 }
 
 static char *
-_get_vhd_zeros(const char *func, unsigned long size)
+_get_vhd_zeros(struct vhd_state *s, const char *func, unsigned long size)
 {
-	if (!_vhd_zeros || _vhd_zsize < size) {
-		EPRINTF("invalid zero request from %s: %lu, %lu, %p\n",
-			func, size, _vhd_zsize, _vhd_zeros);
+	if (!s->zeros || size > 2 * getpagesize() + VHD_BLOCK_SIZE) {
+		EPRINTF("invalid zero request from %s: %lu, %p\n",
+			func, size, s->zeros);
 		ASSERT(0);
 	}
 
-	return _vhd_zeros;
+	return s->zeros;
 }
 
-#define vhd_zeros(size)	_get_vhd_zeros(__func__, size)
+#define vhd_zeros(s, size)	_get_vhd_zeros(s, __func__, size)
 
 static inline void
 set_batmap(struct vhd_state *s, uint32_t blk)
@@ -451,35 +516,98 @@ fail:
 }
 
 static void
-vhd_free_bitmap_cache(struct vhd_state *s)
+__vhd_free_bitmap_cache(struct vhd_bitmap_cache *cache)
 {
 	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
+	for (i = 0; cache->list && i < cache->size; i++) {
+		bm = cache->list + i;
 		free(bm->map);
 		free(bm->shadow);
-		s->bitmap_free[i] = NULL;
 	}
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	free(cache->list);
+	free(cache);
+}
+
+static void
+vhd_free_bitmap_cache(struct vhd_state *s)
+{
+	struct vhd_bitmap_cache *cache = s->bm_cache;
+
+	if (cache) {
+		if (cache->preloading)
+			cache->orphaned = 1;
+		else
+			__vhd_free_bitmap_cache(cache);
+	}
+
+	free(s->bm_hash);
+	free(s->bitmap_free);
+
+	s->bm_cache      = NULL;
+	s->bm_hash       = NULL;
+	s->bitmap_free   = NULL;
+	s->bm_free_count = 0;
+}
+
+/*
+ * TAPDISK_VHD_BITMAP_CACHE sets the number of bitmaps cached per image;
+ * there is no point in more than the image has blocks.
+ */
+static int
+vhd_bitmap_cache_size(struct vhd_state *s)
+{
+	int size;
+	char *env;
+
+	env  = getenv("TAPDISK_VHD_BITMAP_CACHE");
+	size = env ? atoi(env) : VHD_CACHE_SIZE;
+
+	size = MIN(size, VHD_CACHE_MAX);
+	size = MIN(size, (int)s->bat.bat.entries);
+	size = MAX(size, VHD_CACHE_MIN);
+
+	return size;
 }
 
 static int
 vhd_initialize_bitmap_cache(struct vhd_state *s)
 {
-	int i, err, map_size;
+	int i, err, map_size, hash_size;
+	struct vhd_bitmap_cache *cache;
 	struct vhd_bitmap *bm;
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return -ENOMEM;
+
+	s->bm_cache = cache;
+	cache->size = vhd_bitmap_cache_size(s);
+
+	for (hash_size = 1; hash_size < cache->size; hash_size <<= 1)
+		;
+
+	cache->list      = calloc(cache->size, sizeof(struct vhd_bitmap));
+	s->bitmap_free   = calloc(cache->size, sizeof(struct vhd_bitmap *));
+	s->bm_hash       = calloc(hash_size, sizeof(struct vhd_bitmap *));
+	s->bm_hash_mask  = hash_size - 1;
+	if (!cache->list || !s->bitmap_free || !s->bm_hash) {
+		err = -ENOMEM;
+		goto fail;
+	}
 
 	s->bm_lru        = 0;
 	map_size         = vhd_sectors_to_bytes(s->bm_secs);
-	s->bm_free_count = VHD_CACHE_SIZE;
+	s->bm_free_count = cache->size;
+
+	/* each allocation holds a bitmap; leave some for everything else */
+	s->bat.max_pending = MIN(VHD_BAT_PENDING_MAX, cache->size / 2);
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
+	for (i = 0; i < cache->size; i++) {
+		bm = cache->list + i;
+		bm->cache = cache;
 
 		err = posix_memalign((void **)&bm->map, 512, map_size);
 		if (err) {
@@ -622,6 +750,7 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 		err = vhd_open(&s->vhd, name, o_flags);
 		if (err) {
 			EPRINTF("Unable to open [%s] (%d)!\n", name, err);
+			vhd_free(s);
 			return err;
 		}
 	}
@@ -640,8 +769,6 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 
 	vhd_log_open(s);
 
-	SPB = s->spb;
-
 	s->vreq_free_count = VHD_REQS_DATA;
 	for (i = 0; i < VHD_REQS_DATA; i++)
 		s->vreq_free[i] = s->vreq_list + i;
@@ -664,6 +791,8 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 		s->writes++;
 	}
 
+	vhd_preload_bitmaps(s);
+
         return 0;
 
  fail:
@@ -691,6 +820,9 @@ _vhd_open(td_driver_t *driver, const char *name, td_flag_t flags)
 			      VHD_FLAG_OPEN_RDONLY |
 			      VHD_FLAG_OPEN_NO_CACHE);
 
+	if (flags & TD_OPEN_ZERO_DETECT)
+		vhd_flags |= VHD_FLAG_OPEN_ZERO_DETECT;
+
 	/* pre-allocate for all but NFS and LVM storage */
 	if (driver->storage != TAPDISK_STORAGE_TYPE_NFS &&
 	    driver->storage != TAPDISK_STORAGE_TYPE_LVM)
@@ -757,6 +889,7 @@ _vhd_close(td_driver_t *driver)
 	}
 
  free:
+	td_invalidate_io(driver, s->vhd.fd, 0, 0);
 	vhd_log_close(s);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
@@ -915,7 +1048,7 @@ add_to_transaction(struct vhd_transaction *tx, struct vhd_request *r)
 
 	DBG(TLOG_DBG, "blk: 0x%04"PRIx64", lsec: 0x%08"PRIx64", tx: %p, "
 	    "started: %d, finished: %d, status: %u\n",
-	    r->treq.sec / SPB, r->treq.sec, tx,
+	    r->treq.sec / r->state->spb, r->treq.sec, tx,
 	    tx->started, tx->finished, tx->status);
 }
 
@@ -925,33 +1058,46 @@ transaction_completed(struct vhd_transaction *tx)
 	return (tx->started == tx->finished);
 }
 
-static inline void
-init_bat(struct vhd_state *s)
+static inline int
+bat_write_started(struct vhd_state *s)
 {
-	s->bat.req.tx     = NULL;
-	s->bat.req.next   = NULL;
-	s->bat.req.error  = 0;
-	s->bat.pbw_blk    = 0;
-	s->bat.pbw_offset = 0;
-	s->bat.status     = 0;
+	return test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
 }
 
-static inline void
-lock_bat(struct vhd_state *s)
+static inline int
+bat_update_pending(struct vhd_bitmap *bm)
 {
-	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
+	return (bm && test_vhd_flag(bm->status, VHD_FLAG_BM_UPDATE_BAT));
 }
 
 static inline void
-unlock_bat(struct vhd_state *s)
+start_bat_update(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	clear_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
+	ASSERT(!bat_update_pending(bm));
+
+	set_vhd_flag(bm->status, VHD_FLAG_BM_UPDATE_BAT);
+	bm->pbw_error  = 0;
+	bm->pbw_next   = s->bat.pending;
+	s->bat.pending = bm;
+	s->bat.nr_pending++;
 }
 
-static inline int
-bat_locked(struct vhd_state *s)
+static inline void
+end_bat_update(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	return test_vhd_flag(s->bat.status, VHD_FLAG_BAT_LOCKED);
+	struct vhd_bitmap **p;
+
+	for (p = &s->bat.pending; *p; p = &(*p)->pbw_next)
+		if (*p == bm) {
+			*p = bm->pbw_next;
+			break;
+		}
+
+	clear_vhd_flag(bm->status, VHD_FLAG_BM_UPDATE_BAT |
+		       VHD_FLAG_BM_BAT_READY | VHD_FLAG_BM_BAT_WRITE |
+		       VHD_FLAG_BM_BAT_WAIT);
+	bm->pbw_next = NULL;
+	s->bat.nr_pending--;
 }
 
 static inline void
@@ -966,23 +1112,47 @@ init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 	memset(bm->map, 0, vhd_sectors_to_bytes(s->bm_secs));
 	memset(bm->shadow, 0, vhd_sectors_to_bytes(s->bm_secs));
 	init_vhd_request(s, &bm->req);
+	bm->pbw_offset = 0;
+	bm->pbw_error  = 0;
+	bm->pbw_next   = NULL;
+}
+
+static inline struct vhd_bitmap **
+bitmap_bucket(struct vhd_state *s, uint32_t block)
+{
+	return &s->bm_hash[block & s->bm_hash_mask];
 }
 
 static inline struct vhd_bitmap *
 get_bitmap(struct vhd_state *s, uint32_t block)
 {
-	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->blk == block)
+	if (!s->bm_hash)
+		return NULL;
+
+	for (bm = *bitmap_bucket(s, block); bm; bm = bm->hash_next)
+		if (bm->blk == block)
 			return bm;
-	}
 
 	return NULL;
 }
 
+static inline void
+unhash_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_bitmap **p;
+
+	for (p = bitmap_bucket(s, bm->blk); *p; p = &(*p)->hash_next)
+		if (*p == bm) {
+			*p = bm->hash_next;
+			break;
+		}
+
+	bm->hash_next = NULL;
+	bm->cached    = 0;
+}
+
 static inline void
 lock_bitmap(struct vhd_bitmap *bm)
 {
@@ -1033,21 +1203,20 @@ bitmap_full(struct vhd_state *s, struct vhd_bitmap *bm)
 static struct vhd_bitmap *
 remove_lru_bitmap(struct vhd_state *s)
 {
-	int i, idx = 0;
+	int i;
 	u64 seq = s->bm_lru;
 	struct vhd_bitmap *bm, *lru = NULL;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->seqno < seq && !bitmap_locked(bm)) {
-			idx = i;
+	for (i = 0; i < s->bm_cache->size; i++) {
+		bm = s->bm_cache->list + i;
+		if (bm->cached && bm->seqno < seq && !bitmap_locked(bm)) {
 			lru = bm;
 			seq = lru->seqno;
 		}
 	}
 
 	if (lru) {
-		s->bitmap[idx] = NULL;
+		unhash_bitmap(s, lru);
 		ASSERT(!bitmap_in_use(lru));
 	}
 
@@ -1084,9 +1253,9 @@ __bitmap_lru_seqno(struct vhd_state *s)
 
 	if (s->bm_lru == 0xffffffff) {
 		s->bm_lru = 0;
-		for (i = 0; i < VHD_CACHE_SIZE; i++) {
-			bm = s->bitmap[i];
-			if (bm) {
+		for (i = 0; i < s->bm_cache->size; i++) {
+			bm = s->bm_cache->list + i;
+			if (bm->cached) {
 				bm->seqno >>= 1;
 				if (bm->seqno > s->bm_lru)
 					s->bm_lru = bm->seqno;
@@ -1106,32 +1275,24 @@ touch_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 static inline void
 install_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		if (!s->bitmap[i]) {
-			touch_bitmap(s, bm);
-			s->bitmap[i] = bm;
-			return;
-		}
-	}
+	struct vhd_bitmap **bucket = bitmap_bucket(s, bm->blk);
+
+	ASSERT(!bm->cached);
 
-	ASSERT(0);
+	touch_bitmap(s, bm);
+	bm->hash_next = *bucket;
+	bm->cached    = 1;
+	*bucket       = bm;
 }
 
 static inline void
 free_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-
-	for (i = 0; i < VHD_CACHE_SIZE; i++)
-		if (s->bitmap[i] == bm)
-			break;
-
 	ASSERT(!bitmap_locked(bm));
 	ASSERT(!bitmap_in_use(bm));
-	ASSERT(i < VHD_CACHE_SIZE);
+	ASSERT(bm->cached);
 
-	s->bitmap[i] = NULL;
+	unhash_bitmap(s, bm);
 	s->bitmap_free[s->bm_free_count++] = bm;
 }
 
@@ -1156,7 +1317,8 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 
 	if (bat_entry(s, blk) == DD_BLK_UNUSED) {
 		if (op == VHD_OP_DATA_WRITE &&
-		    s->bat.pbw_blk != blk && bat_locked(s))
+		    s->bat.nr_pending >= s->bat.max_pending &&
+		    !bat_update_pending(get_bitmap(s, blk)))
 			return VHD_BM_BAT_LOCKED;
 
 		return VHD_BM_BAT_CLEAR;
@@ -1168,11 +1330,14 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 	}
 
 	bm = get_bitmap(s, blk);
-	if (!bm)
+	if (!bm) {
+		s->bm_misses++;
 		return VHD_BM_NOT_CACHED;
+	}
 
 	/* bump lru count */
 	touch_bitmap(s, bm);
+	s->bm_hits++;
 
 	if (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING))
 		return VHD_BM_READ_PENDING;
@@ -1240,6 +1405,8 @@ aio_read(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 	td_prep_read(tiocb, s->vhd.fd, req->treq.buf,
 		     vhd_sectors_to_bytes(req->treq.secs),
 		     offset, vhd_complete, req);
+	if (req->op == VHD_OP_DATA_READ)
+		tiocb->flags |= TIOCB_FLAG_READAHEAD;
 	td_queue_tiocb(s->driver, tiocb);
 
 	s->queued++;
@@ -1264,47 +1431,75 @@ aio_write(struct vhd_state *s, struct vhd_request *req, uint64_t offset)
 	TRACE(s);
 }
 
+/*
+ * Space is handed out as soon as it is reserved, so that allocations can
+ * overlap; if one fails, its space is left unused until the next open.
+ */
 static inline uint64_t
-reserve_new_block(struct vhd_state *s, uint32_t blk)
+reserve_new_block(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	int gap = 0;
-
-	ASSERT(!test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	uint64_t lb_end;
 
 	/* data region of segment should begin on page boundary */
 	if ((s->next_db + s->bm_secs) % s->spp)
 		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
 
-	s->bat.pbw_blk    = blk;
-	s->bat.pbw_offset = s->next_db + gap;
+	lb_end         = s->next_db;
+	bm->pbw_offset = s->next_db + gap;
+	s->next_db     = bm->pbw_offset + s->spb + s->bm_secs;
 
-	return s->next_db;
+	return lb_end;
 }
 
-static int
+/*
+ * write the sector of the bat holding the first ready entry, along with
+ * every other entry in it that is ready by now
+ */
+static void
 schedule_bat_write(struct vhd_state *s)
 {
-	int i;
+	int i, n;
 	u32 blk;
 	char *buf;
 	u64 offset;
 	struct vhd_request *req;
+	struct vhd_bitmap *bm;
+
+	if (bat_write_started(s))
+		return;
 
-	ASSERT(bat_locked(s));
+	for (bm = s->bat.pending; bm; bm = bm->pbw_next)
+		if (test_vhd_flag(bm->status, VHD_FLAG_BM_BAT_READY))
+			break;
+
+	if (!bm)
+		return;
 
 	req = &s->bat.req;
 	buf = s->bat.bat_buf;
-	blk = s->bat.pbw_blk;
+	blk = bm->blk - (bm->blk % 128);
+	n   = 0;
 
 	init_vhd_request(s, req);
-	memcpy(buf, &bat_entry(s, blk - (blk % 128)), 512);
+	memcpy(buf, &bat_entry(s, blk), 512);
 
-	((u32 *)buf)[blk % 128] = s->bat.pbw_offset;
+	for (; bm; bm = bm->pbw_next) {
+		if (!test_vhd_flag(bm->status, VHD_FLAG_BM_BAT_READY) ||
+		    bm->blk - (bm->blk % 128) != blk)
+			continue;
+
+		((u32 *)buf)[bm->blk % 128] = bm->pbw_offset;
+		clear_vhd_flag(bm->status, VHD_FLAG_BM_BAT_READY);
+		set_vhd_flag(bm->status, VHD_FLAG_BM_BAT_WRITE);
+		n++;
+	}
 
 	for (i = 0; i < 128; i++)
 		BE32_OUT(&((u32 *)buf)[i]);
 
-	offset         = s->vhd.header.table_offset + (blk - (blk % 128)) * 4;
+	offset         = s->vhd.header.table_offset + blk * 4;
+	req->treq.sec  = blk * s->spb;
 	req->treq.secs = 1;
 	req->treq.buf  = buf;
 	req->op        = VHD_OP_BAT_WRITE;
@@ -1313,10 +1508,11 @@ schedule_bat_write(struct vhd_state *s)
 	aio_write(s, req, offset);
 	set_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
 
-	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64", "
-	    "table_offset: 0x%08"PRIx64"\n", blk, s->bat.pbw_offset, offset);
+	s->bat.writes++;
+	s->bat.updates += n;
 
-	return 0;
+	DBG(TLOG_DBG, "blk: 0x%04x, entries: %d, "
+	    "table_offset: 0x%08"PRIx64"\n", blk, n, offset);
 }
 
 static void
@@ -1324,19 +1520,19 @@ schedule_zero_bm_write(struct vhd_state *s,
 		       struct vhd_bitmap *bm, uint64_t lb_end)
 {
 	uint64_t offset;
-	struct vhd_request *req = &s->bat.zero_req;
+	struct vhd_request *req = &bm->zero_req;
 
 	init_vhd_request(s, req);
 
 	offset         = vhd_sectors_to_bytes(lb_end);
 	req->op        = VHD_OP_ZERO_BM_WRITE;
-	req->treq.sec  = s->bat.pbw_blk * s->spb;
-	req->treq.secs = (s->bat.pbw_offset - lb_end) + s->bm_secs;
-	req->treq.buf  = vhd_zeros(vhd_sectors_to_bytes(req->treq.secs));
+	req->treq.sec  = bm->blk * s->spb;
+	req->treq.secs = (bm->pbw_offset - lb_end) + s->bm_secs;
+	req->treq.buf  = vhd_zeros(s, vhd_sectors_to_bytes(req->treq.secs));
 	req->next      = NULL;
 
 	DBG(TLOG_DBG, "blk: 0x%04x, writing zero bitmap at 0x%08"PRIx64"\n",
-	    s->bat.pbw_blk, offset);
+	    bm->blk, offset);
 
 	lock_bitmap(bm);
 	add_to_transaction(&bm->tx, req);
@@ -1351,15 +1547,13 @@ update_bat(struct vhd_state *s, uint32_t blk)
 	struct vhd_bitmap *bm;
 
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
-	
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		return 0;
-	}
 
 	/* empty bitmap could already be in
 	 * cache if earlier bat update failed */
 	bm = get_bitmap(s, blk);
+	if (bat_update_pending(bm))
+		return 0;
+
 	if (!bm) {
 		/* install empty bitmap in cache */
 		err = alloc_vhd_bitmap(s, &bm, blk);
@@ -1369,8 +1563,8 @@ update_bat(struct vhd_state *s, uint32_t blk)
 		install_bitmap(s, bm);
 	}
 
-	lock_bat(s);
-	lb_end = reserve_new_block(s, blk);
+	lb_end = reserve_new_block(s, bm);
+	start_bat_update(s, bm);
 	schedule_zero_bm_write(s, bm, lb_end);
 	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
 
@@ -1380,66 +1574,59 @@ update_bat(struct vhd_state *s, uint32_t blk)
 static int
 allocate_block(struct vhd_state *s, uint32_t blk)
 {
-	char *zeros;
-	int err, gap;
-	uint64_t offset, size;
+	int err;
+	uint64_t lb_end, size;
 	struct vhd_bitmap *bm;
 
 	ASSERT(bat_entry(s, blk) == DD_BLK_UNUSED);
 
-	if (bat_locked(s)) {
-		ASSERT(s->bat.pbw_blk == blk);
-		if (s->bat.req.error)
-			return -EBUSY;
-		return 0;
-	}
+	/* empty bitmap could already be in
+	 * cache if earlier bat update failed */
+	bm = get_bitmap(s, blk);
+	if (bat_update_pending(bm))
+		return (bm->pbw_error ? -EBUSY : 0);
 
-	gap            = 0;
-	s->bat.pbw_blk = blk;
-	offset         = vhd_sectors_to_bytes(s->next_db);
+	if (!bm) {
+		/* install empty bitmap in cache */
+		err = alloc_vhd_bitmap(s, &bm, blk);
+		if (err) 
+			return err;
 
-	/* data region of segment should begin on page boundary */
-	if ((s->next_db + s->bm_secs) % s->spp) {
-		gap = (s->spp - ((s->next_db + s->bm_secs) % s->spp));
-		s->next_db += gap;
+		install_bitmap(s, bm);
 	}
 
-	s->bat.pbw_offset = s->next_db;
+	lb_end = reserve_new_block(s, bm);
+	size   = vhd_sectors_to_bytes(s->next_db - lb_end);
 
 	DBG(TLOG_DBG, "blk: 0x%04x, pbwo: 0x%08"PRIx64"\n",
-	    blk, s->bat.pbw_offset);
+	    blk, bm->pbw_offset);
 
-	if (lseek(s->vhd.fd, offset, SEEK_SET) == (off_t)-1) {
+	if (lseek(s->vhd.fd, vhd_sectors_to_bytes(lb_end), SEEK_SET) ==
+	    (off_t)-1) {
 		ERR(errno, "lseek failed\n");
-		return -errno;
+		err = -errno;
+		goto fail;
 	}
 
-	size = vhd_sectors_to_bytes(s->spb + s->bm_secs + gap);
-	err  = write(s->vhd.fd, vhd_zeros(size), size);
+	err = write(s->vhd.fd, vhd_zeros(s, size), size);
 	if (err != size) {
 		err = (err == -1 ? -errno : -EIO);
 		ERR(err, "write failed");
-		return err;
-	}
-
-	/* empty bitmap could already be in
-	 * cache if earlier bat update failed */
-	bm = get_bitmap(s, blk);
-	if (!bm) {
-		/* install empty bitmap in cache */
-		err = alloc_vhd_bitmap(s, &bm, blk);
-		if (err) 
-			return err;
-
-		install_bitmap(s, bm);
+		goto fail;
 	}
 
-	lock_bat(s);
 	lock_bitmap(bm);
+	start_bat_update(s, bm);
+	set_vhd_flag(bm->tx.status, VHD_FLAG_TX_UPDATE_BAT);
+	set_vhd_flag(bm->status, VHD_FLAG_BM_BAT_READY);
 	schedule_bat_write(s);
-	add_to_transaction(&bm->tx, &s->bat.req);
 
 	return 0;
+
+fail:
+	/* nothing else can have been reserved meanwhile */
+	s->next_db = lb_end;
+	return err;
 }
 
 static int 
@@ -1513,7 +1700,7 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 		if (err)
 			return err;
 
-		offset = s->bat.pbw_offset;
+		offset = get_bitmap(s, blk)->pbw_offset;
 	}
 
 	offset += s->bm_secs + sec;
@@ -1551,7 +1738,7 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 }
 
 static int 
-schedule_bitmap_read(struct vhd_state *s, uint32_t blk)
+schedule_bitmap_read(struct vhd_state *s, uint32_t blk, int preload)
 {
 	int err;
 	u64 offset;
@@ -1581,6 +1768,11 @@ schedule_bitmap_read(struct vhd_state *s, uint32_t blk)
 	req->op        = VHD_OP_BITMAP_READ;
 	req->next      = NULL;
 
+	if (preload) {
+		set_vhd_flag(req->flags, VHD_FLAG_REQ_PRELOAD);
+		s->bm_cache->preloading++;
+	}
+
 	aio_read(s, req, offset);
 	lock_bitmap(bm);
 	install_bitmap(s, bm);
@@ -1608,8 +1800,8 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	       !test_vhd_flag(bm->status, VHD_FLAG_BM_WRITE_PENDING));
 
 	if (offset == DD_BLK_UNUSED) {
-		ASSERT(bat_locked(s) && s->bat.pbw_blk == blk);
-		offset = s->bat.pbw_offset;
+		ASSERT(bat_update_pending(bm));
+		offset = bm->pbw_offset;
 	}
 	
 	offset = vhd_sectors_to_bytes(offset);
@@ -1708,7 +1900,7 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 			break;
 
 		case VHD_BM_NOT_CACHED:
-			err = schedule_bitmap_read(s, clone.sec / s->spb);
+			err = schedule_bitmap_read(s, clone.sec / s->spb, 0);
 			if (err)
 				goto fail;
 
@@ -1743,6 +1935,25 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 	}
 }
 
+/*
+ * unallocated sectors of a disk without a parent read as zeros, so
+ * zero writes to them need not allocate anything.
+ */
+static inline int
+vhd_skip_zero_write(struct vhd_state *s, td_request_t treq)
+{
+	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_ZERO_DETECT) ||
+	    s->vhd.footer.type != HD_TYPE_DYNAMIC)
+		return 0;
+
+	if (!tapdisk_buffer_is_zero(treq.buf, vhd_sectors_to_bytes(treq.secs)))
+		return 0;
+
+	s->zero_writes += treq.secs;
+	td_complete_request(treq, 0);
+	return 1;
+}
+
 static void
 vhd_queue_write(td_driver_t *driver, td_request_t treq)
 {
@@ -1774,6 +1985,8 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 			flags      = (VHD_FLAG_REQ_UPDATE_BAT |
 				      VHD_FLAG_REQ_UPDATE_BITMAP);
 			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+			if (vhd_skip_zero_write(s, clone))
+				break;
 			err        = schedule_data_write(s, clone, flags);
 			if (err)
 				goto fail;
@@ -1782,6 +1995,8 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 		case VHD_BM_BIT_CLEAR:
 			flags      = VHD_FLAG_REQ_UPDATE_BITMAP;
 			clone.secs = read_bitmap_cache_span(s, clone.sec, clone.secs, 0);
+			if (vhd_skip_zero_write(s, clone))
+				break;
 			err        = schedule_data_write(s, clone, flags);
 			if (err)
 				goto fail;
@@ -1796,7 +2011,7 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 
 		case VHD_BM_NOT_CACHED:
 			clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
-			err = schedule_bitmap_read(s, clone.sec / s->spb);
+			err = schedule_bitmap_read(s, clone.sec / s->spb, 0);
 			if (err)
 				goto fail;
 
@@ -1829,6 +2044,205 @@ vhd_queue_write(td_driver_t *driver, td_request_t treq)
 	}
 }
 
+/*
+ * Discards are rare enough to be done synchronously, like preallocation:
+ * the metadata they touch is written before the request completes.  A
+ * block being allocated, or one with i/o on its bitmap, is retried once
+ * that settles.  In differencing disks, deallocated sectors read from
+ * the parent again, which discard semantics allow.
+ */
+static int
+vhd_write_bat_entry(struct vhd_state *s, uint32_t blk, uint32_t entry)
+{
+	int i;
+	u32 first;
+	u64 offset;
+	char *buf;
+
+	ASSERT(!bat_write_started(s));
+
+	buf    = s->bat.bat_buf;
+	first  = blk - (blk % 128);
+	offset = s->vhd.header.table_offset + first * 4;
+
+	memcpy(buf, &bat_entry(s, first), 512);
+	((u32 *)buf)[blk % 128] = entry;
+	for (i = 0; i < 128; i++)
+		BE32_OUT(&((u32 *)buf)[i]);
+
+	if (pwrite(s->vhd.fd, buf, 512, offset) != 512)
+		return (errno ? -errno : -EIO);
+
+	return 0;
+}
+
+static void
+vhd_clear_batmap(struct vhd_state *s, uint32_t blk)
+{
+	int err;
+
+	if (!test_batmap(s, blk))
+		return;
+
+	/* a stale bit on disk would vouch for a partial block */
+	vhd_batmap_clear(&s->vhd, &s->bat.batmap, blk);
+	err = vhd_write_batmap(&s->vhd, &s->bat.batmap);
+	if (err)
+		EPRINTF("%s: writing batmap: %d\n", s->vhd.file, err);
+}
+
+static int
+vhd_deallocate_block(struct vhd_state *s, uint32_t blk)
+{
+	int err;
+	u64 offset;
+	struct vhd_bitmap *bm;
+
+	bm     = get_bitmap(s, blk);
+	offset = bat_entry(s, blk);
+
+	if (offset == DD_BLK_UNUSED)
+		return (bat_update_pending(bm) ? -EBUSY : 0);
+
+	if (bat_write_started(s) ||
+	    (bm && (bitmap_locked(bm) || bitmap_in_use(bm))))
+		return -EBUSY;
+
+	err = vhd_write_bat_entry(s, blk, DD_BLK_UNUSED);
+	if (err) {
+		ERR(err, "blk 0x%04x: writing bat\n", blk);
+		return err;
+	}
+
+	bat_entry(s, blk) = DD_BLK_UNUSED;
+	vhd_clear_batmap(s, blk);
+	if (bm)
+		free_vhd_bitmap(s, bm);
+
+	/* the space itself stays reserved, but need not stay allocated */
+	tapdisk_discard(s->vhd.fd, vhd_sectors_to_bytes(offset),
+			vhd_sectors_to_bytes(s->bm_secs + s->spb));
+	td_invalidate_io(s->driver, s->vhd.fd, vhd_sectors_to_bytes(offset),
+			 vhd_sectors_to_bytes(s->bm_secs + s->spb));
+
+	s->writes++;
+	s->discards++;
+
+	DBG(TLOG_DBG, "%s: blk: 0x%04x, offset: 0x%08"PRIx64" deallocated\n",
+	    s->vhd.file, blk, offset);
+
+	return 0;
+}
+
+static int
+vhd_discard_sectors(struct vhd_state *s, uint64_t sector, int secs)
+{
+	int i, err, psize;
+	u32 blk, sec;
+	u64 offset, start, end;
+	struct vhd_bitmap *bm;
+
+	blk    = sector / s->spb;
+	sec    = sector % s->spb;
+	bm     = get_bitmap(s, blk);
+	offset = bat_entry(s, blk);
+
+	if (offset == DD_BLK_UNUSED)
+		return (bat_update_pending(bm) ? -EBUSY : 0);
+
+	if (!bm) {
+		err = schedule_bitmap_read(s, blk, 0);
+		return (err ? : -EBUSY);
+	}
+
+	if (bitmap_locked(bm) || bitmap_in_use(bm))
+		return -EBUSY;
+
+	for (i = 0; i < secs; i++)
+		vhd_bitmap_clear(&s->vhd, bm->shadow, sec + i);
+
+	if (tapdisk_buffer_is_zero(bm->shadow, s->spb >> 3)) {
+		memcpy(bm->shadow, bm->map, vhd_sectors_to_bytes(s->bm_secs));
+		return vhd_deallocate_block(s, blk);
+	}
+
+	if (pwrite(s->vhd.fd, bm->shadow, vhd_sectors_to_bytes(s->bm_secs),
+		   vhd_sectors_to_bytes(offset)) !=
+	    vhd_sectors_to_bytes(s->bm_secs)) {
+		err = (errno ? -errno : -EIO);
+		memcpy(bm->shadow, bm->map, vhd_sectors_to_bytes(s->bm_secs));
+		ERR(err, "blk 0x%04x: writing bitmap\n", blk);
+		return err;
+	}
+
+	memcpy(bm->map, bm->shadow, vhd_sectors_to_bytes(s->bm_secs));
+	vhd_clear_batmap(s, blk);
+	s->writes++;
+
+	td_invalidate_io(s->driver, s->vhd.fd, vhd_sectors_to_bytes(offset),
+			 vhd_sectors_to_bytes(s->bm_secs + s->spb));
+
+	/* release whatever whole pages the range covers */
+	psize  = getpagesize();
+	offset = vhd_sectors_to_bytes(offset + s->bm_secs);
+	start  = offset + vhd_sectors_to_bytes(sec);
+	end    = start  + vhd_sectors_to_bytes(secs);
+	start  = (start + psize - 1) & ~((u64)psize - 1);
+	end   &= ~((u64)psize - 1);
+	if (end > start)
+		tapdisk_discard(s->vhd.fd, start, end - start);
+
+	return 0;
+}
+
+static void
+vhd_queue_discard(td_driver_t *driver, td_request_t treq)
+{
+	int err;
+	td_request_t clone;
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x\n",
+	    s->vhd.file, treq.sec, treq.secs);
+
+	if (s->vhd.footer.type == HD_TYPE_FIXED) {
+		err = tapdisk_discard(s->vhd.fd,
+				      vhd_sectors_to_bytes(treq.sec),
+				      vhd_sectors_to_bytes(treq.secs));
+		td_invalidate_io(driver, s->vhd.fd,
+				 vhd_sectors_to_bytes(treq.sec),
+				 vhd_sectors_to_bytes(treq.secs));
+		td_complete_request(treq, (err == -EOPNOTSUPP ? 0 : err));
+		return;
+	}
+
+	/*
+	 * Each block's share is completed as it is done, so that the
+	 * request's sectors all get accounted for; on failure the rest of
+	 * the range is failed, and a retry discards it all over again.
+	 */
+	while (treq.secs) {
+		clone      = treq;
+		clone.secs = MIN(clone.secs, s->spb - (clone.sec % s->spb));
+
+		if (clone.secs == s->spb)
+			err = vhd_deallocate_block(s, clone.sec / s->spb);
+		else
+			err = vhd_discard_sectors(s, clone.sec, clone.secs);
+
+		if (err) {
+			treq.blocked = (err == -EBUSY);
+			td_complete_request(treq, err);
+			return;
+		}
+
+		td_complete_request(clone, 0);
+
+		treq.sec  += clone.secs;
+		treq.secs -= clone.secs;
+	}
+}
+
 static inline void
 signal_completion(struct vhd_request *list, int error)
 {
@@ -1904,13 +2318,10 @@ finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	struct vhd_transaction *tx = &bm->tx;
 
-	if (!bat_locked(s))
+	if (!bat_update_pending(bm))
 		return;
 
-	if (s->bat.pbw_blk != bm->blk)
-		return;
-
-	if (!s->bat.req.error)
+	if (!bm->pbw_error)
 		goto release;
 
 	if (!test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE))
@@ -1921,8 +2332,7 @@ finish_bat_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 
  release:
 	DBG(TLOG_DBG, "blk: 0x%04x\n", bm->blk);
-	unlock_bat(s);
-	init_bat(s);
+	end_bat_update(s, bm);
 }
 
 static void
@@ -1936,15 +2346,11 @@ finish_bitmap_transaction(struct vhd_state *s,
 	tx->error = (tx->error ? tx->error : error);
 	map_size  = vhd_sectors_to_bytes(s->bm_secs);
 
-	if (!test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
-			/* still waiting for bat write */
-			ASSERT(bm->blk == s->bat.pbw_blk);
-			ASSERT(test_vhd_flag(s->bat.status, 
-					     VHD_FLAG_BAT_WRITE_STARTED));
-			s->bat.req.tx = tx;
-			return;
-		}
+	if (test_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT)) {
+		/* still waiting for bat write */
+		ASSERT(bat_update_pending(bm));
+		set_vhd_flag(bm->status, VHD_FLAG_BM_BAT_WAIT);
+		return;
 	}
 
 	if (tx->error) {
@@ -1983,45 +2389,63 @@ finish_data_transaction(struct vhd_state *s, struct vhd_bitmap *bm)
 	return finish_bitmap_transaction(s, bm, 0);
 }
 
+static void
+finish_bat_update(struct vhd_state *s, struct vhd_bitmap *bm, int error)
+{
+	struct vhd_transaction *tx = &bm->tx;
+
+	DBG(TLOG_DBG, "blk 0x%04x, pbwo: 0x%08"PRIx64", err %d\n",
+	    bm->blk, bm->pbw_offset, error);
+
+	clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
+
+	if (test_vhd_flag(bm->status, VHD_FLAG_BM_BAT_WAIT)) {
+		clear_vhd_flag(bm->status, VHD_FLAG_BM_BAT_WAIT);
+		finish_bitmap_transaction(s, bm, error);
+	} else if (!bitmap_in_use(bm))
+		unlock_bitmap(bm);
+
+	finish_bat_transaction(s, bm);
+}
+
 static void
 finish_bat_write(struct vhd_request *req)
 {
-	struct vhd_bitmap *bm;
-	struct vhd_transaction *tx;
+	int i, n;
+	struct vhd_bitmap *bm, *done[VHD_BAT_PENDING_MAX];
 	struct vhd_state *s = req->state;
 
 	s->returned++;
 	TRACE(s);
 
-	bm = get_bitmap(s, s->bat.pbw_blk);
+	ASSERT(bat_write_started(s));
 
-	DBG(TLOG_DBG, "blk 0x%04x, pbwo: 0x%08"PRIx64", err %d\n",
-	    s->bat.pbw_blk, s->bat.pbw_offset, req->error);
-	ASSERT(bm && bitmap_valid(bm));
-	ASSERT(bat_locked(s) &&
-	       test_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED));
+	/* completions below may start new allocations: collect ours first */
+	n = 0;
+	for (bm = s->bat.pending; bm; bm = bm->pbw_next) {
+		if (!test_vhd_flag(bm->status, VHD_FLAG_BM_BAT_WRITE))
+			continue;
 
-	tx = &bm->tx;
-	ASSERT(test_vhd_flag(tx->status, VHD_FLAG_TX_LIVE));
+		ASSERT(bitmap_valid(bm) && bitmap_locked(bm));
+		clear_vhd_flag(bm->status, VHD_FLAG_BM_BAT_WRITE);
 
-	if (!req->error) {
-		bat_entry(s, s->bat.pbw_blk) = s->bat.pbw_offset;
-		s->next_db = s->bat.pbw_offset + s->spb + s->bm_secs;
-	} else
-		tx->error = req->error;
+		if (!req->error)
+			bat_entry(s, bm->blk) = bm->pbw_offset;
+		else {
+			bm->pbw_error = req->error;
+			bm->tx.error  = req->error;
+		}
 
-	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_PREALLOCATE)) {
-		tx->finished++;
-		remove_from_req_list(&tx->requests, req);
-		if (transaction_completed(tx))
-			finish_data_transaction(s, bm);
-	} else {
-		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-		if (s->bat.req.tx)
-			finish_bitmap_transaction(s, bm, req->error);
+		ASSERT(n < VHD_BAT_PENDING_MAX);
+		done[n++] = bm;
 	}
 
-	finish_bat_transaction(s, bm);
+	clear_vhd_flag(s->bat.status, VHD_FLAG_BAT_WRITE_STARTED);
+
+	for (i = 0; i < n; i++)
+		finish_bat_update(s, done[i], req->error);
+
+	schedule_bat_write(s);
 }
 
 static void
@@ -2039,20 +2463,20 @@ finish_zero_bm_write(struct vhd_request *req)
 	bm  = get_bitmap(s, blk);
 
 	DBG(TLOG_DBG, "blk: 0x%04x\n", blk);
-	ASSERT(bat_locked(s));
-	ASSERT(s->bat.pbw_blk == blk);
 	ASSERT(bm && bitmap_valid(bm) && bitmap_locked(bm));
+	ASSERT(bat_update_pending(bm));
 
 	tx->finished++;
 	remove_from_req_list(&tx->requests, req);
 
 	if (req->error) {
-		unlock_bat(s);
-		init_bat(s);
+		end_bat_update(s, bm);
 		tx->error = req->error;
 		clear_vhd_flag(tx->status, VHD_FLAG_TX_UPDATE_BAT);
-	} else
+	} else {
+		set_vhd_flag(bm->status, VHD_FLAG_BM_BAT_READY);
 		schedule_bat_write(s);
+	}
 
 	if (transaction_completed(tx))
 		finish_data_transaction(s, bm);
@@ -2186,13 +2610,79 @@ finish_data_write(struct vhd_request *req)
 	}
 }
 
+/*
+ * Read the bitmaps of allocated blocks into free cache entries, a few at
+ * a time, so that cold random reads need not wait for them.  Preloading
+ * never evicts: misses on the data path come first.
+ */
+static void
+vhd_preload_bitmaps(struct vhd_state *s)
+{
+	u32 blk;
+	struct vhd_bitmap_cache *cache = s->bm_cache;
+
+	if (!cache)
+		return;
+
+	while (cache->preloading < VHD_PRELOAD_DEPTH &&
+	       s->bm_free_count > 0 &&
+	       s->bm_preload < s->bat.bat.entries) {
+		blk = s->bm_preload++;
+
+		if (bat_entry(s, blk) == DD_BLK_UNUSED ||
+		    test_batmap(s, blk) || get_bitmap(s, blk))
+			continue;
+
+		if (schedule_bitmap_read(s, blk, 1))
+			break;
+	}
+}
+
+static void
+vhd_preload_complete(struct vhd_request *req, int err)
+{
+	struct vhd_bitmap *bm;
+	struct vhd_bitmap_cache *cache;
+	struct vhd_state *s;
+
+	bm    = (struct vhd_bitmap *)
+		((char *)req - offsetof(struct vhd_bitmap, req));
+	cache = bm->cache;
+
+	cache->preloading--;
+	if (cache->orphaned) {
+		if (!cache->preloading)
+			__vhd_free_bitmap_cache(cache);
+		return;
+	}
+
+	s = req->state;
+	s->completed++;
+	req->error = err;
+
+	if (err) {
+		ERR(err, "%s: bitmap preload of blk %u failed",
+		    s->vhd.file, bm->blk);
+		s->bm_preload = s->bat.bat.entries;
+	} else
+		s->bm_preloaded++;
+
+	finish_bitmap_read(req);
+	vhd_preload_bitmaps(s);
+}
+
 void
 vhd_complete(void *arg, struct tiocb *tiocb, int err)
 {
 	struct vhd_request *req = (struct vhd_request *)arg;
-	struct vhd_state *s = req->state;
+	struct vhd_state *s;
 	struct iocb *io = &tiocb->iocb;
 
+	/* may complete after close: see vhd_free_bitmap_cache() */
+	if (test_vhd_flag(req->flags, VHD_FLAG_REQ_PRELOAD))
+		return vhd_preload_complete(req, err);
+
+	s = req->state;
 	s->completed++;
 	TRACE(s);
 
@@ -2240,6 +2730,7 @@ void
 vhd_debug(td_driver_t *driver)
 {
 	int i;
+	struct vhd_bitmap *bm;
 	struct vhd_state *s = (struct vhd_state *)driver->data;
 
 	DBG(TLOG_WARN, "%s: QUEUED: 0x%08"PRIx64", COMPLETED: 0x%08"PRIx64", "
@@ -2249,6 +2740,8 @@ vhd_debug(td_driver_t *driver)
 	    s->writes, (s->writes ? ((float)s->write_size / s->writes) : 0.0));
 	DBG(TLOG_WARN, "READS: 0x%08"PRIx64", AVG_READ_SIZE: %f\n",
 	    s->reads, (s->reads ? ((float)s->read_size / s->reads) : 0.0));
+	DBG(TLOG_WARN, "ZERO WRITES: 0x%08"PRIx64" secs, DISCARDS: 0x%08"
+	    PRIx64" blocks\n", s->zero_writes, s->discards);
 
 	DBG(TLOG_WARN, "ALLOCATED REQUESTS: (%lu total)\n", VHD_REQS_DATA);
 	for (i = 0; i < VHD_REQS_DATA; i++) {
@@ -2261,14 +2754,21 @@ vhd_debug(td_driver_t *driver)
 			    t->sec, r->flags, r, r->next, r->tx);
 	}
 
-	DBG(TLOG_WARN, "BITMAP CACHE:\n");
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
+	if (!s->bm_cache)
+		goto bat;
+
+	DBG(TLOG_WARN, "BITMAP CACHE: size: %d, free: %d, hits: 0x%08"PRIx64
+	    ", misses: 0x%08"PRIx64", preloaded: 0x%08"PRIx64", "
+	    "preloading: %d\n", s->bm_cache->size, s->bm_free_count,
+	    s->bm_hits, s->bm_misses, s->bm_preloaded,
+	    s->bm_cache->preloading);
+	for (i = 0; i < s->bm_cache->size; i++) {
 		int qnum = 0, wnum = 0, rnum = 0;
-		struct vhd_bitmap *bm = s->bitmap[i];
+		struct vhd_bitmap *bm = s->bm_cache->list + i;
 		struct vhd_transaction *tx;
 		struct vhd_request *r;
 
-		if (!bm)
+		if (!bm->cached)
 			continue;
 
 		tx = &bm->tx;
@@ -2298,9 +2798,15 @@ vhd_debug(td_driver_t *driver)
 		    tx->started, tx->finished, tx->status, tx->requests.head, rnum);
 	}
 
-	DBG(TLOG_WARN, "BAT: status: 0x%08x, pbw_blk: 0x%04x, "
-	    "pbw_off: 0x%08"PRIx64", tx: %p\n", s->bat.status, s->bat.pbw_blk,
-	    s->bat.pbw_offset, s->bat.req.tx);
+bat:
+	DBG(TLOG_WARN, "BAT: status: 0x%08x, pending: %d/%d, writes: "
+	    "0x%08"PRIx64", updates: 0x%08"PRIx64"\n", s->bat.status,
+	    s->bat.nr_pending, s->bat.max_pending, s->bat.writes,
+	    s->bat.updates);
+	for (bm = s->bat.pending; bm; bm = bm->pbw_next)
+		DBG(TLOG_WARN, "blk: 0x%04x, status: 0x%08x, pbw_off: 0x%08"
+		    PRIx64", err: %d\n", bm->blk, bm->status,
+		    bm->pbw_offset, bm->pbw_error);
 
 /*
 	for (i = 0; i < s->hdr.max_bat_size; i++)
@@ -2319,4 +2825,5 @@ struct tap_disk tapdisk_vhd = {
 	.td_get_parent_id   = vhd_get_parent_id,
 	.td_validate_parent = vhd_validate_parent,
 	.td_debug           = vhd_debug,
+	.td_queue_discard   = vhd_queue_discard,
 };
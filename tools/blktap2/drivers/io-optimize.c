@@ -30,6 +30,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <inttypes.h>
 
@@ -39,7 +40,8 @@
 #if (!defined(TEST) && defined(DEBUG))
 #define DBG(ctx, f, a...) tlog_write(TLOG_DBG, f, ##a)
 #elif defined(TEST)
-#define DBG(ctx, f, a...) printf(f, ##a)
+static int verbose = 1;
+#define DBG(ctx, f, a...) do { if (verbose) printf(f, ##a); } while (0)
 #else
 #define DBG(ctx, f, a...) ((void)0)
 #endif
@@ -111,9 +113,47 @@ restore_iocb(struct opio *op)
 {
 	struct iocb *io = op->iocb;
 
-	io->data        = op->data;
-	io->u.c.buf     = op->buf;
-	io->u.c.nbytes  = op->nbytes;
+	io->data           = op->data;
+	io->u.c.buf        = op->buf;
+	io->u.c.nbytes     = op->nbytes;
+	io->aio_lio_opcode = op->opcode;
+}
+
+static inline int
+iocb_vectored(struct iocb *io)
+{
+	return (io->aio_lio_opcode == OPIO_CMD_PREADV ||
+		io->aio_lio_opcode == OPIO_CMD_PWRITEV);
+}
+
+static inline int
+iocb_opcode(struct iocb *io)
+{
+	switch (io->aio_lio_opcode) {
+	case OPIO_CMD_PREADV:
+		return IO_CMD_PREAD;
+	case OPIO_CMD_PWRITEV:
+		return IO_CMD_PWRITE;
+	default:
+		return io->aio_lio_opcode;
+	}
+}
+
+unsigned long
+io_iocb_bytes(struct iocb *io)
+{
+	int i;
+	unsigned long bytes;
+	struct iovec *iov;
+
+	if (!iocb_vectored(io))
+		return io->u.c.nbytes;
+
+	iov = (struct iovec *)io->u.c.buf;
+	for (i = 0, bytes = 0; i < io->u.c.nbytes; i++)
+		bytes += iov[i].iov_len;
+
+	return bytes;
 }
 
 static inline int
@@ -129,7 +169,7 @@ iocb_optimized(struct opioctx *ctx, struct iocb *io)
 static inline int
 contiguous_sectors(struct iocb *l, struct iocb *r)
 {
-	return (l->u.c.offset + l->u.c.nbytes == r->u.c.offset);
+	return (l->u.c.offset + io_iocb_bytes(l) == r->u.c.offset);
 }
 
 static inline int
@@ -142,8 +182,7 @@ static inline int
 contiguous_iocbs(struct iocb *l, struct iocb *r)
 {
 	return ((l->aio_fildes == r->aio_fildes) &&
-		contiguous_sectors(l, r) &&
-		contiguous_buffers(l, r));
+		contiguous_sectors(l, r));
 }
 
 static inline void
@@ -165,6 +204,7 @@ opio_iocb_init(struct opioctx *ctx, struct iocb *io)
 	op->nbytes = io->u.c.nbytes;
 	op->offset = io->u.c.offset;
 	op->data   = io->data;
+	op->opcode = io->aio_lio_opcode;
 	op->iocb   = io;
 	io->data   = op;
 
@@ -182,21 +222,57 @@ opio_get(struct opioctx *ctx, struct iocb *io)
 	        return opio_iocb_init(ctx, io);
 }
 
+static inline void
+vectorize_iocb(struct opio *ophead, struct iocb *head)
+{
+	ophead->iov[0].iov_base = head->u.c.buf;
+	ophead->iov[0].iov_len  = head->u.c.nbytes;
+	ophead->niov            = 1;
+
+	head->aio_lio_opcode = (head->aio_lio_opcode == IO_CMD_PREAD ?
+				OPIO_CMD_PREADV : OPIO_CMD_PWRITEV);
+	head->u.c.buf        = ophead->iov;
+	head->u.c.nbytes     = 1;
+}
+
 static int
 merge_tail(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 {
+	int concat;
+	struct iovec *last;
 	struct opio *ophead, *opio;
 
 	ophead = opio_get(ctx, head);
 	if (!ophead)
 		return -ENOMEM;
 
+	if (iocb_vectored(head)) {
+		last   = &ophead->iov[ophead->niov - 1];
+		concat = ((char *)last->iov_base + last->iov_len ==
+			  io->u.c.buf);
+		if (!concat && ophead->niov == OPIO_MAX_IOV)
+			return -EINVAL;
+	} else
+		concat = contiguous_buffers(head, io);
+
 	opio = opio_get(ctx, io);
 	if (!opio)
 		return -ENOMEM;
 
+	if (!concat && !iocb_vectored(head))
+		vectorize_iocb(ophead, head);
+
+	if (!iocb_vectored(head))
+		head->u.c.nbytes += io->u.c.nbytes;
+	else if (concat)
+		ophead->iov[ophead->niov - 1].iov_len += io->u.c.nbytes;
+	else {
+		ophead->iov[ophead->niov].iov_base = io->u.c.buf;
+		ophead->iov[ophead->niov].iov_len  = io->u.c.nbytes;
+		head->u.c.nbytes = ++ophead->niov;
+	}
+
 	opio->head        = ophead;
-	head->u.c.nbytes += io->u.c.nbytes;
 	ophead->list.tail = ophead->list.tail->next = opio;
 	
 	return 0;
@@ -205,7 +281,7 @@ merge_tail(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 static int
 merge(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 {
-	if (head->aio_lio_opcode != io->aio_lio_opcode)
+	if (iocb_opcode(head) != io->aio_lio_opcode)
 		return -EINVAL;
 
 	if (!contiguous_iocbs(head, io))
@@ -292,23 +368,32 @@ expand_event(struct opioctx *ctx,
 	struct iocb *io;
 	struct io_event *ep;
 	struct opio *ophead, *op, *next;
+	unsigned long done;
 
 	io     = event->obj;
 	ophead = (struct opio *)io->data;
 	op     = ophead;
 
-	if (event->res == io->u.c.nbytes)
-		err = 0;
-	else if ((int)event->res < 0)
-		err = (int)event->res;
-	else
-		err = -EIO;
+	/*
+	 * merged iocbs are in offset order: a short transfer (e.g. a read
+	 * running past the end of the file) only fails those it cut off
+	 */
+	err  = ((int)event->res < 0 ? (int)event->res : 0);
+	done = (err ? 0 : event->res);
 
 	while (op) {
 		next    = op->next;
 		ep      = &queue[idx++];
 		ep->obj = op->iocb;
-		ep->res = (err ? err : op->nbytes);
+		if (err)
+			ep->res = err;
+		else if (done >= op->nbytes) {
+			ep->res = op->nbytes;
+			done   -= op->nbytes;
+		} else {
+			ep->res = done;
+			done    = 0;
+		}
 		restore_iocb(op);
 		free_opio(ctx, op);
 		op      = next;
@@ -342,6 +427,148 @@ io_split(struct opioctx *ctx, struct io_event *events, int num)
 	return on_queue;
 }
 
+void
+opio_elv_free(struct opioelv *elv)
+{
+	free(elv->queue);
+	elv->queue = NULL;
+	elv->size  = 0;
+	elv->held  = 0;
+}
+
+int
+opio_elv_init(struct opioelv *elv, int size)
+{
+	memset(elv, 0, sizeof(struct opioelv));
+
+	elv->queue = calloc(size, sizeof(struct opio_elv_entry));
+	if (!elv->queue)
+		return -ENOMEM;
+
+	elv->size         = size;
+	elv->batch        = OPIO_ELV_BATCH;
+	elv->read_expire  = OPIO_ELV_READ_EXPIRE;
+	elv->write_expire = OPIO_ELV_WRITE_EXPIRE;
+
+	return 0;
+}
+
+static inline int
+elv_compare(struct iocb *io, int fd, long long offset)
+{
+	if (io->aio_fildes != fd)
+		return (io->aio_fildes < fd ? -1 : 1);
+	if (io->u.c.offset != offset)
+		return (io->u.c.offset < offset ? -1 : 1);
+	return 0;
+}
+
+/*
+ * index of the first held iocb at or past (fd, offset); with @after,
+ * past any iocbs at that very position, so equal ones stay in order
+ */
+static int
+elv_search(struct opioelv *elv, int fd, long long offset, int after)
+{
+	int lo, hi, mid, cmp;
+
+	lo = 0;
+	hi = elv->held;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		cmp = elv_compare(elv->queue[mid].iocb, fd, offset);
+		if (cmp < 0 || (after && cmp == 0))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+void
+io_elv_add(struct opioelv *elv, struct iocb **queue, int num, uint64_t now)
+{
+	int i, idx;
+	struct iocb *io;
+	struct opio_elv_entry *e;
+
+	for (i = 0; i < num && elv->held < elv->size; i++) {
+		io  = queue[i];
+		idx = elv_search(elv, io->aio_fildes, io->u.c.offset, 1);
+		e   = elv->queue + idx;
+
+		memmove(e + 1, e, (elv->held - idx) * sizeof(*e));
+		e->iocb  = io;
+		e->stamp = now;
+		elv->held++;
+	}
+}
+
+static int
+elv_expired(struct opioelv *elv, uint64_t now)
+{
+	int i;
+	uint64_t expire;
+	struct opio_elv_entry *e;
+
+	for (i = 0; i < elv->held; i++) {
+		e      = elv->queue + i;
+		expire = (e->iocb->aio_lio_opcode == IO_CMD_PREAD ?
+			  elv->read_expire : elv->write_expire);
+		if (now - e->stamp >= expire)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Move held iocbs to @queue, in one ascending sweep starting where
+ * the last one ended.  Unless @force is set, iocbs are only released
+ * once a batch has built up or one of them is overdue.
+ */
+int
+io_elv_dispatch(struct opioelv *elv, struct iocb **queue, int force,
+		uint64_t now)
+{
+	int i, n, start;
+	uint64_t wait;
+	struct iocb *io;
+	struct opio_elv_entry *e;
+
+	if (!elv->held)
+		return 0;
+
+	if (!force && elv->held < elv->batch) {
+		if (!elv_expired(elv, now))
+			return 0;
+		elv->expired++;
+	}
+
+	start = elv_search(elv, elv->last_fd, elv->last_offset, 0);
+
+	for (i = 0, n = 0; i < elv->held; i++) {
+		e    = elv->queue + ((start + i) % elv->held);
+		wait = now - e->stamp;
+
+		queue[n++]       = e->iocb;
+		elv->wait_total += wait;
+		if (wait > elv->wait_max)
+			elv->wait_max = wait;
+	}
+
+	io               = queue[n - 1];
+	elv->last_fd     = io->aio_fildes;
+	elv->last_offset = io->u.c.offset + io->u.c.nbytes;
+	elv->held        = 0;
+	elv->dispatches++;
+	elv->dispatched += n;
+
+	return n;
+}
+
 /******************************************************************************
 debug print functions
 ******************************************************************************/
@@ -350,12 +577,12 @@ __print_iocb(struct opioctx *ctx, struct iocb *io, char *prefix)
 {
 	char *type;
 
-	type = (io->aio_lio_opcode == IO_CMD_PREAD ? "read" : "write");
+	type = (iocb_opcode(io) == IO_CMD_PREAD ? "read" : "write");
 
 	DBG(ctx, "%soff: %08llx, nbytes: %04lx, buf: %p, type: %s, data: %08lx,"
-	    " optimized: %d\n", prefix, io->u.c.offset, io->u.c.nbytes, 
-	    io->u.c.buf, type, (unsigned long)io->data, 
-	    iocb_optimized(ctx, io));
+	    " optimized: %d, vectored: %d\n", prefix, io->u.c.offset,
+	    io_iocb_bytes(io), io->u.c.buf, type, (unsigned long)io->data,
+	    iocb_optimized(ctx, io), iocb_vectored(io));
 }
 
 static char *null_prefix = "";
@@ -438,7 +665,7 @@ static void
 usage(void)
 {
 	fprintf(stderr, "usage: io_optimize [-n num_runs] "
-		"[-i num_iocbs] [-s num_secs] [-r random_seed]\n");
+		"[-i num_iocbs] [-s num_secs] [-r random_seed] [-b]\n");
 	exit(-1);
 }
 
@@ -531,7 +758,7 @@ simulate_io(struct iocb **iocbs, struct io_event *events, int num_iocbs)
 		io      = iocbs[i];
 		ep      = &events[i];
 		ep->obj = io;
-		ep->res = (random() % 10 < 8 ? io->u.c.nbytes : 0);
+		ep->res = (random() % 10 < 8 ? io_iocb_bytes(io) : 0);
 	}
 
 	return done;
@@ -571,13 +798,222 @@ init_optest(struct iocb *iocb_list,
 		iocbs[i]  = &iocb_list[i];
 }
 
+/*
+ * Benchmark (-b): iocbs arrive in small batches from a number of
+ * sequential streams, as from several guests at once, and are served in
+ * order by a model disk which charges a seek for every discontiguous
+ * request.  The same workload is run merging within submit batches only,
+ * and through the elevator, which holds iocbs while the disk is busy.
+ */
+#define BENCH_POOL          256
+#define BENCH_STREAMS       8
+#define BENCH_DEPTH         4     /* elevator holds with this many busy */
+#define BENCH_TICK_US       10
+#define BENCH_ARRIVAL_US    12000 /* between batches */
+#define BENCH_SEEK_US       2000
+#define BENCH_KB_US         10    /* ~100MB/s */
+
+struct bench_stream {
+	short               type;
+	long long           offset;
+};
+
+struct bench_disk {
+	struct iocb        *io[BENCH_POOL];
+	uint64_t            done[BENCH_POOL];
+	int                 head;
+	int                 count;
+	uint64_t            busy_until;
+	long long           pos;
+};
+
+struct bench_result {
+	uint64_t            iocbs;
+	uint64_t            requests;
+	uint64_t            lat_total;
+	uint64_t            lat_max;
+	uint64_t            elapsed;
+};
+
+static int
+bench_inflight(struct bench_disk *disk, uint64_t now)
+{
+	int i, n;
+
+	for (i = 0, n = 0; i < disk->count; i++)
+		if (disk->done[(disk->head + i) % BENCH_POOL] > now)
+			n++;
+
+	return n;
+}
+
+static void
+bench_disk_submit(struct bench_disk *disk, struct iocb *io, uint64_t now)
+{
+	uint64_t start, cost;
+	unsigned long bytes = io_iocb_bytes(io);
+
+	start = (disk->busy_until > now ? disk->busy_until : now);
+	cost  = (bytes >> 10) * BENCH_KB_US;
+	if (io->u.c.offset != disk->pos)
+		cost += BENCH_SEEK_US;
+
+	disk->busy_until = start + cost;
+	disk->pos        = io->u.c.offset + bytes;
+
+	disk->io[(disk->head + disk->count) % BENCH_POOL]   = io;
+	disk->done[(disk->head + disk->count) % BENCH_POOL] = disk->busy_until;
+	disk->count++;
+}
+
+static void
+bench_run(int elevator, int total, uint64_t num_secs, int seed,
+	  struct bench_result *res)
+{
+	struct opioctx ctx;
+	struct opioelv elv;
+	struct bench_disk disk;
+	struct bench_stream streams[BENCH_STREAMS];
+	struct iocb iocb_list[BENCH_POOL], *free_list[BENCH_POOL];
+	struct iocb *batch[BENCH_POOL], *queue[BENCH_POOL];
+	struct io_event events[BENCH_POOL];
+	uint64_t arrival[BENCH_POOL], now, next_arrival;
+	int i, n, nfree, issued, completed;
+
+	srandom(seed);
+	memset(res, 0, sizeof(*res));
+	memset(&disk, 0, sizeof(disk));
+
+	if (opio_init(&ctx, BENCH_POOL) || opio_elv_init(&elv, BENCH_POOL)) {
+		fprintf(stderr, "initialization failed\n");
+		exit(ENOMEM);
+	}
+
+	for (i = 0; i < BENCH_STREAMS; i++) {
+		streams[i].type   = (random() % 2 ? IO_CMD_PREAD : IO_CMD_PWRITE);
+		streams[i].offset = (random() % num_secs) << 9;
+	}
+
+	for (i = 0; i < BENCH_POOL; i++)
+		free_list[i] = &iocb_list[i];
+	nfree = BENCH_POOL;
+
+	now          = 0;
+	next_arrival = 0;
+	issued       = 0;
+	completed    = 0;
+
+	while (completed < total) {
+		/* reap */
+		for (n = 0; disk.count && disk.done[disk.head] <= now; n++) {
+			events[n].obj = disk.io[disk.head];
+			events[n].res = io_iocb_bytes(disk.io[disk.head]);
+			disk.head = (disk.head + 1) % BENCH_POOL;
+			disk.count--;
+		}
+
+		n = io_split(&ctx, events, n);
+		for (i = 0; i < n; i++) {
+			struct iocb *io = events[i].obj;
+			uint64_t lat    = now - arrival[io - iocb_list];
+
+			res->lat_total += lat;
+			if (lat > res->lat_max)
+				res->lat_max = lat;
+
+			free_list[nfree++] = io;
+			completed++;
+		}
+
+		/* arrive */
+		n = 0;
+		if (now >= next_arrival && issued < total) {
+			int num = (random() % 8) + 1;
+
+			while (n < num && nfree && issued < total) {
+				struct bench_stream *s;
+				struct iocb *io;
+				unsigned long nbytes;
+
+				s      = &streams[random() % BENCH_STREAMS];
+				io     = free_list[--nfree];
+				nbytes = ((random() % 8) + 1) << 12;
+
+				memset(io, 0, sizeof(*io));
+				io->aio_lio_opcode = s->type;
+				io->aio_fildes     = 1;
+				io->u.c.offset     = s->offset;
+				io->u.c.nbytes     = nbytes;
+				io->u.c.buf        = (char *)((unsigned long)
+							      (io - iocb_list + 1) << 20);
+				io->data           = (void *)(io - iocb_list);
+				arrival[io - iocb_list] = now;
+
+				s->offset += nbytes;
+				batch[n++] = io;
+				issued++;
+			}
+
+			next_arrival += BENCH_ARRIVAL_US;
+		}
+
+		/* submit */
+		if (elevator) {
+			io_elv_add(&elv, batch, n, now);
+			n = io_elv_dispatch(&elv, queue,
+					    bench_inflight(&disk, now) < BENCH_DEPTH,
+					    now);
+		} else
+			memcpy(queue, batch, n * sizeof(struct iocb *));
+
+		n = io_merge(&ctx, queue, n);
+		for (i = 0; i < n; i++)
+			bench_disk_submit(&disk, queue[i], now);
+
+		res->requests += n;
+		now += BENCH_TICK_US;
+	}
+
+	res->iocbs   = completed;
+	res->elapsed = now;
+
+	opio_elv_free(&elv);
+	opio_free(&ctx);
+}
+
+static void
+bench_print(const char *name, struct bench_result *res)
+{
+	printf("%-10s iocbs: %8"PRIu64", requests: %8"PRIu64", merge: %5.2f, "
+	       "lat avg: %8.0fus, max: %8"PRIu64"us, elapsed: %8.1fms\n",
+	       name, res->iocbs, res->requests,
+	       (double)res->iocbs / res->requests,
+	       (double)res->lat_total / res->iocbs, res->lat_max,
+	       res->elapsed / 1000.0);
+}
+
+static void
+bench(int num_iocbs, uint64_t num_secs, int seed)
+{
+	struct bench_result batched, elevator;
+
+	printf("Benchmarking %d iocbs from %d streams on %"PRIu64" sectors, "
+	       "seed = %d\n", num_iocbs, BENCH_STREAMS, num_secs, seed);
+
+	bench_run(0, num_iocbs, num_secs, seed, &batched);
+	bench_run(1, num_iocbs, num_secs, seed, &elevator);
+
+	bench_print("batched", &batched);
+	bench_print("elevator", &elevator);
+}
+
 int
 main(int argc, char **argv)
 {
 	uint64_t num_secs;
 	struct opioctx ctx;
 	struct io_event *events;
-	int i, c, num_runs, num_iocbs, seed;
+	int i, c, num_runs, num_iocbs, seed, benchmark;
 	struct iocb *iocb_list, **iocbs, **ioqueue;
 
 	num_runs  = 1;
@@ -585,7 +1021,9 @@ main(int argc, char **argv)
 	seed      = time(NULL);
 	num_secs  = ((4ULL << 20) >> 9); /* 4GB disk */
 
-	while ((c = getopt(argc, argv, "n:i:s:r:h")) != -1) {
+	benchmark = 0;
+
+	while ((c = getopt(argc, argv, "n:i:s:r:bh")) != -1) {
 		switch (c) {
 		case 'n':
 			num_runs  = atoi(optarg);
@@ -599,6 +1037,9 @@ main(int argc, char **argv)
 		case 'r':
 			seed      = atoi(optarg);
 			break;
+		case 'b':
+			benchmark = 1;
+			break;
 		case 'h':
 			usage();
 		case '?':
@@ -607,6 +1048,12 @@ main(int argc, char **argv)
 		}
 	}
 
+	if (benchmark) {
+		verbose = 0;
+		bench(num_iocbs, num_secs, seed);
+		return 0;
+	}
+
 	printf("Running %d tests with %d iocbs on %llu sectors, seed = %d\n",
 	       num_runs, num_iocbs, num_secs, seed);
 
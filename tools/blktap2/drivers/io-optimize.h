@@ -29,8 +29,19 @@
 #ifndef __IO_OPTIMIZE_H__
 #define __IO_OPTIMIZE_H__
 
+#include <stdint.h>
+#include <sys/uio.h>
 #include <libaio.h>
 
+/*
+ * iocbs on adjacent sectors but in scattered buffers are merged into
+ * vectored requests (IOCB_CMD_PREADV/PWRITEV; older libaio headers
+ * don't name them).
+ */
+#define OPIO_CMD_PREADV     7
+#define OPIO_CMD_PWRITEV    8
+#define OPIO_MAX_IOV        32
+
 struct opio;
 
 struct opio_list {
@@ -48,6 +59,9 @@ struct opio {
 	struct opio        *head;
 	struct opio        *next;
 	struct opio_list    list;
+	short               opcode;
+	int                 niov;      /* head of a vectored merge */
+	struct iovec        iov[OPIO_MAX_IOV];
 };
 
 struct opioctx {
@@ -59,10 +73,52 @@ struct opioctx {
 	struct io_event    *event_queue;
 };
 
+/*
+ * Deadline-style elevator: iocbs submitted while the disk is busy are
+ * held back, sorted by file and offset, so that requests from successive
+ * batches can be merged.  Everything held is dispatched in one ascending
+ * sweep once the disk goes idle, enough has queued up, or the oldest
+ * iocb has waited past its deadline.
+ */
+struct opio_elv_entry {
+	struct iocb        *iocb;
+	uint64_t            stamp;     /* arrival, usecs */
+};
+
+struct opioelv {
+	int                    size;
+	int                    held;
+	int                    batch;       /* dispatch at this many held */
+	uint64_t               read_expire; /* usecs */
+	uint64_t               write_expire;
+	struct opio_elv_entry *queue;       /* sorted by fd, offset */
+
+	int                    last_fd;     /* end of the previous sweep */
+	long long              last_offset;
+
+	uint64_t               dispatches;
+	uint64_t               dispatched;
+	uint64_t               expired;
+	uint64_t               wait_total;  /* usecs */
+	uint64_t               wait_max;
+};
+
+#define OPIO_ELV_BATCH          32
+#define OPIO_ELV_READ_EXPIRE    1000
+#define OPIO_ELV_WRITE_EXPIRE   5000
+
 int opio_init(struct opioctx *ctx, int num_iocbs);
 void opio_free(struct opioctx *ctx);
 int io_merge(struct opioctx *ctx, struct iocb **queue, int num);
 int io_split(struct opioctx *ctx, struct io_event *events, int num);
 int io_expand_iocbs(struct opioctx *ctx, struct iocb **queue, int idx, int num);
+unsigned long io_iocb_bytes(struct iocb *io);
+
+int opio_elv_init(struct opioelv *elv, int size);
+void opio_elv_free(struct opioelv *elv);
+void io_elv_add(struct opioelv *elv, struct iocb **queue, int num,
+		uint64_t now);
+int io_elv_dispatch(struct opioelv *elv, struct iocb **queue, int force,
+		    uint64_t now);
 
 #endif
@@ -40,11 +40,22 @@
 typedef int                          event_id_t;
 typedef void (*event_cb_t)          (event_id_t id, char mode, void *private);
 
+struct event_fd;
+
 typedef struct scheduler {
+	/* select() backend */
 	fd_set                       read_fds;
 	fd_set                       write_fds;
 	fd_set                       except_fds;
 
+	/* epoll backend, used unless epoll_fd is -1 */
+	int                          epoll_fd;
+	struct event_fd            **fds;
+	int                          nr_fds;
+	int                          nr_always;
+	struct list_head             timeouts;
+	struct list_head             ready;
+
 	struct list_head             events;
 
 	int                          uuid;
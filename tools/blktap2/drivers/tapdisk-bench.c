@@ -0,0 +1,489 @@
+/*
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Drives an image through the tapdisk driver stack with a fixed queue
+ * depth, fio-style, and reports throughput: e.g. sequential writes into
+ * an empty VHD measure the cost of block allocation.  With -d it issues
+ * discards instead, which also checks that each one is answered.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "list.h"
+#include "scheduler.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-server.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-utils.h"
+
+#define POLL_READ                        0
+#define POLL_WRITE                       1
+
+#define MIN(a, b)                        ((a) < (b) ? (a) : (b))
+
+struct tapdisk_bench_request {
+	uint64_t                         sec;
+	uint32_t                         secs;
+	blkif_request_t                  blkif_req;
+	struct list_head                 next;
+};
+
+struct tapdisk_bench {
+	td_vbd_t                        *vbd;
+
+	unsigned int                     id;
+	int                              err;
+
+	int                              write;
+	int                              discard;
+	int                              random;
+	int                              depth;
+	uint32_t                         bs;       /* sectors per request */
+
+	uint64_t                         cur;
+	uint64_t                         start;
+	uint64_t                         end;
+	uint64_t                         issued;   /* sectors */
+
+	uint64_t                         started;
+	uint64_t                         completed;
+	int                              pending;
+
+	struct timeval                   t_start;
+	struct timeval                   t_end;
+
+	int                              pipe[2];
+	int                              poll_set;
+	event_id_t                       enqueue_event_id;
+
+	struct list_head                 free_list;
+
+	struct tapdisk_bench_request     requests[MAX_REQUESTS];
+};
+
+static void
+usage(const char *app, int err)
+{
+	printf("usage: %s <-n type:/path/to/image> [-w | -d] [-r] "
+	       "[-b request KB] [-q queue depth] [-c sector count] "
+	       "[-s skip sectors] [-N]\n"
+	       "  -w  write (default: read)\n"
+	       "  -d  discard\n"
+	       "  -r  random offsets (default: sequential)\n"
+	       "  -N  treat storage as NFS/LVM (no preallocation)\n", app);
+	exit(err);
+}
+
+static inline void
+tapdisk_bench_poll_set(struct tapdisk_bench *b)
+{
+	int dummy = 0;
+
+	if (!b->poll_set) {
+		write_exact(b->pipe[POLL_WRITE], &dummy, sizeof(dummy));
+		b->poll_set = 1;
+	}
+}
+
+static inline void
+tapdisk_bench_poll_clear(struct tapdisk_bench *b)
+{
+	int dummy;
+
+	read_exact(b->pipe[POLL_READ], &dummy, sizeof(dummy));
+	b->poll_set = 0;
+}
+
+static inline int
+tapdisk_bench_done(struct tapdisk_bench *b)
+{
+	return (!b->pending && (b->issued >= b->end - b->start || b->err));
+}
+
+static void
+tapdisk_bench_close_image(struct tapdisk_bench *b)
+{
+	td_vbd_t *vbd;
+
+	vbd = tapdisk_server_get_vbd(b->id);
+	if (vbd) {
+		tapdisk_vbd_close_vdi(vbd);
+		tapdisk_server_remove_vbd(vbd);
+		free((void *)vbd->ring.vstart);
+		free(vbd->name);
+		free(vbd);
+		b->vbd = NULL;
+	}
+}
+
+static void
+tapdisk_bench_dequeue(void *arg, blkif_response_t *rsp)
+{
+	struct tapdisk_bench *b = (struct tapdisk_bench *)arg;
+	struct tapdisk_bench_request *breq = b->requests + rsp->id;
+
+	if (rsp->status != BLKIF_RSP_OKAY) {
+		b->err = EIO;
+		fprintf(stderr, "error %s sector 0x%"PRIx64"\n",
+			(b->discard ? "discarding" :
+			 b->write ? "writing" : "reading"), breq->sec);
+	}
+
+	b->pending--;
+	b->completed++;
+	list_add_tail(&breq->next, &b->free_list);
+
+	tapdisk_bench_poll_set(b);
+}
+
+static uint64_t
+tapdisk_bench_next_sector(struct tapdisk_bench *b)
+{
+	uint64_t sec, span;
+
+	if (!b->random) {
+		sec     = b->cur;
+		b->cur += b->bs;
+		return sec;
+	}
+
+	span = (b->end - b->start) / b->bs;
+	sec  = ((((uint64_t)rand() << 31) | rand()) % span) * b->bs;
+	return b->start + sec;
+}
+
+static void
+tapdisk_bench_enqueue(event_id_t id, char mode, void *arg)
+{
+	td_vbd_t *vbd;
+	int i, idx, psize;
+	struct tapdisk_bench *b = (struct tapdisk_bench *)arg;
+
+	vbd = b->vbd;
+	tapdisk_bench_poll_clear(b);
+
+	if (tapdisk_bench_done(b)) {
+		gettimeofday(&b->t_end, NULL);
+		tapdisk_bench_close_image(b);
+		return;
+	}
+
+	psize = getpagesize();
+
+	while (b->pending < b->depth &&
+	       b->issued < b->end - b->start && !b->err) {
+		blkif_request_t *req;
+		td_vbd_request_t *vreq;
+		struct tapdisk_bench_request *breq;
+		uint32_t left;
+
+		if (list_empty(&b->free_list))
+			break;
+
+		breq = list_entry(b->free_list.next,
+				  struct tapdisk_bench_request, next);
+		list_del_init(&breq->next);
+
+		idx        = breq - b->requests;
+		breq->sec  = tapdisk_bench_next_sector(b);
+		breq->secs = MIN(b->bs, b->end - breq->sec);
+
+		req                = &breq->blkif_req;
+		memset(req, 0, sizeof(*req));
+		req->id            = idx;
+		req->sector_number = breq->sec;
+		req->operation     = (b->write ? BLKIF_OP_WRITE : BLKIF_OP_READ);
+
+		if (b->discard) {
+			blkif_request_discard_t *dreq;
+
+			dreq             = (blkif_request_discard_t *)req;
+			dreq->operation  = BLKIF_OP_DISCARD;
+			dreq->nr_sectors = breq->secs;
+			left             = 0;
+		} else
+			left             = breq->secs;
+
+		for (i = 0; left; i++) {
+			uint32_t secs = MIN(left, psize >> SECTOR_SHIFT);
+			struct blkif_request_segment *seg = req->seg + i;
+
+			seg->first_sect = 0;
+			seg->last_sect  = secs - 1;
+			req->nr_segments++;
+			left -= secs;
+		}
+
+		vreq = vbd->request_list + idx;
+
+		assert(list_empty(&vreq->next));
+		assert(vreq->secs_pending == 0);
+
+		memcpy(&vreq->req, req, sizeof(*req));
+		vbd->received++;
+		vreq->vbd = vbd;
+
+		tapdisk_vbd_move_request(vreq, &vbd->new_requests);
+
+		b->issued += breq->secs;
+		b->started++;
+		b->pending++;
+	}
+
+	tapdisk_vbd_issue_requests(vbd);
+}
+
+static int
+tapdisk_bench_open(struct tapdisk_bench *b, const char *params,
+		   const char *path, int type, uint16_t storage,
+		   uint64_t count, uint64_t skip)
+{
+	int i, err, psize;
+	image_t image;
+	td_ring_t *ring;
+
+	err = tapdisk_server_initialize();
+	if (err)
+		goto out;
+
+	err = tapdisk_vbd_initialize(b->id);
+	if (err)
+		goto out;
+
+	b->vbd = tapdisk_server_get_vbd(b->id);
+	if (!b->vbd) {
+		err = -ENODEV;
+		goto out;
+	}
+
+	tapdisk_vbd_set_callback(b->vbd, tapdisk_bench_dequeue, b);
+
+	err = tapdisk_vbd_parse_stack(b->vbd, params);
+	if (err)
+		goto out;
+
+	err = tapdisk_vbd_open_vdi(b->vbd, path, type, storage,
+				   (b->write || b->discard ? 0 : TD_OPEN_RDONLY));
+	if (err)
+		goto out;
+
+	b->vbd->reopened = 1;
+
+	err = tapdisk_vbd_get_image_info(b->vbd, &image);
+	if (err)
+		goto out;
+
+	if (count == (uint64_t)-1)
+		count = image.size - skip;
+
+	if (count + skip > image.size || count < b->bs) {
+		fprintf(stderr, "bad range 0x%"PRIx64"+0x%"PRIx64
+			" for image size 0x%"PRIx64"\n",
+			skip, count, (uint64_t)image.size);
+		err = -EINVAL;
+		goto out;
+	}
+
+	b->start = skip;
+	b->cur   = skip;
+	b->end   = skip + count;
+
+	/* as in tapdisk-stream, the vbd uses our buffers for its ring */
+	ring  = &b->vbd->ring;
+	psize = getpagesize();
+	err   = posix_memalign((void **)&ring->vstart, psize,
+			       psize * BLKTAP_MMAP_REGION_SIZE);
+	if (err) {
+		ring->vstart = 0;
+		err = -err;
+		goto out;
+	}
+
+	memset((void *)ring->vstart, 0x5a, psize * BLKTAP_MMAP_REGION_SIZE);
+
+	for (i = 0; i < MAX_REQUESTS; i++) {
+		INIT_LIST_HEAD(&b->requests[i].next);
+		list_add_tail(&b->requests[i].next, &b->free_list);
+	}
+
+	if (pipe(b->pipe)) {
+		err = -errno;
+		goto out;
+	}
+
+	err = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					    b->pipe[POLL_READ], 0,
+					    tapdisk_bench_enqueue, b);
+	if (err < 0)
+		goto out;
+
+	b->enqueue_event_id = err;
+	err = 0;
+
+out:
+	if (err)
+		fprintf(stderr, "failed to open %s: %d\n", path, err);
+	return err;
+}
+
+static void
+tapdisk_bench_release(struct tapdisk_bench *b)
+{
+	tapdisk_bench_close_image(b);
+
+	if (b->enqueue_event_id)
+		tapdisk_server_unregister_event(b->enqueue_event_id);
+	if (b->pipe[POLL_READ] != -1)
+		close(b->pipe[POLL_READ]);
+	if (b->pipe[POLL_WRITE] != -1)
+		close(b->pipe[POLL_WRITE]);
+}
+
+static void
+tapdisk_bench_report(struct tapdisk_bench *b)
+{
+	double secs, mb;
+
+	secs = (b->t_end.tv_sec - b->t_start.tv_sec) +
+		(b->t_end.tv_usec - b->t_start.tv_usec) / 1000000.0;
+	mb   = (double)(b->issued << SECTOR_SHIFT) / (1 << 20);
+
+	if (secs <= 0)
+		secs = 1e-6;
+
+	printf("%s %s, %u KB requests, depth %d: %"PRIu64" requests, "
+	       "%.1f MB in %.3fs: %.1f MB/s, %.0f iops\n",
+	       (b->random ? "random" : "sequential"),
+	       (b->discard ? "discard" : b->write ? "write" : "read"),
+	       b->bs >> 1, b->depth,
+	       b->completed, mb, secs, mb / secs, b->completed / secs);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int c, err, type, max_kb;
+	uint16_t storage;
+	const char *params, *path;
+	uint64_t count, skip;
+	struct tapdisk_bench bench;
+
+	memset(&bench, 0, sizeof(bench));
+	INIT_LIST_HEAD(&bench.free_list);
+	bench.pipe[POLL_READ] = bench.pipe[POLL_WRITE] = -1;
+	bench.depth = 32;
+	bench.bs    = 64;
+
+	err     = 0;
+	skip    = 0;
+	count   = (uint64_t)-1;
+	params  = NULL;
+	storage = TAPDISK_STORAGE_TYPE_DEFAULT;
+	max_kb  = (BLKIF_MAX_SEGMENTS_PER_REQUEST * getpagesize()) >> 10;
+
+	while ((c = getopt(argc, argv, "n:wdrb:q:c:s:Nh")) != -1) {
+		switch (c) {
+		case 'n':
+			params = optarg;
+			break;
+		case 'w':
+			bench.write = 1;
+			break;
+		case 'd':
+			bench.discard = 1;
+			break;
+		case 'r':
+			bench.random = 1;
+			break;
+		case 'b':
+			bench.bs = atoi(optarg) << 1;
+			break;
+		case 'q':
+			bench.depth = atoi(optarg);
+			break;
+		case 'c':
+			count = strtoull(optarg, NULL, 10);
+			break;
+		case 's':
+			skip = strtoull(optarg, NULL, 10);
+			break;
+		case 'N':
+			storage = TAPDISK_STORAGE_TYPE_NFS;
+			break;
+		default:
+			err = EINVAL;
+		case 'h':
+			usage(argv[0], err);
+		}
+	}
+
+	/* discards carry no segments, so aren't bound by them */
+	if (!params || !bench.bs || (bench.write && bench.discard) ||
+	    (!bench.discard && bench.bs > max_kb << 1) ||
+	    bench.depth < 1 || bench.depth > MAX_REQUESTS)
+		usage(argv[0], EINVAL);
+
+	type = tapdisk_disktype_parse_params(params, &path);
+	if (type < 0) {
+		err = type;
+		fprintf(stderr, "invalid argument %s: %d\n", params, err);
+		return err;
+	}
+
+	tapdisk_start_logging("tapdisk-bench");
+
+	err = tapdisk_bench_open(&bench, params, path, type, storage,
+				 count, skip);
+	if (err)
+		goto out;
+
+	gettimeofday(&bench.t_start, NULL);
+	tapdisk_bench_poll_set(&bench);
+
+	err = tapdisk_server_run();
+	if (err) {
+		fprintf(stderr, "failed to run tapdisk server: %d\n", err);
+		goto out;
+	}
+
+	err = bench.err;
+	if (!err)
+		tapdisk_bench_report(&bench);
+
+out:
+	tapdisk_bench_release(&bench);
+	tapdisk_stop_logging();
+	return err;
+}
@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <pthread.h>
 #include <sys/un.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -44,9 +45,11 @@
 #include "blktaplib.h"
 #include "tapdisk-vbd.h"
 #include "tapdisk-utils.h"
+#include "tapdisk-interface.h"
 #include "tapdisk-server.h"
 #include "tapdisk-message.h"
 #include "tapdisk-disktype.h"
+#include "vhd-util.h"
 
 struct tapdisk_control {
 	char              *path;
@@ -104,7 +107,8 @@ tapdisk_control_allocate_connection(int fd)
 static void
 tapdisk_control_close_connection(struct tapdisk_control_connection *connection)
 {
-	tapdisk_server_unregister_event(connection->event_id);
+	if (connection->event_id != -1)
+		tapdisk_server_unregister_event(connection->event_id);
 	close(connection->socket);
 	free(connection);
 }
@@ -231,6 +235,7 @@ tapdisk_control_list_minors(struct tapdisk_control_connection *connection,
 
 	head = tapdisk_server_get_all_vbds();
 
+	tapdisk_server_lock_vbds();
 	list_for_each_entry(vbd, head, next) {
 		response.u.minors.list[i++] = vbd->minor;
 		if (i >= TAPDISK_MESSAGE_MAX_MINORS) {
@@ -239,6 +244,7 @@ tapdisk_control_list_minors(struct tapdisk_control_connection *connection,
 			break;
 		}
 	}
+	tapdisk_server_unlock_vbds();
 
 	response.u.minors.count = i;
 	tapdisk_control_write_message(connection->socket, &response, 2);
@@ -260,6 +266,8 @@ tapdisk_control_list(struct tapdisk_control_connection *connection,
 
 	head = tapdisk_server_get_all_vbds();
 
+	tapdisk_server_lock_vbds();
+
 	count = 0;
 	list_for_each_entry(vbd, head, next)
 		count++;
@@ -283,6 +291,8 @@ tapdisk_control_list(struct tapdisk_control_connection *connection,
 		tapdisk_control_write_message(connection->socket, &response, 2);
 	}
 
+	tapdisk_server_unlock_vbds();
+
 	response.u.list.count   = count;
 	response.u.list.minor   = -1;
 	response.u.list.path[0] = 0;
@@ -333,6 +343,12 @@ tapdisk_control_attach_vbd(struct tapdisk_control_connection *connection,
 		goto out;
 	}
 
+	if ((request->u.params.flags & TAPDISK_MESSAGE_FLAG_THREAD) &&
+	    !tapdisk_server_get_loop(request->u.params.thread)) {
+		err = -EINVAL;
+		goto out;
+	}
+
 	vbd = tapdisk_vbd_create(minor);
 	if (!vbd) {
 		err = -ENOMEM;
@@ -440,6 +456,9 @@ tapdisk_control_open_image(struct tapdisk_control_connection *connection,
 		flags |= TD_OPEN_VHD_INDEX;
 	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_LOG_DIRTY)
 		flags |= TD_OPEN_LOG_DIRTY;
+	if (request->u.params.flags & TAPDISK_MESSAGE_FLAG_ZERO_DETECT ||
+	    getenv("TAPDISK_ZERO_DETECT"))
+		flags |= TD_OPEN_ZERO_DETECT;
 
 	vbd->name = strndup(request->u.params.path,
 			    sizeof(request->u.params.path));
@@ -485,6 +504,9 @@ out:
 		response.u.image.sector_size = image.secsize;
 		response.u.image.info        = image.info;
 		response.type                = TAPDISK_MESSAGE_OPEN_RSP;
+
+		if (td_can_discard(tapdisk_vbd_first_image(vbd)))
+			response.u.image.info |= TAPDISK_MESSAGE_IMAGE_DISCARD;
 	}
 
 	tapdisk_control_write_message(connection->socket, &response, 2);
@@ -627,6 +649,320 @@ out:
 	tapdisk_control_close_connection(connection);
 }
 
+static void
+tapdisk_control_set_qos(struct tapdisk_control_connection *connection,
+			tapdisk_message_t *request)
+{
+	int err;
+	td_vbd_t *vbd;
+	td_qos_params_t params;
+	tapdisk_message_t response;
+	tapdisk_message_qos_t *qos = &request->u.qos;
+
+	memset(&response, 0, sizeof(response));
+
+	response.type = TAPDISK_MESSAGE_QOS_RSP;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	params = vbd->qos.params;
+
+	if (qos->flags & TAPDISK_MESSAGE_QOS_IOPS)
+		params.iops = qos->iops;
+	if (qos->flags & TAPDISK_MESSAGE_QOS_BPS)
+		params.bps = qos->bps;
+	if (qos->flags & TAPDISK_MESSAGE_QOS_PRIORITY)
+		params.priority = qos->priority;
+	if (qos->flags & TAPDISK_MESSAGE_QOS_LATENCY)
+		params.latency_target = qos->latency_target;
+
+	err = tapdisk_vbd_set_qos(vbd, &params);
+
+out:
+	response.cookie = request->cookie;
+	response.u.response.error = -err;
+	tapdisk_control_write_message(connection->socket, &response, 2);
+	tapdisk_control_close_connection(connection);
+}
+
+static void
+tapdisk_control_stats(struct tapdisk_control_connection *connection,
+		      tapdisk_message_t *request)
+{
+	int i, new, pending, failed, completed;
+	td_vbd_t *vbd;
+	td_qos_stats_t stats;
+	tapdisk_message_t response;
+	tapdisk_message_stats_t *rsp = &response.u.stats;
+
+	memset(&response, 0, sizeof(response));
+	response.cookie = request->cookie;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		response.type = TAPDISK_MESSAGE_ERROR;
+		response.u.response.error = EINVAL;
+		goto out;
+	}
+
+	td_qos_get_stats(&vbd->qos, &stats);
+	tapdisk_vbd_queue_count(vbd, &new, &pending, &failed, &completed);
+
+	response.type           = TAPDISK_MESSAGE_STATS_RSP;
+	rsp->qos.iops           = stats.params.iops;
+	rsp->qos.bps            = stats.params.bps;
+	rsp->qos.priority       = stats.params.priority;
+	rsp->qos.latency_target = stats.params.latency_target;
+	rsp->cap                = stats.cap;
+	rsp->throttled          = stats.throttled;
+	rsp->queued             = new;
+	rsp->inflight           = pending + failed;
+	rsp->p50                = stats.p50;
+	rsp->p99                = stats.p99;
+
+	for (i = 0; i < TAPDISK_MESSAGE_STATS_BUCKETS &&
+		     i < TD_QOS_HIST_BUCKETS; i++)
+		rsp->hist[i] = stats.hist[i];
+
+out:
+	tapdisk_control_write_message(connection->socket, &response, 2);
+	tapdisk_control_close_connection(connection);
+}
+
+struct tapdisk_control_coalesce {
+	struct tapdisk_control_connection *connection;
+	uint16_t                           cookie;
+	char                              *name;
+	vhd_coalesce_opts_t                opts;
+};
+
+static void *
+tapdisk_control_coalesce_thread(void *private)
+{
+	int err;
+	tapdisk_message_t response;
+	struct tapdisk_control_coalesce *c = private;
+
+	DPRINTF("coalescing %s\n", c->name);
+	err = vhd_coalesce(c->name, &c->opts);
+	DPRINTF("coalesced %s: %d\n", c->name, err);
+
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_COALESCE_RSP;
+	response.cookie = c->cookie;
+	response.u.response.error = -err;
+	tapdisk_control_write_message(c->connection->socket, &response, 2);
+	tapdisk_control_close_connection(c->connection);
+
+	free(c->name);
+	free(c);
+	return NULL;
+}
+
+/*
+ * Coalesce a read-only vhd in the vbd's chain into its parent while the
+ * vbd stays up.  Only sectors the image holds are written to the
+ * parent, and the image still shadows them, so the chain reads the same
+ * throughout.  The copy runs on a thread of its own, which answers once
+ * it is done; relinking the chain afterwards is left to the toolstack.
+ */
+static void
+tapdisk_control_coalesce(struct tapdisk_control_connection *connection,
+			 tapdisk_message_t *request)
+{
+	int err;
+	td_vbd_t *vbd;
+	pthread_t thread;
+	pthread_attr_t attr;
+	td_image_t *image, *tmp, *found;
+	tapdisk_message_t response;
+	struct tapdisk_control_coalesce *c;
+	tapdisk_message_coalesce_t *msg = &request->u.coalesce;
+
+	c = NULL;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (strnlen(msg->path, sizeof(msg->path)) >= sizeof(msg->path)) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	found = NULL;
+	tapdisk_vbd_for_each_image(vbd, image, tmp)
+		if (!strcmp(image->name, msg->path)) {
+			found = image;
+			break;
+		}
+
+	if (!found) {
+		err = -ENOENT;
+		goto out;
+	}
+
+	/* the leaf is still being written */
+	if (found->type != DISK_TYPE_VHD ||
+	    !td_flag_test(found->flags, TD_OPEN_RDONLY) ||
+	    found == list_entry(vbd->images.next, td_image_t, next)) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	c->name = strdup(found->name);
+	if (!c->name) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	c->connection     = connection;
+	c->cookie         = request->cookie;
+	c->opts.threads   = msg->threads;
+	c->opts.bandwidth = msg->bandwidth;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = -pthread_create(&thread, &attr,
+			      tapdisk_control_coalesce_thread, c);
+	pthread_attr_destroy(&attr);
+	if (!err)
+		return;
+
+out:
+	if (c) {
+		free(c->name);
+		free(c);
+	}
+
+	memset(&response, 0, sizeof(response));
+	response.type = TAPDISK_MESSAGE_COALESCE_RSP;
+	response.cookie = request->cookie;
+	response.u.response.error = -err;
+	tapdisk_control_write_message(connection->socket, &response, 2);
+	tapdisk_control_close_connection(connection);
+}
+
+typedef void (*tapdisk_control_handler_t)(struct tapdisk_control_connection *,
+					  tapdisk_message_t *);
+
+struct tapdisk_control_call {
+	tapdisk_control_handler_t          handler;
+	struct tapdisk_control_connection *connection;
+	tapdisk_message_t                 *message;
+};
+
+static void
+tapdisk_control_call_handler(void *private)
+{
+	struct tapdisk_control_call *call = private;
+
+	call->handler(call->connection, call->message);
+}
+
+/*
+ * A vbd about to be opened with a driver which is not loop-safe is moved
+ * to the main loop first.
+ */
+static tapdisk_loop_t *
+tapdisk_control_open_loop(tapdisk_message_t *message, tapdisk_loop_t *loop)
+{
+	tapdisk_loop_t *main_loop = tapdisk_server_get_loop(0);
+	td_vbd_t *vbd;
+	char *params;
+	int safe, err;
+
+	if (loop == main_loop)
+		return loop;
+
+	params = strndup(message->u.params.path,
+			 sizeof(message->u.params.path));
+	if (!params)
+		return loop;
+
+	safe = tapdisk_disktype_loop_safe(params);
+	free(params);
+	if (safe)
+		return loop;
+
+	vbd = tapdisk_server_get_vbd(message->cookie);
+	if (!vbd)
+		return loop;
+
+	err = tapdisk_server_move_vbd(vbd, main_loop);
+	if (err) {
+		EPRINTF("failed to move vbd %d to the main thread: %d\n",
+			message->cookie, err);
+		return loop;
+	}
+
+	DPRINTF("vbd %d moved to the main thread for its driver\n",
+		message->cookie);
+
+	return main_loop;
+}
+
+/*
+ * Requests naming a vbd are handled on the vbd's event loop.  New vbds
+ * go to the loop requested, or else the least loaded one.  If there is
+ * no such vbd or loop, the handler runs here and reports the error; if
+ * the loop cannot take the call, we answer with an error ourselves.
+ */
+static void
+tapdisk_control_dispatch(struct tapdisk_control_connection *connection,
+			 tapdisk_message_t *message,
+			 tapdisk_control_handler_t handler)
+{
+	struct tapdisk_control_call call;
+	tapdisk_loop_t *loop;
+	int err;
+
+	if (message->type != TAPDISK_MESSAGE_ATTACH)
+		loop = tapdisk_server_get_vbd_loop(message->cookie);
+	else if (message->u.params.flags & TAPDISK_MESSAGE_FLAG_THREAD)
+		loop = tapdisk_server_get_loop(message->u.params.thread);
+	else
+		loop = tapdisk_server_pick_loop();
+
+	if (loop && message->type == TAPDISK_MESSAGE_OPEN)
+		loop = tapdisk_control_open_loop(message, loop);
+
+	call.handler    = handler;
+	call.connection = connection;
+	call.message    = message;
+
+	if (!loop)
+		return handler(connection, message);
+
+	err = tapdisk_server_call(loop, tapdisk_control_call_handler, &call);
+	if (err) {
+		tapdisk_message_t response;
+
+		EPRINTF("failed to pass '%s' to thread %d: %d\n",
+			tapdisk_message_name(message->type), loop->id, err);
+
+		/* the vbd belongs to that loop: do not touch it from here */
+		memset(&response, 0, sizeof(response));
+		response.type = TAPDISK_MESSAGE_ERROR;
+		response.cookie = message->cookie;
+		response.u.response.error = -err;
+		tapdisk_control_write_message(connection->socket, &response, 2);
+		tapdisk_control_close_connection(connection);
+	}
+}
+
 static void
 tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 {
@@ -641,6 +977,13 @@ tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 		return;
 	}
 
+	/*
+	 * One request per connection.  Drop the event here, since the
+	 * connection may be closed by a handler on another thread.
+	 */
+	tapdisk_server_unregister_event(connection->event_id);
+	connection->event_id = -1;
+
 	err = tapdisk_control_validate_request(&message);
 	if (err)
 		goto fail;
@@ -653,17 +996,32 @@ tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 	case TAPDISK_MESSAGE_LIST:
 		return tapdisk_control_list(connection, &message);
 	case TAPDISK_MESSAGE_ATTACH:
-		return tapdisk_control_attach_vbd(connection, &message);
+		return tapdisk_control_dispatch(connection, &message,
+						tapdisk_control_attach_vbd);
 	case TAPDISK_MESSAGE_DETACH:
-		return tapdisk_control_detach_vbd(connection, &message);
+		return tapdisk_control_dispatch(connection, &message,
+						tapdisk_control_detach_vbd);
 	case TAPDISK_MESSAGE_OPEN:
-		return tapdisk_control_open_image(connection, &message);
+		return tapdisk_control_dispatch(connection, &message,
+						tapdisk_control_open_image);
 	case TAPDISK_MESSAGE_PAUSE:
-		return tapdisk_control_pause_vbd(connection, &message);
+		return tapdisk_control_dispatch(connection, &message,
+						tapdisk_control_pause_vbd);
 	case TAPDISK_MESSAGE_RESUME:
-		return tapdisk_control_resume_vbd(connection, &message);
+		return tapdisk_control_dispatch(connection, &message,
+						tapdisk_control_resume_vbd);
 	case TAPDISK_MESSAGE_CLOSE:
-		return tapdisk_control_close_image(connection, &message);
+		return tapdisk_control_dispatch(connection, &message,
+						tapdisk_control_close_image);
+	case TAPDISK_MESSAGE_QOS:
+		return tapdisk_control_dispatch(connection, &message,
+						tapdisk_control_set_qos);
+	case TAPDISK_MESSAGE_STATS:
+		return tapdisk_control_dispatch(connection, &message,
+						tapdisk_control_stats);
+	case TAPDISK_MESSAGE_COALESCE:
+		return tapdisk_control_dispatch(connection, &message,
+						tapdisk_control_coalesce);
 	default: {
 		tapdisk_message_t response;
 	fail:
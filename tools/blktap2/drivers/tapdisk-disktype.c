@@ -67,7 +67,7 @@ static const disk_info_t vhd_disk = {
 static const disk_info_t ram_disk = {
        "ram",
        "ramdisk image (ram)",
-       1,
+       DISK_TYPE_SINGLE_CONTROLLER | DISK_TYPE_LOOP_UNSAFE,
 };
 
 static const disk_info_t qcow_disk = {
@@ -76,18 +76,18 @@ static const disk_info_t qcow_disk = {
        0,
 };
 
+static const disk_info_t qcow2_disk = {
+       "qcow2",
+       "qcow2 disk (qcow2)",
+       0,
+};
+
 static const disk_info_t block_cache_disk = {
        "bc",
        "block cache image (bc)",
        1,
 };
 
-static const disk_info_t vhd_index_disk = {
-       "vhdi",
-       "vhd index image (vhdi)",
-       1,
-};
-
 static const disk_info_t log_disk = {
 	"log",
 	"write logger (log)",
@@ -97,7 +97,7 @@ static const disk_info_t log_disk = {
 static const disk_info_t remus_disk = {
        "remus",
        "remus disk replicator (remus)",
-       0,
+       DISK_TYPE_LOOP_UNSAFE,
 };
 
 const disk_info_t *tapdisk_disk_types[] = {
@@ -110,8 +110,9 @@ const disk_info_t *tapdisk_disk_types[] = {
 	[DISK_TYPE_QCOW]	= &qcow_disk,
 	[DISK_TYPE_BLOCK_CACHE] = &block_cache_disk,
 	[DISK_TYPE_LOG]	= &log_disk,
-	[DISK_TYPE_VINDEX]	= &vhd_index_disk,
+	[DISK_TYPE_VINDEX]	= NULL, /* no driver */
 	[DISK_TYPE_REMUS]	= &remus_disk,
+	[DISK_TYPE_QCOW2]	= &qcow2_disk,
 	0,
 };
 
@@ -122,8 +123,8 @@ extern struct tap_disk tapdisk_vhdsync;
 extern struct tap_disk tapdisk_vhd;
 extern struct tap_disk tapdisk_ram;
 extern struct tap_disk tapdisk_qcow;
+extern struct tap_disk tapdisk_qcow2;
 extern struct tap_disk tapdisk_block_cache;
-extern struct tap_disk tapdisk_vhd_index;
 extern struct tap_disk tapdisk_log;
 extern struct tap_disk tapdisk_remus;
 
@@ -137,9 +138,10 @@ const struct tap_disk *tapdisk_disk_drivers[] = {
 	[DISK_TYPE_RAM]         = &tapdisk_ram,
 	[DISK_TYPE_QCOW]        = &tapdisk_qcow,
 	[DISK_TYPE_BLOCK_CACHE] = &tapdisk_block_cache,
-	[DISK_TYPE_VINDEX]      = &tapdisk_vhd_index,
+	[DISK_TYPE_VINDEX]      = NULL,
 	[DISK_TYPE_LOG]         = &tapdisk_log,
 	[DISK_TYPE_REMUS]       = &tapdisk_remus,
+	[DISK_TYPE_QCOW2]       = &tapdisk_qcow2,
 	0,
 };
 
@@ -149,8 +151,10 @@ tapdisk_disktype_find(const char *name)
 	const disk_info_t *info;
 	int i;
 
-	for (i = 0; info = tapdisk_disk_types[i], info != NULL; ++i) {
-		if (strcmp(name, info->name))
+	/* the table has holes: walk it to the end */
+	for (i = 0; i < sizeof(tapdisk_disk_types) / sizeof(info); ++i) {
+		info = tapdisk_disk_types[i];
+		if (!info || strcmp(name, info->name))
 			continue;
 
 		if (!tapdisk_disk_drivers[i])
@@ -202,3 +206,26 @@ tapdisk_parse_disk_type(const char *params, const char **_path, int *_type)
 
 	return 0;
 }
+
+/*
+ * Can a VBD with driver stack @params ('|'-separated) run on any event
+ * loop?  Unknown types are left for the open to refuse.
+ */
+int
+tapdisk_disktype_loop_safe(const char *params)
+{
+	const char *path;
+	int type;
+
+	for (; params; params = strchr(params, '|')) {
+		if (*params == '|')
+			params++;
+
+		type = tapdisk_disktype_parse_params(params, &path);
+		if (type >= 0 &&
+		    tapdisk_disk_types[type]->flags & DISK_TYPE_LOOP_UNSAFE)
+			return 0;
+	}
+
+	return 1;
+}
@@ -40,6 +40,7 @@
 #define DISK_TYPE_LOG         8
 #define DISK_TYPE_REMUS       9
 #define DISK_TYPE_VINDEX      10
+#define DISK_TYPE_QCOW2       11
 
 #define DISK_TYPE_NAME_MAX    32
 
@@ -54,9 +55,12 @@ extern const struct tap_disk *tapdisk_disk_drivers[];
 
 /* one single controller for all instances of disk type */
 #define DISK_TYPE_SINGLE_CONTROLLER (1<<0)
+/* instances share state without locking: keep them on the main loop */
+#define DISK_TYPE_LOOP_UNSAFE       (1<<1)
 
 int tapdisk_disktype_find(const char *name);
 int tapdisk_disktype_parse_params(const char *params, const char **_path);
 int tapdisk_parse_disk_type(const char *, const char **, int *);
+int tapdisk_disktype_loop_safe(const char *params);
 
 #endif
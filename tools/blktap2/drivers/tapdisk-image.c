@@ -35,6 +35,7 @@
 #include "tapdisk-image.h"
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
+#include "tapdisk-interface.h"
 
 #define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
 
@@ -97,10 +98,11 @@ tapdisk_image_check_td_request(td_image_t *image, td_request_t treq)
 	info   = &driver->info;
 	rdonly = td_flag_test(image->flags, TD_OPEN_RDONLY);
 
-	if (treq.op != TD_OP_READ && treq.op != TD_OP_WRITE)
+	if (treq.op != TD_OP_READ && treq.op != TD_OP_WRITE &&
+	    treq.op != TD_OP_DISCARD)
 		goto fail;
 
-	if (treq.op == TD_OP_WRITE && rdonly)
+	if (treq.op != TD_OP_READ && rdonly)
 		goto fail;
 
 	if (treq.secs <= 0 || treq.sec + treq.secs > info->size)
@@ -134,6 +136,19 @@ tapdisk_image_check_ring_request(td_image_t *image, blkif_request_t *req)
 
 	rdonly = td_flag_test(image->flags, TD_OPEN_RDONLY);
 
+	if (req->operation == BLKIF_OP_DISCARD) {
+		blkif_request_discard_t *dreq = (blkif_request_discard_t *)req;
+
+		if (!td_can_discard(image))
+			goto fail;
+
+		if (!dreq->nr_sectors ||
+		    dreq->sector_number + dreq->nr_sectors > info->size)
+			goto fail;
+
+		return 0;
+	}
+
 	if (req->operation != BLKIF_OP_READ &&
 	    req->operation != BLKIF_OP_WRITE)
 		goto fail;
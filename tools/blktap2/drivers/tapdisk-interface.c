@@ -213,6 +213,48 @@ fail:
 	td_complete_request(treq, err);
 }
 
+int
+td_can_discard(td_image_t *image)
+{
+	td_driver_t *driver = image->driver;
+
+	return driver && driver->ops->td_queue_discard &&
+		!td_flag_test(image->flags, TD_OPEN_RDONLY);
+}
+
+void
+td_queue_discard(td_image_t *image, td_request_t treq)
+{
+	int err;
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver) {
+		err = -ENODEV;
+		goto fail;
+	}
+
+	if (!td_flag_test(driver->state, TD_DRIVER_OPEN)) {
+		err = -EBADF;
+		goto fail;
+	}
+
+	if (!driver->ops->td_queue_discard) {
+		err = -EOPNOTSUPP;
+		goto fail;
+	}
+
+	err = tapdisk_image_check_td_request(image, treq);
+	if (err)
+		goto fail;
+
+	driver->ops->td_queue_discard(driver, treq);
+	return;
+
+fail:
+	td_complete_request(treq, err);
+}
+
 void
 td_forward_request(td_request_t treq)
 {
@@ -231,6 +273,17 @@ td_queue_tiocb(td_driver_t *driver, struct tiocb *tiocb)
 	tapdisk_driver_queue_tiocb(driver, tiocb);
 }
 
+/*
+ * drivers writing @fd other than through td_queue_tiocb call this
+ * (and with a @bytes of 0 before closing it), so that no stale
+ * read-ahead data is returned
+ */
+void
+td_invalidate_io(td_driver_t *driver, int fd, long long offset, size_t bytes)
+{
+	tapdisk_server_invalidate_io(fd, offset, bytes);
+}
+
 void
 td_prep_read(struct tiocb *tiocb, int fd, char *buf, size_t bytes,
 	     long long offset, td_queue_callback_t cb, void *arg)
@@ -40,12 +40,15 @@ int td_validate_parent(td_image_t *, td_image_t *);
 
 void td_queue_write(td_image_t *, td_request_t);
 void td_queue_read(td_image_t *, td_request_t);
+void td_queue_discard(td_image_t *, td_request_t);
+int td_can_discard(td_image_t *);
 void td_forward_request(td_request_t);
 void td_complete_request(td_request_t, int);
 
 void td_debug(td_image_t *);
 
 void td_queue_tiocb(td_driver_t *, struct tiocb *);
+void td_invalidate_io(td_driver_t *, int, long long, size_t);
 void td_prep_read(struct tiocb *, int, char *, size_t,
 		  long long, td_queue_callback_t, void *);
 void td_prep_write(struct tiocb *, int, char *, size_t,
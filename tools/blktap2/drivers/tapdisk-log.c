@@ -34,6 +34,7 @@
 #include <stdarg.h>
 #include <syslog.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <sys/time.h>
 
 #include "tapdisk-log.h"
@@ -68,6 +69,11 @@ struct tlog {
 static struct ehandle tapdisk_err;
 static struct tlog tapdisk_log;
 
+/* Serialises all of the above: VBD loops may log from several threads. */
+static pthread_mutex_t tlog_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void __tlog_flush(void);
+
 void
 open_tlog(char *file, size_t bytes, int level, int append)
 {
@@ -92,23 +98,27 @@ open_tlog(char *file, size_t bytes, int level, int append)
 void
 close_tlog(void)
 {
+	pthread_mutex_lock(&tlog_lock);
+
 	if (!tapdisk_log.buf)
-		return;
+		goto out;
 
 	if (tapdisk_log.append)
-		tlog_flush();
+		__tlog_flush();
 
 	free(tapdisk_log.buf);
 	free(tapdisk_log.file);
 
 	memset(&tapdisk_log, 0, sizeof(struct tlog));
+
+out:
+	pthread_mutex_unlock(&tlog_lock);
 }
 
-void
-__tlog_write(int level, const char *func, const char *fmt, ...)
+static void
+__tlog_vwrite(int level, const char *func, const char *fmt, va_list ap)
 {
 	char *buf;
-	va_list ap;
 	struct timeval t;
 	int ret, len, avail;
 
@@ -121,7 +131,7 @@ __tlog_write(int level, const char *func, const char *fmt, ...)
 	avail = tapdisk_log.size - (tapdisk_log.p - tapdisk_log.buf);
 	if (avail < MAX_ENTRY_LEN) {
 		if (tapdisk_log.append)
-			tlog_flush();
+			__tlog_flush();
 		tapdisk_log.p = tapdisk_log.buf;
 	}
 
@@ -131,9 +141,7 @@ __tlog_write(int level, const char *func, const char *fmt, ...)
 		       "%s ", tapdisk_log.cnt,
 			t.tv_sec, (unsigned long long)t.tv_usec, func);
 
-	va_start(ap, fmt);
 	ret = vsnprintf(buf + len, MAX_ENTRY_LEN - (len + 1), fmt, ap);
-	va_end(ap);
 
 	len = (ret < MAX_ENTRY_LEN - (len + 1) ?
 	       len + ret : MAX_ENTRY_LEN - 1);
@@ -143,6 +151,30 @@ __tlog_write(int level, const char *func, const char *fmt, ...)
 	tapdisk_log.p += len;
 }
 
+static void
+__tlog_printf(int level, const char *func, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	__tlog_vwrite(level, func, fmt, ap);
+	va_end(ap);
+}
+
+void
+__tlog_write(int level, const char *func, const char *fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&tlog_lock);
+
+	va_start(ap, fmt);
+	__tlog_vwrite(level, func, fmt, ap);
+	va_end(ap);
+
+	pthread_mutex_unlock(&tlog_lock);
+}
+
 void
 __tlog_error(int err, const char *func, const char *fmt, ...)
 {
@@ -153,17 +185,19 @@ __tlog_error(int err, const char *func, const char *fmt, ...)
 
 	err = (err > 0 ? err : -err);
 
+	pthread_mutex_lock(&tlog_lock);
+
 	for (i = 0; i < tapdisk_err.cnt; i++) {
 		e = &tapdisk_err.errors[i];
 		if (e->err == err && e->func == func) {
 			e->cnt++;
-			return;
+			goto out;
 		}
 	}
 
 	if (tapdisk_err.cnt >= MAX_ERROR_MESSAGES) {
 		tapdisk_err.dropped++;
-		return;
+		goto out;
 	}
 
 	gettimeofday(&t, NULL);
@@ -184,6 +218,9 @@ __tlog_error(int err, const char *func, const char *fmt, ...)
 	e->err  = err;
 	e->func = (char *)func;
 	tapdisk_err.cnt++;
+
+out:
+	pthread_mutex_unlock(&tlog_lock);
 }
 
 void
@@ -192,6 +229,8 @@ tlog_print_errors(void)
 	int i;
 	struct error *e;
 
+	pthread_mutex_lock(&tlog_lock);
+
 	for (i = 0; i < tapdisk_err.cnt; i++) {
 		e = &tapdisk_err.errors[i];
 		syslog(LOG_INFO, "TAPDISK ERROR: errno %d at %s (cnt = %d): "
@@ -201,9 +240,11 @@ tlog_print_errors(void)
 	if (tapdisk_err.dropped)
 		syslog(LOG_INFO, "TAPDISK ERROR: %d other error messages "
 		       "dropped\n", tapdisk_err.dropped);
+
+	pthread_mutex_unlock(&tlog_lock);
 }
 
-void
+static void
 tlog_flush_errors(void)
 {
 	int i;
@@ -211,18 +252,18 @@ tlog_flush_errors(void)
 
 	for (i = 0; i < tapdisk_err.cnt; i++) {
 		e = &tapdisk_err.errors[i];
-		tlog_write(TLOG_WARN, "TAPDISK ERROR: errno %d at %s "
-			   "(cnt = %d): %s\n", e->err, e->func, e->cnt,
-			   e->msg);
+		__tlog_printf(TLOG_WARN, __func__, "TAPDISK ERROR: errno %d "
+			      "at %s (cnt = %d): %s\n", e->err, e->func,
+			      e->cnt, e->msg);
 	}
 
 	if (tapdisk_err.dropped)
-		tlog_write(TLOG_WARN, "TAPDISK ERROR: %d other error messages "
-		       "dropped\n", tapdisk_err.dropped);
+		__tlog_printf(TLOG_WARN, __func__, "TAPDISK ERROR: %d other "
+			      "error messages dropped\n", tapdisk_err.dropped);
 }
 
-void
-tlog_flush(void)
+static void
+__tlog_flush(void)
 {
 	int fd, flags;
 	size_t size, wsize;
@@ -255,3 +296,11 @@ tlog_flush(void)
 out:
 	close(fd);
 }
+
+void
+tlog_flush(void)
+{
+	pthread_mutex_lock(&tlog_lock);
+	__tlog_flush();
+	pthread_mutex_unlock(&tlog_lock);
+}
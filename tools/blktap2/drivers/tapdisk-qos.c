@@ -0,0 +1,393 @@
+/* 
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+
+#include "tapdisk.h"
+#include "tapdisk-qos.h"
+#include "tapdisk-server.h"
+
+#define USECS_PER_SEC                 1000000LL
+
+#define MIN(a, b)                     (((a) < (b)) ? (a) : (b))
+#define MAX(a, b)                     (((a) > (b)) ? (a) : (b))
+
+/*
+ * Latency pressure is shared by all VBDs of the process, whichever
+ * loop they run on: the highest priority whose target was missed in
+ * the last couple of windows.
+ */
+static pthread_mutex_t td_qos_lock = PTHREAD_MUTEX_INITIALIZER;
+static int td_qos_pressure_priority;
+static struct timeval td_qos_pressure_expires;
+
+static inline int64_t
+td_qos_usecs(const struct timeval *a, const struct timeval *b)
+{
+	return ((int64_t)(a->tv_sec - b->tv_sec) * USECS_PER_SEC +
+		(a->tv_usec - b->tv_usec));
+}
+
+static inline int64_t
+td_qos_burst(td_qos_bucket_t *b)
+{
+	return MAX((int64_t)(b->rate * TD_QOS_BURST_MS / 1000), 1);
+}
+
+static void
+td_qos_bucket_set(td_qos_bucket_t *b, uint64_t rate,
+		  const struct timeval *now)
+{
+	int64_t burst;
+
+	if (!b->rate)
+		b->tokens = INT64_MAX;
+
+	b->rate = rate;
+	b->frac = 0;
+	b->ts   = *now;
+
+	if (rate) {
+		burst     = td_qos_burst(b);
+		b->tokens = MIN(b->tokens, burst);
+	} else
+		b->tokens = 0;
+}
+
+/*
+ * Fractions of a token are carried over, so slow buckets polled often
+ * still fill up.
+ */
+static void
+td_qos_bucket_refill(td_qos_bucket_t *b, const struct timeval *now)
+{
+	int64_t usecs, units;
+
+	if (!b->rate)
+		return;
+
+	usecs = td_qos_usecs(now, &b->ts);
+	b->ts = *now;
+
+	if (usecs < 0 || usecs >= USECS_PER_SEC) {
+		b->tokens = td_qos_burst(b);
+		b->frac   = 0;
+		return;
+	}
+
+	units     = b->rate * usecs + b->frac;
+	b->frac   = units % USECS_PER_SEC;
+	b->tokens = MIN(b->tokens + units / USECS_PER_SEC, td_qos_burst(b));
+}
+
+/* usecs until the bucket is out of debt, 0 if it is already */
+static int64_t
+td_qos_bucket_wait(td_qos_bucket_t *b)
+{
+	if (!b->rate || b->tokens > 0)
+		return 0;
+
+	return (1 - b->tokens) * USECS_PER_SEC / b->rate + 1;
+}
+
+static int
+td_qos_bucket_index(int64_t usecs)
+{
+	int i;
+
+	for (i = 0; i < TD_QOS_HIST_BUCKETS - 1; i++)
+		if (usecs < (2LL << i))
+			break;
+
+	return i;
+}
+
+/* upper bound, in usecs, of the bucket holding the given percentile */
+static uint32_t
+td_qos_percentile(uint64_t *hist, uint64_t total, int pct)
+{
+	uint64_t sum, want;
+	int i;
+
+	want = (total * pct + 99) / 100;
+
+	for (i = 0, sum = 0; i < TD_QOS_HIST_BUCKETS - 1; i++) {
+		sum += hist[i];
+		if (sum >= want)
+			break;
+	}
+
+	return 2U << i;
+}
+
+static void
+td_qos_raise_pressure(int priority, const struct timeval *now)
+{
+	struct timeval expires = *now;
+
+	expires.tv_sec += 2 * TD_QOS_WINDOW_MS / 1000;
+
+	pthread_mutex_lock(&td_qos_lock);
+	if (timercmp(now, &td_qos_pressure_expires, >=) ||
+	    priority >= td_qos_pressure_priority) {
+		td_qos_pressure_priority = priority;
+		td_qos_pressure_expires  = expires;
+	}
+	pthread_mutex_unlock(&td_qos_lock);
+}
+
+static int
+td_qos_under_pressure(int priority, const struct timeval *now)
+{
+	int pressure;
+
+	pthread_mutex_lock(&td_qos_lock);
+	pressure = (timercmp(now, &td_qos_pressure_expires, <) &&
+		    priority < td_qos_pressure_priority);
+	pthread_mutex_unlock(&td_qos_lock);
+
+	return pressure;
+}
+
+/*
+ * Once per window: work out this VBD's percentiles, raise pressure if
+ * it misses its target, and adjust its cap if someone else does.  The
+ * cap halves for every window under pressure and grows back by a
+ * quarter per window without, until it is well clear of the load.
+ */
+static void
+td_qos_roll_window(td_qos_t *qos, const struct timeval *now)
+{
+	int64_t elapsed;
+	uint64_t rate, observed;
+
+	elapsed = td_qos_usecs(now, &qos->window_ts);
+	if (elapsed >= 0 && elapsed < TD_QOS_WINDOW_MS * 1000)
+		return;
+
+	if (qos->window_ios >= TD_QOS_MIN_SAMPLES) {
+		qos->p50 = td_qos_percentile(qos->window,
+					     qos->window_ios, 50);
+		qos->p99 = td_qos_percentile(qos->window,
+					     qos->window_ios, 99);
+
+		if (qos->params.latency_target &&
+		    qos->p99 > qos->params.latency_target)
+			td_qos_raise_pressure(qos->params.priority, now);
+	}
+
+	observed = (elapsed > 0 ?
+		    qos->window_ios * USECS_PER_SEC / elapsed : 0);
+
+	if (td_qos_under_pressure(qos->params.priority, now)) {
+		if (qos->cap.rate || observed) {
+			rate = (qos->cap.rate ? : observed) / 2;
+			td_qos_bucket_set(&qos->cap,
+					  MAX(rate, TD_QOS_MIN_IOPS), now);
+		}
+	} else if (qos->cap.rate) {
+		rate = qos->cap.rate + qos->cap.rate / 4 + 1;
+		if (rate > 2 * observed + TD_QOS_MIN_IOPS ||
+		    (qos->params.iops && rate >= qos->params.iops))
+			rate = 0;
+		td_qos_bucket_set(&qos->cap, rate, now);
+	}
+
+	memset(qos->window, 0, sizeof(qos->window));
+	qos->window_ios = 0;
+	qos->window_ts  = *now;
+}
+
+static void
+td_qos_timer_event(event_id_t id, char mode, void *private)
+{
+	td_qos_t *qos = private;
+	uint64_t expirations;
+
+	if (read(qos->timer_fd, &expirations, sizeof(expirations)) == -1 &&
+	    errno != EAGAIN)
+		EPRINTF("reading qos timer: %d\n", errno);
+
+	qos->armed = 0;
+	qos->cb(qos->arg);
+}
+
+static void
+td_qos_arm(td_qos_t *qos, int64_t usecs)
+{
+	struct itimerspec its;
+	event_id_t id;
+
+	if (qos->armed)
+		return;
+
+	if (qos->timer_fd == -1) {
+		qos->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					       TFD_NONBLOCK | TFD_CLOEXEC);
+		if (qos->timer_fd == -1)
+			goto fallback;
+
+		id = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+						   qos->timer_fd, 0,
+						   td_qos_timer_event, qos);
+		if (id < 0) {
+			close(qos->timer_fd);
+			qos->timer_fd = -1;
+			goto fallback;
+		}
+
+		qos->timer_event = id;
+	}
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec  = usecs / USECS_PER_SEC;
+	its.it_value.tv_nsec = (usecs % USECS_PER_SEC) * 1000;
+
+	if (timerfd_settime(qos->timer_fd, 0, &its, NULL))
+		goto fallback;
+
+	qos->armed = 1;
+	return;
+
+fallback:
+	/* no timer: the retry poll will pick the requests up */
+	tapdisk_server_set_max_timeout(1);
+}
+
+void
+td_qos_init(td_qos_t *qos, td_qos_cb_t cb, void *arg)
+{
+	memset(qos, 0, sizeof(*qos));
+	qos->timer_fd = -1;
+	qos->cb       = cb;
+	qos->arg      = arg;
+	gettimeofday(&qos->window_ts, NULL);
+}
+
+void
+td_qos_free(td_qos_t *qos)
+{
+	if (qos->timer_fd == -1)
+		return;
+
+	tapdisk_server_unregister_event(qos->timer_event);
+	close(qos->timer_fd);
+	qos->timer_fd = -1;
+	qos->armed    = 0;
+}
+
+int
+td_qos_set(td_qos_t *qos, const td_qos_params_t *params)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	qos->params = *params;
+	td_qos_bucket_set(&qos->iops, params->iops, &now);
+	td_qos_bucket_set(&qos->bps, params->bps, &now);
+
+	if (qos->params.iops && qos->cap.rate >= qos->params.iops)
+		td_qos_bucket_set(&qos->cap, 0, &now);
+
+	return 0;
+}
+
+/*
+ * Returns 0 and charges the buckets if a request of the given size may
+ * go now.  Otherwise returns -EBUSY, and the callback will run once
+ * every bucket is out of debt.
+ */
+int
+td_qos_admit(td_qos_t *qos, uint64_t bytes)
+{
+	struct timeval now;
+	int64_t wait;
+
+	gettimeofday(&now, NULL);
+	td_qos_roll_window(qos, &now);
+
+	if (!qos->iops.rate && !qos->bps.rate && !qos->cap.rate)
+		return 0;
+
+	td_qos_bucket_refill(&qos->iops, &now);
+	td_qos_bucket_refill(&qos->bps, &now);
+	td_qos_bucket_refill(&qos->cap, &now);
+
+	wait = td_qos_bucket_wait(&qos->iops);
+	wait = MAX(wait, td_qos_bucket_wait(&qos->bps));
+	wait = MAX(wait, td_qos_bucket_wait(&qos->cap));
+
+	if (wait) {
+		if (!qos->armed)
+			qos->throttled++;
+		td_qos_arm(qos, wait);
+		return -EBUSY;
+	}
+
+	if (qos->iops.rate)
+		qos->iops.tokens--;
+	if (qos->bps.rate)
+		qos->bps.tokens -= bytes;
+	if (qos->cap.rate)
+		qos->cap.tokens--;
+
+	return 0;
+}
+
+void
+td_qos_complete(td_qos_t *qos, const struct timeval *issued)
+{
+	struct timeval now;
+	int i;
+
+	gettimeofday(&now, NULL);
+
+	i = td_qos_bucket_index(MAX(td_qos_usecs(&now, issued), 0));
+	qos->hist[i]++;
+	qos->window[i]++;
+	qos->window_ios++;
+
+	td_qos_roll_window(qos, &now);
+}
+
+void
+td_qos_get_stats(td_qos_t *qos, td_qos_stats_t *stats)
+{
+	stats->params    = qos->params;
+	stats->cap       = qos->cap.rate;
+	stats->throttled = qos->throttled;
+	stats->p50       = qos->p50;
+	stats->p99       = qos->p99;
+	memcpy(stats->hist, qos->hist, sizeof(stats->hist));
+}
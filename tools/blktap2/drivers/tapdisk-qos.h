@@ -0,0 +1,110 @@
+/* 
+ * Copyright (c) 2008, XenSource Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef _TAPDISK_QOS_H_
+#define _TAPDISK_QOS_H_
+
+#include <inttypes.h>
+#include <sys/time.h>
+
+#include "scheduler.h"
+
+/*
+ * Per-VBD IO budgets: token buckets for IOPS and bandwidth, plus a
+ * latency target.  When a VBD with a latency target sees its p99 go
+ * over it, every VBD of lower priority in this tapdisk backs off to an
+ * adaptive IOPS cap until the pressure goes away.
+ */
+
+/* latency histogram buckets: [2^i, 2^(i+1)) usecs, the last one open */
+#define TD_QOS_HIST_BUCKETS         20
+
+#define TD_QOS_BURST_MS             100    /* bucket depth */
+#define TD_QOS_WINDOW_MS            1000   /* latency sampling period */
+#define TD_QOS_MIN_SAMPLES          16     /* per window, for a p99 */
+#define TD_QOS_MIN_IOPS             16     /* floor of the adaptive cap */
+
+typedef struct td_qos               td_qos_t;
+typedef struct td_qos_bucket        td_qos_bucket_t;
+typedef struct td_qos_params        td_qos_params_t;
+typedef struct td_qos_stats         td_qos_stats_t;
+typedef void (*td_qos_cb_t)        (void *);
+
+struct td_qos_bucket {
+	uint64_t                    rate;   /* per second, 0: unlimited */
+	int64_t                     tokens; /* may go into debt */
+	int64_t                     frac;   /* millionths of a token */
+	struct timeval              ts;
+};
+
+struct td_qos_params {
+	uint64_t                    iops;
+	uint64_t                    bps;
+	int                         priority;
+	uint32_t                    latency_target; /* usecs, 0: none */
+};
+
+struct td_qos_stats {
+	td_qos_params_t             params;
+	uint64_t                    cap;
+	uint64_t                    throttled;
+	uint32_t                    p50;
+	uint32_t                    p99;
+	uint64_t                    hist[TD_QOS_HIST_BUCKETS];
+};
+
+struct td_qos {
+	td_qos_params_t             params;
+
+	td_qos_bucket_t             iops;
+	td_qos_bucket_t             bps;
+	td_qos_bucket_t             cap;   /* set under latency pressure */
+
+	uint64_t                    hist[TD_QOS_HIST_BUCKETS];
+	uint64_t                    window[TD_QOS_HIST_BUCKETS];
+	uint64_t                    window_ios;
+	struct timeval              window_ts;
+	uint32_t                    p50;
+	uint32_t                    p99;
+
+	uint64_t                    throttled;
+
+	int                         timer_fd;
+	event_id_t                  timer_event;
+	int                         armed;
+	td_qos_cb_t                 cb;
+	void                       *arg;
+};
+
+void td_qos_init(td_qos_t *, td_qos_cb_t, void *);
+void td_qos_free(td_qos_t *);
+int td_qos_set(td_qos_t *, const td_qos_params_t *);
+int td_qos_admit(td_qos_t *, uint64_t bytes);
+void td_qos_complete(td_qos_t *, const struct timeval *issued);
+void td_qos_get_stats(td_qos_t *, td_qos_stats_t *);
+
+#endif
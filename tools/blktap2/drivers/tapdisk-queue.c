@@ -27,9 +27,12 @@
 */
 
 #include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <libaio.h>
+#include <sys/time.h>
 #ifdef __linux__
 #include <linux/version.h>
 #endif
@@ -55,6 +58,31 @@
  */
 #define REQUEST_ASYNC_FD ((io_context_t)1)
 
+/*
+ * The elevator holds iocbs back while this many are in flight;
+ * TAPDISK_ELEVATOR overrides it, 0 disables the elevator.
+ */
+#define TQUEUE_ELV_DEPTH 4
+
+static void ra_invalidate(struct tqueue *, int, long long, long long);
+static void ra_write(struct tqueue *, struct iocb *, int);
+static void ra_complete(struct tqueue *, struct tiocb *, unsigned long);
+
+static inline uint64_t
+tapdisk_queue_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static inline int
+ra_enabled(struct tqueue *queue)
+{
+	return queue->ra.max_window != 0;
+}
+
 static inline void
 queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 {
@@ -122,6 +150,11 @@ complete_tiocb(struct tqueue *queue, struct tiocb *tiocb, unsigned long res)
 	int err;
 	struct iocb *iocb = &tiocb->iocb;
 
+	if (tiocb->flags & TIOCB_FLAG_PREFETCH) {
+		ra_complete(queue, tiocb, res);
+		return;
+	}
+
 	if (res == iocb->u.c.nbytes)
 		err = 0;
 	else if ((int)res < 0)
@@ -129,9 +162,49 @@ complete_tiocb(struct tqueue *queue, struct tiocb *tiocb, unsigned long res)
 	else
 		err = -EIO;
 
+	if (iocb->aio_lio_opcode == IO_CMD_PWRITE && ra_enabled(queue))
+		ra_write(queue, iocb, err);
+
 	tiocb->cb(tiocb->arg, tiocb, err);
 }
 
+/*
+ * the elevator reorders iocbs: relink their tiocbs in submission
+ * order, which is what cancel_tiocbs walks
+ */
+static void
+link_tiocbs(struct iocb **iocbs, int num)
+{
+	int i;
+	struct tiocb *tiocb;
+
+	for (i = 0; i < num; i++) {
+		tiocb       = iocbs[i]->data;
+		tiocb->next = (i + 1 < num ? iocbs[i + 1]->data : NULL);
+	}
+}
+
+/*
+ * pass queued iocbs through the elevator, leaving whatever
+ * is to be submitted now in queue->iocbs
+ */
+static void
+schedule_tiocbs(struct tqueue *queue, int force)
+{
+	uint64_t now;
+
+	if (!queue->elv_depth)
+		return;
+
+	force |= queue->iocbs_pending < queue->elv_depth;
+	now    = tapdisk_queue_now();
+
+	io_elv_add(&queue->elv, queue->iocbs, queue->queued, now);
+	queue->queued = io_elv_dispatch(&queue->elv, queue->iocbs, force, now);
+
+	link_tiocbs(queue->iocbs, queue->queued);
+}
+
 static int
 cancel_tiocbs(struct tqueue *queue, int err)
 {
@@ -206,18 +279,40 @@ tapdisk_rwio_setup(struct tqueue *queue, int size)
 static inline ssize_t
 tapdisk_rwio_rw(const struct iocb *iocb)
 {
-	int fd        = iocb->aio_fildes;
-	char *buf     = iocb->u.c.buf;
-	long long off = iocb->u.c.offset;
-	size_t size   = iocb->u.c.nbytes;
-	ssize_t (*func)(int, void *, size_t) = 
-		(iocb->aio_lio_opcode == IO_CMD_PWRITE ? vwrite : read);
+	int i, niov, fd = iocb->aio_fildes;
+	long long off   = iocb->u.c.offset;
+	struct iovec *iov, single;
+	ssize_t (*func)(int, void *, size_t);
+	size_t size, n;
+
+	switch (iocb->aio_lio_opcode) {
+	case OPIO_CMD_PREADV:
+	case OPIO_CMD_PWRITEV:
+		iov  = (struct iovec *)iocb->u.c.buf;
+		niov = iocb->u.c.nbytes;
+		break;
+	default:
+		single.iov_base = iocb->u.c.buf;
+		single.iov_len  = iocb->u.c.nbytes;
+		iov  = &single;
+		niov = 1;
+		break;
+	}
+
+	func = (iocb->aio_lio_opcode == IO_CMD_PWRITE ||
+		iocb->aio_lio_opcode == OPIO_CMD_PWRITEV ? vwrite : read);
 
 	if (lseek(fd, off, SEEK_SET) == (off_t)-1)
 		return -errno;
 
-	if (atomicio(func, fd, buf, size) != size)
-		return -errno;
+	for (i = 0, size = 0; i < niov; i++) {
+		n     = atomicio(func, fd, iov[i].iov_base, iov[i].iov_len);
+		size += n;
+
+		/* short transfers are reported as such, like aio does */
+		if (n != iov[i].iov_len)
+			return (size ? size : -errno);
+	}
 
 	return size;
 }
@@ -231,12 +326,16 @@ tapdisk_rwio_submit(struct tqueue *queue)
 	struct tiocb *tiocb;
 	struct io_event *ep;
 
-	if (!queue->queued)
+	if (!queue->queued && !queue->elv.held)
 		return 0;
 
 	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+	schedule_tiocbs(queue, 1);
 	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
 
+	queue->submits++;
+	queue->tiocbs_submitted += queue->queued;
+	queue->iocbs_submitted  += merged;
 	queue->queued = 0;
 
 	for (i = 0; i < merged; i++) {
@@ -262,9 +361,9 @@ tapdisk_rwio_submit(struct tqueue *queue)
 
 static const struct tio td_tio_rwio = {
 	.name        = "rwio",
-	.data_size   = 0,
-	.tio_setup   = NULL,
-	.tio_destroy = NULL,
+	.data_size   = sizeof(struct rwio),
+	.tio_setup   = tapdisk_rwio_setup,
+	.tio_destroy = tapdisk_rwio_destroy,
 	.tio_submit  = tapdisk_rwio_submit
 };
 
@@ -511,10 +610,14 @@ tapdisk_lio_submit(struct tqueue *queue)
 	struct lio *lio = queue->tio_data;
 	int merged, submitted, err = 0;
 
-	if (!queue->queued)
+	if (!queue->queued && !queue->elv.held)
 		return 0;
 
 	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+	schedule_tiocbs(queue, 0);
+	if (!queue->queued)
+		return 0;
+
 	merged    = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
 	tapdisk_lio_set_eventfd(queue, merged, queue->iocbs);
 	submitted = io_submit(lio->aio_ctx, merged, queue->iocbs);
@@ -522,6 +625,10 @@ tapdisk_lio_submit(struct tqueue *queue)
 	DBG("queued: %d, merged: %d, submitted: %d\n",
 	    queue->queued, merged, submitted);
 
+	queue->submits++;
+	queue->tiocbs_submitted += queue->queued;
+	queue->iocbs_submitted  += merged;
+
 	if (submitted < 0) {
 		err = submitted;
 		submitted = 0;
@@ -547,6 +654,455 @@ static const struct tio td_tio_lio = {
 	.tio_submit  = tapdisk_lio_submit,
 };
 
+/*
+ * read-ahead
+ */
+
+static inline void
+tlist_add(struct tlist *list, struct tiocb *tiocb)
+{
+	tiocb->next = NULL;
+
+	if (!list->head)
+		list->head = list->tail = tiocb;
+	else
+		list->tail = list->tail->next = tiocb;
+}
+
+static inline long long
+ra_slot_end(struct tra_slot *slot)
+{
+	return slot->offset + slot->len;
+}
+
+static void
+ra_reset_stream(struct tra_stream *s, int fd)
+{
+	int i;
+
+	s->fd     = fd;
+	s->next   = 0;
+	s->fill   = 0;
+	s->window = TQUEUE_RA_MIN_WINDOW;
+	s->seq    = 0;
+
+	for (i = 0; i < TQUEUE_RA_SLOTS; i++)
+		s->slots[i].state = TRA_SLOT_EMPTY;
+}
+
+static int
+ra_stream_busy(struct tra_stream *s)
+{
+	int i;
+
+	for (i = 0; i < TQUEUE_RA_SLOTS; i++)
+		if (s->slots[i].state == TRA_SLOT_INFLIGHT)
+			return 1;
+
+	return 0;
+}
+
+/*
+ * a slot holding (or about to hold) all of [offset, offset + size)
+ */
+static struct tra_slot *
+ra_find_slot(struct tqueue *queue, int fd, long long offset, size_t size,
+	     struct tra_stream **stream)
+{
+	int i, j;
+	struct tra_stream *s;
+	struct tra_slot *slot;
+
+	for (i = 0; i < TQUEUE_RA_STREAMS; i++) {
+		s = queue->ra.streams + i;
+		if (s->fd != fd)
+			continue;
+
+		for (j = 0; j < TQUEUE_RA_SLOTS; j++) {
+			slot = s->slots + j;
+			if (slot->state == TRA_SLOT_EMPTY || slot->stale)
+				continue;
+
+			if (offset >= slot->offset &&
+			    offset + (long long)size <= ra_slot_end(slot)) {
+				*stream = s;
+				return slot;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * the stream a read at @offset continues, allowing for small gaps
+ * (e.g., VHD bitmaps between data blocks)
+ */
+static struct tra_stream *
+ra_find_stream(struct tqueue *queue, int fd, long long offset)
+{
+	int i;
+	struct tra_stream *s;
+
+	for (i = 0; i < TQUEUE_RA_STREAMS; i++) {
+		s = queue->ra.streams + i;
+		if (s->fd == fd &&
+		    offset >= s->next &&
+		    offset - s->next <= TQUEUE_RA_MAX_GAP)
+			return s;
+	}
+
+	return NULL;
+}
+
+static struct tra_stream *
+ra_new_stream(struct tqueue *queue, int fd)
+{
+	int i;
+	struct tra_stream *s, *lru;
+
+	lru = NULL;
+
+	for (i = 0; i < TQUEUE_RA_STREAMS; i++) {
+		s = queue->ra.streams + i;
+		if (ra_stream_busy(s))
+			continue;
+		if (s->fd == -1) {
+			lru = s;
+			break;
+		}
+		if (!lru || s->used < lru->used)
+			lru = s;
+	}
+
+	if (lru)
+		ra_reset_stream(lru, fd);
+
+	return lru;
+}
+
+/*
+ * prefetch up to a window past the reader, into whichever slots are
+ * free or hold data it has moved past
+ */
+static void
+ra_fill(struct tqueue *queue, struct tra_stream *s)
+{
+	int i, err;
+	void *buf;
+	struct tra_slot *slot;
+
+	if (s->fill < s->next)
+		s->fill = s->next;
+
+	for (i = 0; i < TQUEUE_RA_SLOTS; i++) {
+		slot = s->slots + i;
+		if (slot->state == TRA_SLOT_VALID &&
+		    ra_slot_end(slot) <= s->next)
+			slot->state = TRA_SLOT_EMPTY;
+	}
+
+	for (i = 0; i < TQUEUE_RA_SLOTS; i++) {
+		if (s->fill >= s->next + (long long)s->window)
+			break;
+
+		if (tapdisk_queue_full(queue))
+			break;
+
+		slot = s->slots + i;
+		if (slot->state != TRA_SLOT_EMPTY)
+			continue;
+
+		if (!slot->buf) {
+			err = posix_memalign(&buf, 4096,
+					     queue->ra.max_window);
+			if (err)
+				break;
+			slot->buf = buf;
+		}
+
+		slot->state  = TRA_SLOT_INFLIGHT;
+		slot->stale  = 0;
+		slot->offset = s->fill;
+		slot->len    = s->window;
+
+		tapdisk_prep_tiocb(&slot->tiocb, s->fd, 0, slot->buf,
+				   slot->len, slot->offset, NULL, slot);
+		slot->tiocb.flags = TIOCB_FLAG_PREFETCH;
+
+		queue_tiocb(queue, &slot->tiocb);
+
+		s->fill += slot->len;
+		queue->ra.fills++;
+	}
+}
+
+/*
+ * returns 1 if @tiocb will be completed from read-ahead
+ */
+static int
+ra_read(struct tqueue *queue, struct tiocb *tiocb)
+{
+	struct treadahead *ra = &queue->ra;
+	struct iocb *iocb = &tiocb->iocb;
+	int fd = iocb->aio_fildes;
+	long long offset = iocb->u.c.offset;
+	size_t size = iocb->u.c.nbytes;
+	struct tra_stream *s;
+	struct tra_slot *slot;
+
+	slot = ra_find_slot(queue, fd, offset, size, &s);
+	if (slot) {
+		if (slot->state == TRA_SLOT_VALID) {
+			memcpy(iocb->u.c.buf,
+			       slot->buf + (offset - slot->offset), size);
+			tlist_add(&ra->done, tiocb);
+			ra->hits++;
+		} else {
+			tlist_add(&slot->waiters, tiocb);
+			ra->waits++;
+		}
+
+		s->next = offset + size;
+		s->used = ++ra->clock;
+		if (s->window < ra->max_window)
+			s->window <<= 1;
+		if (s->window > ra->max_window)
+			s->window = ra->max_window;
+		ra_fill(queue, s);
+
+		return 1;
+	}
+
+	ra->misses++;
+
+	s = ra_find_stream(queue, fd, offset);
+	if (s)
+		s->seq++;
+	else {
+		s = ra_new_stream(queue, fd);
+		if (!s)
+			return 0;
+	}
+
+	s->next = offset + size;
+	s->used = ++ra->clock;
+
+	if (s->seq)
+		ra_fill(queue, s);
+
+	return 0;
+}
+
+static void
+ra_complete(struct tqueue *queue, struct tiocb *tiocb, unsigned long res)
+{
+	struct tra_slot *slot = tiocb->arg;
+	struct tiocb *waiter, *next;
+	struct iocb *iocb;
+
+	if ((int)res < 0 || slot->stale) {
+		slot->state = TRA_SLOT_EMPTY;
+		slot->len   = 0;
+	} else {
+		slot->state = TRA_SLOT_VALID;
+		if (res < slot->len)
+			slot->len = res;
+	}
+
+	waiter = slot->waiters.head;
+	slot->waiters.head = slot->waiters.tail = NULL;
+
+	for (; waiter != NULL; waiter = next) {
+		next = waiter->next;
+		iocb = &waiter->iocb;
+
+		if (slot->state == TRA_SLOT_VALID &&
+		    iocb->u.c.offset + (long long)iocb->u.c.nbytes <=
+		    ra_slot_end(slot)) {
+			memcpy(iocb->u.c.buf,
+			       slot->buf + (iocb->u.c.offset - slot->offset),
+			       iocb->u.c.nbytes);
+			waiter->cb(waiter->arg, waiter, 0);
+			continue;
+		}
+
+		/* short or failed prefetch: read it the usual way */
+		waiter->flags &= ~TIOCB_FLAG_READAHEAD;
+		tapdisk_queue_tiocb(queue, waiter);
+	}
+}
+
+/*
+ * resume prefetching after the last data still good
+ */
+static void
+ra_rewind(struct tra_stream *s)
+{
+	int i;
+	struct tra_slot *slot;
+
+	s->fill = s->next;
+
+	for (i = 0; i < TQUEUE_RA_SLOTS; i++) {
+		slot = s->slots + i;
+		if (slot->state != TRA_SLOT_EMPTY && !slot->stale &&
+		    ra_slot_end(slot) > s->fill)
+			s->fill = ra_slot_end(slot);
+	}
+}
+
+/*
+ * drop read-ahead data overlapping [start, end)
+ */
+static void
+ra_invalidate(struct tqueue *queue, int fd, long long start, long long end)
+{
+	int i, j, dropped;
+	struct tra_stream *s;
+	struct tra_slot *slot;
+
+	for (i = 0; i < TQUEUE_RA_STREAMS; i++) {
+		s = queue->ra.streams + i;
+		if (s->fd != fd)
+			continue;
+
+		dropped = 0;
+
+		for (j = 0; j < TQUEUE_RA_SLOTS; j++) {
+			slot = s->slots + j;
+			if (slot->state == TRA_SLOT_EMPTY)
+				continue;
+
+			if (start >= ra_slot_end(slot) || slot->offset >= end)
+				continue;
+
+			if (slot->state == TRA_SLOT_INFLIGHT)
+				slot->stale = 1;
+			else
+				slot->state = TRA_SLOT_EMPTY;
+
+			queue->ra.invalidations++;
+			dropped = 1;
+		}
+
+		if (dropped)
+			ra_rewind(s);
+	}
+}
+
+/*
+ * a write completed: copy it into read-ahead data it overlaps.
+ * Prefetches still in flight may have raced with it, and are dropped.
+ */
+static void
+ra_write(struct tqueue *queue, struct iocb *iocb, int err)
+{
+	int i, j, dropped;
+	long long start, end, lo, hi;
+	struct tra_stream *s;
+	struct tra_slot *slot;
+
+	start = iocb->u.c.offset;
+	end   = start + iocb->u.c.nbytes;
+
+	if (err) {
+		ra_invalidate(queue, iocb->aio_fildes, start, end);
+		return;
+	}
+
+	for (i = 0; i < TQUEUE_RA_STREAMS; i++) {
+		s = queue->ra.streams + i;
+		if (s->fd != iocb->aio_fildes)
+			continue;
+
+		dropped = 0;
+
+		for (j = 0; j < TQUEUE_RA_SLOTS; j++) {
+			slot = s->slots + j;
+			if (slot->state == TRA_SLOT_EMPTY)
+				continue;
+
+			if (start >= ra_slot_end(slot) || slot->offset >= end)
+				continue;
+
+			if (slot->state == TRA_SLOT_INFLIGHT) {
+				slot->stale = 1;
+				queue->ra.invalidations++;
+				dropped = 1;
+				continue;
+			}
+
+			lo = (start > slot->offset ? start : slot->offset);
+			hi = (end < ra_slot_end(slot) ? end : ra_slot_end(slot));
+
+			memcpy(slot->buf + (lo - slot->offset),
+			       iocb->u.c.buf + (lo - start), hi - lo);
+		}
+
+		if (dropped)
+			ra_rewind(s);
+	}
+}
+
+static int
+ra_complete_hits(struct tqueue *queue)
+{
+	int n;
+	struct tiocb *tiocb, *next;
+
+	tiocb = queue->ra.done.head;
+	queue->ra.done.head = queue->ra.done.tail = NULL;
+
+	for (n = 0; tiocb != NULL; tiocb = next, n++) {
+		next = tiocb->next;
+		tiocb->cb(tiocb->arg, tiocb, 0);
+	}
+
+	return n;
+}
+
+static void
+ra_init(struct tqueue *queue)
+{
+	int i;
+	char *env;
+	long kb;
+
+	env = getenv("TAPDISK_READAHEAD");
+	kb  = env ? atol(env) : (TQUEUE_RA_MAX_WINDOW >> 10);
+
+	if (kb <= 0) {
+		queue->ra.max_window = 0;
+		return;
+	}
+
+	if (kb < (TQUEUE_RA_MIN_WINDOW >> 10))
+		kb = TQUEUE_RA_MIN_WINDOW >> 10;
+	kb = (kb + 3) & ~3L;
+
+	queue->ra.max_window = kb << 10;
+
+	for (i = 0; i < TQUEUE_RA_STREAMS; i++)
+		ra_reset_stream(queue->ra.streams + i, -1);
+}
+
+static void
+ra_free(struct tqueue *queue)
+{
+	int i, j;
+	struct tra_slot *slot;
+
+	for (i = 0; i < TQUEUE_RA_STREAMS; i++)
+		for (j = 0; j < TQUEUE_RA_SLOTS; j++) {
+			slot = queue->ra.streams[i].slots + j;
+			free(slot->buf);
+			slot->buf = NULL;
+		}
+
+	queue->ra.max_window = 0;
+}
+
 static void
 tapdisk_queue_free_io(struct tqueue *queue)
 {
@@ -609,6 +1165,7 @@ tapdisk_init_queue(struct tqueue *queue, int size,
 		   int drv, struct tfilter *filter)
 {
 	int i, err;
+	char *env;
 
 	memset(queue, 0, sizeof(struct tqueue));
 
@@ -632,6 +1189,17 @@ tapdisk_init_queue(struct tqueue *queue, int size,
 	if (err)
 		goto fail;
 
+	err = opio_elv_init(&queue->elv, size);
+	if (err)
+		goto fail;
+
+	env = getenv("TAPDISK_ELEVATOR");
+	queue->elv_depth = env ? atoi(env) : TQUEUE_ELV_DEPTH;
+	if (queue->elv_depth < 0)
+		queue->elv_depth = 0;
+
+	ra_init(queue);
+
 	return 0;
 
  fail:
@@ -648,6 +1216,8 @@ tapdisk_free_queue(struct tqueue *queue)
 	queue->iocbs = NULL;
 
 	opio_free(&queue->opioctx);
+	opio_elv_free(&queue->elv);
+	ra_free(queue);
 }
 
 void 
@@ -660,6 +1230,19 @@ tapdisk_debug_queue(struct tqueue *queue)
 	     "tiocbs_pending: %d, tiocbs_deferred: %d, deferrals: %"PRIx64"\n",
 	     queue->size, queue->tio->name, queue->queued, queue->iocbs_pending,
 	     queue->tiocbs_pending, queue->tiocbs_deferred, queue->deferrals);
+	WARN("submits: %"PRIu64", tiocbs: %"PRIu64", iocbs: %"PRIu64"\n",
+	     queue->submits, queue->tiocbs_submitted, queue->iocbs_submitted);
+	WARN("elevator: depth: %d, held: %d, dispatches: %"PRIu64", "
+	     "dispatched: %"PRIu64", expired: %"PRIu64", avg wait: %"PRIu64
+	     "us, max wait: %"PRIu64"us\n", queue->elv_depth, queue->elv.held,
+	     queue->elv.dispatches, queue->elv.dispatched, queue->elv.expired,
+	     queue->elv.dispatched ?
+	     queue->elv.wait_total / queue->elv.dispatched : 0,
+	     queue->elv.wait_max);
+	WARN("read-ahead: window: %zuK, hits: %"PRIu64", waits: %"PRIu64", "
+	     "misses: %"PRIu64", fills: %"PRIu64", invalidations: %"PRIu64"\n",
+	     queue->ra.max_window >> 10, queue->ra.hits, queue->ra.waits,
+	     queue->ra.misses, queue->ra.fills, queue->ra.invalidations);
 
 	if (tiocb) {
 		WARN("deferred:\n");
@@ -684,15 +1267,20 @@ tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
 	else
 		io_prep_pread(iocb, fd, buf, size, offset);
 
-	iocb->data  = tiocb;
-	tiocb->cb   = cb;
-	tiocb->arg  = arg;
-	tiocb->next = NULL;
+	iocb->data   = tiocb;
+	tiocb->cb    = cb;
+	tiocb->arg   = arg;
+	tiocb->next  = NULL;
+	tiocb->flags = 0;
 }
 
 void
 tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 {
+	if (tiocb->flags & TIOCB_FLAG_READAHEAD &&
+	    ra_enabled(queue) && ra_read(queue, tiocb))
+		return;
+
 	if (!tapdisk_queue_full(queue))
 		queue_tiocb(queue, tiocb);
 	else
@@ -706,6 +1294,8 @@ tapdisk_queue_tiocb(struct tqueue *queue, struct tiocb *tiocb)
 int
 tapdisk_submit_tiocbs(struct tqueue *queue)
 {
+	ra_complete_hits(queue);
+
 	return queue->tio->tio_submit(queue);
 }
 
@@ -716,7 +1306,7 @@ tapdisk_submit_all_tiocbs(struct tqueue *queue)
 
 	do {
 		submitted += tapdisk_submit_tiocbs(queue);
-	} while (!tapdisk_queue_empty(queue));
+	} while (!tapdisk_queue_empty(queue) || queue->ra.done.head);
 
 	return submitted;
 }
@@ -727,6 +1317,13 @@ tapdisk_submit_all_tiocbs(struct tqueue *queue)
 int
 tapdisk_cancel_tiocbs(struct tqueue *queue)
 {
+	if (queue->elv.held) {
+		queue->queued += io_elv_dispatch(&queue->elv,
+						 queue->iocbs + queue->queued,
+						 1, tapdisk_queue_now());
+		link_tiocbs(queue->iocbs, queue->queued);
+	}
+
 	return cancel_tiocbs(queue, -EIO);
 }
 
@@ -741,3 +1338,21 @@ tapdisk_cancel_all_tiocbs(struct tqueue *queue)
 
 	return cancelled;
 }
+
+/*
+ * for writes made behind the queue's back: drops any read-ahead
+ * overlapping them.  A @size of 0 covers the whole file, which
+ * must be done before its fd is closed.
+ */
+void
+tapdisk_queue_invalidate(struct tqueue *queue, int fd,
+			 long long offset, size_t size)
+{
+	if (!ra_enabled(queue))
+		return;
+
+	if (!size)
+		ra_invalidate(queue, fd, 0, LLONG_MAX);
+	else
+		ra_invalidate(queue, fd, offset, offset + size);
+}
@@ -46,13 +46,74 @@ struct tiocb {
 
 	struct iocb           iocb;
 	struct tiocb         *next;
+
+	unsigned int          flags;
 };
 
+/* sequential reads of this tiocb may be served from read-ahead */
+#define TIOCB_FLAG_READAHEAD  (1<<0)
+/* internal: a read-ahead fill */
+#define TIOCB_FLAG_PREFETCH   (1<<1)
+
 struct tlist {
 	struct tiocb         *head;
 	struct tiocb         *tail;
 };
 
+/*
+ * Read-ahead: sequential reads flagged TIOCB_FLAG_READAHEAD are
+ * tracked per file, and once a stream is established the data past
+ * it is prefetched into a pair of buffers, the window doubling on
+ * every hit.  Writes completing through the queue are copied into
+ * overlapping buffers; tapdisk_queue_invalidate drops them.
+ */
+#define TQUEUE_RA_STREAMS     8
+#define TQUEUE_RA_SLOTS       2
+#define TQUEUE_RA_MIN_WINDOW  (64 << 10)
+#define TQUEUE_RA_MAX_WINDOW  (512 << 10)
+#define TQUEUE_RA_MAX_GAP     (64 << 10)
+
+enum {
+	TRA_SLOT_EMPTY    = 0,
+	TRA_SLOT_INFLIGHT = 1,
+	TRA_SLOT_VALID    = 2,
+};
+
+struct tra_slot {
+	int                   state;
+	int                   stale;
+	char                 *buf;
+	long long             offset;
+	size_t                len;
+	struct tiocb          tiocb;
+	struct tlist          waiters;
+};
+
+struct tra_stream {
+	int                   fd;
+	long long             next;     /* where the next read should be */
+	long long             fill;     /* end of the prefetched data */
+	size_t                window;
+	int                   seq;
+	uint64_t              used;
+	struct tra_slot       slots[TQUEUE_RA_SLOTS];
+};
+
+struct treadahead {
+	size_t                max_window; /* 0: disabled */
+	uint64_t              clock;
+	struct tra_stream     streams[TQUEUE_RA_STREAMS];
+
+	/* hits, completed on the next submit */
+	struct tlist          done;
+
+	uint64_t              hits;
+	uint64_t              waits;
+	uint64_t              misses;
+	uint64_t              fills;
+	uint64_t              invalidations;
+};
+
 struct tqueue {
 	int                   size;
 
@@ -81,7 +142,17 @@ struct tqueue {
 	/* optional tapdisk filter */
 	struct tfilter       *filter;
 
+	/* iocbs are held by the elevator while at least
+	 * elv_depth of them are pending in the aio layer */
+	struct opioelv        elv;
+	int                   elv_depth;
+
+	struct treadahead     ra;
+
 	uint64_t              deferrals;
+	uint64_t              submits;
+	uint64_t              tiocbs_submitted;
+	uint64_t              iocbs_submitted;
 };
 
 struct tio {
@@ -110,7 +181,7 @@ enum {
 #define tapdisk_queue_count(q) ((q)->queued)
 #define tapdisk_queue_empty(q) ((q)->queued == 0)
 #define tapdisk_queue_full(q)  \
-	(((q)->tiocbs_pending + (q)->queued) >= (q)->size)
+	(((q)->tiocbs_pending + (q)->queued + (q)->elv.held) >= (q)->size)
 int tapdisk_init_queue(struct tqueue *, int size, int drv, struct tfilter *);
 void tapdisk_free_queue(struct tqueue *);
 void tapdisk_debug_queue(struct tqueue *);
@@ -119,6 +190,8 @@ int tapdisk_submit_tiocbs(struct tqueue *);
 int tapdisk_submit_all_tiocbs(struct tqueue *);
 int tapdisk_cancel_tiocbs(struct tqueue *);
 int tapdisk_cancel_all_tiocbs(struct tqueue *);
+void tapdisk_queue_invalidate(struct tqueue *, int fd,
+			      long long offset, size_t size);
 void tapdisk_prep_tiocb(struct tiocb *, int, int, char *, size_t,
 			long long, td_queue_callback_t, void *);
 
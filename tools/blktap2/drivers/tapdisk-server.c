@@ -27,6 +27,7 @@
  */
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
@@ -42,19 +43,36 @@
 
  tapdisk_server_t server;
 
+/* The loop run by this thread; NULL (loop 0) on the main thread. */
+static __thread tapdisk_loop_t *current_loop;
+
 #define tapdisk_server_for_each_vbd(vbd, tmp)			        \
 	list_for_each_entry_safe(vbd, tmp, &server.vbds, next)
 
+#define tapdisk_loop_for_each_vbd(loop, vbd, tmp)			\
+	list_for_each_entry_safe(vbd, tmp, &(loop)->vbds, loop_next)
+
+static inline tapdisk_loop_t *
+tapdisk_server_loop(void)
+{
+	return current_loop ? : &server.loops[0];
+}
+
+/*
+ * Images are only shared between VBDs on the same loop: driver state is
+ * not locked against other threads.
+ */
 td_image_t *
 tapdisk_server_get_shared_image(td_image_t *image)
 {
 	td_vbd_t *vbd, *tmpv;
 	td_image_t *img, *tmpi;
+	tapdisk_loop_t *loop = tapdisk_server_loop();
 
 	if (!td_flag_test(image->flags, TD_OPEN_SHAREABLE))
 		return NULL;
 
-	tapdisk_server_for_each_vbd(vbd, tmpv)
+	tapdisk_loop_for_each_vbd(loop, vbd, tmpv)
 		tapdisk_vbd_for_each_image(vbd, img, tmpi)
 			if (img->type == image->type &&
 			    !strcmp(img->name, image->name))
@@ -63,14 +81,30 @@ tapdisk_server_get_shared_image(td_image_t *image)
 	return NULL;
 }
 
+/*
+ * The list of all VBDs, across loops.  Callers must hold the vbds lock
+ * while walking it.
+ */
 struct list_head *
 tapdisk_server_get_all_vbds(void)
 {
 	return &server.vbds;
 }
 
-td_vbd_t *
-tapdisk_server_get_vbd(uint16_t uuid)
+void
+tapdisk_server_lock_vbds(void)
+{
+	pthread_mutex_lock(&server.vbds_lock);
+}
+
+void
+tapdisk_server_unlock_vbds(void)
+{
+	pthread_mutex_unlock(&server.vbds_lock);
+}
+
+static td_vbd_t *
+__tapdisk_server_get_vbd(uint16_t uuid)
 {
 	td_vbd_t *vbd, *tmp;
 
@@ -81,64 +115,251 @@ tapdisk_server_get_vbd(uint16_t uuid)
 	return NULL;
 }
 
+td_vbd_t *
+tapdisk_server_get_vbd(uint16_t uuid)
+{
+	td_vbd_t *vbd;
+
+	tapdisk_server_lock_vbds();
+	vbd = __tapdisk_server_get_vbd(uuid);
+	tapdisk_server_unlock_vbds();
+
+	return vbd;
+}
+
+tapdisk_loop_t *
+tapdisk_server_get_vbd_loop(uint16_t uuid)
+{
+	td_vbd_t *vbd;
+	tapdisk_loop_t *loop;
+
+	tapdisk_server_lock_vbds();
+	vbd  = __tapdisk_server_get_vbd(uuid);
+	loop = vbd ? vbd->loop : NULL;
+	tapdisk_server_unlock_vbds();
+
+	return loop;
+}
+
+/*
+ * VBDs are added to, and removed from, the loop of the calling thread.
+ */
 void
 tapdisk_server_add_vbd(td_vbd_t *vbd)
 {
+	tapdisk_loop_t *loop = tapdisk_server_loop();
+
+	vbd->loop = loop;
+	list_add_tail(&vbd->loop_next, &loop->vbds);
+
+	tapdisk_server_lock_vbds();
 	list_add_tail(&vbd->next, &server.vbds);
+	loop->nr_vbds++;
+	tapdisk_server_unlock_vbds();
 }
 
 void
 tapdisk_server_remove_vbd(td_vbd_t *vbd)
 {
+	tapdisk_loop_t *loop = vbd->loop;
+
+	list_del(&vbd->loop_next);
+	INIT_LIST_HEAD(&vbd->loop_next);
+
+	tapdisk_server_lock_vbds();
 	list_del(&vbd->next);
 	INIT_LIST_HEAD(&vbd->next);
+	if (loop)
+		loop->nr_vbds--;
+	tapdisk_server_unlock_vbds();
+
+	vbd->loop = NULL;
 	tapdisk_server_check_state();
 }
 
+struct tapdisk_move_vbd {
+	td_vbd_t                    *vbd;
+	int                          err;
+};
+
+static void
+tapdisk_loop_release_vbd(void *arg)
+{
+	struct tapdisk_move_vbd *move = arg;
+	td_vbd_t *vbd = move->vbd;
+
+	tapdisk_vbd_unregister_events(vbd);
+	td_qos_free(&vbd->qos);
+
+	list_del(&vbd->loop_next);
+	INIT_LIST_HEAD(&vbd->loop_next);
+
+	tapdisk_server_lock_vbds();
+	vbd->loop->nr_vbds--;
+	vbd->loop = NULL;
+	tapdisk_server_unlock_vbds();
+}
+
+static void
+tapdisk_loop_adopt_vbd(void *arg)
+{
+	struct tapdisk_move_vbd *move = arg;
+	td_vbd_t *vbd = move->vbd;
+	tapdisk_loop_t *loop = tapdisk_server_loop();
+
+	list_add_tail(&vbd->loop_next, &loop->vbds);
+
+	tapdisk_server_lock_vbds();
+	vbd->loop = loop;
+	loop->nr_vbds++;
+	tapdisk_server_unlock_vbds();
+
+	move->err = tapdisk_vbd_register_event_watches(vbd);
+}
+
+/*
+ * Move an attached VBD with no images open to @loop.  VBDs whose drivers
+ * are not loop-safe are moved to the main loop this way before they are
+ * opened.  Main thread only.
+ */
+int
+tapdisk_server_move_vbd(td_vbd_t *vbd, tapdisk_loop_t *loop)
+{
+	struct tapdisk_move_vbd move;
+	int err;
+
+	if (vbd->loop == loop)
+		return 0;
+
+	if (!list_empty(&vbd->images))
+		return -EBUSY;
+
+	move.vbd = vbd;
+	move.err = 0;
+
+	err = tapdisk_server_call(vbd->loop, tapdisk_loop_release_vbd, &move);
+	if (err)
+		return err;
+
+	err = tapdisk_server_call(loop, tapdisk_loop_adopt_vbd, &move);
+
+	return err ? : move.err;
+}
+
 void
 tapdisk_server_queue_tiocb(struct tiocb *tiocb)
 {
-	tapdisk_queue_tiocb(&server.aio_queue, tiocb);
+	tapdisk_queue_tiocb(&tapdisk_server_loop()->aio_queue, tiocb);
 }
 
 void
-tapdisk_server_debug(void)
+tapdisk_server_invalidate_io(int fd, long long offset, size_t size)
+{
+	tapdisk_queue_invalidate(&tapdisk_server_loop()->aio_queue,
+				 fd, offset, size);
+}
+
+static void
+tapdisk_loop_debug(void *arg)
 {
+	tapdisk_loop_t *loop = arg;
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_debug_queue(&server.aio_queue);
+	tapdisk_debug_queue(&loop->aio_queue);
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
+	tapdisk_loop_for_each_vbd(loop, vbd, tmp)
 		tapdisk_vbd_debug(vbd);
+}
+
+static void
+tapdisk_loop_stop_vbds(void *arg)
+{
+	tapdisk_loop_t *loop = arg;
+	td_vbd_t *vbd, *tmp;
+
+	tapdisk_loop_for_each_vbd(loop, vbd, tmp)
+		tapdisk_vbd_kill_queue(vbd);
+}
+
+static void
+tapdisk_loop_close_vbds(void *arg)
+{
+	tapdisk_loop_t *loop = arg;
+	td_vbd_t *vbd, *tmp;
+
+	tapdisk_loop_for_each_vbd(loop, vbd, tmp)
+		tapdisk_vbd_close(vbd);
+}
+
+/*
+ * Run @fn on every loop, each on its own thread.  Main thread only.
+ */
+static void
+tapdisk_server_for_each_loop(tapdisk_loop_fn_t fn)
+{
+	int i;
+	tapdisk_loop_t *loop;
 
+	for (i = 0; i < server.nr_loops; i++) {
+		loop = &server.loops[i];
+		if (loop->run)
+			tapdisk_server_call(loop, fn, loop);
+	}
+}
+
+void
+tapdisk_server_debug(void)
+{
+	tapdisk_server_for_each_loop(tapdisk_loop_debug);
 	tlog_flush();
 }
 
+static void
+tapdisk_loop_kick(tapdisk_loop_t *loop)
+{
+	char c = 0;
+
+	/* a full pipe means a wakeup is pending already */
+	if (write(loop->call_pipe[1], &c, 1) == -1 && errno != EAGAIN)
+		ERR(errno, "loop %d: kick failed", loop->id);
+}
+
 void
 tapdisk_server_check_state(void)
 {
-	if (list_empty(&server.vbds))
-		server.run = 0;
+	int empty;
+
+	tapdisk_server_lock_vbds();
+	empty = list_empty(&server.vbds);
+	tapdisk_server_unlock_vbds();
+
+	if (!empty)
+		return;
+
+	server.run = 0;
+	if (tapdisk_server_loop() != &server.loops[0])
+		tapdisk_loop_kick(&server.loops[0]);
 }
 
 event_id_t
 tapdisk_server_register_event(char mode, int fd,
 			      int timeout, event_cb_t cb, void *data)
 {
-	return scheduler_register_event(&server.scheduler,
+	return scheduler_register_event(&tapdisk_server_loop()->scheduler,
 					mode, fd, timeout, cb, data);
 }
 
 void
 tapdisk_server_unregister_event(event_id_t event)
 {
-	return scheduler_unregister_event(&server.scheduler, event);
+	return scheduler_unregister_event(&tapdisk_server_loop()->scheduler,
+					  event);
 }
 
 void
 tapdisk_server_set_max_timeout(int seconds)
 {
-	scheduler_set_max_timeout(&server.scheduler, seconds);
+	scheduler_set_max_timeout(&tapdisk_server_loop()->scheduler, seconds);
 }
 
 static void
@@ -148,133 +369,466 @@ tapdisk_server_assert_locks(void)
 }
 
 static void
-tapdisk_server_set_retry_timeout(void)
+tapdisk_server_set_retry_timeout(tapdisk_loop_t *loop)
 {
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
+	tapdisk_loop_for_each_vbd(loop, vbd, tmp)
 		if (tapdisk_vbd_retry_needed(vbd)) {
-			tapdisk_server_set_max_timeout(TD_VBD_RETRY_INTERVAL);
+			scheduler_set_max_timeout(&loop->scheduler,
+						  TD_VBD_RETRY_INTERVAL);
 			return;
 		}
 }
 
 static void
-tapdisk_server_check_progress(void)
+tapdisk_server_check_progress(tapdisk_loop_t *loop)
 {
 	struct timeval now;
 	td_vbd_t *vbd, *tmp;
 
 	gettimeofday(&now, NULL);
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
+	tapdisk_loop_for_each_vbd(loop, vbd, tmp)
 		tapdisk_vbd_check_progress(vbd);
 }
 
 static void
-tapdisk_server_submit_tiocbs(void)
+tapdisk_server_submit_tiocbs(tapdisk_loop_t *loop)
 {
-	tapdisk_submit_all_tiocbs(&server.aio_queue);
+	tapdisk_submit_all_tiocbs(&loop->aio_queue);
 }
 
 static void
-tapdisk_server_kick_responses(void)
+tapdisk_server_kick_responses(tapdisk_loop_t *loop)
 {
-	int n;
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
+	tapdisk_loop_for_each_vbd(loop, vbd, tmp)
 		tapdisk_vbd_kick(vbd);
 }
 
 static void
-tapdisk_server_check_vbds(void)
+tapdisk_server_check_vbds(tapdisk_loop_t *loop)
 {
 	td_vbd_t *vbd, *tmp;
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
+	tapdisk_loop_for_each_vbd(loop, vbd, tmp)
 		tapdisk_vbd_check_state(vbd);
 }
 
 static void
-tapdisk_server_stop_vbds(void)
+tapdisk_loop_iterate(tapdisk_loop_t *loop)
 {
-	td_vbd_t *vbd, *tmp;
+	int ret;
 
-	tapdisk_server_for_each_vbd(vbd, tmp)
-		tapdisk_vbd_kill_queue(vbd);
+	tapdisk_server_assert_locks();
+	tapdisk_server_set_retry_timeout(loop);
+	tapdisk_server_check_progress(loop);
+
+	ret = scheduler_wait_for_events(&loop->scheduler);
+	if (ret < 0)
+		DBG(TLOG_WARN, "loop %d: wait returned %d\n", loop->id, ret);
+
+	tapdisk_server_check_vbds(loop);
+	tapdisk_server_submit_tiocbs(loop);
+	tapdisk_server_kick_responses(loop);
+}
+
+void
+tapdisk_server_iterate(void)
+{
+	tapdisk_loop_iterate(tapdisk_server_loop());
+}
+
+static void
+tapdisk_loop_call_event(event_id_t id, char mode, void *private)
+{
+	tapdisk_loop_t *loop = private;
+	struct tapdisk_loop_call *call;
+	char buf[16];
+
+	while (read(loop->call_pipe[0], buf, sizeof(buf)) > 0)
+		;
+
+	pthread_mutex_lock(&loop->call_lock);
+	call = loop->call;
+	if (call && call->done)
+		call = NULL;
+	pthread_mutex_unlock(&loop->call_lock);
+
+	if (!call)
+		return;
+
+	call->fn(call->arg);
+
+	pthread_mutex_lock(&loop->call_lock);
+	call->done = 1;
+	pthread_cond_broadcast(&loop->call_cond);
+	pthread_mutex_unlock(&loop->call_lock);
+}
+
+/*
+ * Run @fn on @loop's thread and wait for it to return.  Only the main
+ * thread calls into other loops, so this cannot deadlock.
+ */
+int
+tapdisk_server_call(tapdisk_loop_t *loop, tapdisk_loop_fn_t fn, void *arg)
+{
+	struct tapdisk_loop_call call;
+
+	if (loop == tapdisk_server_loop()) {
+		fn(arg);
+		return 0;
+	}
+
+	if (!loop->run)
+		return -ESRCH;
+
+	call.fn   = fn;
+	call.arg  = arg;
+	call.done = 0;
+
+	pthread_mutex_lock(&loop->call_lock);
+	while (loop->call)
+		pthread_cond_wait(&loop->call_cond, &loop->call_lock);
+	loop->call = &call;
+	pthread_mutex_unlock(&loop->call_lock);
+
+	tapdisk_loop_kick(loop);
+
+	pthread_mutex_lock(&loop->call_lock);
+	while (!call.done)
+		pthread_cond_wait(&loop->call_cond, &loop->call_lock);
+	loop->call = NULL;
+	pthread_cond_broadcast(&loop->call_cond);
+	pthread_mutex_unlock(&loop->call_lock);
+
+	return 0;
+}
+
+static void
+tapdisk_loop_init(tapdisk_loop_t *loop, int id)
+{
+	memset(loop, 0, sizeof(*loop));
+
+	loop->id           = id;
+	loop->call_pipe[0] = -1;
+	loop->call_pipe[1] = -1;
+	loop->call_event   = -1;
+	INIT_LIST_HEAD(&loop->vbds);
+	pthread_mutex_init(&loop->call_lock, NULL);
+	pthread_cond_init(&loop->call_cond, NULL);
+
+	scheduler_initialize(&loop->scheduler);
+}
+
+static void
+tapdisk_loop_close(tapdisk_loop_t *loop)
+{
+	tapdisk_loop_t *prev = current_loop;
+
+	current_loop = loop;
+
+	if (loop->call_event != -1) {
+		scheduler_unregister_event(&loop->scheduler, loop->call_event);
+		loop->call_event = -1;
+	}
+
+	if (loop->call_pipe[0] != -1) {
+		close(loop->call_pipe[0]);
+		close(loop->call_pipe[1]);
+		loop->call_pipe[0] = -1;
+		loop->call_pipe[1] = -1;
+	}
+
+	tapdisk_free_queue(&loop->aio_queue);
+	loop->run = 0;
+
+	current_loop = prev;
 }
 
 static int
-tapdisk_server_init_aio(void)
+tapdisk_loop_open(tapdisk_loop_t *loop)
 {
-	return tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
-				  TIO_DRV_LIO, NULL);
+	int i, err;
+	tapdisk_loop_t *prev = current_loop;
+
+	/* the queue registers its completion event on the current loop */
+	current_loop = loop;
+
+	err = tapdisk_init_queue(&loop->aio_queue, TAPDISK_TIOCBS,
+				 TIO_DRV_LIO, NULL);
+	if (err)
+		goto out;
+
+	if (pipe(loop->call_pipe)) {
+		err = -errno;
+		loop->call_pipe[0] = loop->call_pipe[1] = -1;
+		goto out;
+	}
+
+	for (i = 0; i < 2; i++) {
+		fcntl(loop->call_pipe[i], F_SETFL, O_NONBLOCK);
+		fcntl(loop->call_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	err = scheduler_register_event(&loop->scheduler,
+				       SCHEDULER_POLL_READ_FD,
+				       loop->call_pipe[0], 0,
+				       tapdisk_loop_call_event, loop);
+	if (err < 0)
+		goto out;
+
+	loop->call_event = err;
+	loop->run        = 1;
+	err              = 0;
+
+out:
+	current_loop = prev;
+	if (err)
+		tapdisk_loop_close(loop);
+	return err;
+}
+
+static void *
+tapdisk_loop_thread(void *arg)
+{
+	tapdisk_loop_t *loop = arg;
+
+	current_loop = loop;
+
+	while (loop->run)
+		tapdisk_loop_iterate(loop);
+
+	return NULL;
 }
 
 static void
-tapdisk_server_close_aio(void)
+tapdisk_loop_stop(void *arg)
 {
-	tapdisk_free_queue(&server.aio_queue);
+	tapdisk_loop_t *loop = arg;
+
+	loop->run = 0;
 }
 
 static void
-tapdisk_server_close(void)
+tapdisk_server_stop_loops(void)
 {
-	tapdisk_server_close_aio();
+	int i;
+	tapdisk_loop_t *loop;
+
+	for (i = 1; i < server.nr_loops; i++) {
+		loop = &server.loops[i];
+		if (!loop->run)
+			continue;
+
+		tapdisk_server_call(loop, tapdisk_loop_stop, loop);
+		pthread_join(loop->thread, NULL);
+		tapdisk_loop_close(loop);
+	}
 }
 
-void
-tapdisk_server_iterate(void)
+static int
+tapdisk_server_start_loops(void)
 {
-	int ret;
+	int i, err = 0;
+	sigset_t set, old;
+	tapdisk_loop_t *loop;
 
-	tapdisk_server_assert_locks();
-	tapdisk_server_set_retry_timeout();
-	tapdisk_server_check_progress();
+	/* signals are handled on the main thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
 
-	ret = scheduler_wait_for_events(&server.scheduler);
-	if (ret < 0)
-		DBG(TLOG_WARN, "server wait returned %d\n", ret);
+	for (i = 1; i < server.nr_loops; i++) {
+		loop = &server.loops[i];
+
+		tapdisk_loop_init(loop, i);
+
+		err = tapdisk_loop_open(loop);
+		if (err) {
+			ERR(err, "loop %d: failed to open", i);
+			break;
+		}
 
-	tapdisk_server_check_vbds();
-	tapdisk_server_submit_tiocbs();
-	tapdisk_server_kick_responses();
+		err = pthread_create(&loop->thread, NULL,
+				     tapdisk_loop_thread, loop);
+		if (err) {
+			err = -err;
+			ERR(err, "loop %d: failed to start", i);
+			tapdisk_loop_close(loop);
+			break;
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err)
+		tapdisk_server_stop_loops();
+
+	return err;
+}
+
+int
+tapdisk_server_set_threads(int threads)
+{
+	if (threads < 1 || threads > TAPDISK_MAX_THREADS)
+		return -EINVAL;
+
+	server.nr_loops = threads;
+	return 0;
+}
+
+int
+tapdisk_server_nr_threads(void)
+{
+	return server.nr_loops;
+}
+
+tapdisk_loop_t *
+tapdisk_server_get_loop(int id)
+{
+	if (id < 0 || id >= server.nr_loops)
+		return NULL;
+
+	return &server.loops[id];
+}
+
+/*
+ * The loop serving the fewest VBDs.
+ */
+tapdisk_loop_t *
+tapdisk_server_pick_loop(void)
+{
+	int i;
+	tapdisk_loop_t *loop;
+
+	loop = &server.loops[0];
+
+	tapdisk_server_lock_vbds();
+	for (i = 1; i < server.nr_loops; i++)
+		if (server.loops[i].nr_vbds < loop->nr_vbds)
+			loop = &server.loops[i];
+	tapdisk_server_unlock_vbds();
+
+	return loop;
+}
+
+static void
+tapdisk_server_close_signals(void)
+{
+	if (server.signal_event != -1) {
+		tapdisk_server_unregister_event(server.signal_event);
+		server.signal_event = -1;
+	}
+
+	if (server.signal_pipe[0] != -1) {
+		close(server.signal_pipe[0]);
+		close(server.signal_pipe[1]);
+		server.signal_pipe[0] = -1;
+		server.signal_pipe[1] = -1;
+	}
+}
+
+static void
+tapdisk_server_close(void)
+{
+	tapdisk_server_close_signals();
+	tapdisk_loop_close(&server.loops[0]);
 }
 
 static void
 __tapdisk_server_run(void)
 {
+	tapdisk_loop_t *loop = &server.loops[0];
+
 	while (server.run)
-		tapdisk_server_iterate();
+		tapdisk_loop_iterate(loop);
 }
 
+/*
+ * Signals are only queued on the signal pipe here, and handled by the
+ * main loop in tapdisk_server_signal_event(): VBDs belong to their
+ * loop's thread, and most of what a signal asks for is not async-signal
+ * safe.
+ */
 static void
 tapdisk_server_signal_handler(int signal)
 {
-	td_vbd_t *vbd, *tmp;
+	int err = errno;
+	char c = signal;
+
+	while (write(server.signal_pipe[1], &c, 1) == -1 && errno == EINTR)
+		;
+
+	errno = err;
+}
+
+static void
+tapdisk_server_signal_event(event_id_t id, char mode, void *private)
+{
+	char sigs[16];
+	int i, n;
 	static int xfsz_error_sent = 0;
 
-	switch (signal) {
-	case SIGBUS:
-	case SIGINT:
-		tapdisk_server_for_each_vbd(vbd, tmp)
-			tapdisk_vbd_close(vbd);
-		break;
-
-	case SIGXFSZ:
-		ERR(EFBIG, "received SIGXFSZ");
-		tapdisk_server_stop_vbds();
-		if (xfsz_error_sent)
-			break;
+	while ((n = read(server.signal_pipe[0], sigs, sizeof(sigs))) > 0)
+		for (i = 0; i < n; i++)
+			switch (sigs[i]) {
+			case SIGBUS:
+			case SIGINT:
+				tapdisk_server_for_each_loop(
+					tapdisk_loop_close_vbds);
+				break;
+
+			case SIGXFSZ:
+				ERR(EFBIG, "received SIGXFSZ");
+				tapdisk_server_for_each_loop(
+					tapdisk_loop_stop_vbds);
+				if (xfsz_error_sent)
+					break;
+
+				xfsz_error_sent = 1;
+				break;
+
+			case SIGUSR1:
+				tapdisk_server_debug();
+				break;
+			}
+}
 
-		xfsz_error_sent = 1;
-		break;
+static int
+tapdisk_server_open_signals(void)
+{
+	int i, err;
 
-	case SIGUSR1:
-		tapdisk_server_debug();
-		break;
+	if (pipe(server.signal_pipe)) {
+		err = -errno;
+		server.signal_pipe[0] = server.signal_pipe[1] = -1;
+		return err;
+	}
+
+	for (i = 0; i < 2; i++) {
+		fcntl(server.signal_pipe[i], F_SETFL, O_NONBLOCK);
+		fcntl(server.signal_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	err = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					    server.signal_pipe[0], 0,
+					    tapdisk_server_signal_event,
+					    NULL);
+	if (err < 0) {
+		tapdisk_server_close_signals();
+		return err;
 	}
+
+	server.signal_event = err;
+
+	signal(SIGBUS, tapdisk_server_signal_handler);
+	signal(SIGINT, tapdisk_server_signal_handler);
+	signal(SIGUSR1, tapdisk_server_signal_handler);
+	signal(SIGXFSZ, tapdisk_server_signal_handler);
+
+	return 0;
 }
 
 int
@@ -282,8 +836,14 @@ tapdisk_server_init(void)
 {
 	memset(&server, 0, sizeof(server));
 	INIT_LIST_HEAD(&server.vbds);
+	pthread_mutex_init(&server.vbds_lock, NULL);
 
-	scheduler_initialize(&server.scheduler);
+	server.signal_pipe[0] = -1;
+	server.signal_pipe[1] = -1;
+	server.signal_event   = -1;
+
+	server.nr_loops = 1;
+	tapdisk_loop_init(&server.loops[0], 0);
 
 	return 0;
 }
@@ -293,17 +853,13 @@ tapdisk_server_complete(void)
 {
 	int err;
 
-	err = tapdisk_server_init_aio();
+	err = tapdisk_loop_open(&server.loops[0]);
 	if (err)
-		goto fail;
+		return err;
 
 	server.run = 1;
 
 	return 0;
-
-fail:
-	tapdisk_server_close_aio();
-	return err;
 }
 
 int
@@ -324,6 +880,10 @@ fail:
 	return err;
 }
 
+/*
+ * Worker loops are started here rather than at init time, since
+ * tapdisk2 daemonizes in between.
+ */
 int
 tapdisk_server_run()
 {
@@ -333,12 +893,17 @@ tapdisk_server_run()
 	if (err)
 		return err;
 
-	signal(SIGBUS, tapdisk_server_signal_handler);
-	signal(SIGINT, tapdisk_server_signal_handler);
-	signal(SIGUSR1, tapdisk_server_signal_handler);
-	signal(SIGXFSZ, tapdisk_server_signal_handler);
+	err = tapdisk_server_open_signals();
+	if (err)
+		return err;
+
+	err = tapdisk_server_start_loops();
+	if (err)
+		return err;
 
 	__tapdisk_server_run();
+
+	tapdisk_server_stop_loops();
 	tapdisk_server_close();
 
 	return 0;
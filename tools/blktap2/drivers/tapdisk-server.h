@@ -28,20 +28,27 @@
 #ifndef _TAPDISK_SERVER_H_
 #define _TAPDISK_SERVER_H_
 
+#include <pthread.h>
+
 #include "list.h"
 #include "tapdisk-vbd.h"
 #include "tapdisk-queue.h"
 
+#define TAPDISK_MAX_THREADS         32
+
 struct tap_disk *tapdisk_server_find_driver_interface(int);
 
 td_image_t *tapdisk_server_get_shared_image(td_image_t *);
 
 struct list_head *tapdisk_server_get_all_vbds(void);
+void tapdisk_server_lock_vbds(void);
+void tapdisk_server_unlock_vbds(void);
 td_vbd_t *tapdisk_server_get_vbd(td_uuid_t);
 void tapdisk_server_add_vbd(td_vbd_t *);
 void tapdisk_server_remove_vbd(td_vbd_t *);
 
 void tapdisk_server_queue_tiocb(struct tiocb *);
+void tapdisk_server_invalidate_io(int, long long, size_t);
 
 void tapdisk_server_check_state(void);
 
@@ -49,6 +56,17 @@ event_id_t tapdisk_server_register_event(char, int, int, event_cb_t, void *);
 void tapdisk_server_unregister_event(event_id_t);
 void tapdisk_server_set_max_timeout(int);
 
+typedef struct tapdisk_loop tapdisk_loop_t;
+typedef void (*tapdisk_loop_fn_t)(void *);
+
+int tapdisk_server_set_threads(int);
+int tapdisk_server_nr_threads(void);
+tapdisk_loop_t *tapdisk_server_get_loop(int);
+tapdisk_loop_t *tapdisk_server_pick_loop(void);
+tapdisk_loop_t *tapdisk_server_get_vbd_loop(td_uuid_t);
+int tapdisk_server_move_vbd(td_vbd_t *, tapdisk_loop_t *);
+int tapdisk_server_call(tapdisk_loop_t *, tapdisk_loop_fn_t, void *);
+
 int tapdisk_server_init(void);
 int tapdisk_server_initialize(void);
 int tapdisk_server_complete(void);
@@ -57,11 +75,48 @@ void tapdisk_server_iterate(void);
 
 #define TAPDISK_TIOCBS              (TAPDISK_DATA_REQUESTS + 50)
 
-typedef struct tapdisk_server {
+struct tapdisk_loop_call {
+	tapdisk_loop_fn_t            fn;
+	void                        *arg;
+	int                          done;
+};
+
+/*
+ * An event loop: a thread with its own scheduler and aio queue, serving
+ * the VBDs attached to it.  Loop 0 is the main thread, which also owns
+ * the control socket; any others are started by tapdisk_server_run().
+ * Everything a VBD does runs on its loop's thread, so drivers need no
+ * locking for per-VBD state.  Drivers whose instances share state say so
+ * with DISK_TYPE_LOOP_UNSAFE, and their VBDs are kept on loop 0.  Other
+ * threads get work done on a loop with tapdisk_server_call().
+ */
+struct tapdisk_loop {
+	int                          id;
 	int                          run;
-	struct list_head             vbds;
+	pthread_t                    thread;
+
 	scheduler_t                  scheduler;
 	struct tqueue                aio_queue;
+	struct list_head             vbds;
+	int                          nr_vbds;
+
+	int                          call_pipe[2];
+	event_id_t                   call_event;
+	pthread_mutex_t              call_lock;
+	pthread_cond_t               call_cond;
+	struct tapdisk_loop_call    *call;
+};
+
+typedef struct tapdisk_server {
+	int                          run;
+	struct list_head             vbds;
+	pthread_mutex_t              vbds_lock;
+
+	int                          signal_pipe[2];
+	event_id_t                   signal_event;
+
+	int                          nr_loops;
+	tapdisk_loop_t               loops[TAPDISK_MAX_THREADS];
 } tapdisk_server_t;
 
 #endif
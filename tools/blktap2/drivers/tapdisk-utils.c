@@ -26,6 +26,7 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -35,6 +36,8 @@
 #include <sys/resource.h>
 #include <sys/utsname.h>
 #ifdef __linux__
+#include <linux/fs.h>
+#include <linux/falloc.h>
 #include <linux/version.h>
 #endif
 
@@ -175,6 +178,74 @@ int tapdisk_linux_version(void)
 }
 
 #endif
+
+/*
+ * word-at-a-time scan; @buf is expected to be sector aligned, as all
+ * request buffers are.
+ */
+int
+tapdisk_buffer_is_zero(const char *buf, size_t size)
+{
+	const unsigned long *p = (const unsigned long *)buf;
+	size_t i, n = size / sizeof(*p);
+
+	for (i = 0; i < n; i++)
+		if (p[i])
+			return 0;
+
+	for (i = n * sizeof(*p); i < size; i++)
+		if (buf[i])
+			return 0;
+
+	return 1;
+}
+
+#ifdef __linux__
+
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12, 119)
+#endif
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE  0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE 0x02
+#endif
+
+/*
+ * deallocate a byte range: punches a hole into regular files and
+ * issues BLKDISCARD on block devices.  the range reads back as zeros
+ * for files; devices may return anything.
+ */
+int
+tapdisk_discard(int fd, uint64_t offset, uint64_t len)
+{
+	struct stat st;
+	int err;
+
+	if (fstat(fd, &st))
+		return -errno;
+
+	if (S_ISBLK(st.st_mode)) {
+		uint64_t range[2] = { offset, len };
+		err = ioctl(fd, BLKDISCARD, range);
+	} else
+		err = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				offset, len);
+
+	return (err ? -errno : 0);
+}
+
+#else
+
+int
+tapdisk_discard(int fd, uint64_t offset, uint64_t len)
+{
+	return -EOPNOTSUPP;
+}
+
+#endif
+
 int read_exact(int fd, void *data, size_t size)
 {
     size_t offset = 0;
@@ -38,6 +38,8 @@ int tapdisk_set_resource_limits(void);
 int tapdisk_namedup(char **, const char *);
 int tapdisk_get_image_size(int, uint64_t *, uint32_t *);
 int tapdisk_linux_version(void);
+int tapdisk_buffer_is_zero(const char *, size_t);
+int tapdisk_discard(int, uint64_t, uint64_t);
 
 int read_exact(int fd, void *data, size_t size); /* EOF => -1, errno=0 */
 int write_exact(int fd, const void *data, size_t size);
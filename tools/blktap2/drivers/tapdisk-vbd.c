@@ -69,6 +69,7 @@
 
 static void tapdisk_vbd_ring_event(event_id_t, char, void *);
 static void tapdisk_vbd_callback(void *, blkif_response_t *);
+static void tapdisk_vbd_qos_event(void *);
 
 /* 
  * initialization
@@ -86,6 +87,7 @@ tapdisk_vbd_free(td_vbd_t *vbd)
 {
 	if (vbd) {
 		tapdisk_vbd_free_stack(vbd);
+		td_qos_free(&vbd->qos);
 		list_del_init(&vbd->next);
 		free(vbd->name);
 		free(vbd);
@@ -123,7 +125,9 @@ tapdisk_vbd_create(uint16_t uuid)
 	INIT_LIST_HEAD(&vbd->failed_requests);
 	INIT_LIST_HEAD(&vbd->completed_requests);
 	INIT_LIST_HEAD(&vbd->next);
+	INIT_LIST_HEAD(&vbd->loop_next);
 	gettimeofday(&vbd->ts, NULL);
+	td_qos_init(&vbd->qos, tapdisk_vbd_qos_event, vbd);
 
 	for (i = 0; i < MAX_REQUESTS; i++)
 		tapdisk_vbd_initialize_vreq(vbd->request_list + i);
@@ -575,7 +579,7 @@ fail:
 	return err;
 }
 
-static int
+int
 tapdisk_vbd_register_event_watches(td_vbd_t *vbd)
 {
 	event_id_t id;
@@ -591,11 +595,12 @@ tapdisk_vbd_register_event_watches(td_vbd_t *vbd)
 	return 0;
 }
 
-static void
+void
 tapdisk_vbd_unregister_events(td_vbd_t *vbd)
 {
 	if (vbd->ring_event_id)
 		tapdisk_server_unregister_event(vbd->ring_event_id);
+	vbd->ring_event_id = 0;
 }
 
 static int
@@ -715,7 +720,7 @@ out:
 	return err;
 }
 
-static void
+void
 tapdisk_vbd_queue_count(td_vbd_t *vbd, int *new,
 			int *pending, int *failed, int *completed)
 {
@@ -824,10 +829,36 @@ tapdisk_vbd_debug(td_vbd_t *vbd)
 	    vbd->errors, vbd->retries,
 	    vbd->received, vbd->returned, vbd->kicked);
 
+	if (vbd->qos.throttled || vbd->qos.params.latency_target)
+		DBG(TLOG_WARN, "%s: qos: iops: %"PRIu64", bps: %"PRIu64", "
+		    "cap: %"PRIu64", throttled: %"PRIu64", p99: %uus\n",
+		    vbd->name, vbd->qos.params.iops, vbd->qos.params.bps,
+		    vbd->qos.cap.rate, vbd->qos.throttled, vbd->qos.p99);
+
 	tapdisk_vbd_for_each_image(vbd, image, tmp)
 		td_debug(image);
 }
 
+int
+tapdisk_vbd_set_qos(td_vbd_t *vbd, const td_qos_params_t *params)
+{
+	int err;
+
+	err = td_qos_set(&vbd->qos, params);
+	if (err)
+		return err;
+
+	DPRINTF("%s: qos: iops %"PRIu64", bps %"PRIu64", priority %d, "
+		"latency target %uus\n", vbd->name, params->iops,
+		params->bps, params->priority, params->latency_target);
+
+	/* limits may have been lifted */
+	if (!list_empty(&vbd->new_requests))
+		tapdisk_vbd_issue_requests(vbd);
+
+	return 0;
+}
+
 static void
 tapdisk_vbd_drop_log(td_vbd_t *vbd)
 {
@@ -1071,6 +1102,9 @@ tapdisk_vbd_make_response(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	if (rsp->status != BLKIF_RSP_OKAY)
 		ERR(EIO, "returning BLKIF_RSP %d", rsp->status);
 
+	if (vreq->issued.tv_sec)
+		td_qos_complete(&vbd->qos, &vreq->issued);
+
 	vbd->returned++;
 	vbd->callback(vbd->argument, rsp);
 }
@@ -1211,7 +1245,8 @@ __tapdisk_vbd_complete_td_request(td_vbd_t *vbd, td_vbd_request_t *vreq,
 			vbd->errors++;
 			ERR(err, "req %"PRIu64": %s 0x%04x secs to "
 			    "0x%08"PRIx64, vreq->req.id,
-			    (treq.op == TD_OP_WRITE ? "write" : "read"),
+			    (treq.op == TD_OP_WRITE ? "write" :
+			     treq.op == TD_OP_DISCARD ? "discard" : "read"),
 			    treq.secs, treq.sec);
 		}
 	} else {
@@ -1247,6 +1282,15 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 
 	vreq->submitting++;
 
+	/*
+	 * discards only deallocate in the image they were queued to:
+	 * there is nothing to do for ranges the leaf does not own.
+	 */
+	if (treq.op == TD_OP_DISCARD) {
+		td_complete_request(treq, 0);
+		goto done;
+	}
+
 	if (tapdisk_vbd_is_last_image(vbd, image)) {
 		memset(treq.buf, 0, treq.secs << SECTOR_SHIFT);
 		td_complete_request(treq, 0);
@@ -1352,6 +1396,49 @@ tapdisk_vbd_complete_td_request(td_request_t treq, int res)
 	__tapdisk_vbd_complete_td_request(vbd, vreq, treq, res);
 }
 
+/*
+ * discard ranges may span the whole disk: split them into chunks
+ * which fit a td_request_t and which drivers can handle in one go.
+ */
+#define TD_DISCARD_MAX_SECS          (1 << 21)
+
+static void
+tapdisk_vbd_issue_discard(td_vbd_t *vbd, td_vbd_request_t *vreq)
+{
+	td_image_t *image;
+	td_request_t treq;
+	uint64_t sec, end;
+	blkif_request_discard_t *req;
+
+	req   = (blkif_request_discard_t *)&vreq->req;
+	image = tapdisk_vbd_first_image(vbd);
+	sec   = req->sector_number;
+	end   = req->sector_number + req->nr_sectors;
+
+	while (sec < end) {
+		memset(&treq, 0, sizeof(treq));
+
+		treq.op             = TD_OP_DISCARD;
+		treq.id             = req->id;
+		treq.sec            = sec;
+		treq.secs           = (end - sec > TD_DISCARD_MAX_SECS ?
+				       TD_DISCARD_MAX_SECS : end - sec);
+		treq.image          = image;
+		treq.cb             = tapdisk_vbd_complete_td_request;
+		treq.private        = vreq;
+
+		DBG(TLOG_DBG, "%s: req %d discard sec 0x%08"PRIx64" "
+		    "secs 0x%04x\n", image->name, (int)treq.id,
+		    treq.sec, treq.secs);
+
+		vreq->secs_pending += treq.secs;
+		vbd->secs_pending  += treq.secs;
+		sec                += treq.secs;
+
+		td_queue_discard(image, treq);
+	}
+}
+
 static int
 tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 {
@@ -1384,6 +1471,12 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 	if (err)
 		goto fail;
 
+	if (req->operation == BLKIF_OP_DISCARD) {
+		tapdisk_vbd_issue_discard(vbd, vreq);
+		err = 0;
+		goto out;
+	}
+
 	for (i = 0; i < req->nr_segments; i++) {
 		nsects = req->seg[i].last_sect - req->seg[i].first_sect + 1;
 		page   = (char *)MMAP_VADDR(ring->vstart, 
@@ -1498,6 +1591,26 @@ tapdisk_vbd_reissue_failed_requests(td_vbd_t *vbd)
 	return err;
 }
 
+static uint64_t
+tapdisk_vbd_request_bytes(td_vbd_request_t *vreq)
+{
+	blkif_request_t *req = &vreq->req;
+	uint64_t secs;
+	int i;
+
+	if (req->operation == BLKIF_OP_DISCARD)
+		return 0;
+
+	for (i = 0, secs = 0; i < req->nr_segments; i++)
+		secs += req->seg[i].last_sect - req->seg[i].first_sect + 1;
+
+	return secs << SECTOR_SHIFT;
+}
+
+/*
+ * New requests wait here for the vbd's qos budget; retries of failed
+ * requests were charged the first time round.
+ */
 static int
 tapdisk_vbd_issue_new_requests(td_vbd_t *vbd)
 {
@@ -1505,6 +1618,10 @@ tapdisk_vbd_issue_new_requests(td_vbd_t *vbd)
 	td_vbd_request_t *vreq, *tmp;
 
 	tapdisk_vbd_for_each_request(vreq, tmp, &vbd->new_requests) {
+		if (td_qos_admit(&vbd->qos, tapdisk_vbd_request_bytes(vreq)))
+			return 0;
+
+		gettimeofday(&vreq->issued, NULL);
 		err = tapdisk_vbd_issue_request(vbd, vreq);
 		if (err)
 			return err;
@@ -1702,6 +1819,14 @@ tapdisk_vbd_check_ring_message(td_vbd_t *vbd)
 	}
 }
 
+static void
+tapdisk_vbd_qos_event(void *private)
+{
+	td_vbd_t *vbd = private;
+
+	tapdisk_vbd_issue_requests(vbd);
+}
+
 static void
 tapdisk_vbd_ring_event(event_id_t id, char mode, void *private)
 {
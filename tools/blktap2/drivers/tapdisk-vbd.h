@@ -34,6 +34,7 @@
 
 #include "tapdisk.h"
 #include "scheduler.h"
+#include "tapdisk-qos.h"
 #include "tapdisk-image.h"
 
 #define TD_VBD_MAX_RETRIES          100
@@ -56,6 +57,8 @@ typedef struct td_vbd_driver_info   td_vbd_driver_info_t;
 typedef struct td_vbd_handle        td_vbd_t;
 typedef void (*td_vbd_cb_t)        (void *, blkif_response_t *);
 
+struct tapdisk_loop;
+
 struct td_ring {
 	int                         fd;
 	char                       *mem;
@@ -71,9 +74,10 @@ struct td_vbd_request {
 	int                         error;
 	int                         blocked; /* blocked on a dependency */
 	int                         submitting;
-	int                         secs_pending;
+	int64_t                     secs_pending;
 	int                         num_retries;
 	struct timeval              last_try;
+	struct timeval              issued;  /* first try, for latency */
 
 	td_vbd_t                   *vbd;
 	struct list_head            next;
@@ -117,8 +121,14 @@ struct td_vbd_handle {
 
 	struct list_head            next;
 
+	/* the event loop serving this vbd, see tapdisk-server.h */
+	struct tapdisk_loop        *loop;
+	struct list_head            loop_next;
+
 	struct timeval              ts;
 
+	td_qos_t                    qos;
+
 	uint64_t                    received;
 	uint64_t                    returned;
 	uint64_t                    kicked;
@@ -185,6 +195,8 @@ void tapdisk_vbd_close_vdi(td_vbd_t *);
 
 int tapdisk_vbd_attach(td_vbd_t *, const char *, int);
 void tapdisk_vbd_detach(td_vbd_t *);
+int tapdisk_vbd_register_event_watches(td_vbd_t *);
+void tapdisk_vbd_unregister_events(td_vbd_t *);
 
 void tapdisk_vbd_forward_request(td_request_t);
 
@@ -201,6 +213,8 @@ int tapdisk_vbd_kick(td_vbd_t *);
 void tapdisk_vbd_check_state(td_vbd_t *);
 void tapdisk_vbd_check_progress(td_vbd_t *);
 void tapdisk_vbd_debug(td_vbd_t *);
+void tapdisk_vbd_queue_count(td_vbd_t *, int *, int *, int *, int *);
+int tapdisk_vbd_set_qos(td_vbd_t *, const td_qos_params_t *);
 
 void tapdisk_vbd_complete_vbd_request(td_vbd_t *, td_vbd_request_t *);
 
@@ -85,6 +85,7 @@
 
 #define TD_OP_READ                   0
 #define TD_OP_WRITE                  1
+#define TD_OP_DISCARD                2
 
 #define TD_OPEN_QUIET                0x00001
 #define TD_OPEN_QUERY                0x00002
@@ -94,6 +95,7 @@
 #define TD_OPEN_ADD_CACHE            0x00020
 #define TD_OPEN_VHD_INDEX            0x00040
 #define TD_OPEN_LOG_DIRTY            0x00080
+#define TD_OPEN_ZERO_DETECT          0x00100
 
 #define TD_CREATE_SPARSE             0x00001
 #define TD_CREATE_MULTITYPE          0x00002
@@ -164,6 +166,9 @@ struct tap_disk {
 	void (*td_queue_read)        (td_driver_t *, td_request_t);
 	void (*td_queue_write)       (td_driver_t *, td_request_t);
 	void (*td_debug)             (td_driver_t *);
+
+	/* optional: drivers which cannot deallocate leave this NULL */
+	void (*td_queue_discard)     (td_driver_t *, td_request_t);
 };
 
 #endif
@@ -42,24 +42,32 @@
 static void
 usage(const char *app, int err)
 {
-	fprintf(stderr, "usage: %s [-D] <-u uuid> <-c control socket>\n", app);
+	fprintf(stderr, "usage: %s [-D] [-t threads] <-u uuid> "
+		"<-c control socket>\n", app);
 	exit(err);
 }
 
 int
 main(int argc, char *argv[])
 {
-	char *control;
-	int c, err, nodaemon;
+	char *control, *env;
+	int c, err, nodaemon, threads;
 
 	control  = NULL;
 	nodaemon = 0;
 
-	while ((c = getopt(argc, argv, "s:Dh")) != -1) {
+	/* tap-ctl spawns tapdisk2 without arguments */
+	env     = getenv("TAPDISK2_THREADS");
+	threads = env ? atoi(env) : 1;
+
+	while ((c = getopt(argc, argv, "s:t:Dh")) != -1) {
 		switch (c) {
 		case 'D':
 			nodaemon = 1;
 			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
 		case 'h':
 			usage(argv[0], 0);
 			break;
@@ -93,6 +101,12 @@ main(int argc, char *argv[])
 		goto out;
 	}
 
+	err = tapdisk_server_set_threads(threads);
+	if (err) {
+		DPRINTF("bad number of threads %d: %d\n", threads, err);
+		goto out;
+	}
+
 	if (!nodaemon) {
 		err = daemon(0, 1);
 		if (err) {
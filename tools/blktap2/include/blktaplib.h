@@ -235,6 +235,7 @@ typedef struct msg_lock {
 static char *blkif_op_name[] = {
 	[BLKIF_OP_READ]       = "READ",
 	[BLKIF_OP_WRITE]      = "WRITE",
+	[BLKIF_OP_DISCARD]    = "DISCARD",
 };
 
 #endif /* __COMPILING_BLKTAP_LIB */
@@ -41,6 +41,20 @@
 #define TAPDISK_MESSAGE_FLAG_ADD_CACHE   0x04
 #define TAPDISK_MESSAGE_FLAG_VHD_INDEX   0x08
 #define TAPDISK_MESSAGE_FLAG_LOG_DIRTY   0x10
+#define TAPDISK_MESSAGE_FLAG_THREAD      0x20
+#define TAPDISK_MESSAGE_FLAG_ZERO_DETECT 0x40
+
+/* tapdisk_message_image.info, above the driver's VDISK_* bits */
+#define TAPDISK_MESSAGE_IMAGE_DISCARD    0x10000
+
+/* tapdisk_message_qos.flags: the fields to change */
+#define TAPDISK_MESSAGE_QOS_IOPS         0x01
+#define TAPDISK_MESSAGE_QOS_BPS          0x02
+#define TAPDISK_MESSAGE_QOS_PRIORITY     0x04
+#define TAPDISK_MESSAGE_QOS_LATENCY      0x08
+
+/* latency histogram: bucket i counts [2^i, 2^(i+1)) usecs */
+#define TAPDISK_MESSAGE_STATS_BUCKETS    20
 
 typedef struct tapdisk_message           tapdisk_message_t;
 typedef uint8_t                          tapdisk_message_flag_t;
@@ -50,6 +64,9 @@ typedef struct tapdisk_message_string    tapdisk_message_string_t;
 typedef struct tapdisk_message_response  tapdisk_message_response_t;
 typedef struct tapdisk_message_minors    tapdisk_message_minors_t;
 typedef struct tapdisk_message_list      tapdisk_message_list_t;
+typedef struct tapdisk_message_qos       tapdisk_message_qos_t;
+typedef struct tapdisk_message_stats     tapdisk_message_stats_t;
+typedef struct tapdisk_message_coalesce  tapdisk_message_coalesce_t;
 
 struct tapdisk_message_params {
 	tapdisk_message_flag_t           flags;
@@ -59,6 +76,7 @@ struct tapdisk_message_params {
 	uint32_t                         domid;
 	uint16_t                         path_len;
 	char                             path[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
+	uint16_t                         thread; /* with FLAG_THREAD */
 };
 
 struct tapdisk_message_image {
@@ -88,6 +106,31 @@ struct tapdisk_message_list {
 	char                             path[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
 };
 
+struct tapdisk_message_qos {
+	uint32_t                         flags;
+	int32_t                          priority;
+	uint64_t                         iops;
+	uint64_t                         bps;
+	uint32_t                         latency_target; /* usecs */
+};
+
+struct tapdisk_message_stats {
+	tapdisk_message_qos_t            qos;
+	uint64_t                         cap;       /* adaptive iops cap */
+	uint64_t                         throttled;
+	uint32_t                         queued;
+	uint32_t                         inflight;
+	uint32_t                         p50;       /* usecs */
+	uint32_t                         p99;
+	uint64_t                         hist[TAPDISK_MESSAGE_STATS_BUCKETS];
+};
+
+struct tapdisk_message_coalesce {
+	uint32_t                         threads;   /* 0 for default */
+	uint64_t                         bandwidth; /* bytes/s; 0 for no cap */
+	char                             path[TAPDISK_MESSAGE_MAX_PATH_LENGTH];
+};
+
 struct tapdisk_message {
 	uint16_t                         type;
 	uint16_t                         cookie;
@@ -100,6 +143,9 @@ struct tapdisk_message {
 		tapdisk_message_minors_t minors;
 		tapdisk_message_response_t response;
 		tapdisk_message_list_t   list;
+		tapdisk_message_qos_t    qos;
+		tapdisk_message_stats_t  stats;
+		tapdisk_message_coalesce_t coalesce;
 	} u;
 };
 
@@ -126,6 +172,12 @@ enum tapdisk_message_id {
 	TAPDISK_MESSAGE_LIST_RSP,
 	TAPDISK_MESSAGE_FORCE_SHUTDOWN,
 	TAPDISK_MESSAGE_EXIT,
+	TAPDISK_MESSAGE_QOS,
+	TAPDISK_MESSAGE_QOS_RSP,
+	TAPDISK_MESSAGE_STATS,
+	TAPDISK_MESSAGE_STATS_RSP,
+	TAPDISK_MESSAGE_COALESCE,
+	TAPDISK_MESSAGE_COALESCE_RSP,
 };
 
 static inline char *
@@ -195,6 +247,24 @@ tapdisk_message_name(enum tapdisk_message_id id)
 	case TAPDISK_MESSAGE_EXIT:
 		return "exit";
 
+	case TAPDISK_MESSAGE_QOS:
+		return "qos";
+
+	case TAPDISK_MESSAGE_QOS_RSP:
+		return "qos response";
+
+	case TAPDISK_MESSAGE_STATS:
+		return "stats";
+
+	case TAPDISK_MESSAGE_STATS_RSP:
+		return "stats response";
+
+	case TAPDISK_MESSAGE_COALESCE:
+		return "coalesce";
+
+	case TAPDISK_MESSAGE_COALESCE_RSP:
+		return "coalesce response";
+
 	default:
 		return "unknown";
 	}
@@ -27,6 +27,8 @@
 #ifndef _VHD_UTIL_H_
 #define _VHD_UTIL_H_
 
+#include <inttypes.h>
+
 int vhd_util_create(int argc, char **argv);
 int vhd_util_snapshot(int argc, char **argv);
 int vhd_util_query(int argc, char **argv);
@@ -41,4 +43,16 @@ int vhd_util_scan(int argc, char **argv);
 int vhd_util_check(int argc, char **argv);
 int vhd_util_revert(int argc, char **argv);
 
+typedef void (*vhd_coalesce_progress_t)(uint64_t done, uint64_t total,
+					void *arg);
+
+typedef struct vhd_coalesce_opts {
+	int                        threads;    /* readers; 0 for default */
+	uint64_t                   bandwidth;  /* bytes/s; 0 for no cap */
+	vhd_coalesce_progress_t    progress;   /* per block; may be NULL */
+	void                      *arg;
+} vhd_coalesce_opts_t;
+
+int vhd_coalesce(const char *name, const vhd_coalesce_opts_t *opts);
+
 #endif
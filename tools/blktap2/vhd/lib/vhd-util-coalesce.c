@@ -28,9 +28,46 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #include "libvhd.h"
+#include "vhd-util.h"
+
+#define VHD_COALESCE_THREADS      4
+#define VHD_COALESCE_MAX_THREADS  64
+
+/*
+ * Reader threads, each with its own handle on the child, fill a ring of
+ * slots with allocated child blocks; the caller's thread writes them to
+ * the parent in block order, so the parent is laid out as before.
+ */
+struct vhd_coalesce_slot {
+	uint32_t                  block;
+	char                     *buf;
+	char                     *map;       /* NULL if the block is full */
+	int                       err;
+	int                       ready;
+};
+
+struct vhd_coalesce {
+	const char               *name;
+	const vhd_coalesce_opts_t *opts;
+
+	uint32_t                 *blocks;    /* allocated in the child */
+	uint64_t                  nr_blocks;
+	uint64_t                  next;      /* next to read */
+	uint64_t                  written;   /* written to the parent */
+
+	int                       depth;
+	struct vhd_coalesce_slot *slots;
+
+	pthread_mutex_t           lock;
+	pthread_cond_t            cond;
+	int                       err;
+};
 
 static int
 __raw_io_write(int fd, char* buf, uint64_t sec, uint32_t secs)
@@ -55,106 +92,316 @@ __raw_io_write(int fd, char* buf, uint64_t sec, uint32_t secs)
 	return (errno ? -errno : -EIO);
 }
 
+static int
+vhd_util_coalesce_write(vhd_context_t *parent, int parent_fd,
+			char *buf, uint64_t sec, uint32_t secs)
+{
+	if (parent->file)
+		return vhd_io_write(parent, buf, sec, secs);
+
+	return __raw_io_write(parent_fd, buf, sec, secs);
+}
+
 /*
  * Use 'parent' if the parent is VHD, and 'parent_fd' if the parent is raw
  */
 static int
 vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
-		int parent_fd, uint64_t block)
+		int parent_fd, struct vhd_coalesce_slot *slot)
 {
 	int i, err;
-	char *buf, *map;
 	uint64_t sec, secs;
 
-	buf = NULL;
-	map = NULL;
-	sec = block * vhd->spb;
+	sec = (uint64_t)slot->block * vhd->spb;
+
+	if (!slot->map)
+		return vhd_util_coalesce_write(parent, parent_fd,
+					       slot->buf, sec, vhd->spb);
+
+	for (i = 0; i < vhd->spb; i++) {
+		if (!vhd_bitmap_test(vhd, slot->map, i))
+			continue;
+
+		for (secs = 0; i + secs < vhd->spb; secs++)
+			if (!vhd_bitmap_test(vhd, slot->map, i + secs))
+				break;
+
+		err = vhd_util_coalesce_write(parent, parent_fd,
+					      slot->buf +
+					      vhd_sectors_to_bytes(i),
+					      sec + i, secs);
+		if (err)
+			return err;
+
+		i += secs;
+	}
+
+	return 0;
+}
+
+static int
+vhd_util_coalesce_read(vhd_context_t *vhd, struct vhd_coalesce_slot *slot)
+{
+	int err;
 
-	if (vhd->bat.bat[block] == DD_BLK_UNUSED)
+	free(slot->map);
+	slot->map = NULL;
+
+	err = vhd_io_read(vhd, slot->buf,
+			  (uint64_t)slot->block * vhd->spb, vhd->spb);
+	if (err)
+		return err;
+
+	if (vhd_has_batmap(vhd) &&
+	    vhd_batmap_test(vhd, &vhd->batmap, slot->block))
 		return 0;
 
-	err = posix_memalign((void **)&buf, 4096, vhd->header.block_size);
+	return vhd_read_bitmap(vhd, slot->block, &slot->map);
+}
+
+static int
+vhd_coalesce_open_child(vhd_context_t *vhd, const char *name)
+{
+	int err;
+
+	err = vhd_open(vhd, name, VHD_OPEN_RDONLY);
 	if (err)
-		return -err;
+		return err;
 
-	err = vhd_io_read(vhd, buf, sec, vhd->spb);
+	err = vhd_get_bat(vhd);
 	if (err)
-		goto done;
-
-	if (vhd_has_batmap(vhd) && vhd_batmap_test(vhd, &vhd->batmap, block)) {
-		if (parent->file)
-			err = vhd_io_write(parent, buf, sec, vhd->spb);
-		else
-			err = __raw_io_write(parent_fd, buf, sec, vhd->spb);
-		goto done;
+		goto fail;
+
+	if (vhd_has_batmap(vhd)) {
+		err = vhd_get_batmap(vhd);
+		if (err)
+			goto fail;
 	}
 
-	err = vhd_read_bitmap(vhd, block, &map);
-	if (err)
-		goto done;
+	return 0;
 
-	for (i = 0; i < vhd->spb; i++) {
-		if (!vhd_bitmap_test(vhd, map, i))
-			continue;
+fail:
+	vhd_close(vhd);
+	return err;
+}
 
-		for (secs = 0; i + secs < vhd->spb; secs++)
-			if (!vhd_bitmap_test(vhd, map, i + secs))
-				break;
+static void *
+vhd_coalesce_reader(void *arg)
+{
+	int err;
+	uint64_t n;
+	vhd_context_t vhd;
+	struct vhd_coalesce_slot *slot;
+	struct vhd_coalesce *c = arg;
+
+	err = vhd_coalesce_open_child(&vhd, c->name);
+	if (err) {
+		pthread_mutex_lock(&c->lock);
+		c->err = (c->err ? c->err : err);
+		pthread_cond_broadcast(&c->cond);
+		pthread_mutex_unlock(&c->lock);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&c->lock);
+
+	for (;;) {
+		while (!c->err && c->next < c->nr_blocks &&
+		       c->next - c->written >= c->depth)
+			pthread_cond_wait(&c->cond, &c->lock);
+
+		if (c->err || c->next >= c->nr_blocks)
+			break;
+
+		n    = c->next++;
+		slot = c->slots + (n % c->depth);
+		pthread_mutex_unlock(&c->lock);
+
+		slot->block = c->blocks[n];
+		err = vhd_util_coalesce_read(&vhd, slot);
+
+		pthread_mutex_lock(&c->lock);
+		slot->err   = err;
+		slot->ready = 1;
+		pthread_cond_broadcast(&c->cond);
+	}
+
+	pthread_mutex_unlock(&c->lock);
+	vhd_close(&vhd);
+	return NULL;
+}
+
+static inline uint64_t
+vhd_coalesce_now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ * sleep off any lead over the bandwidth cap
+ */
+static void
+vhd_coalesce_throttle(const vhd_coalesce_opts_t *opts,
+		      uint64_t start, uint64_t bytes)
+{
+	uint64_t due, now;
+
+	if (!opts->bandwidth)
+		return;
+
+	due = start + bytes * 1000000 / opts->bandwidth;
+	now = vhd_coalesce_now_us();
+	if (due > now)
+		usleep(due - now);
+}
+
+static int
+vhd_coalesce_write_blocks(struct vhd_coalesce *c, vhd_context_t *vhd,
+			  vhd_context_t *parent, int parent_fd)
+{
+	int err;
+	uint64_t i, start, bytes;
+	struct vhd_coalesce_slot *slot;
+	const vhd_coalesce_opts_t *opts = c->opts;
+
+	err   = 0;
+	bytes = 0;
+	start = vhd_coalesce_now_us();
+
+	for (i = 0; i < c->nr_blocks; i++) {
+		slot = c->slots + (i % c->depth);
+
+		pthread_mutex_lock(&c->lock);
+		while (!slot->ready && !c->err)
+			pthread_cond_wait(&c->cond, &c->lock);
+		err = (c->err ? c->err : slot->err);
+		pthread_mutex_unlock(&c->lock);
 
-		if (parent->file)
-			err = vhd_io_write(parent,
-					   buf + vhd_sectors_to_bytes(i),
-					   sec + i, secs);
-		else
-			err = __raw_io_write(parent_fd,
-					     buf + vhd_sectors_to_bytes(i),
-					     sec + i, secs);
 		if (err)
-			goto done;
+			break;
 
-		i += secs;
+		err = vhd_util_coalesce_block(vhd, parent, parent_fd, slot);
+		if (err)
+			break;
+
+		bytes += vhd->header.block_size;
+		vhd_coalesce_throttle(opts, start, bytes);
+
+		pthread_mutex_lock(&c->lock);
+		slot->ready = 0;
+		c->written++;
+		pthread_cond_broadcast(&c->cond);
+		pthread_mutex_unlock(&c->lock);
+
+		if (opts->progress)
+			opts->progress(i + 1, c->nr_blocks, opts->arg);
 	}
 
-	err = 0;
+	pthread_mutex_lock(&c->lock);
+	c->err = (c->err ? c->err : err);
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->lock);
 
-done:
-	free(buf);
-	free(map);
 	return err;
 }
 
-int
-vhd_util_coalesce(int argc, char **argv)
+static int
+vhd_coalesce_copy(const char *name, vhd_context_t *vhd,
+		  vhd_context_t *parent, int parent_fd,
+		  const vhd_coalesce_opts_t *opts)
 {
-	int err, c;
-	uint64_t i;
-	char *name, *pname;
-	vhd_context_t vhd, parent;
-	int parent_fd = -1;
+	int i, err, threads, started;
+	uint64_t b;
+	pthread_t tids[VHD_COALESCE_MAX_THREADS];
+	struct vhd_coalesce c;
+
+	memset(&c, 0, sizeof(c));
+	c.name = name;
+	c.opts = opts;
+
+	threads = (opts->threads > 0 ? opts->threads : VHD_COALESCE_THREADS);
+	threads = (threads > VHD_COALESCE_MAX_THREADS ?
+		   VHD_COALESCE_MAX_THREADS : threads);
+	c.depth = threads * 2;
+
+	c.blocks = malloc(vhd->bat.entries * sizeof(uint32_t));
+	c.slots  = calloc(c.depth, sizeof(struct vhd_coalesce_slot));
+	if (!c.blocks || !c.slots) {
+		err = -ENOMEM;
+		goto out;
+	}
 
-	name  = NULL;
-	pname = NULL;
-	parent.file = NULL;
+	for (b = 0; b < vhd->bat.entries; b++)
+		if (vhd->bat.bat[b] != DD_BLK_UNUSED)
+			c.blocks[c.nr_blocks++] = b;
 
-	if (!argc || !argv)
-		goto usage;
+	for (i = 0; i < c.depth; i++) {
+		err = posix_memalign((void **)&c.slots[i].buf, 4096,
+				     vhd->header.block_size);
+		if (err) {
+			c.slots[i].buf = NULL;
+			err = -err;
+			goto out;
+		}
+	}
 
-	optind = 0;
-	while ((c = getopt(argc, argv, "n:h")) != -1) {
-		switch (c) {
-		case 'n':
-			name = optarg;
+	if (opts->progress)
+		opts->progress(0, c.nr_blocks, opts->arg);
+
+	pthread_mutex_init(&c.lock, NULL);
+	pthread_cond_init(&c.cond, NULL);
+
+	for (started = 0; started < threads; started++) {
+		err = pthread_create(&tids[started], NULL,
+				     vhd_coalesce_reader, &c);
+		if (err) {
+			c.err = -err;
 			break;
-		case 'h':
-		default:
-			goto usage;
 		}
 	}
 
-	if (!name || optind != argc)
-		goto usage;
+	if (started)
+		err = vhd_coalesce_write_blocks(&c, vhd, parent, parent_fd);
+
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
 
-	err = vhd_open(&vhd, name, VHD_OPEN_RDONLY);
+	err = (c.err ? c.err : err);
+
+	pthread_cond_destroy(&c.cond);
+	pthread_mutex_destroy(&c.lock);
+
+out:
+	if (c.slots)
+		for (i = 0; i < c.depth; i++) {
+			free(c.slots[i].buf);
+			free(c.slots[i].map);
+		}
+	free(c.slots);
+	free(c.blocks);
+	return err;
+}
+
+/*
+ * Copies the data of child 'name' into its parent.  Only sectors the
+ * child holds are written, so the chain reads the same throughout and
+ * this may run while the child is attached to a tapdisk.
+ */
+int
+vhd_coalesce(const char *name, const vhd_coalesce_opts_t *opts)
+{
+	int err;
+	char *pname;
+	vhd_context_t vhd, parent;
+	int parent_fd = -1;
+
+	pname = NULL;
+	parent.file = NULL;
+
+	err = vhd_coalesce_open_child(&vhd, name);
 	if (err) {
 		printf("error opening %s: %d\n", name, err);
 		return err;
@@ -172,6 +419,7 @@ vhd_util_coalesce(int argc, char **argv)
 		if (parent_fd == -1) {
 			err = -errno;
 			printf("failed to open parent %s: %d\n", pname, err);
+			free(pname);
 			vhd_close(&vhd);
 			return err;
 		}
@@ -185,25 +433,8 @@ vhd_util_coalesce(int argc, char **argv)
 		}
 	}
 
-	err = vhd_get_bat(&vhd);
-	if (err)
-		goto done;
-
-	if (vhd_has_batmap(&vhd)) {
-		err = vhd_get_batmap(&vhd);
-		if (err)
-			goto done;
-	}
+	err = vhd_coalesce_copy(name, &vhd, &parent, parent_fd, opts);
 
-	for (i = 0; i < vhd.bat.entries; i++) {
-		err = vhd_util_coalesce_block(&vhd, &parent, parent_fd, i);
-		if (err)
-			goto done;
-	}
-
-	err = 0;
-
- done:
 	free(pname);
 	vhd_close(&vhd);
 	if (parent.file)
@@ -211,8 +442,66 @@ vhd_util_coalesce(int argc, char **argv)
 	else
 		close(parent_fd);
 	return err;
+}
+
+static void
+vhd_util_coalesce_progress(uint64_t done, uint64_t total, void *arg)
+{
+	int *last = arg;
+	int pct   = (total ? done * 100 / total : 100);
+
+	if (pct == *last)
+		return;
+
+	*last = pct;
+	printf("coalesce: %3d%% (%"PRIu64"/%"PRIu64" blocks)\n",
+	       pct, done, total);
+	fflush(stdout);
+}
+
+int
+vhd_util_coalesce(int argc, char **argv)
+{
+	int c, last;
+	char *name;
+	vhd_coalesce_opts_t opts;
+
+	name = NULL;
+	last = -1;
+	memset(&opts, 0, sizeof(opts));
+
+	if (!argc || !argv)
+		goto usage;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "n:t:b:ph")) != -1) {
+		switch (c) {
+		case 'n':
+			name = optarg;
+			break;
+		case 't':
+			opts.threads = atoi(optarg);
+			break;
+		case 'b':
+			opts.bandwidth = strtoull(optarg, NULL, 10) << 20;
+			break;
+		case 'p':
+			opts.progress = vhd_util_coalesce_progress;
+			opts.arg      = &last;
+			break;
+		case 'h':
+		default:
+			goto usage;
+		}
+	}
+
+	if (!name || optind != argc || opts.threads < 0)
+		goto usage;
+
+	return vhd_coalesce(name, &opts);
 
 usage:
-	printf("options: <-n name> [-h help]\n");
+	printf("options: <-n name> [-t reader threads] "
+	       "[-b bandwidth cap in MB/s] [-p print progress] [-h help]\n");
 	return -EINVAL;
 }
@@ -36,15 +36,20 @@
  * want to use superpages.
  */
 
+#include <inttypes.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/stat.h>
 
 #include "xg_private.h"
 #include "xg_save_restore.h"
+#include "xc_bitops.h"
 #include "xc_dom.h"
 
 #include <xen/hvm/ioreq.h>
 #include <xen/hvm/params.h>
+#include <xen/mem_event.h>
 
 struct restore_ctx {
     unsigned long max_mfn; /* max mfn of the current host machine */
@@ -60,6 +65,8 @@ struct restore_ctx {
     int completed; /* Set when a consistent image is available */
     int last_checkpoint; /* Set when we should commit to the current checkpoint when it completes. */
     int compressing; /* Set when sender signals that pages would be sent compressed (for Remus) */
+    unsigned long *lazy; /* Pages still to come in the lazy phase */
+    unsigned long nr_lazy;
     struct domain_info_context dinfo;
 };
 
@@ -726,6 +733,11 @@ typedef struct {
 
     /* Types of the pfns in the current region */
     unsigned long* pfn_types;
+    /* Where the data for each of them is in pages, or XC_PAGE_REF_ZERO */
+    uint32_t *page_refs;
+    /* XC_SAVE_ID_PAGE_REFS for the next batch, if nr_batch_refs */
+    uint32_t *batch_refs;
+    unsigned int nr_batch_refs;
 
     int verify;
 
@@ -765,6 +777,10 @@ static void pagebuf_free(pagebuf_t* buf)
         free(buf->pfn_types);
         buf->pfn_types = NULL;
     }
+    free(buf->page_refs);
+    buf->page_refs = NULL;
+    free(buf->batch_refs);
+    buf->batch_refs = NULL;
 }
 
 static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
@@ -972,6 +988,32 @@ static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
         }
         return compbuf_size;
 
+    case XC_SAVE_ID_PAGE_REFS:
+        if ( RDEXACT(fd, &buf->nr_batch_refs, sizeof(uint32_t)) )
+        {
+            PERROR("Error when reading page refs count");
+            return -1;
+        }
+        if ( !buf->nr_batch_refs || buf->nr_batch_refs > MAX_BATCH_SIZE )
+        {
+            ERROR("Bad page refs count (%u)", buf->nr_batch_refs);
+            errno = EMSGSIZE;
+            return -1;
+        }
+        if ( !buf->batch_refs &&
+             !(buf->batch_refs = malloc(MAX_BATCH_SIZE * sizeof(uint32_t))) )
+        {
+            ERROR("Could not allocate page refs buffer");
+            return -1;
+        }
+        if ( RDEXACT(fd, buf->batch_refs,
+                     buf->nr_batch_refs * sizeof(uint32_t)) )
+        {
+            PERROR("Error when reading page refs");
+            return -1;
+        }
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
     case XC_SAVE_ID_HVM_GENERATION_ID_ADDR:
         /* Skip padding 4 bytes then read the generation id buffer location. */
         if ( RDEXACT(fd, &buf->vm_generationid_addr, sizeof(uint32_t)) ||
@@ -1010,17 +1052,61 @@ static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
         PERROR("Error when reading region pfn types");
         return -1;
     }
+    if (!(ptmp = realloc(buf->page_refs, buf->nr_pages * sizeof(*(buf->page_refs))))) {
+        ERROR("Could not reallocate page refs buffer");
+        return -1;
+    }
+    buf->page_refs = ptmp;
 
-    countpages = count;
+    if ( buf->nr_batch_refs && buf->nr_batch_refs != count ) {
+        ERROR("Page refs for %u pages, batch of %d", buf->nr_batch_refs, count);
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Work out where in pages the data for each page is: zero pages and
+     * copies of other pages in the batch are left out. */
+    countpages = 0;
     for (i = oldcount; i < buf->nr_pages; ++i)
     {
         unsigned long pagetype;
+        uint32_t ref;
 
         pagetype = buf->pfn_types[i] & XEN_DOMCTL_PFINFO_LTAB_MASK;
         if ( pagetype == XEN_DOMCTL_PFINFO_XTAB ||
              pagetype == XEN_DOMCTL_PFINFO_BROKEN ||
              pagetype == XEN_DOMCTL_PFINFO_XALLOC )
-            --countpages;
+            continue;
+
+        ref = buf->nr_batch_refs ? buf->batch_refs[i - oldcount]
+                                 : XC_PAGE_REF_DATA;
+        if ( ref == XC_PAGE_REF_DATA )
+            buf->page_refs[i] = buf->nr_physpages + countpages++;
+        else if ( ref == XC_PAGE_REF_ZERO || ref == XC_PAGE_REF_LAZY )
+            buf->page_refs[i] = ref;
+        else
+            buf->page_refs[i] = buf->nr_physpages + ref;
+    }
+
+    if ( buf->nr_batch_refs )
+    {
+        if ( buf->compressing )
+        {
+            ERROR("Page refs in a compressed checkpoint");
+            errno = EINVAL;
+            return -1;
+        }
+        /* Copies must be of pages whose data is sent. */
+        for (i = 0; i < count; ++i)
+            if ( buf->batch_refs[i] < XC_PAGE_REF_LAZY &&
+                 buf->batch_refs[i] >= countpages )
+            {
+                ERROR("Bad page ref %u in batch of %d",
+                      buf->batch_refs[i], count);
+                errno = EINVAL;
+                return -1;
+            }
+        buf->nr_batch_refs = 0;
     }
 
     if (!countpages)
@@ -1078,7 +1164,7 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
                        struct xc_mmu* mmu,
                        pagebuf_t* pagebuf, int curbatch)
 {
-    int i, j, curpage, nr_mfns;
+    int i, j, nr_mfns;
     int k, scount;
     unsigned long superpage_start=INVALID_P2M_ENTRY;
     /* used by debug verify code */
@@ -1258,7 +1344,7 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
         return -1;
     }
 
-    for ( i = 0, curpage = -1; i < j; i++ )
+    for ( i = 0; i < j; i++ )
     {
         pfn      = pagebuf->pfn_types[i + curbatch] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
         pagetype = pagebuf->pfn_types[i + curbatch] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
@@ -1286,8 +1372,6 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
             goto err_mapped;
         }
 
-        ++curpage;
-
         if ( pfn > dinfo->p2m_size )
         {
             ERROR("pfn out of range");
@@ -1313,9 +1397,27 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
                 goto err_mapped;
             }
         }
+        else if ( pagebuf->page_refs[i + curbatch] == XC_PAGE_REF_LAZY )
+        {
+            /* Sent after the tail: see restore_lazy_pages(). */
+            if ( !ctx->lazy &&
+                 !(ctx->lazy = bitmap_alloc(dinfo->p2m_size)) )
+            {
+                ERROR("Could not allocate lazy page bitmap");
+                goto err_mapped;
+            }
+            if ( !test_and_set_bit(pfn, ctx->lazy) )
+                ctx->nr_lazy++;
+            continue;
+        }
+        else if ( pagebuf->page_refs[i + curbatch] == XC_PAGE_REF_ZERO )
+            memset(page, 0, PAGE_SIZE);
         else
-            memcpy(page, pagebuf->pages + (curpage + curbatch) * PAGE_SIZE,
-                   PAGE_SIZE);
+            memcpy(page, pagebuf->pages +
+                   pagebuf->page_refs[i + curbatch] * PAGE_SIZE, PAGE_SIZE);
+
+        if ( ctx->nr_lazy && test_and_clear_bit(pfn, ctx->lazy) )
+            ctx->nr_lazy--;
 
         pagetype &= XEN_DOMCTL_PFINFO_LTABTYPE_MASK;
 
@@ -1396,6 +1498,420 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
     return rc;
 }
 
+/*
+** The lazy phase of a post-copy migration.  The pages the sender left
+** behind are paged out of the new domain through the mem_event paging
+** interface, as tools/xenpaging does, before the toolstack gets to resume
+** it.  A vcpu touching one of them is paused by Xen until we page it in,
+** which happens as soon as it arrives down the stream; if the stream is a
+** socket we ask the sender for it first.
+*/
+/* Page requests in flight before the domain is resumed. */
+#define LAZY_MAX_REQUESTS 64
+
+struct lazy_pager {
+    xc_interface *xch;
+    uint32_t dom;
+    int io_fd;
+    int requests;               /* can we ask for pages? */
+    unsigned long p2m_size;
+
+    void *ring_page;
+    mem_event_back_ring_t back_ring;
+    xc_evtchn *xce;
+    int port;
+    int enabled;
+
+    unsigned long *lazy;        /* pages still to come */
+    unsigned long nr_lazy;
+    unsigned long *evicted;     /* of which paged out */
+    unsigned long nr_resident;  /* of which not */
+    unsigned long *requested;   /* of which asked for */
+    unsigned long nr_outstanding; /* requests not yet answered */
+
+    mem_event_request_t *waiting; /* faults on pages still to come */
+    unsigned int nr_waiting, max_waiting;
+
+    void *page;                 /* page-aligned receive buffer */
+};
+
+static int lazy_pager_init(struct lazy_pager *lp)
+{
+    xc_interface *xch = lp->xch;
+    unsigned long ring_pfn = 0;
+    uint32_t evtchn_port;
+    xen_pfn_t mmap_pfn;
+    int rc;
+
+    lp->evicted = bitmap_alloc(lp->p2m_size);
+    lp->requested = bitmap_alloc(lp->p2m_size);
+    if ( !lp->evicted || !lp->requested ||
+         posix_memalign(&lp->page, PAGE_SIZE, PAGE_SIZE) )
+    {
+        ERROR("Could not allocate lazy pager state");
+        return -1;
+    }
+
+    /* Map the ring page */
+    xc_get_hvm_param(xch, lp->dom, HVM_PARAM_PAGING_RING_PFN, &ring_pfn);
+    mmap_pfn = ring_pfn;
+    lp->ring_page = xc_map_foreign_batch(xch, lp->dom, PROT_READ | PROT_WRITE,
+                                         &mmap_pfn, 1);
+    if ( mmap_pfn & XEN_DOMCTL_PFINFO_XTAB )
+    {
+        /* Map failed, populate ring page */
+        if ( lp->ring_page )
+            munmap(lp->ring_page, PAGE_SIZE);
+        if ( xc_domain_populate_physmap_exact(xch, lp->dom, 1, 0, 0,
+                                              &ring_pfn) )
+        {
+            PERROR("Failed to populate paging ring gfn");
+            lp->ring_page = NULL;
+            return -1;
+        }
+        mmap_pfn = ring_pfn;
+        lp->ring_page = xc_map_foreign_batch(xch, lp->dom,
+                                             PROT_READ | PROT_WRITE,
+                                             &mmap_pfn, 1);
+        if ( mmap_pfn & XEN_DOMCTL_PFINFO_XTAB )
+        {
+            PERROR("Could not map the paging ring page");
+            if ( lp->ring_page )
+                munmap(lp->ring_page, PAGE_SIZE);
+            lp->ring_page = NULL;
+            return -1;
+        }
+    }
+
+    if ( xc_mem_paging_enable(xch, lp->dom, &evtchn_port) )
+    {
+        PERROR("Could not enable paging (needs HAP, and no xenpaging)");
+        return -1;
+    }
+    lp->enabled = 1;
+
+    lp->xce = xc_evtchn_open(NULL, 0);
+    if ( lp->xce == NULL )
+    {
+        PERROR("Failed to open event channel");
+        return -1;
+    }
+    rc = xc_evtchn_bind_interdomain(lp->xce, lp->dom, evtchn_port);
+    if ( rc < 0 )
+    {
+        PERROR("Failed to bind paging event channel");
+        return -1;
+    }
+    lp->port = rc;
+
+    SHARED_RING_INIT((mem_event_sring_t *)lp->ring_page);
+    BACK_RING_INIT(&lp->back_ring, (mem_event_sring_t *)lp->ring_page,
+                   PAGE_SIZE);
+
+    /* Now that the ring is set, remove it from the guest's physmap */
+    if ( xc_domain_decrease_reservation_exact(xch, lp->dom, 1, 0, &ring_pfn) )
+        PERROR("Failed to remove paging ring from guest physmap");
+
+    return 0;
+}
+
+static void lazy_pager_fini(struct lazy_pager *lp)
+{
+    xc_interface *xch = lp->xch;
+
+    if ( lp->enabled && xc_mem_paging_disable(xch, lp->dom) )
+        PERROR("Failed to disable paging");
+    if ( lp->xce )
+    {
+        if ( lp->port > 0 )
+            xc_evtchn_unbind(lp->xce, lp->port);
+        xc_evtchn_close(lp->xce);
+    }
+    if ( lp->ring_page )
+        munmap(lp->ring_page, PAGE_SIZE);
+    free(lp->evicted);
+    free(lp->requested);
+    free(lp->waiting);
+    free(lp->page);
+}
+
+/* Ask the sender for a page, unless we have already. */
+static void lazy_request(struct lazy_pager *lp, unsigned long pfn)
+{
+    xc_interface *xch = lp->xch;
+    uint64_t req = pfn;
+
+    if ( !lp->requests || test_and_set_bit(pfn, lp->requested) )
+        return;
+    if ( write_exact(lp->io_fd, &req, sizeof(req)) )
+    {
+        /* Wait for the sender to push it. */
+        DPRINTF("Lazy phase: cannot request pages (errno %d)\n", errno);
+        lp->requests = 0;
+        return;
+    }
+    lp->nr_outstanding++;
+}
+
+static int lazy_respond(struct lazy_pager *lp, const mem_event_request_t *req)
+{
+    mem_event_response_t rsp;
+    RING_IDX rsp_prod = lp->back_ring.rsp_prod_pvt;
+
+    memset(&rsp, 0, sizeof(rsp));
+    rsp.gfn = req->gfn;
+    rsp.vcpu_id = req->vcpu_id;
+    rsp.flags = req->flags;
+
+    memcpy(RING_GET_RESPONSE(&lp->back_ring, rsp_prod), &rsp, sizeof(rsp));
+    lp->back_ring.rsp_prod_pvt = rsp_prod + 1;
+    RING_PUSH_RESPONSES(&lp->back_ring);
+
+    return xc_evtchn_notify(lp->xce, lp->port);
+}
+
+/* Handle the faults Xen has queued on the ring. */
+static int lazy_handle_requests(struct lazy_pager *lp)
+{
+    xc_interface *xch = lp->xch;
+    mem_event_request_t req, *w;
+    RING_IDX req_cons;
+    int port;
+
+    port = xc_evtchn_pending(lp->xce);
+    if ( port == -1 )
+    {
+        PERROR("Failed to read port from event channel");
+        return -1;
+    }
+    if ( xc_evtchn_unmask(lp->xce, port) < 0 )
+        PERROR("Failed to unmask event channel port");
+
+    while ( RING_HAS_UNCONSUMED_REQUESTS(&lp->back_ring) )
+    {
+        req_cons = lp->back_ring.req_cons;
+        memcpy(&req, RING_GET_REQUEST(&lp->back_ring, req_cons), sizeof(req));
+        lp->back_ring.req_cons = ++req_cons;
+        lp->back_ring.sring->req_event = req_cons + 1;
+
+        if ( req.gfn < lp->p2m_size && test_bit(req.gfn, lp->evicted) )
+        {
+            if ( req.flags & MEM_EVENT_FLAG_DROP_PAGE )
+            {
+                /* Ballooned out: we need not wait for it after all. */
+                clear_bit(req.gfn, lp->evicted);
+                clear_bit(req.gfn, lp->lazy);
+                lp->nr_lazy--;
+                if ( lazy_respond(lp, &req) < 0 )
+                    return -1;
+                continue;
+            }
+
+            /* Answered when the page arrives. */
+            if ( lp->nr_waiting == lp->max_waiting )
+            {
+                unsigned int max = lp->max_waiting ? lp->max_waiting * 2 : 16;
+
+                w = realloc(lp->waiting, max * sizeof(*w));
+                if ( !w )
+                {
+                    ERROR("Could not queue page fault");
+                    return -1;
+                }
+                lp->waiting = w;
+                lp->max_waiting = max;
+            }
+            lp->waiting[lp->nr_waiting++] = req;
+            lazy_request(lp, req.gfn);
+        }
+        else if ( req.flags & (MEM_EVENT_FLAG_VCPU_PAUSED |
+                               MEM_EVENT_FLAG_EVICT_FAIL) )
+        {
+            /* Already paged in: just let the vcpu go. */
+            if ( lazy_respond(lp, &req) < 0 )
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Read one page from the stream and put it in place.  Returns 1 at the end
+ * of the lazy phase.
+ */
+static int lazy_receive(struct lazy_pager *lp)
+{
+    xc_interface *xch = lp->xch;
+    uint64_t pfn;
+    void *page;
+    unsigned int i;
+
+    if ( read_exact(lp->io_fd, &pfn, sizeof(pfn)) )
+    {
+        PERROR("Error when reading lazy page pfn");
+        return -1;
+    }
+    if ( pfn == XC_LAZY_PFN_END )
+        return 1;
+    if ( pfn >= lp->p2m_size )
+    {
+        ERROR("Lazy page pfn %"PRIx64" out of range", pfn);
+        return -1;
+    }
+    if ( read_exact(lp->io_fd, lp->page, PAGE_SIZE) )
+    {
+        PERROR("Error when reading lazy page %"PRIx64, pfn);
+        return -1;
+    }
+
+    if ( test_and_clear_bit(pfn, lp->requested) )
+        lp->nr_outstanding--;
+
+    /* Dropped by the guest in the meantime? */
+    if ( !test_and_clear_bit(pfn, lp->lazy) )
+        return 0;
+    lp->nr_lazy--;
+
+    if ( test_and_clear_bit(pfn, lp->evicted) )
+    {
+        if ( xc_mem_paging_load(xch, lp->dom, pfn, lp->page) )
+        {
+            PERROR("Failed to page in lazy page %"PRIx64, pfn);
+            return -1;
+        }
+    }
+    else
+    {
+        page = xc_map_foreign_range(xch, lp->dom, PAGE_SIZE, PROT_WRITE, pfn);
+        if ( page == NULL )
+        {
+            PERROR("Failed to map lazy page %"PRIx64, pfn);
+            return -1;
+        }
+        memcpy(page, lp->page, PAGE_SIZE);
+        munmap(page, PAGE_SIZE);
+        lp->nr_resident--;
+    }
+
+    /* Let the vcpus waiting for it go. */
+    for ( i = 0; i < lp->nr_waiting; )
+    {
+        if ( lp->waiting[i].gfn != pfn )
+        {
+            i++;
+            continue;
+        }
+        if ( lazy_respond(lp, &lp->waiting[i]) < 0 )
+            return -1;
+        lp->waiting[i] = lp->waiting[--lp->nr_waiting];
+    }
+
+    return 0;
+}
+
+static int restore_lazy_pages(xc_interface *xch, struct restore_ctx *ctx,
+                              uint32_t dom, int io_fd,
+                              struct restore_callbacks *callbacks)
+{
+    struct lazy_pager lp;
+    struct pollfd fds[2];
+    struct stat st;
+    unsigned long pfn;
+    int rc = -1, done = 0;
+
+    memset(&lp, 0, sizeof(lp));
+    lp.xch = xch;
+    lp.dom = dom;
+    lp.io_fd = io_fd;
+    /* Only a socket can carry page requests back to the sender. */
+    lp.requests = fstat(io_fd, &st) == 0 && S_ISSOCK(st.st_mode);
+    lp.p2m_size = ctx->dinfo.p2m_size;
+    lp.lazy = ctx->lazy;
+    lp.nr_lazy = ctx->nr_lazy;
+
+    DPRINTF("Lazy phase: %lu pages to fetch\n", lp.nr_lazy);
+
+    if ( lazy_pager_init(&lp) )
+        goto out;
+
+    /* Page out the pages still to come; any we cannot are fetched now. */
+    for ( pfn = 0; pfn < lp.p2m_size; pfn++ )
+    {
+        if ( !test_bit(pfn, lp.lazy) )
+            continue;
+        if ( xc_mem_paging_nominate(xch, dom, pfn) == 0 &&
+             xc_mem_paging_evict(xch, dom, pfn) == 0 )
+            set_bit(pfn, lp.evicted);
+        else
+            lp.nr_resident++;
+    }
+
+    /*
+     * The sender only reads our requests between pushes, so asking for
+     * all the resident pages at once could leave both sides blocked
+     * writing: keep a few requests in flight, and more as pages arrive.
+     */
+    if ( lp.nr_resident )
+        DPRINTF("Lazy phase: %lu pages could not be paged out\n",
+                lp.nr_resident);
+    for ( pfn = 0; lp.nr_resident && !done; )
+    {
+        for ( ; pfn < lp.p2m_size && lp.nr_outstanding < LAZY_MAX_REQUESTS;
+              pfn++ )
+            if ( test_bit(pfn, lp.lazy) && !test_bit(pfn, lp.evicted) )
+                lazy_request(&lp, pfn);
+        if ( (done = lazy_receive(&lp)) < 0 )
+            goto out;
+    }
+
+    if ( callbacks != NULL && callbacks->lazy_resume != NULL &&
+         callbacks->lazy_resume(dom, callbacks->data) )
+    {
+        ERROR("lazy_resume callback failed");
+        goto out;
+    }
+
+    fds[0].fd = io_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = xc_evtchn_fd(lp.xce);
+    fds[1].events = POLLIN;
+    while ( !done )
+    {
+        if ( poll(fds, 2, -1) < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            PERROR("Poll failed in lazy phase");
+            goto out;
+        }
+        if ( (fds[1].revents & POLLIN) && lazy_handle_requests(&lp) )
+            goto out;
+        if ( (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) &&
+             (done = lazy_receive(&lp)) < 0 )
+            goto out;
+    }
+
+    if ( lp.nr_lazy )
+    {
+        ERROR("Lazy phase ended with %lu pages missing", lp.nr_lazy);
+        goto out;
+    }
+    if ( lp.nr_waiting )
+    {
+        ERROR("Lazy phase ended with %u faults pending", lp.nr_waiting);
+        goto out;
+    }
+
+    DPRINTF("Lazy phase: all pages received\n");
+    rc = 0;
+
+ out:
+    ctx->nr_lazy = lp.nr_lazy;
+    lazy_pager_fini(&lp);
+    return rc;
+}
+
 int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       unsigned int store_evtchn, unsigned long *store_mfn,
                       domid_t store_domid, unsigned int console_evtchn,
@@ -2326,6 +2842,18 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
         goto out;
     }
 
+    if ( ctx->nr_lazy )
+    {
+        if ( checkpointed_stream )
+        {
+            ERROR("Lazy pages in a checkpointed stream");
+            goto out;
+        }
+        rc = restore_lazy_pages(xch, ctx, dom, io_fd, callbacks);
+        if ( rc )
+            goto out;
+    }
+
     /* HVM success! */
     rc = 0;
 
@@ -2338,6 +2866,7 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     free(pfn_type);
     free(region_mfn);
     free(ctx->p2m_batch);
+    free(ctx->lazy);
     pagebuf_free(&pagebuf);
     tailbuf_free(&tailbuf);
 
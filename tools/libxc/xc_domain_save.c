@@ -25,6 +25,9 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/stat.h>
 
 #include "xc_private.h"
 #include "xc_bitops.h"
@@ -355,6 +358,39 @@ static int analysis_phase(xc_interface *xch, uint32_t domid, struct save_ctx *ct
     return -1;
 }
 
+/*
+** Work out how the pass that just finished went, and how long the last
+** pass would take if the domain were suspended now: its dirty pages,
+** sent at the rate this pass achieved.
+*/
+static void measure_iteration(xc_interface *xch, uint32_t domid, int iter,
+                              unsigned int sent, unsigned int skipped,
+                              uint64_t start, struct save_iter_stats *s)
+{
+    xc_shadow_op_stats_t stats;
+    uint64_t us = llgettimeofday() - start;
+
+    if ( us == 0 )
+        us = 1;
+
+    memset(s, 0, sizeof(*s));
+    s->iter = iter;
+    s->pages_sent = sent;
+    s->pages_skipped = skipped;
+    s->duration_ms = us / 1000;
+
+    /* Peeking leaves the log-dirty bitmap and counts alone. */
+    if ( xc_shadow_control(xch, domid, XEN_DOMCTL_SHADOW_OP_PEEK,
+                           NULL, 0, NULL, 0, &stats) >= 0 )
+        s->pages_dirty = stats.dirty_count;
+
+    s->send_rate = s->pages_sent * 1000000 / us;
+    s->dirty_rate = s->pages_dirty * 1000000 / us;
+    s->projected_downtime_ms = s->send_rate ?
+        (s->pages_dirty * 1000 + s->send_rate - 1) / s->send_rate :
+        UINT64_MAX;
+}
+
 static int suspend_and_state(int (*suspend)(void*), void* data,
                              xc_interface *xch, int io_fd, int dom,
                              xc_dominfo_t *info)
@@ -522,6 +558,644 @@ static int canonicalize_pagetable(struct save_ctx *ctx,
     return race;
 }
 
+/*
+** Pages are sent in batches, which go through a pipeline: the main
+** thread picks the pages for each batch from the dirty bitmap, worker
+** threads map them, look up their types and copy them out (canonicalising
+** page tables on the way), and the main thread writes the finished
+** batches to the stream in the order they were picked.  Without workers
+** the main thread prepares each batch itself, and ordinary pages are sent
+** straight from the mapping instead of being copied out, unless other
+** pages may be sent as references to them while the guest still runs.
+*/
+#define SAVE_MAX_WORKERS 8
+
+/*
+** The HVM params giving pages which Xen, or the restoring side, uses
+** before the guest runs: the magic pages (which are cleared on restore,
+** after the pages are loaded), the mem_event rings, the identity
+** pagetable and the vm86 TSS.  These are never left for the lazy phase.
+*/
+static const int lazy_skip_params[] = {
+    HVM_PARAM_IOREQ_PFN, HVM_PARAM_BUFIOREQ_PFN, HVM_PARAM_STORE_PFN,
+    HVM_PARAM_CONSOLE_PFN, HVM_PARAM_PAGING_RING_PFN,
+    HVM_PARAM_ACCESS_RING_PFN, HVM_PARAM_SHARING_RING_PFN,
+    HVM_PARAM_IDENT_PT, HVM_PARAM_VM86_TSS,
+};
+#define LAZY_SKIP_PARAMS \
+    (sizeof(lazy_skip_params) / sizeof(lazy_skip_params[0]))
+
+struct save_batch {
+    /* Set up by the main thread. */
+    int iter;
+    unsigned int batch;
+    unsigned long *pfn_batch;
+    /* MFNs (PV) or PFNs (HVM) on the way in, types and PFNs out. */
+    xen_pfn_t *pfn_type;
+    /* Pages to send as XEN_DOMCTL_PFINFO_XALLOC. */
+    unsigned long alloc_only[MAX_BATCH_SIZE / (sizeof(unsigned long) * 8)];
+    /* Leave zero and duplicate pages out of the stream? */
+    int elide;
+    /* Can the guest still change the pages while the batch is out? */
+    int running;
+    /* Leave ordinary pages for the lazy phase? */
+    int lazy;
+
+    /* Filled in by the worker. */
+    int *pfn_err;
+    int rc;          /* -1 if the batch could not be prepared */
+    unsigned int run;       /* number of valid pages in the batch */
+    unsigned int nr_pages;  /* number of pages to send */
+    char *data[MAX_BATCH_SIZE]; /* their contents, in pages or region */
+    char *pages;     /* copies of them, nr_pages * PAGE_SIZE */
+    unsigned char *region;  /* the batch, while mapped for sending */
+    unsigned int nr_elided; /* number of pages left out */
+    unsigned int nr_lazy;   /* of which left for the lazy phase */
+    uint32_t refs[MAX_BATCH_SIZE]; /* XC_PAGE_REF_*, if nr_elided */
+
+    enum { BATCH_FREE, BATCH_QUEUED, BATCH_DONE } state;
+};
+
+struct save_pipeline {
+    xc_interface *xch;
+    uint32_t dom;
+    struct save_ctx *ctx;
+    int hvm, live, debug;
+
+    struct save_batch *batches;
+    unsigned int nr_batches;
+    /* Batches picked, taken by a worker and written, ever. */
+    unsigned int picked, taken, written;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;   /* a batch was queued, or exiting */
+    pthread_cond_t done_cond;   /* a batch was prepared */
+    pthread_t threads[SAVE_MAX_WORKERS];
+    unsigned int nr_threads;
+    int exiting;
+
+    /* HVM pages which must be sent before the tail, even when lazy. */
+    xen_pfn_t lazy_skip[LAZY_SKIP_PARAMS];
+    unsigned int nr_lazy_skip;
+};
+
+/* Is pfn one of the pages which lazy_skip_params[] name? */
+static int lazy_skip_page(const struct save_pipeline *p, unsigned long pfn)
+{
+    unsigned int i;
+
+    for ( i = 0; i < p->nr_lazy_skip; i++ )
+        if ( p->lazy_skip[i] == pfn )
+            return 1;
+    return 0;
+}
+
+/* Find the pages lazy_skip_params[] name. */
+static void lazy_skip_init(struct save_pipeline *p)
+{
+    xc_interface *xch = p->xch;
+    unsigned long value;
+    unsigned int i;
+
+    for ( i = 0; i < LAZY_SKIP_PARAMS; i++ )
+    {
+        value = 0;
+        xc_get_hvm_param(xch, p->dom, lazy_skip_params[i], &value);
+        /* IDENT_PT and VM86_TSS are addresses, the others pfns. */
+        if ( lazy_skip_params[i] == HVM_PARAM_IDENT_PT ||
+             lazy_skip_params[i] == HVM_PARAM_VM86_TSS )
+            value >>= PAGE_SHIFT;
+        if ( value )
+            p->lazy_skip[p->nr_lazy_skip++] = value;
+    }
+}
+
+/*
+** Zero pages, and copies of pages already in the batch, need not be sent:
+** we find them by hashing each page's contents.
+*/
+#define PAGE_HASH_SLOTS (2 * MAX_BATCH_SIZE)
+
+struct page_index {
+    uint64_t hash[MAX_BATCH_SIZE];      /* of each page in b->data */
+    uint16_t slot[PAGE_HASH_SLOTS];     /* index in b->data + 1, or 0 */
+};
+
+/* Hash the contents of a page, returning 0 if it is all zeroes. */
+static uint64_t hash_page(const void *page)
+{
+    const uint64_t *p = page;
+    uint64_t h = 0, any = 0;
+    unsigned int i;
+
+    /* Four words at a time, which the compiler can vectorise. */
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i += 4 )
+    {
+        any |= p[i] | p[i+1] | p[i+2] | p[i+3];
+        h = (h ^ p[i] ^ (p[i+1] << 1) ^ (p[i+2] << 2) ^ (p[i+3] << 3))
+            * 0x9e3779b97f4a7c15ULL;
+    }
+
+    return any ? (h | 1) : 0;
+}
+
+/*
+** Return how page should be sent, as an XC_PAGE_REF_* value.  Pages to
+** be sent in full are added to the index, as page nr of the batch.
+*/
+static uint32_t page_ref(struct page_index *idx, char *const *data,
+                         unsigned int nr, const void *page)
+{
+    uint64_t hash = hash_page(page);
+    unsigned int i, k;
+
+    if ( hash == 0 )
+        return XC_PAGE_REF_ZERO;
+
+    for ( i = hash % PAGE_HASH_SLOTS; idx->slot[i];
+          i = (i + 1) % PAGE_HASH_SLOTS )
+    {
+        k = idx->slot[i] - 1;
+        if ( idx->hash[k] == hash && !memcmp(data[k], page, PAGE_SIZE) )
+            return k;
+    }
+
+    idx->slot[i] = nr + 1;
+    idx->hash[nr] = hash;
+    return XC_PAGE_REF_DATA;
+}
+
+/* Map the pages of a batch, and copy out the ones to send, or (without
+ * workers) keep the batch mapped to send them from there. */
+static void prepare_batch(struct save_pipeline *p, struct save_batch *b)
+{
+    xc_interface *xch = p->xch;
+    struct save_ctx *ctx = p->ctx;
+    struct domain_info_context *dinfo = &ctx->dinfo;
+    struct page_index idx;
+    unsigned char *region_base;
+    unsigned int j;
+    int direct = !p->nr_threads;
+
+    b->rc = 0;
+    b->run = b->nr_pages = b->nr_elided = b->nr_lazy = 0;
+    if ( b->elide )
+        memset(idx.slot, 0, sizeof(idx.slot));
+
+    region_base = xc_map_foreign_bulk(
+        xch, p->dom, PROT_READ, b->pfn_type, b->pfn_err, b->batch);
+    if ( region_base == NULL )
+    {
+        PERROR("map batch failed");
+        b->rc = -1;
+        return;
+    }
+
+    /* Get page types */
+    if ( xc_get_pfn_type_batch(xch, p->dom, b->batch, b->pfn_type) )
+    {
+        PERROR("get_pfn_type_batch failed");
+        b->rc = -1;
+        goto out;
+    }
+
+    for ( j = 0; j < b->batch; j++ )
+    {
+        unsigned long gmfn = b->pfn_batch[j];
+
+        if ( !p->hvm )
+            gmfn = pfn_to_mfn(gmfn);
+
+        if ( b->pfn_type[j] == XEN_DOMCTL_PFINFO_BROKEN )
+        {
+            b->pfn_type[j] |= b->pfn_batch[j];
+            ++b->run;
+            continue;
+        }
+
+        if ( b->pfn_err[j] )
+        {
+            if ( b->pfn_type[j] == XEN_DOMCTL_PFINFO_XTAB )
+                continue;
+
+            DPRINTF("map fail: page %i mfn %08lx err %d\n",
+                    j, gmfn, b->pfn_err[j]);
+            b->pfn_type[j] = XEN_DOMCTL_PFINFO_XTAB;
+            continue;
+        }
+
+        if ( b->pfn_type[j] == XEN_DOMCTL_PFINFO_XTAB )
+        {
+            DPRINTF("type fail: page %i mfn %08lx\n", j, gmfn);
+            continue;
+        }
+
+        if ( test_bit(j, b->alloc_only) )
+            b->pfn_type[j] = XEN_DOMCTL_PFINFO_XALLOC;
+
+        /* canonicalise mfn->pfn */
+        b->pfn_type[j] |= b->pfn_batch[j];
+        ++b->run;
+
+        if ( p->debug )
+        {
+            if ( p->hvm )
+                DPRINTF("%d pfn=%08lx sum=%08lx\n",
+                        b->iter,
+                        b->pfn_type[j],
+                        csum_page(region_base + (PAGE_SIZE*j)));
+            else
+                DPRINTF("%d pfn= %08lx mfn= %08lx [mfn]= %08lx"
+                        " sum= %08lx\n",
+                        b->iter,
+                        b->pfn_type[j],
+                        gmfn,
+                        mfn_to_pfn(gmfn),
+                        csum_page(region_base + (PAGE_SIZE*j)));
+        }
+    }
+
+    /* pfn_type is now in pfns (Not mfns) */
+    for ( j = 0; b->run && j < b->batch; j++ )
+    {
+        unsigned long pfn, pagetype;
+        void *spage = region_base + (PAGE_SIZE*j);
+        void *dpage = b->pages + (PAGE_SIZE*b->nr_pages);
+
+        pfn      = b->pfn_type[j] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+        pagetype = b->pfn_type[j] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
+
+        b->refs[j] = XC_PAGE_REF_DATA;
+
+        /*
+         * skip pages that aren't present,
+         * or are broken, or are alloc-only
+         */
+        if ( pagetype == XEN_DOMCTL_PFINFO_XTAB
+            || pagetype == XEN_DOMCTL_PFINFO_BROKEN
+            || pagetype == XEN_DOMCTL_PFINFO_XALLOC )
+            continue;
+
+        if ( b->lazy && pagetype == XEN_DOMCTL_PFINFO_NOTAB &&
+             !lazy_skip_page(p, pfn) )
+        {
+            b->refs[j] = XC_PAGE_REF_LAZY;
+            b->nr_elided++;
+            b->nr_lazy++;
+            continue;
+        }
+
+        if ( b->elide && pagetype == XEN_DOMCTL_PFINFO_NOTAB )
+        {
+            b->refs[j] = page_ref(&idx, b->data, b->nr_pages, spage);
+            if ( b->refs[j] != XC_PAGE_REF_DATA )
+            {
+                b->nr_elided++;
+                continue;
+            }
+        }
+
+        pagetype &= XEN_DOMCTL_PFINFO_LTABTYPE_MASK;
+
+        if ( (pagetype >= XEN_DOMCTL_PFINFO_L1TAB) &&
+             (pagetype <= XEN_DOMCTL_PFINFO_L4TAB) )
+        {
+            /* We have a pagetable page: need to rewrite it. */
+            if ( canonicalize_pagetable(ctx, pagetype, pfn, spage, dpage) &&
+                 !p->live )
+            {
+                ERROR("Fatal PT race (pfn %lx, type %08lx)", pfn,
+                      pagetype);
+                b->rc = -1;
+                goto out;
+            }
+        }
+        /*
+         * A page others may refer to must not change before it is
+         * written, or they would be restored with its new contents but
+         * never be sent again: only send it from the mapping once the
+         * guest has stopped.
+         */
+        else if ( direct && !(b->elide && b->running) )
+            dpage = spage;
+        else
+            memcpy(dpage, spage, PAGE_SIZE);
+
+        b->data[b->nr_pages++] = dpage;
+    }
+
+ out:
+    if ( direct && !b->rc )
+        b->region = region_base;
+    else
+        munmap(region_base, b->batch*PAGE_SIZE);
+}
+
+static void *save_worker(void *arg)
+{
+    struct save_pipeline *p = arg;
+    struct save_batch *b;
+
+    pthread_mutex_lock(&p->lock);
+    for ( ; ; )
+    {
+        while ( !p->exiting && p->taken == p->picked )
+            pthread_cond_wait(&p->work_cond, &p->lock);
+        if ( p->exiting )
+            break;
+        b = &p->batches[p->taken++ % p->nr_batches];
+        pthread_mutex_unlock(&p->lock);
+
+        prepare_batch(p, b);
+
+        pthread_mutex_lock(&p->lock);
+        b->state = BATCH_DONE;
+        pthread_cond_broadcast(&p->done_cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+/* How many threads to prepare batches on: none if libxc must be called
+ * from one thread only, or to keep debug output in order. */
+static unsigned int save_nr_workers(xc_interface *xch, int debug)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if ( (xch->flags & XC_OPENFLAG_NON_REENTRANT) || debug || cpus < 2 )
+        return 0;
+
+    return cpus > SAVE_MAX_WORKERS ? SAVE_MAX_WORKERS : cpus;
+}
+
+static int save_pipeline_init(struct save_pipeline *p, xc_interface *xch,
+                              uint32_t dom, struct save_ctx *ctx,
+                              int hvm, int live, int debug)
+{
+    unsigned int i, nr_workers = save_nr_workers(xch, debug);
+
+    memset(p, 0, sizeof(*p));
+    p->xch = xch;
+    p->dom = dom;
+    p->ctx = ctx;
+    p->hvm = hvm;
+    p->live = live;
+    p->debug = debug;
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work_cond, NULL);
+    pthread_cond_init(&p->done_cond, NULL);
+
+    /* One batch for each worker to prepare, and one for the main thread
+     * to write out. */
+    p->nr_batches = nr_workers + 1;
+    p->batches = calloc(p->nr_batches, sizeof(*p->batches));
+    if ( p->batches == NULL )
+        goto nomem;
+
+    for ( i = 0; i < p->nr_batches; i++ )
+    {
+        struct save_batch *b = &p->batches[i];
+
+        b->pfn_type  = malloc(ROUNDUP(MAX_BATCH_SIZE * sizeof(*b->pfn_type),
+                                      PAGE_SHIFT));
+        b->pfn_batch = calloc(MAX_BATCH_SIZE, sizeof(*b->pfn_batch));
+        b->pfn_err   = malloc(MAX_BATCH_SIZE * sizeof(*b->pfn_err));
+        b->pages     = malloc(MAX_BATCH_SIZE * PAGE_SIZE);
+        if ( (b->pfn_type == NULL) || (b->pfn_batch == NULL) ||
+             (b->pfn_err == NULL) || (b->pages == NULL) )
+            goto nomem;
+        memset(b->pfn_type, 0,
+               ROUNDUP(MAX_BATCH_SIZE * sizeof(*b->pfn_type), PAGE_SHIFT));
+    }
+
+    for ( i = 0; i < nr_workers; i++ )
+    {
+        if ( pthread_create(&p->threads[i], NULL, save_worker, p) )
+            break;
+        p->nr_threads++;
+    }
+    DPRINTF("Preparing batches on %u threads\n", p->nr_threads);
+
+    return 0;
+
+ nomem:
+    ERROR("failed to alloc memory for batches");
+    errno = ENOMEM;
+    return -1;
+}
+
+static void save_pipeline_destroy(struct save_pipeline *p)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&p->lock);
+    p->exiting = 1;
+    pthread_cond_broadcast(&p->work_cond);
+    pthread_mutex_unlock(&p->lock);
+
+    for ( i = 0; i < p->nr_threads; i++ )
+        pthread_join(p->threads[i], NULL);
+
+    for ( i = 0; p->batches && i < p->nr_batches; i++ )
+    {
+        if ( p->batches[i].region )
+            munmap(p->batches[i].region, p->batches[i].batch * PAGE_SIZE);
+        free(p->batches[i].pfn_type);
+        free(p->batches[i].pfn_batch);
+        free(p->batches[i].pfn_err);
+        free(p->batches[i].pages);
+    }
+    free(p->batches);
+    p->batches = NULL;
+
+    pthread_cond_destroy(&p->done_cond);
+    pthread_cond_destroy(&p->work_cond);
+    pthread_mutex_destroy(&p->lock);
+}
+
+/* Get a free batch to fill in: the caller must first write out the
+ * oldest one if it returns NULL. */
+static struct save_batch *save_batch_get(struct save_pipeline *p)
+{
+    struct save_batch *b = &p->batches[p->picked % p->nr_batches];
+
+    return (b->state == BATCH_FREE) ? b : NULL;
+}
+
+/* Hand a filled in batch over to be prepared. */
+static void save_batch_queue(struct save_pipeline *p, struct save_batch *b)
+{
+    if ( !p->nr_threads )
+    {
+        prepare_batch(p, b);
+        b->state = BATCH_DONE;
+        p->picked++;
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    b->state = BATCH_QUEUED;
+    p->picked++;
+    pthread_cond_signal(&p->work_cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Wait for the oldest batch not yet written out to be prepared, or
+ * return NULL if there is none. */
+static struct save_batch *save_batch_oldest(struct save_pipeline *p)
+{
+    struct save_batch *b;
+
+    if ( p->written == p->picked )
+        return NULL;
+
+    b = &p->batches[p->written % p->nr_batches];
+    if ( p->nr_threads )
+    {
+        pthread_mutex_lock(&p->lock);
+        while ( b->state != BATCH_DONE )
+            pthread_cond_wait(&p->done_cond, &p->lock);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    return b;
+}
+
+/* Done with the oldest batch. */
+static void save_batch_put(struct save_pipeline *p, struct save_batch *b)
+{
+    if ( b->region )
+    {
+        munmap(b->region, b->batch * PAGE_SIZE);
+        b->region = NULL;
+    }
+    b->state = BATCH_FREE;
+    p->written++;
+}
+
+/* Write a prepared batch to the stream, or to the compression buffer, and
+ * note its lazy pages in to_lazy. */
+static int write_batch(xc_interface *xch, struct save_batch *b,
+                       int dobuf, struct outbuf *ob, int fd,
+                       comp_ctx *compress_ctx, unsigned long *to_lazy)
+{
+    unsigned int k, run;
+    int j;
+
+    for ( j = 0; b->nr_lazy && j < b->batch; j++ )
+        if ( b->refs[j] == XC_PAGE_REF_LAZY )
+            set_bit(b->pfn_type[j] & ~XEN_DOMCTL_PFINFO_LTAB_MASK, to_lazy);
+
+    if ( b->nr_elided )
+    {
+        int id = XC_SAVE_ID_PAGE_REFS;
+        uint32_t count = b->batch;
+
+        if ( write_buffer(xch, dobuf, ob, fd, &id, sizeof(id)) ||
+             write_buffer(xch, dobuf, ob, fd, &count, sizeof(count)) ||
+             write_buffer(xch, dobuf, ob, fd, b->refs,
+                          sizeof(*b->refs)*b->batch) )
+        {
+            PERROR("Error when writing to state file (page refs)");
+            return -1;
+        }
+    }
+
+    if ( write_buffer(xch, dobuf, ob, fd, &b->batch, sizeof(unsigned int)) )
+    {
+        PERROR("Error when writing to state file (2)");
+        return -1;
+    }
+
+    if ( sizeof(unsigned long) < sizeof(*b->pfn_type) )
+        for ( j = 0; j < b->batch; j++ )
+            ((unsigned long *)b->pfn_type)[j] = b->pfn_type[j];
+    if ( write_buffer(xch, dobuf, ob, fd, b->pfn_type,
+                      sizeof(unsigned long)*b->batch) )
+    {
+        PERROR("Error when writing to state file (3)");
+        return -1;
+    }
+    if ( sizeof(unsigned long) < sizeof(*b->pfn_type) )
+        while ( --j >= 0 )
+            b->pfn_type[j] = ((unsigned long *)b->pfn_type)[j];
+
+    if ( !compress_ctx )
+    {
+        /* Write out runs of pages which are contiguous in memory. */
+        for ( k = 0; k < b->nr_pages; k += run )
+        {
+            for ( run = 1; k + run < b->nr_pages; run++ )
+                if ( b->data[k + run] != b->data[k] + PAGE_SIZE*run )
+                    break;
+
+            if ( write_uncached(xch, dobuf, ob, fd, b->data[k],
+                                PAGE_SIZE*run) != PAGE_SIZE*run )
+            {
+                PERROR("Error when writing to state file (4)"
+                       " (errno %d)", errno);
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    k = 0;
+
+    for ( j = 0; j < b->batch; j++ )
+    {
+        unsigned long pfn, pagetype;
+        int c_err;
+
+        pfn      = b->pfn_type[j] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+        pagetype = b->pfn_type[j] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
+
+        if ( pagetype == XEN_DOMCTL_PFINFO_XTAB
+            || pagetype == XEN_DOMCTL_PFINFO_BROKEN
+            || pagetype == XEN_DOMCTL_PFINFO_XALLOC )
+            continue;
+
+        pagetype &= XEN_DOMCTL_PFINFO_LTABTYPE_MASK;
+
+        /* For checkpoint compression, accumulate the page in the page
+         * buffer, to be compressed later.  Pagetable pages are sent
+         * uncompressed.
+         */
+        c_err = xc_compression_add_page(
+            xch, compress_ctx, b->data[k++], pfn,
+            (pagetype >= XEN_DOMCTL_PFINFO_L1TAB) &&
+            (pagetype <= XEN_DOMCTL_PFINFO_L4TAB));
+
+        if ( c_err == -2 ) /* OOB PFN */
+        {
+            ERROR("Could not add page "
+                  "(pfn:%" PRIpfn "to page buffer\n", pfn);
+            return -1;
+        }
+
+        if ( c_err == -1 )
+        {
+            /*
+             * We are out of buffer space to hold dirty pages. Compress
+             * and flush the current buffer to make space. This is a
+             * corner case, that slows down checkpointing as the
+             * compression happens while domain is suspended. Happens
+             * seldom and if you find this occuring frequently, increase
+             * the PAGE_BUFFER_SIZE in xc_compression.c.
+             */
+            if ( write_compressed(xch, compress_ctx, dobuf, ob, fd) < 0 )
+            {
+                ERROR("Error when writing compressed data (4b)\n");
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
 xen_pfn_t *xc_map_m2p(xc_interface *xch,
                                  unsigned long max_mfn,
                                  int prot,
@@ -800,8 +1474,159 @@ static int save_tsc_info(xc_interface *xch, uint32_t dom, int io_fd)
     return 0;
 }
 
+/*
+** The lazy phase: once the tail (and, through the lazy_tail callback, the
+** device model state) is out, the far end resumes the domain and we push
+** the pages left behind.  Pages it asks for, because its guest is waiting
+** on them, are sent ahead of the rest.
+*/
+#define LAZY_PUSH_BATCH 64
+
+static int send_lazy_page(xc_interface *xch, int io_fd, uint64_t pfn,
+                          const void *page)
+{
+    if ( write_exact(io_fd, &pfn, sizeof(pfn)) ||
+         write_exact(io_fd, page, PAGE_SIZE) )
+    {
+        PERROR("Error when writing lazy page %"PRIx64, pfn);
+        return -1;
+    }
+    return 0;
+}
+
+/* Send the page the far end asked for, if it is one we still owe it. */
+static int answer_lazy_request(xc_interface *xch, uint32_t dom, int io_fd,
+                               unsigned long *to_lazy, unsigned long p2m_size,
+                               unsigned long *nr_lazy)
+{
+    uint64_t pfn;
+    void *page;
+    int rc;
+
+    if ( read_exact(io_fd, &pfn, sizeof(pfn)) )
+    {
+        PERROR("Error when reading lazy page request");
+        return -1;
+    }
+    if ( pfn >= p2m_size || !test_bit(pfn, to_lazy) )
+        return 0;
+
+    page = xc_map_foreign_range(xch, dom, PAGE_SIZE, PROT_READ, pfn);
+    if ( page == NULL )
+    {
+        PERROR("Failed to map lazy page %"PRIx64, pfn);
+        return -1;
+    }
+    rc = send_lazy_page(xch, io_fd, pfn, page);
+    munmap(page, PAGE_SIZE);
+    if ( rc == 0 )
+    {
+        clear_bit(pfn, to_lazy);
+        (*nr_lazy)--;
+    }
+    return rc;
+}
+
+static int send_lazy_pages(xc_interface *xch, uint32_t dom, int io_fd,
+                           struct outbuf *ob, struct save_callbacks *callbacks,
+                           unsigned long *to_lazy, unsigned long p2m_size,
+                           unsigned long nr_lazy)
+{
+    xen_pfn_t pfns[LAZY_PUSH_BATCH];
+    int errs[LAZY_PUSH_BATCH];
+    unsigned long pfn = 0;
+    unsigned int batch, j;
+    struct pollfd pfd;
+    struct stat st;
+    int requests;
+    uint64_t end = XC_LAZY_PFN_END;
+    char *region;
+
+    DPRINTF("Lazy phase: %lu pages to send\n", nr_lazy);
+
+    /* Only a socket can carry page requests back to us. */
+    requests = fstat(io_fd, &st) == 0 && S_ISSOCK(st.st_mode);
+    if ( !requests )
+        DPRINTF("Lazy phase: not a socket, no page requests\n");
+
+    if ( outbuf_flush(xch, ob, io_fd) < 0 )
+    {
+        PERROR("Error when flushing output buffer");
+        return -1;
+    }
+    if ( callbacks->lazy_tail(dom, io_fd, callbacks->data) )
+    {
+        ERROR("lazy_tail callback failed");
+        return -1;
+    }
+
+    while ( nr_lazy )
+    {
+        /* Pages the far end is waiting for go first. */
+        while ( requests && nr_lazy )
+        {
+            pfd.fd = io_fd;
+            pfd.events = POLLIN;
+            if ( poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLIN) )
+                break;
+            if ( answer_lazy_request(xch, dom, io_fd, to_lazy, p2m_size,
+                                     &nr_lazy) )
+                return -1;
+        }
+
+        for ( batch = 0; batch < LAZY_PUSH_BATCH && pfn < p2m_size; pfn++ )
+            if ( test_bit(pfn, to_lazy) )
+                pfns[batch++] = pfn;
+        if ( batch == 0 )
+        {
+            if ( nr_lazy )
+            {
+                ERROR("Lazy phase: %lu pages unaccounted for", nr_lazy);
+                return -1;
+            }
+            break;
+        }
+
+        region = xc_map_foreign_bulk(xch, dom, PROT_READ, pfns, errs, batch);
+        if ( region == NULL )
+        {
+            PERROR("Failed to map lazy pages");
+            return -1;
+        }
+        for ( j = 0; j < batch; j++ )
+        {
+            /* Sent on request since we picked it? */
+            if ( !test_bit(pfns[j], to_lazy) )
+                continue;
+            if ( errs[j] )
+            {
+                ERROR("Failed to map lazy page %lx (%d)",
+                      (unsigned long)pfns[j], errs[j]);
+                munmap(region, batch * PAGE_SIZE);
+                return -1;
+            }
+            if ( send_lazy_page(xch, io_fd, pfns[j], region + j * PAGE_SIZE) )
+            {
+                munmap(region, batch * PAGE_SIZE);
+                return -1;
+            }
+            clear_bit(pfns[j], to_lazy);
+            nr_lazy--;
+        }
+        munmap(region, batch * PAGE_SIZE);
+    }
+
+    if ( write_exact(io_fd, &end, sizeof(end)) )
+    {
+        PERROR("Error when writing end of lazy phase");
+        return -1;
+    }
+    return 0;
+}
+
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iters,
-                   uint32_t max_factor, uint32_t flags,
+                   uint32_t max_factor, uint32_t target_downtime_ms,
+                   uint32_t flags,
                    struct save_callbacks* callbacks, int hvm,
                    unsigned long vm_generationid_addr)
 {
@@ -812,8 +1637,10 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     int live  = (flags & XCFLAGS_LIVE);
     int debug = (flags & XCFLAGS_DEBUG);
     int superpages = !!hvm;
-    int race = 0, sent_last_iter, skip_this_iter = 0;
+    int sent_last_iter, skip_this_iter = 0;
     unsigned int sent_this_iter = 0;
+    uint64_t iter_start = 0;
+    struct save_iter_stats iter_stats;
     int tmem_saved = 0;
 
     /* The new domain's shared-info frame number. */
@@ -822,10 +1649,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     /* A copy of the CPU context of the guest. */
     vcpu_guest_context_any_t ctxt;
 
-    /* A table containing the type of each PFN (/not/ MFN!). */
-    xen_pfn_t *pfn_type = NULL;
-    unsigned long *pfn_batch = NULL;
-    int *pfn_err = NULL;
+    /* Batches of pages being prepared for sending. */
+    struct save_pipeline pipeline = { .xch = NULL };
 
     /* A copy of one frame of guest memory. */
     char page[PAGE_SIZE];
@@ -833,9 +1658,6 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     /* Live mapping of shared info structure */
     shared_info_any_t *live_shinfo = NULL;
 
-    /* base of the region in which domain memory is mapped */
-    unsigned char *region_base = NULL;
-
     /* A copy of the CPU eXtended States of the guest. */
     DECLARE_HYPERCALL_BUFFER(void, buffer);
 
@@ -852,6 +1674,12 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
     unsigned long needed_to_fix = 0;
     unsigned long total_sent    = 0;
+    unsigned long total_elided  = 0;
+    unsigned long total_lazy    = 0;
+
+    /* Lazy migration: pages left for after the tail. */
+    int lazy = (flags & XCFLAGS_LAZY);
+    unsigned long *to_lazy = NULL;
 
     uint64_t vcpumap[XC_SR_MAX_VCPUS/64] = { 1ULL };
 
@@ -904,6 +1732,17 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         return 1;
     }
 
+    if ( lazy && (!hvm || !live || debug || callbacks->checkpoint ||
+                  (flags & XCFLAGS_CHECKPOINT_COMPRESS) ||
+                  !(flags & XCFLAGS_PAGE_REFS) || !callbacks->lazy_tail) )
+    {
+        ERROR("Lazy migration needs a live save of an HVM domain, without "
+              "checkpoints, to a receiver which takes page references, "
+              "and a lazy_tail callback.");
+        errno = EINVAL;
+        return 1;
+    }
+
     outbuf_init(xch, &ob_pagebuf, OUTBUF_SIZE);
 
     memset(ctx, 0, sizeof(*ctx));
@@ -1018,6 +1857,12 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         goto out;
     }
 
+    if ( lazy && !(to_lazy = calloc(1, bitmap_size(dinfo->p2m_size))) )
+    {
+        ERROR("Couldn't allocate to_lazy array");
+        goto out;
+    }
+
     memset(to_send, 0xff, bitmap_size(dinfo->p2m_size));
 
     if ( hvm )
@@ -1039,17 +1884,10 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
     analysis_phase(xch, dom, ctx, HYPERCALL_BUFFER(to_skip), 0);
 
-    pfn_type   = malloc(ROUNDUP(MAX_BATCH_SIZE * sizeof(*pfn_type), PAGE_SHIFT));
-    pfn_batch  = calloc(MAX_BATCH_SIZE, sizeof(*pfn_batch));
-    pfn_err    = malloc(MAX_BATCH_SIZE * sizeof(*pfn_err));
-    if ( (pfn_type == NULL) || (pfn_batch == NULL) || (pfn_err == NULL) )
-    {
-        ERROR("failed to alloc memory for pfn_type and/or pfn_batch arrays");
-        errno = ENOMEM;
+    if ( save_pipeline_init(&pipeline, xch, dom, ctx, hvm, live, debug) )
         goto out;
-    }
-    memset(pfn_type, 0,
-           ROUNDUP(MAX_BATCH_SIZE * sizeof(*pfn_type), PAGE_SHIFT));
+    if ( lazy )
+        lazy_skip_init(&pipeline);
 
     /* Setup the mfn_to_pfn table mapping */
     if ( !(ctx->live_m2p = xc_map_m2p(xch, ctx->max_mfn, PROT_READ, &ctx->m2p_mfn0)) )
@@ -1118,7 +1956,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     /* Now write out each data page, canonicalising page tables as we go... */
     for ( ; ; )
     {
-        unsigned int N, batch, run;
+        unsigned int N, batch;
+        struct save_batch *b;
         char reportbuf[80];
 
         snprintf(reportbuf, sizeof(reportbuf),
@@ -1130,12 +1969,32 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         iter++;
         sent_this_iter = 0;
         skip_this_iter = 0;
+        iter_start = llgettimeofday();
         N = 0;
 
         while ( N < dinfo->p2m_size )
         {
             xc_report_progress_step(xch, N, dinfo->p2m_size);
 
+            /* Write out the oldest batch if they are all in use. */
+            while ( (b = save_batch_get(&pipeline)) == NULL )
+            {
+                b = save_batch_oldest(&pipeline);
+                if ( b->rc )
+                    goto out;
+                if ( b->run )
+                {
+                    if ( write_batch(xch, b, last_iter, ob, io_fd,
+                                     compressing ? compress_ctx : NULL,
+                                     to_lazy) )
+                        goto out;
+                    sent_this_iter += b->batch;
+                    total_elided += b->nr_elided;
+                    total_lazy += b->nr_lazy;
+                }
+                save_batch_put(&pipeline, b);
+            }
+
             if ( !last_iter )
             {
                 /* Slightly wasteful to peek the whole array every time,
@@ -1150,6 +2009,13 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                 }
             }
 
+            b->iter = iter;
+            memset(b->alloc_only, 0, sizeof(b->alloc_only));
+            /* Compressed checkpoints cannot refer to other pages. */
+            b->elide = !compressing && (flags & XCFLAGS_PAGE_REFS);
+            b->running = !last_iter;
+            b->lazy = lazy && last_iter;
+
             /* load pfn_type[] with the mfn of all the pages we're doing in
                this batch. */
             for  ( batch = 0;
@@ -1183,11 +2049,11 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                     if ( !test_bit(n, to_send) )
                         continue;
 
-                    pfn_batch[batch] = n;
+                    b->pfn_batch[batch] = n;
                     if ( hvm )
-                        pfn_type[batch] = n;
+                        b->pfn_type[batch] = n;
                     else
-                        pfn_type[batch] = pfn_to_mfn(n);
+                        b->pfn_type[batch] = pfn_to_mfn(n);
                 }
                 else
                 {
@@ -1216,16 +2082,16 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                     **  3. add in pages that still need fixup (net bufs)
                     */
 
-                    pfn_batch[batch] = n;
+                    b->pfn_batch[batch] = n;
 
                     /* Hypercall interfaces operate in PFNs for HVM guests
                      * and MFNs for PV guests */
                     if ( hvm )
-                        pfn_type[batch] = n;
+                        b->pfn_type[batch] = n;
                     else
-                        pfn_type[batch] = pfn_to_mfn(n);
+                        b->pfn_type[batch] = pfn_to_mfn(n);
                     
-                    if ( !is_mapped(pfn_type[batch]) )
+                    if ( !is_mapped(b->pfn_type[batch]) )
                     {
                         /*
                         ** not currently in psuedo-physical map -- set bit
@@ -1243,261 +2109,45 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                     {
                         needed_to_fix++;
                         DPRINTF("Fix! iter %d, pfn %x. mfn %lx\n",
-                                iter, n, pfn_type[batch]);
+                                iter, n, b->pfn_type[batch]);
                     }
 
                     clear_bit(n, to_fix);
                 }
-                
-                batch++;
-            }
 
-            if ( batch == 0 )
-                goto skip; /* vanishingly unlikely... */
-
-            region_base = xc_map_foreign_bulk(
-                xch, dom, PROT_READ, pfn_type, pfn_err, batch);
-            if ( region_base == NULL )
-            {
-                PERROR("map batch failed");
-                goto out;
-            }
+                /* First time through, only allocate superpages which are
+                   dirty already: they will be sent later anyway */
+                if ( superpages && iter == 1 && test_bit(n, to_skip) )
+                    set_bit(batch, b->alloc_only);
 
-            /* Get page types */
-            if ( xc_get_pfn_type_batch(xch, dom, batch, pfn_type) )
-            {
-                PERROR("get_pfn_type_batch failed");
-                goto out;
+                batch++;
             }
 
-            for ( run = j = 0; j < batch; j++ )
-            {
-                unsigned long gmfn = pfn_batch[j];
-
-                if ( !hvm )
-                    gmfn = pfn_to_mfn(gmfn);
-
-                if ( pfn_type[j] == XEN_DOMCTL_PFINFO_BROKEN )
-                {
-                    pfn_type[j] |= pfn_batch[j];
-                    ++run;
-                    continue;
-                }
-
-                if ( pfn_err[j] )
-                {
-                    if ( pfn_type[j] == XEN_DOMCTL_PFINFO_XTAB )
-                        continue;
-
-                    DPRINTF("map fail: page %i mfn %08lx err %d\n",
-                            j, gmfn, pfn_err[j]);
-                    pfn_type[j] = XEN_DOMCTL_PFINFO_XTAB;
-                    continue;
-                }
-
-                if ( pfn_type[j] == XEN_DOMCTL_PFINFO_XTAB )
-                {
-                    DPRINTF("type fail: page %i mfn %08lx\n", j, gmfn);
-                    continue;
-                }
-
-                if ( superpages && iter==1 && test_bit(gmfn, to_skip))
-                    pfn_type[j] = XEN_DOMCTL_PFINFO_XALLOC;
-
-                /* canonicalise mfn->pfn */
-                pfn_type[j] |= pfn_batch[j];
-                ++run;
-
-                if ( debug )
-                {
-                    if ( hvm )
-                        DPRINTF("%d pfn=%08lx sum=%08lx\n",
-                                iter,
-                                pfn_type[j],
-                                csum_page(region_base + (PAGE_SIZE*j)));
-                    else
-                        DPRINTF("%d pfn= %08lx mfn= %08lx [mfn]= %08lx"
-                                " sum= %08lx\n",
-                                iter,
-                                pfn_type[j],
-                                gmfn,
-                                mfn_to_pfn(gmfn),
-                                csum_page(region_base + (PAGE_SIZE*j)));
-                }
-            }
+            if ( batch == 0 )
+                break; /* vanishingly unlikely... */
 
-            if ( !run )
-            {
-                munmap(region_base, batch*PAGE_SIZE);
-                continue; /* bail on this batch: no valid pages */
-            }
+            b->batch = batch;
+            save_batch_queue(&pipeline, b);
 
-            if ( wrexact(io_fd, &batch, sizeof(unsigned int)) )
-            {
-                PERROR("Error when writing to state file (2)");
-                goto out;
-            }
+        } /* end of this while loop for this iteration */
 
-            if ( sizeof(unsigned long) < sizeof(*pfn_type) )
-                for ( j = 0; j < batch; j++ )
-                    ((unsigned long *)pfn_type)[j] = pfn_type[j];
-            if ( wrexact(io_fd, pfn_type, sizeof(unsigned long)*batch) )
-            {
-                PERROR("Error when writing to state file (3)");
+        /* Write out the batches still in the pipeline. */
+        while ( (b = save_batch_oldest(&pipeline)) != NULL )
+        {
+            if ( b->rc )
                 goto out;
-            }
-            if ( sizeof(unsigned long) < sizeof(*pfn_type) )
-                while ( --j >= 0 )
-                    pfn_type[j] = ((unsigned long *)pfn_type)[j];
-
-            /* entering this loop, pfn_type is now in pfns (Not mfns) */
-            run = 0;
-            for ( j = 0; j < batch; j++ )
+            if ( b->run )
             {
-                unsigned long pfn, pagetype;
-                void *spage = (char *)region_base + (PAGE_SIZE*j);
-
-                pfn      = pfn_type[j] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
-                pagetype = pfn_type[j] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
-
-                if ( pagetype != 0 )
-                {
-                    /* If the page is not a normal data page, write out any
-                       run of pages we may have previously acumulated */
-                    if ( !compressing && run )
-                    {
-                        if ( wruncached(io_fd, live,
-                                       (char*)region_base+(PAGE_SIZE*(j-run)), 
-                                       PAGE_SIZE*run) != PAGE_SIZE*run )
-                        {
-                            PERROR("Error when writing to state file (4a)"
-                                  " (errno %d)", errno);
-                            goto out;
-                        }                        
-                        run = 0;
-                    }
-                }
-
-                /*
-                 * skip pages that aren't present,
-                 * or are broken, or are alloc-only
-                 */
-                if ( pagetype == XEN_DOMCTL_PFINFO_XTAB
-                    || pagetype == XEN_DOMCTL_PFINFO_BROKEN
-                    || pagetype == XEN_DOMCTL_PFINFO_XALLOC )
-                    continue;
-
-                pagetype &= XEN_DOMCTL_PFINFO_LTABTYPE_MASK;
-
-                if ( (pagetype >= XEN_DOMCTL_PFINFO_L1TAB) &&
-                     (pagetype <= XEN_DOMCTL_PFINFO_L4TAB) )
-                {
-                    /* We have a pagetable page: need to rewrite it. */
-                    race = 
-                        canonicalize_pagetable(ctx, pagetype, pfn, spage, page); 
-
-                    if ( race && !live )
-                    {
-                        ERROR("Fatal PT race (pfn %lx, type %08lx)", pfn,
-                              pagetype);
-                        goto out;
-                    }
-
-                    if (compressing)
-                    {
-                        int c_err;
-                        /* Mark pagetable page to be sent uncompressed */
-                        c_err = xc_compression_add_page(xch, compress_ctx, page,
-                                                        pfn, 1 /* raw page */);
-                        if (c_err == -2) /* OOB PFN */
-                        {
-                            ERROR("Could not add pagetable page "
-                                  "(pfn:%" PRIpfn "to page buffer\n", pfn);
-                            goto out;
-                        }
-
-                        if (c_err == -1)
-                        {
-                            /*
-                             * We are out of buffer space to hold dirty
-                             * pages. Compress and flush the current buffer
-                             * to make space. This is a corner case, that
-                             * slows down checkpointing as the compression
-                             * happens while domain is suspended. Happens
-                             * seldom and if you find this occuring
-                             * frequently, increase the PAGE_BUFFER_SIZE
-                             * in xc_compression.c.
-                             */
-                            if (wrcompressed(io_fd) < 0)
-                            {
-                                ERROR("Error when writing compressed"
-                                      " data (4b)\n");
-                                goto out;
-                            }
-                        }
-                    }
-                    else if ( wruncached(io_fd, live, page,
-                                         PAGE_SIZE) != PAGE_SIZE )
-                    {
-                        PERROR("Error when writing to state file (4b)"
-                              " (errno %d)", errno);
-                        goto out;
-                    }
-                }
-                else
-                {
-                    /* We have a normal page: accumulate it for writing. */
-                    if (compressing)
-                    {
-                        int c_err;
-                        /* For checkpoint compression, accumulate the page in the
-                         * page buffer, to be compressed later.
-                         */
-                        c_err = xc_compression_add_page(xch, compress_ctx, spage,
-                                                        pfn, 0 /* not raw page */);
-
-                        if (c_err == -2) /* OOB PFN */
-                        {
-                            ERROR("Could not add page "
-                                  "(pfn:%" PRIpfn "to page buffer\n", pfn);
-                            goto out;
-                        }
-
-                        if (c_err == -1)
-                        {
-                            if (wrcompressed(io_fd) < 0)
-                            {
-                                ERROR("Error when writing compressed"
-                                      " data (4c)\n");
-                                goto out;
-                            }
-                        }
-                    }
-                    else
-                        run++;
-                }
-            } /* end of the write out for this batch */
-
-            if ( run )
-            {
-                /* write out the last accumulated run of pages */
-                if ( wruncached(io_fd, live,
-                               (char*)region_base+(PAGE_SIZE*(j-run)), 
-                               PAGE_SIZE*run) != PAGE_SIZE*run )
-                {
-                    PERROR("Error when writing to state file (4c)"
-                          " (errno %d)", errno);
+                if ( write_batch(xch, b, last_iter, ob, io_fd,
+                                 compressing ? compress_ctx : NULL,
+                                 to_lazy) )
                     goto out;
-                }                        
+                sent_this_iter += b->batch;
+                total_elided += b->nr_elided;
+                total_lazy += b->nr_lazy;
             }
-
-            sent_this_iter += batch;
-
-            munmap(region_base, batch*PAGE_SIZE);
-
-        } /* end of this while loop for this iteration */
-
-      skip:
+            save_batch_put(&pipeline, b);
+        }
 
         xc_report_progress_step(xch, dinfo->p2m_size, dinfo->p2m_size);
 
@@ -1510,6 +2160,10 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
             DPRINTF("Total pages sent= %ld (%.2fx)\n",
                     total_sent, ((float)total_sent)/dinfo->p2m_size );
             DPRINTF("(of which %ld were fixups)\n", needed_to_fix  );
+            DPRINTF("(and %ld were zero or duplicates, not sent in full)\n",
+                    total_elided - total_lazy);
+            if ( lazy )
+                DPRINTF("(and %ld are left for the lazy phase)\n", total_lazy);
         }
 
         if ( last_iter && debug )
@@ -1534,8 +2188,47 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
         if ( live )
         {
-            if ( (iter >= max_iters) ||
-                 (sent_this_iter+skip_this_iter < 50) ||
+            int stop = 0;
+
+            measure_iteration(xch, dom, iter, sent_this_iter, skip_this_iter,
+                              iter_start, &iter_stats);
+            DPRINTF("iter %d: %"PRIu64" pages/s sent, %"PRIu64" pages/s "
+                    "dirtied, %"PRIu64" dirty, last pass ~%"PRIu64"ms\n",
+                    iter, iter_stats.send_rate, iter_stats.dirty_rate,
+                    iter_stats.pages_dirty, iter_stats.projected_downtime_ms);
+
+            if ( target_downtime_ms )
+            {
+                /* Stop as soon as the last pass would be short enough, or
+                 * once more passes cannot make it any shorter. */
+                if ( iter_stats.projected_downtime_ms <= target_downtime_ms )
+                    stop = 1;
+                else if ( iter > 1 &&
+                          iter_stats.dirty_rate >= iter_stats.send_rate )
+                {
+                    DPRINTF("Dirtying pages faster than they are sent\n");
+                    stop = 1;
+                }
+            }
+            else if ( sent_this_iter+skip_this_iter < 50 )
+                stop = 1;
+
+            if ( callbacks->iteration )
+            {
+                frc = callbacks->iteration(&iter_stats, callbacks->data);
+                if ( frc < 0 )
+                {
+                    ERROR("Save aborted by iteration callback");
+                    goto out;
+                }
+                if ( frc > 0 )
+                    stop = 1;
+            }
+
+            /* Lazily, whatever is still dirty after the first pass is
+             * fetched after the domain has been resumed at the far end. */
+            if ( stop || lazy ||
+                 (iter >= max_iters) ||
                  (total_sent > dinfo->p2m_size*max_factor) )
             {
                 DPRINTF("Start last iteration\n");
@@ -1831,6 +2524,11 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
             goto out;
         }
         
+        if ( total_lazy &&
+             send_lazy_pages(xch, dom, io_fd, ob, callbacks, to_lazy,
+                             dinfo->p2m_size, total_lazy) )
+            goto out;
+
         /* HVM guests are done now */
         rc = 0;
         goto out;
@@ -2110,6 +2808,9 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
             DPRINTF("Warning - couldn't disable qemu log-dirty mode");
     }
 
+    if ( pipeline.xch )
+        save_pipeline_destroy(&pipeline);
+
     if (compress_ctx)
         xc_compression_free_context(xch, compress_ctx);
 
@@ -2125,10 +2826,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     xc_hypercall_buffer_free_pages(xch, to_send, NRPAGES(bitmap_size(dinfo->p2m_size)));
     xc_hypercall_buffer_free_pages(xch, to_skip, NRPAGES(bitmap_size(dinfo->p2m_size)));
 
-    free(pfn_type);
-    free(pfn_batch);
-    free(pfn_err);
     free(to_fix);
+    free(to_lazy);
     free(hvm_buf);
     outbuf_free(&ob_pagebuf);
 
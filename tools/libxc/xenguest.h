@@ -28,10 +28,27 @@
 #define XCFLAGS_HVM       (1 << 2)
 #define XCFLAGS_STDVGA    (1 << 3)
 #define XCFLAGS_CHECKPOINT_COMPRESS    (1 << 4)
+/* The receiver understands XC_SAVE_ID_PAGE_REFS chunks. */
+#define XCFLAGS_PAGE_REFS (1 << 5)
+/* Post-copy: leave the pages still dirty for after the tail, see below.
+ * Needs XCFLAGS_PAGE_REFS too. */
+#define XCFLAGS_LAZY      (1 << 6)
 
 #define X86_64_B_SIZE   64 
 #define X86_32_B_SIZE   32
 
+/* How one pass of a live save went, see save_callbacks->iteration. */
+struct save_iter_stats {
+    uint32_t iter;                  /* pass number, from 1 */
+    uint64_t pages_sent;            /* pages sent in the pass */
+    uint64_t pages_skipped;         /* pages skipped as dirty again */
+    uint64_t pages_dirty;           /* pages dirtied since it started */
+    uint64_t duration_ms;           /* wall time the pass took */
+    uint64_t send_rate;             /* pages sent per second */
+    uint64_t dirty_rate;            /* pages dirtied per second */
+    uint64_t projected_downtime_ms; /* time to send pages_dirty */
+};
+
 /* callbacks provided by xc_domain_save */
 struct save_callbacks {
     /* Called after expiration of checkpoint interval,
@@ -72,6 +89,24 @@ struct save_callbacks {
      */
     int (*toolstack_save)(uint32_t domid, uint8_t **buf, uint32_t *len, void *data);
 
+    /* Lazy (post-copy) migration only, see XCFLAGS_LAZY: called once the
+     * domain's state has been written to fd, before the pages left behind
+     * are sent.  The device model state must be written here, since the
+     * restoring side needs it before it can resume the domain: as the
+     * usual "DeviceModelRecord0002" record (signature, 32-bit length,
+     * data), which xc_domain_restore reads as the end of the tail, so no
+     * restore callback is needed for it.
+     */
+    int (*lazy_tail)(uint32_t domid, int fd, void *data); /* HVM only */
+
+    /* Called after each pass of a live save but the last.
+     *
+     * returns:
+     * 0: carry on, suspending the domain when xc_domain_save sees fit
+     * 1: suspend the domain now and do the last pass
+     * -1: abort the save */
+    int (*iteration)(const struct save_iter_stats *stats, void *data);
+
     /* to be provided as the last argument to each callback function */
     void* data;
 };
@@ -79,13 +114,27 @@ struct save_callbacks {
 /**
  * This function will save a running domain.
  *
+ * With XCFLAGS_LAZY (live HVM saves only), the pages still dirty after the
+ * first pass are not copied before the domain's state is sent: they follow
+ * the state, so the far end can resume the domain straight away and fetch
+ * them on demand.  If io_fd is a socket the far end asks for the pages its
+ * guest faults on over it, and those are sent first.  The domain stays
+ * suspended until all its pages have been sent.
+ *
  * @parm xch a handle to an open hypervisor interface
  * @parm fd the file descriptor to save a domain to
  * @parm dom the id of the domain
+ * @parm max_iters the most passes a live save makes before the last one
+ * @parm max_factor the most pages a live save sends, as a multiple of the
+ *       domain's size, before the last pass
+ * @parm target_downtime_ms if non-zero, a live save suspends the domain as
+ *       soon as the last pass is expected to take less than this long, or
+ *       when the domain dirties pages faster than they can be sent
  * @return 0 on success, -1 on failure
  */
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iters,
-                   uint32_t max_factor, uint32_t flags /* XCFLAGS_xxx */,
+                   uint32_t max_factor, uint32_t target_downtime_ms,
+                   uint32_t flags /* XCFLAGS_xxx */,
                    struct save_callbacks* callbacks, int hvm,
                    unsigned long vm_generationid_addr);
 
@@ -96,6 +145,16 @@ struct restore_callbacks {
     int (*toolstack_restore)(uint32_t domid, const uint8_t *buf,
             uint32_t size, void* data);
 
+    /* Lazy (post-copy) migration only: called once the domain is ready to
+     * run, while the pages left behind by the saving side are still being
+     * fetched.  *store_mfn, *console_mfn and *vm_generationid_addr are set
+     * by then.  Once this returns, the toolstack may finish setting up the
+     * domain (and its device model) and unpause it, while the pages
+     * continue to be fetched until the end of the stream.  If NULL, all
+     * the pages are fetched before returning.
+     */
+    int (*lazy_resume)(uint32_t domid, void *data);
+
     /* to be provided as the last argument to each callback function */
     void* data;
 };
@@ -82,6 +82,19 @@
  *     page data        : PAGE_SIZE bytes for each page marked present in PFN
  *                        array
  *
+ * A batch may be preceded by an XC_SAVE_ID_PAGE_REFS chunk (only if the
+ * saver was given XCFLAGS_PAGE_REFS), in which case the pages it marks as
+ * zero or as copies are left out of the page data:
+ *
+ *     uint32_t         : number of pages in the batch
+ *     uint32_t[]       : for each page in the batch, XC_PAGE_REF_DATA if
+ *                        its data is sent, XC_PAGE_REF_ZERO if it is all
+ *                        zeroes, or else the index among the pages whose
+ *                        data is sent in the batch of one with the same
+ *                        contents, or XC_PAGE_REF_LAZY if it is sent
+ *                        in the LAZY PHASE.  Only pages of type
+ *                        XEN_DOMCTL_PFINFO_NOTAB are left out.
+ *
  * If the chunk type is -ve then chunk consists of one of a number of
  * metadata types.  See definitions of XC_SAVE_ID_* below.
  *
@@ -238,6 +251,19 @@
  *                        present in extended-info header)
  *
  *  Shared Info Page    : 4096 bytes of shared info page
+ *
+ * LAZY PHASE (HVM only, present iff any page was marked XC_PAGE_REF_LAZY)
+ * ----------
+ *
+ * Follows the Qemu context, which is written by the toolstack.  A series of
+ * records, one for each lazy page, in no particular order:
+ *     uint64_t         : PFN
+ *     bytes            : PAGE_SIZE bytes of page data
+ * terminated by a PFN of XC_LAZY_PFN_END.
+ *
+ * While this is going on the restoring side may write uint64_t PFNs of lazy
+ * pages its guest is waiting for back down the stream, if the stream is a
+ * socket, and the saving side sends those first.
  */
 
 #define XC_SAVE_ID_ENABLE_VERIFY_MODE -1 /* Switch to validation phase. */
@@ -259,6 +285,15 @@
 #define XC_SAVE_ID_HVM_ACCESS_RING_PFN  -16
 #define XC_SAVE_ID_HVM_SHARING_RING_PFN -17
 #define XC_SAVE_ID_TOOLSTACK          -18 /* Optional toolstack specific info */
+#define XC_SAVE_ID_PAGE_REFS          -19 /* Pages of next batch not sent */
+
+/* Entries of an XC_SAVE_ID_PAGE_REFS chunk. */
+#define XC_PAGE_REF_DATA  0xffffffffU
+#define XC_PAGE_REF_ZERO  0xfffffffeU
+#define XC_PAGE_REF_LAZY  0xfffffffdU
+
+/* End of the lazy phase. */
+#define XC_LAZY_PFN_END   (~0ULL)
 
 /*
 ** We process save/restore/migrate in batches of pages; the below
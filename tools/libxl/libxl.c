@@ -774,6 +774,13 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
         goto out_err;
     }
 
+    if ((flags & LIBXL_SUSPEND_LAZY) &&
+        (type != LIBXL_DOMAIN_TYPE_HVM || !(flags & LIBXL_SUSPEND_LIVE))) {
+        LOG(ERROR, "lazy migration needs a live save of an HVM domain");
+        rc = ERROR_INVAL;
+        goto out_err;
+    }
+
     libxl__domain_suspend_state *dss;
     GCNEW(dss);
 
@@ -785,6 +792,8 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
     dss->type = type;
     dss->live = flags & LIBXL_SUSPEND_LIVE;
     dss->debug = flags & LIBXL_SUSPEND_DEBUG;
+    dss->page_refs = flags & LIBXL_SUSPEND_PAGE_REFS;
+    dss->lazy = flags & LIBXL_SUSPEND_LAZY;
 
     libxl__domain_suspend(egc, dss);
     return AO_INPROGRESS;
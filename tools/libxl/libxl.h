@@ -336,6 +336,24 @@
  */
 #define LIBXL_HAVE_DOMINFO_OUTSTANDING_MEMKB 1
 
+/*
+ * LIBXL_HAVE_SUSPEND_PAGE_REFS
+ *
+ * If this is defined, libxl_domain_suspend takes LIBXL_SUSPEND_PAGE_REFS,
+ * and libxl_domain_create_restore can read the streams it produces.
+ */
+#define LIBXL_HAVE_SUSPEND_PAGE_REFS 1
+
+/*
+ * LIBXL_HAVE_SUSPEND_LAZY
+ *
+ * If this is defined, libxl_domain_suspend takes LIBXL_SUSPEND_LAZY, and
+ * libxl_domain_create_restore can read the streams it produces.  If the
+ * rest of the memory is still arriving once the new domain is set up, it
+ * unpauses the domain then, and returns once all of it has arrived.
+ */
+#define LIBXL_HAVE_SUSPEND_LAZY 1
+
 /* Functions annotated with LIBXL_EXTERNAL_CALLERS_ONLY may not be
  * called from within libxl itself. Callers outside libxl, who
  * do not #include libxl_internal.h, are fine. */
@@ -576,6 +594,14 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd,
                          LIBXL_EXTERNAL_CALLERS_ONLY;
 #define LIBXL_SUSPEND_DEBUG 1
 #define LIBXL_SUSPEND_LIVE 2
+/* Leave zero and duplicate pages out of the stream.  Only for a receiver
+ * which understands this, see LIBXL_HAVE_SUSPEND_PAGE_REFS. */
+#define LIBXL_SUSPEND_PAGE_REFS 4
+/* Post-copy: suspend the domain after one pass, and send the memory it
+ * dirtied meanwhile after its state, so that the receiver can run it
+ * without waiting for all of it.  Live saves of HVM domains only, to a
+ * receiver with LIBXL_HAVE_SUSPEND_LAZY; implies LIBXL_SUSPEND_PAGE_REFS. */
+#define LIBXL_SUSPEND_LAZY 8
 
 /* @param suspend_cancel [from xenctrl.h:xc_domain_resume( @param fast )]
  *   If this parameter is true, use co-operative resume. The guest
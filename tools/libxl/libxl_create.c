@@ -582,6 +582,10 @@ static int store_libxl_entry(libxl__gc *gc, uint32_t domid,
  * arranges for the next to be called, as the very last thing it
  * does.  (If that particular sub-operation is not needed, a
  * function will call the next event callback directly.)
+ *
+ * The exception is a lazy (post-copy) restore: the save helper goes
+ * on paging the domain in after domcreate_lazy_resume, while the rest
+ * of the sequence runs, and domcreate_complete waits for both.
  */
 
 /* Event callbacks, in this order: */
@@ -605,6 +609,9 @@ static void domcreate_attach_pci(libxl__egc *egc, libxl__multidev *aodevs,
 static void domcreate_console_available(libxl__egc *egc,
                                         libxl__domain_create_state *dcs);
 
+static void domcreate_restored(libxl__egc *egc,
+                               libxl__domain_create_state *dcs,
+                               int ret);
 static void domcreate_rebuild_done(libxl__egc *egc,
                                    libxl__domain_create_state *dcs,
                                    int ret);
@@ -614,6 +621,12 @@ static void domcreate_rebuild_done(libxl__egc *egc,
 static void domcreate_complete(libxl__egc *egc,
                                libxl__domain_create_state *dcs,
                                int rc);
+static void domcreate_finish(libxl__egc *egc,
+                             libxl__domain_create_state *dcs,
+                             int rc);
+
+/* Called by the save helper during a lazy restore */
+static void domcreate_lazy_resume(uint32_t domid, void *user);
 
 /* If creation is not successful, this callback will be executed
  * when domain destruction is finished */
@@ -762,6 +775,7 @@ static void domcreate_bootloader_done(libxl__egc *egc,
         superpages = 1;
         pae = libxl_defbool_val(info->u.hvm.pae);
         callbacks->toolstack_restore = libxl__toolstack_restore;
+        callbacks->lazy_resume = domcreate_lazy_resume;
         break;
     case LIBXL_DOMAIN_TYPE_PV:
         hvm = 0;
@@ -794,32 +808,86 @@ void libxl__srm_callout_callback_restore_results(unsigned long store_mfn,
     shs->need_results =           0;
 }
 
+/*
+ * A lazy stream leaves some of the domain's memory for after its state.
+ * The helper calls us once the domain could run, and then pages that
+ * memory in as the guest and its device model touch it, until the end
+ * of the stream.  Meanwhile we set the domain up as usual and unpause
+ * it, but only complete once the helper has finished.
+ */
+static void domcreate_lazy_resume(uint32_t domid, void *user)
+{
+    libxl__save_helper_state *shs = user;
+    libxl__domain_create_state *dcs = CONTAINER_OF(shs, *dcs, shs);
+    libxl__egc *egc = shs->egc;
+    STATE_AO_GC(dcs->ao);
+
+    LOG(DEBUG, "domain %"PRIu32" restored lazily, rest of memory to follow",
+        domid);
+    dcs->lazy_restoring = 1;
+    libxl__xc_domain_saverestore_async_callback_done(egc, shs, 0);
+    domcreate_restored(egc, dcs, 0);
+}
+
 void libxl__xc_domain_restore_done(libxl__egc *egc, void *dcs_void,
                                    int ret, int retval, int errnoval)
 {
     libxl__domain_create_state *dcs = dcs_void;
     STATE_AO_GC(dcs->ao);
     libxl_ctx *ctx = libxl__gc_owner(gc);
+    int esave, flags;
+
+    /* convenience aliases */
+    const int fd = dcs->restore_fd;
+
+    if (!ret && retval) {
+        LOGEV(ERROR, errnoval, "restoring domain");
+        ret = ERROR_FAIL;
+    }
+
+    esave = errno;
+
+    flags = fcntl(fd, F_GETFL);
+    if (flags == -1) {
+        LIBXL__LOG_ERRNO(ctx, LIBXL__LOG_ERROR, "unable to get flags on restore fd");
+    } else {
+        flags &= ~O_NONBLOCK;
+        if (fcntl(fd, F_SETFL, flags) == -1)
+            LIBXL__LOG_ERRNO(ctx, LIBXL__LOG_ERROR, "unable to put restore fd"
+                         " back to blocking mode");
+    }
+
+    errno = esave;
+
+    if (dcs->lazy_restoring) {
+        dcs->lazy_restoring = 0;
+        dcs->lazy_rc = ret;
+        if (dcs->lazy_created)
+            domcreate_finish(egc, dcs, dcs->lazy_create_rc ? : ret);
+        return;
+    }
+
+    domcreate_restored(egc, dcs, ret);
+}
+
+static void domcreate_restored(libxl__egc *egc,
+                               libxl__domain_create_state *dcs,
+                               int ret)
+{
+    STATE_AO_GC(dcs->ao);
     char **vments = NULL, **localents = NULL;
     struct timeval start_time;
-    int i, esave, flags;
+    int i;
 
     /* convenience aliases */
     const uint32_t domid = dcs->guest_domid;
     libxl_domain_config *const d_config = dcs->guest_config;
     libxl_domain_build_info *const info = &d_config->b_info;
     libxl__domain_build_state *const state = &dcs->build_state;
-    const int fd = dcs->restore_fd;
 
     if (ret)
         goto out;
 
-    if (retval) {
-        LOGEV(ERROR, errnoval, "restoring domain");
-        ret = ERROR_FAIL;
-        goto out;
-    }
-
     gettimeofday(&start_time, NULL);
 
     switch (info->type) {
@@ -869,19 +937,6 @@ out:
         libxl__file_reference_unmap(&state->pv_ramdisk);
     }
 
-    esave = errno;
-
-    flags = fcntl(fd, F_GETFL);
-    if (flags == -1) {
-        LIBXL__LOG_ERRNO(ctx, LIBXL__LOG_ERROR, "unable to get flags on restore fd");
-    } else {
-        flags &= ~O_NONBLOCK;
-        if (fcntl(fd, F_SETFL, flags) == -1)
-            LIBXL__LOG_ERRNO(ctx, LIBXL__LOG_ERROR, "unable to put restore fd"
-                         " back to blocking mode");
-    }
-
-    errno = esave;
     domcreate_rebuild_done(egc, dcs, ret);
 }
 
@@ -1184,6 +1239,27 @@ static void domcreate_complete(libxl__egc *egc,
     if (!rc && d_config->b_info.exec_ssidref)
         rc = xc_flask_relabel_domain(CTX->xch, dcs->guest_domid, d_config->b_info.exec_ssidref);
 
+    if (dcs->lazy_restoring) {
+        /* Let the guest run on the memory it has while the rest arrives;
+         * if we failed, stop the helper rather than wait for all of it. */
+        if (!rc)
+            rc = libxl_domain_unpause(CTX, dcs->guest_domid);
+        if (rc)
+            libxl__save_helper_abort(egc, &dcs->shs);
+        dcs->lazy_created = 1;
+        dcs->lazy_create_rc = rc;
+        return;
+    }
+
+    domcreate_finish(egc, dcs, rc ? : dcs->lazy_rc);
+}
+
+static void domcreate_finish(libxl__egc *egc,
+                             libxl__domain_create_state *dcs,
+                             int rc)
+{
+    STATE_AO_GC(dcs->ao);
+
     if (rc) {
         if (dcs->guest_domid) {
             dcs->dds.ao = ao;
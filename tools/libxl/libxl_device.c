@@ -83,18 +83,15 @@ out:
     return rc;
 }
 
-int libxl__device_generic_add(libxl__gc *gc, xs_transaction_t t,
-        libxl__device *device, char **bents, char **fents, char **ro_fents)
+/* Add the xenstore changes which create a device to batch m.  Returns
+ * false, setting errno, if they cannot all be added. */
+static bool device_generic_add_ops(libxl__gc *gc, struct xs_multi *m,
+        libxl__device *device, const char *frontend_path,
+        const char *backend_path, char **bents, char **fents, char **ro_fents)
 {
-    libxl_ctx *ctx = libxl__gc_owner(gc);
-    char *frontend_path, *backend_path;
     struct xs_permissions frontend_perms[2];
     struct xs_permissions ro_frontend_perms[2];
     struct xs_permissions backend_perms[2];
-    int create_transaction = t == XBT_NULL;
-
-    frontend_path = libxl__device_frontend_path(gc, device);
-    backend_path = libxl__device_backend_path(gc, device);
 
     frontend_perms[0].id = device->domid;
     frontend_perms[0].perms = XS_PERM_NONE;
@@ -106,42 +103,105 @@ int libxl__device_generic_add(libxl__gc *gc, xs_transaction_t t,
     ro_frontend_perms[1].id = backend_perms[1].id = device->domid;
     ro_frontend_perms[1].perms = backend_perms[1].perms = XS_PERM_READ;
 
-retry_transaction:
-    if (create_transaction)
-        t = xs_transaction_start(ctx->xsh);
     /* FIXME: read frontend_path and check state before removing stuff */
 
+    /* Failures of the individual ops, eg. removing a path which does not
+     * exist, are ignored. */
     if (fents || ro_fents) {
-        xs_rm(ctx->xsh, t, frontend_path);
-        xs_mkdir(ctx->xsh, t, frontend_path);
+        if (!xs_multi_rm(m, frontend_path) ||
+            !xs_multi_mkdir(m, frontend_path))
+            return false;
         /* Console 0 is a special case. It doesn't use the regular PV
          * state machine but also the frontend directory has
          * historically contained other information, such as the
          * vnc-port, which we don't want the guest fiddling with.
          */
-        if (device->kind == LIBXL__DEVICE_KIND_CONSOLE && device->devid == 0)
-            xs_set_permissions(ctx->xsh, t, frontend_path,
-                               ro_frontend_perms, ARRAY_SIZE(ro_frontend_perms));
-        else
-            xs_set_permissions(ctx->xsh, t, frontend_path,
-                               frontend_perms, ARRAY_SIZE(frontend_perms));
-        xs_write(ctx->xsh, t, libxl__sprintf(gc, "%s/backend", frontend_path), backend_path, strlen(backend_path));
-        if (fents)
-            libxl__xs_writev_perms(gc, t, frontend_path, fents,
-                                   frontend_perms, ARRAY_SIZE(frontend_perms));
-        if (ro_fents)
-            libxl__xs_writev_perms(gc, t, frontend_path, ro_fents,
-                                   ro_frontend_perms, ARRAY_SIZE(ro_frontend_perms));
+        if (device->kind == LIBXL__DEVICE_KIND_CONSOLE && device->devid == 0) {
+            if (!xs_multi_set_permissions(m, frontend_path, ro_frontend_perms,
+                                          ARRAY_SIZE(ro_frontend_perms)))
+                return false;
+        } else {
+            if (!xs_multi_set_permissions(m, frontend_path, frontend_perms,
+                                          ARRAY_SIZE(frontend_perms)))
+                return false;
+        }
+        if (!xs_multi_write(m, libxl__sprintf(gc, "%s/backend", frontend_path),
+                            backend_path, strlen(backend_path)))
+            return false;
+        if (fents &&
+            libxl__xs_multi_writev_perms(gc, m, frontend_path, fents,
+                        frontend_perms, ARRAY_SIZE(frontend_perms)))
+            return false;
+        if (ro_fents &&
+            libxl__xs_multi_writev_perms(gc, m, frontend_path, ro_fents,
+                        ro_frontend_perms, ARRAY_SIZE(ro_frontend_perms)))
+            return false;
     }
 
     if (bents) {
-        xs_rm(ctx->xsh, t, backend_path);
-        xs_mkdir(ctx->xsh, t, backend_path);
-        xs_set_permissions(ctx->xsh, t, backend_path, backend_perms, ARRAY_SIZE(backend_perms));
-        xs_write(ctx->xsh, t, libxl__sprintf(gc, "%s/frontend", backend_path), frontend_path, strlen(frontend_path));
-        libxl__xs_writev(gc, t, backend_path, bents);
+        if (!xs_multi_rm(m, backend_path) ||
+            !xs_multi_mkdir(m, backend_path) ||
+            !xs_multi_set_permissions(m, backend_path, backend_perms,
+                                      ARRAY_SIZE(backend_perms)) ||
+            !xs_multi_write(m, libxl__sprintf(gc, "%s/frontend", backend_path),
+                            frontend_path, strlen(frontend_path)))
+            return false;
+        if (libxl__xs_multi_writev_perms(gc, m, backend_path, bents, NULL, 0))
+            return false;
+    }
+
+    return true;
+}
+
+/* Send the changes for a device in batch m, which is freed. */
+static bool device_generic_add_batch(libxl__gc *gc, struct xs_multi *m,
+        libxl__device *device, const char *frontend_path,
+        const char *backend_path, char **bents, char **fents, char **ro_fents)
+{
+    if (!device_generic_add_ops(gc, m, device, frontend_path, backend_path,
+                                bents, fents, ro_fents)) {
+        xs_multi_end(m, 1);
+        return false;
+    }
+    return xs_multi_end(m, 0) >= 0;
+}
+
+int libxl__device_generic_add(libxl__gc *gc, xs_transaction_t t,
+        libxl__device *device, char **bents, char **fents, char **ro_fents)
+{
+    libxl_ctx *ctx = libxl__gc_owner(gc);
+    char *frontend_path, *backend_path;
+    struct xs_multi *m;
+    int create_transaction = t == XBT_NULL;
+
+    frontend_path = libxl__device_frontend_path(gc, device);
+    backend_path = libxl__device_backend_path(gc, device);
+
+    /*
+     * Without a transaction from the caller, xenstored can make all the
+     * changes at once in a single batch.  If they do not fit, or the batch
+     * cannot be sent, fall back to a transaction of our own.
+     */
+    if (create_transaction) {
+        m = xs_multi_start(ctx->xsh, XBT_NULL);
+        if (m && device_generic_add_batch(gc, m, device, frontend_path,
+                                          backend_path, bents, fents,
+                                          ro_fents))
+            return 0;
     }
 
+retry_transaction:
+    if (create_transaction)
+        t = xs_transaction_start(ctx->xsh);
+
+    /* As with the individual writes, only the end of the transaction
+     * decides whether we failed. */
+    m = xs_multi_start(ctx->xsh, t);
+    if (!m || !device_generic_add_batch(gc, m, device, frontend_path,
+                                        backend_path, bents, fents, ro_fents))
+        LIBXL__LOG_ERRNO(ctx, LIBXL__LOG_ERROR,
+                         "failed to write %s to xenstore", backend_path);
+
     if (!create_transaction)
         return 0;
 
@@ -1262,6 +1262,32 @@ static void remus_checkpoint_dm_saved(libxl__egc *egc,
     libxl__xc_domain_saverestore_async_callback_done(egc, &dss->shs, 1);
 }
 
+/*----- lazy (post-copy) save callback -----*/
+
+static void lazy_tail_dm_saved(libxl__egc *egc,
+                               libxl__domain_suspend_state *dss, int rc);
+
+static void libxl__domain_lazy_tail_callback(uint32_t domid, int fd,
+                                             void *data)
+{
+    libxl__save_helper_state *shs = data;
+    libxl__domain_suspend_state *dss = CONTAINER_OF(shs, *dss, shs);
+    libxl__egc *egc = dss->shs.egc;
+
+    /* The receiver needs the device model state to resume the domain,
+     * so it goes ahead of the memory left behind. */
+    libxl__domain_save_device_model(egc, dss, lazy_tail_dm_saved);
+}
+
+static void lazy_tail_dm_saved(libxl__egc *egc,
+                               libxl__domain_suspend_state *dss, int rc)
+{
+    if (!rc)
+        dss->dm_saved = 1;
+    libxl__xc_domain_saverestore_async_callback_done(egc, &dss->shs,
+                                                     rc ? -1 : 0);
+}
+
 /*----- main code for suspending, in order of execution -----*/
 
 void libxl__domain_suspend(libxl__egc *egc, libxl__domain_suspend_state *dss)
@@ -1305,6 +1331,8 @@ void libxl__domain_suspend(libxl__egc *egc, libxl__domain_suspend_state *dss)
 
     dss->xcflags = (live ? XCFLAGS_LIVE : 0)
           | (debug ? XCFLAGS_DEBUG : 0)
+          | (dss->page_refs ? XCFLAGS_PAGE_REFS : 0)
+          | (dss->lazy ? XCFLAGS_LAZY | XCFLAGS_PAGE_REFS : 0)
           | (dss->hvm ? XCFLAGS_HVM : 0);
 
     dss->suspend_eventchn = -1;
@@ -1340,6 +1368,8 @@ void libxl__domain_suspend(libxl__egc *egc, libxl__domain_suspend_state *dss)
         callbacks->checkpoint = libxl__remus_domain_checkpoint_callback;
     } else
         callbacks->suspend = libxl__domain_suspend_common_callback;
+    if (dss->lazy)
+        callbacks->lazy_tail = libxl__domain_lazy_tail_callback;
 
     callbacks->switch_qemu_logdirty = libxl__domain_suspend_common_switch_qemu_logdirty;
     dss->shs.callbacks.save.toolstack_save = libxl__toolstack_save;
@@ -1375,7 +1405,7 @@ void libxl__xc_domain_save_done(libxl__egc *egc, void *dss_void,
         goto out;
     }
 
-    if (type == LIBXL_DOMAIN_TYPE_HVM) {
+    if (type == LIBXL_DOMAIN_TYPE_HVM && !dss->dm_saved) {
         rc = libxl__domain_suspend_device_model(gc, dss);
         if (rc) goto out;
 
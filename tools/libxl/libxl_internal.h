@@ -524,6 +524,11 @@ _hidden int libxl__xs_writev_perms(libxl__gc *gc, xs_transaction_t t,
                                    const char *dir, char *kvs[],
                                    struct xs_permissions *perms,
                                    unsigned int num_perms);
+/* as writev_perms but adds the writes to a batch, see xs_multi_start */
+_hidden int libxl__xs_multi_writev_perms(libxl__gc *gc, struct xs_multi *m,
+                                         const char *dir, char *kvs[],
+                                         struct xs_permissions *perms,
+                                         unsigned int num_perms);
 /* _atonce creates a transaction and writes all keys at once */
 _hidden int libxl__xs_writev_atonce(libxl__gc *gc,
                              const char *dir, char **kvs);
@@ -2252,6 +2257,8 @@ struct libxl__domain_suspend_state {
     libxl_domain_type type;
     int live;
     int debug;
+    int page_refs;
+    int lazy;
     const libxl_domain_remus_info *remus;
     /* private */
     xc_evtchn *xce; /* event channel handle */
@@ -2261,6 +2268,7 @@ struct libxl__domain_suspend_state {
     int guest_responded;
     const char *dm_savefile;
     int interval; /* checkpoint interval (for Remus) */
+    int dm_saved; /* device model state already sent (lazy save) */
     libxl__save_helper_state shs;
     libxl__logdirty_switch logdirty;
     /* private for libxl__domain_save_device_model */
@@ -2523,6 +2531,10 @@ struct libxl__domain_create_state {
     /* necessary if the domain creation failed and we have to destroy it */
     libxl__domain_destroy_state dds;
     libxl__multidev multidev;
+    /* lazy (post-copy) restore: the helper is still paging the domain in,
+     * and the rest of domain creation, if done, is waiting for it */
+    int lazy_restoring, lazy_created;
+    int lazy_rc, lazy_create_rc;
 };
 
 /*----- Domain suspend (save) functions -----*/
@@ -2548,6 +2560,11 @@ _hidden void libxl__xc_domain_save_done(libxl__egc*, void *dss_void,
 void libxl__xc_domain_saverestore_async_callback_done(libxl__egc *egc,
                            libxl__save_helper_state *shs, int return_value);
 
+/* Kills the helper; its completion callback is then called with an
+ * error as usual. */
+_hidden void libxl__save_helper_abort(libxl__egc *egc,
+                                      libxl__save_helper_state *shs);
+
 _hidden int libxl__domain_suspend_common_callback(void *data);
 _hidden void libxl__domain_suspend_common_switch_qemu_logdirty
                                (int domid, unsigned int enable, void *data);
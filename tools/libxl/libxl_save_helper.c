@@ -183,6 +183,17 @@ static int toolstack_save_cb(uint32_t domid, uint8_t **buf,
     return 0;
 }
 
+static unsigned long restore_store_mfn, restore_console_mfn;
+static unsigned long restore_genidad;
+
+static int lazy_resume_cb(uint32_t domid, void *data)
+{
+    /* libxl needs these to set the domain up while we page it in. */
+    helper_stub_restore_results(restore_store_mfn, restore_console_mfn,
+                                restore_genidad, 0);
+    return helper_stub_lazy_resume(domid, data);
+}
+
 static void startup(const char *op) {
     logger = (xentoollog_logger*)createlogger_tellparent();
     if (!logger) {
@@ -221,6 +232,7 @@ int main(int argc, char **argv)
         uint32_t dom =             strtoul(NEXTARG,0,10);
         uint32_t max_iters =       strtoul(NEXTARG,0,10);
         uint32_t max_factor =      strtoul(NEXTARG,0,10);
+        uint32_t target_downtime = strtoul(NEXTARG,0,10);
         uint32_t flags =           strtoul(NEXTARG,0,10);
         int hvm =                  atoi(NEXTARG);
         unsigned long genidad =    strtoul(NEXTARG,0,10);
@@ -235,7 +247,8 @@ int main(int argc, char **argv)
         helper_setcallbacks_save(&helper_save_callbacks, cbflags);
 
         startup("save");
-        r = xc_domain_save(xch, io_fd, dom, max_iters, max_factor, flags,
+        r = xc_domain_save(xch, io_fd, dom, max_iters, max_factor,
+                           target_downtime, flags,
                            &helper_save_callbacks, hvm, genidad);
         complete(r);
 
@@ -255,18 +268,18 @@ int main(int argc, char **argv)
         assert(!*++argv);
 
         helper_setcallbacks_restore(&helper_restore_callbacks, cbflags);
-
-        unsigned long store_mfn = 0;
-        unsigned long console_mfn = 0;
-        unsigned long genidad = 0;
+        if (helper_restore_callbacks.lazy_resume)
+            helper_restore_callbacks.lazy_resume = lazy_resume_cb;
 
         startup("restore");
-        r = xc_domain_restore(xch, io_fd, dom, store_evtchn, &store_mfn,
-                              store_domid, console_evtchn, &console_mfn,
+        r = xc_domain_restore(xch, io_fd, dom, store_evtchn,
+                              &restore_store_mfn, store_domid,
+                              console_evtchn, &restore_console_mfn,
                               console_domid, hvm, pae, superpages,
-                              no_incr_genidad, 0, &genidad,
+                              no_incr_genidad, 0, &restore_genidad,
                               &helper_restore_callbacks);
-        helper_stub_restore_results(store_mfn,console_mfn,genidad,0);
+        helper_stub_restore_results(restore_store_mfn, restore_console_mfn,
+                                    restore_genidad, 0);
         complete(r);
 
     } else {
@@ -36,6 +36,9 @@ our @msgs = (
                                               'unsigned long', 'genidad'] ],
     [  9, 'srW',    "complete",              [qw(int retval
                                                  int errnoval)] ],
+    [ 10, 'scxA',   "lazy_tail",             [qw(uint32_t domid
+                                                 int fd)] ],
+    [ 11, 'rcxA',   "lazy_resume",           [qw(uint32_t domid)] ],
 );
 
 #----------------------------------------
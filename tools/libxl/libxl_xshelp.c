@@ -65,6 +65,30 @@ int libxl__xs_writev_perms(libxl__gc *gc, xs_transaction_t t,
     return 0;
 }
 
+int libxl__xs_multi_writev_perms(libxl__gc *gc, struct xs_multi *m,
+                                 const char *dir, char *kvs[],
+                                 struct xs_permissions *perms,
+                                 unsigned int num_perms)
+{
+    char *path;
+    int i;
+
+    if (!kvs)
+        return 0;
+
+    for (i = 0; kvs[i] != NULL; i += 2) {
+        path = libxl__sprintf(gc, "%s/%s", dir, kvs[i]);
+        if (path && kvs[i + 1]) {
+            int length = strlen(kvs[i + 1]);
+            if (!xs_multi_write(m, path, kvs[i + 1], length))
+                return ERROR_FAIL;
+            if (perms && !xs_multi_set_permissions(m, path, perms, num_perms))
+                return ERROR_FAIL;
+        }
+    }
+    return 0;
+}
+
 int libxl__xs_writev(libxl__gc *gc, xs_transaction_t t,
                      const char *dir, char *kvs[])
 {
@@ -3265,7 +3265,7 @@ static void save_domain_core_writeconfig(int fd, const char *source,
 }
 
 static int save_domain(uint32_t domid, const char *filename, int checkpoint,
-                const char *override_config_file)
+                       int page_refs, const char *override_config_file)
 {
     int fd;
     uint8_t *config_data;
@@ -3286,7 +3286,9 @@ static int save_domain(uint32_t domid, const char *filename, int checkpoint,
 
     save_domain_core_writeconfig(fd, filename, config_data, config_len);
 
-    int rc = libxl_domain_suspend(ctx, domid, fd, 0, NULL);
+    int rc = libxl_domain_suspend(ctx, domid, fd,
+                                  page_refs ? LIBXL_SUSPEND_PAGE_REFS : 0,
+                                  NULL);
     close(fd);
 
     if (rc < 0)
@@ -3446,6 +3448,7 @@ static void migrate_do_preamble(int send_fd, int recv_fd, pid_t child,
 }
 
 static void migrate_domain(uint32_t domid, const char *rune, int debug,
+                           int page_refs, int lazy,
                            const char *override_config_file)
 {
     pid_t child = -1;
@@ -3474,6 +3477,10 @@ static void migrate_domain(uint32_t domid, const char *rune, int debug,
 
     if (debug)
         flags |= LIBXL_SUSPEND_DEBUG;
+    if (page_refs)
+        flags |= LIBXL_SUSPEND_PAGE_REFS;
+    if (lazy)
+        flags |= LIBXL_SUSPEND_LAZY;
     rc = libxl_domain_suspend(ctx, domid, send_fd, flags, NULL);
     if (rc) {
         fprintf(stderr, "migration sender: libxl_domain_suspend failed"
@@ -3836,13 +3843,16 @@ int main_save(int argc, char **argv)
     uint32_t domid;
     const char *filename;
     const char *config_filename = NULL;
-    int checkpoint = 0;
+    int checkpoint = 0, page_refs = 0;
     int opt;
 
-    SWITCH_FOREACH_OPT(opt, "c", NULL, "save", 2) {
+    SWITCH_FOREACH_OPT(opt, "cz", NULL, "save", 2) {
     case 'c':
         checkpoint = 1;
         break;
+    case 'z':
+        page_refs = 1;
+        break;
     }
 
     if (argc-optind > 3) {
@@ -3855,7 +3865,7 @@ int main_save(int argc, char **argv)
     if ( argc - optind >= 3 )
         config_filename = argv[optind + 2];
 
-    save_domain(domid, filename, checkpoint, config_filename);
+    save_domain(domid, filename, checkpoint, page_refs, config_filename);
     return 0;
 }
 
@@ -3866,14 +3876,14 @@ int main_migrate(int argc, char **argv)
     const char *ssh_command = "ssh";
     char *rune = NULL;
     char *host;
-    int opt, daemonize = 1, monitor = 1, debug = 0;
+    int opt, daemonize = 1, monitor = 1, debug = 0, page_refs = 0, lazy = 0;
     static struct option opts[] = {
         {"debug", 0, 0, 0x100},
         COMMON_LONG_OPTS,
         {0, 0, 0, 0}
     };
 
-    SWITCH_FOREACH_OPT(opt, "FC:s:e", opts, "migrate", 2) {
+    SWITCH_FOREACH_OPT(opt, "FC:s:ezl", opts, "migrate", 2) {
     case 'C':
         config_filename = optarg;
         break;
@@ -3887,6 +3897,12 @@ int main_migrate(int argc, char **argv)
         daemonize = 0;
         monitor = 0;
         break;
+    case 'z':
+        page_refs = 1;
+        break;
+    case 'l':
+        lazy = 1;
+        break;
     case 0x100:
         debug = 1;
         break;
@@ -3905,7 +3921,7 @@ int main_migrate(int argc, char **argv)
             return 1;
     }
 
-    migrate_domain(domid, rune, debug, config_filename);
+    migrate_domain(domid, rune, debug, page_refs, lazy, config_filename);
     return 0;
 }
 
@@ -142,7 +142,9 @@ struct cmd_spec cmd_table[] = {
       "Save a domain state to restore later",
       "[options] <Domain> <CheckpointFile> [<ConfigFile>]",
       "-h  Print this help.\n"
-      "-c  Leave domain running after creating the snapshot."
+      "-c  Leave domain running after creating the snapshot.\n"
+      "-z  Leave zero and duplicate pages out of the state file.  It can\n"
+      "    then only be restored by a version of xl which supports this."
     },
     { "migrate",
       &main_migrate, 0, 1,
@@ -155,6 +157,10 @@ struct cmd_spec cmd_table[] = {
       "                migrate-receive [-d -e]\n"
       "-e              Do not wait in the background (on <host>) for the death\n"
       "                of the domain.\n"
+      "-z              Leave zero and duplicate pages out of the stream.  Only\n"
+      "                use this if xl on <host> supports it.\n"
+      "-l              Post-copy: start the domain on <host> before all its\n"
+      "                memory has been sent (HVM only, implies -z).\n"
       "--debug         Print huge (!) amount of debug during the migration process."
     },
     { "dump-core",
@@ -166,20 +166,23 @@ static int switch_qemu_logdirty(int domid, unsigned int enable, void *data)
 int
 main(int argc, char **argv)
 {
-    unsigned int maxit, max_f, lflags;
+    unsigned int maxit, max_f, downtime_ms, lflags;
     int io_fd, ret, port;
     struct save_callbacks callbacks;
     xentoollog_level lvl;
     xentoollog_logger *l;
 
-    if (argc != 6)
-        errx(1, "usage: %s iofd domid maxit maxf flags", argv[0]);
+    if (argc != 6 && argc != 7)
+        errx(1, "usage: %s iofd domid maxit maxf flags [downtime_ms]",
+             argv[0]);
 
     io_fd = atoi(argv[1]);
     si.domid = atoi(argv[2]);
     maxit = atoi(argv[3]);
     max_f = atoi(argv[4]);
     si.flags = atoi(argv[5]);
+    /* Target downtime of a live save, or 0 for the old stop conditions. */
+    downtime_ms = argc > 6 ? atoi(argv[6]) : 0;
 
     si.suspend_evtchn = -1;
 
@@ -212,8 +215,8 @@ main(int argc, char **argv)
     memset(&callbacks, 0, sizeof(callbacks));
     callbacks.suspend = suspend;
     callbacks.switch_qemu_logdirty = switch_qemu_logdirty;
-    ret = xc_domain_save(si.xch, io_fd, si.domid, maxit, max_f, si.flags, 
-                         &callbacks, !!(si.flags & XCFLAGS_HVM), 0);
+    ret = xc_domain_save(si.xch, io_fd, si.domid, maxit, max_f, downtime_ms,
+                         si.flags, &callbacks, !!(si.flags & XCFLAGS_HVM), 0);
 
     if (si.suspend_evtchn > 0)
 	 xc_suspend_evtchn_release(si.xch, si.xce, si.domid, si.suspend_evtchn);
@@ -49,6 +49,7 @@
 #define XS_UNWATCH_FILTER     1UL<<2
 
 struct xs_handle;
+struct xs_multi;
 typedef uint32_t xs_transaction_t;
 
 /* IMPORTANT: For details on xenstore protocol limits, see
@@ -197,6 +198,33 @@ xs_transaction_t xs_transaction_start(struct xs_handle *h);
 bool xs_transaction_end(struct xs_handle *h, xs_transaction_t t,
 			bool abort);
 
+/* Batch up changes to send to the store daemon in one request.
+ * Outside a transaction the batch is made all at once, and adding an op
+ * fails with E2BIG once it is full.  In transaction t, a full batch is
+ * just sent and a new one started.
+ * Returns NULL on failure.
+ */
+struct xs_multi *xs_multi_start(struct xs_handle *h, xs_transaction_t t);
+
+/* Add an op to the batch, as for xs_write() and friends.
+ * Returns false on failure: the op is not added.
+ */
+bool xs_multi_write(struct xs_multi *m, const char *path,
+		    const void *data, unsigned int len);
+bool xs_multi_mkdir(struct xs_multi *m, const char *path);
+bool xs_multi_rm(struct xs_multi *m, const char *path);
+bool xs_multi_set_permissions(struct xs_multi *m, const char *path,
+			      struct xs_permissions *perms,
+			      unsigned int num_perms);
+
+/* Send the batch, unless abort is true, and free m.
+ * Returns how many of the ops failed, or -1 if the batch could not be
+ * sent.  A daemon which does not support batches is sent the ops one
+ * by one in transaction t; outside a transaction, the batch fails with
+ * errno ENOSYS instead, since the ops would not be made all at once.
+ */
+int xs_multi_end(struct xs_multi *m, bool abort);
+
 /* Introduce a new domain.
  * This tells the store daemon about a shared memory page, event channel and
  * store path associated with a domain: the domain uses these to communicate.
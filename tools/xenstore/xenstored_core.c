@@ -49,6 +49,8 @@
 #include "xenstored_watch.h"
 #include "xenstored_transaction.h"
 #include "xenstored_domain.h"
+#include "xenstored_memstore.h"
+#include "xenstored_workers.h"
 #include "xenctrl.h"
 #include "tdb.h"
 
@@ -69,8 +71,14 @@ static bool recovery = true;
 static bool remove_local = true;
 static int reopen_log_pipe[2];
 static int reopen_log_pipe0_pollfd_idx = -1;
+
+/* Connections queued for service by event_loop(). */
+static LIST_HEAD(ready_connections);
+static bool use_fd_watcher;
 static char *tracefile = NULL;
 static TDB_CONTEXT *tdb_ctx = NULL;
+static bool memory_store = false;
+static unsigned int snapshot_interval = 60;
 
 static void corrupt(struct connection *conn, const char *fmt, ...);
 static void check_store(void);
@@ -89,24 +97,87 @@ int quota_nb_watch_per_domain = 128;
 int quota_max_entry_size = 2048; /* 2K */
 int quota_max_transaction = 10;
 
-TDB_CONTEXT *tdb_context(struct connection *conn)
+/* Last generation count stamped into a node record. */
+static uint64_t generation;
+
+TDB_DATA fetch_record(const void *ctx, TDB_DATA key)
 {
-	/* conn = NULL used in manual_node at setup. */
-	if (!conn || !conn->transaction)
-		return tdb_ctx;
-	return tdb_transaction_context(conn->transaction);
+	TDB_DATA data;
+
+	if (memstore_enabled())
+		return memstore_fetch(ctx, key);
+
+	data = tdb_fetch(tdb_ctx, key);
+	if (data.dptr == NULL) {
+		if (tdb_error(tdb_ctx) == TDB_ERR_NOEXIST)
+			errno = ENOENT;
+		else {
+			log("TDB error on read: %s", tdb_errorstr(tdb_ctx));
+			errno = EIO;
+		}
+	} else
+		talloc_steal(ctx, data.dptr);
+	return data;
 }
 
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb)
+bool store_record(TDB_DATA key, TDB_DATA data)
 {
-	if (!(tdb_ctx->flags & TDB_INTERNAL))
-		if (rename(newname, xs_daemon_tdb()) != 0)
-			return false;
-	tdb_close(tdb_ctx);
-	tdb_ctx = talloc_steal(talloc_autofree_context(), newtdb);
+	((struct xs_tdb_record_hdr *)data.dptr)->generation = ++generation;
+
+	if (memstore_enabled())
+		return memstore_store(key, data);
+
+	/* TDB should set errno, but doesn't even set ecode AFAICT. */
+	if (tdb_store(tdb_ctx, key, data, TDB_REPLACE) != 0) {
+		errno = EIO;
+		return false;
+	}
 	return true;
 }
 
+bool delete_record(TDB_DATA key)
+{
+	if (memstore_enabled())
+		return memstore_delete(key);
+
+	if (tdb_delete(tdb_ctx, key) != 0) {
+		errno = tdb_error(tdb_ctx) == TDB_ERR_NOEXIST ? ENOENT : EIO;
+		return false;
+	}
+	return true;
+}
+
+struct traverse_args {
+	store_traverse_fn *fn;
+	void *private;
+};
+
+static int traverse_tdb_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
+			 void *private)
+{
+	struct traverse_args *args = private;
+
+	return args->fn(key, val, args->private);
+}
+
+void traverse_store(store_traverse_fn *fn, void *private)
+{
+	struct traverse_args args = { .fn = fn, .private = private };
+
+	if (memstore_enabled())
+		memstore_traverse(fn, private);
+	else
+		tdb_traverse(tdb_ctx, &traverse_tdb_, &args);
+}
+
+/* Delete a record from the store or from a transaction's view of it. */
+static bool remove_record(struct transaction *trans, TDB_DATA key)
+{
+	if (trans)
+		return transaction_delete(trans, key);
+	return delete_record(key);
+}
+
 static char *sockmsg_string(enum xsd_sockmsg_type type)
 {
 	switch (type) {
@@ -131,6 +202,7 @@ static char *sockmsg_string(enum xsd_sockmsg_type type)
 	case XS_RESUME: return "RESUME";
 	case XS_SET_TARGET: return "SET_TARGET";
 	case XS_RESET_WATCHES: return "RESET_WATCHES";
+	case XS_MULTI: return "MULTI";
 	default:
 		return "**UNKNOWN**";
 	}
@@ -294,11 +366,14 @@ static int destroy_conn(void *_conn)
 		       && poll(&pfd, 1, 0) == 1)
 			if (!write_messages(conn))
 				break;
+		if (use_fd_watcher)
+			fd_watcher_del(conn->fd);
 		close(conn->fd);
 	}
         if (conn->target)
                 talloc_unlink(conn, conn->target);
 	list_del(&conn->list);
+	list_del(&conn->ready_list);
 	trace_destroy(conn, "connection");
 	return 0;
 }
@@ -374,6 +449,8 @@ static void initialize_fds(int sock, int *p_sock_pollfd_idx,
 			conn->pollfd_idx = set_fd(conn->fd, events);
 		}
 	}
+
+	*ptimeout = memstore_poll_timeout(*ptimeout);
 }
 
 /* Is child a subnode of parent, or equal? */
@@ -392,64 +469,93 @@ bool is_child(const char *child, const char *parent)
 	return child[len] == '/' || child[len] == '\0';
 }
 
+/* Point the node's fields into its store record. */
+static void parse_node(struct node *node, TDB_DATA data)
+{
+	struct xs_tdb_record_hdr *hdr = (void *)data.dptr;
+
+	/* Datalen, childlen, number of permissions */
+	node->num_perms = hdr->num_perms;
+	node->datalen = hdr->datalen;
+	node->childlen = hdr->childlen;
+
+	/* Permissions are struct xs_permissions. */
+	node->perms = hdr->perms;
+	/* Data is binary blob (usually ascii, no nul). */
+	node->data = node->perms + node->num_perms;
+	/* Children is strings, nul separated. */
+	node->children = node->data + node->datalen;
+}
+
 /* If it fails, returns NULL and sets errno. */
 static struct node *read_node(struct connection *conn, const char *name)
 {
 	TDB_DATA key, data;
-	uint32_t *p;
 	struct node *node;
-	TDB_CONTEXT * context = tdb_context(conn);
+	struct transaction *trans = conn ? conn->transaction : NULL;
 
 	key.dptr = (void *)name;
 	key.dsize = strlen(name);
-	data = tdb_fetch(context, key);
+	if (trans)
+		data = transaction_fetch(trans, key);
+	else
+		data = fetch_record(name, key);
 
-	if (data.dptr == NULL) {
-		if (tdb_error(context) == TDB_ERR_NOEXIST)
-			errno = ENOENT;
-		else {
-			log("TDB error on read: %s", tdb_errorstr(context));
-			errno = EIO;
-		}
+	if (data.dptr == NULL)
 		return NULL;
-	}
 
 	node = talloc(name, struct node);
 	node->name = talloc_strdup(node, name);
 	node->parent = NULL;
-	node->tdb = tdb_context(conn);
+	node->trans = trans;
 	talloc_steal(node, data.dptr);
+	parse_node(node, data);
 
-	/* Datalen, childlen, number of permissions */
-	p = (uint32_t *)data.dptr;
-	node->num_perms = p[0];
-	node->datalen = p[1];
-	node->childlen = p[2];
+	return node;
+}
 
-	/* Permissions are struct xs_permissions. */
-	node->perms = (void *)&p[3];
-	/* Data is binary blob (usually ascii, no nul). */
-	node->data = node->perms + node->num_perms;
-	/* Children is strings, nul separated. */
-	node->children = node->data + node->datalen;
+/*
+ * Outside a transaction, fill in *node straight from the memory store's
+ * record, without allocating: for looking at the node until the store
+ * next changes, never for modifying it.  Returns false if the node is
+ * not there or not in the memory store: read_node() knows which.
+ */
+static bool peek_node(struct connection *conn, const char *name,
+		      struct node *node)
+{
+	TDB_DATA key, data;
 
-	return node;
+	if (conn->transaction || !memstore_enabled())
+		return false;
+
+	key.dptr = (void *)name;
+	key.dsize = strlen(name);
+	data = memstore_peek(key);
+	if (data.dptr == NULL)
+		return false;
+
+	node->name = (char *)name;
+	node->parent = NULL;
+	node->trans = NULL;
+	parse_node(node, data);
+	return true;
 }
 
 static bool write_node(struct connection *conn, const struct node *node)
 {
 	/*
 	 * conn will be null when this is called from manual_node.
-	 * tdb_context copes with this.
 	 */
 
 	TDB_DATA key, data;
+	struct xs_tdb_record_hdr *hdr;
 	void *p;
+	bool ret;
 
 	key.dptr = (void *)node->name;
 	key.dsize = strlen(node->name);
 
-	data.dsize = 3*sizeof(uint32_t)
+	data.dsize = sizeof(*hdr)
 		+ node->num_perms*sizeof(node->perms[0])
 		+ node->datalen + node->childlen;
 
@@ -457,10 +563,12 @@ static bool write_node(struct connection *conn, const struct node *node)
 		goto error;
 
 	data.dptr = talloc_size(node, data.dsize);
-	((uint32_t *)data.dptr)[0] = node->num_perms;
-	((uint32_t *)data.dptr)[1] = node->datalen;
-	((uint32_t *)data.dptr)[2] = node->childlen;
-	p = data.dptr + 3 * sizeof(uint32_t);
+	hdr = (void *)data.dptr;
+	hdr->generation = 0;
+	hdr->num_perms = node->num_perms;
+	hdr->datalen = node->datalen;
+	hdr->childlen = node->childlen;
+	p = hdr->perms;
 
 	memcpy(p, node->perms, node->num_perms*sizeof(node->perms[0]));
 	p += node->num_perms*sizeof(node->perms[0]);
@@ -468,8 +576,11 @@ static bool write_node(struct connection *conn, const struct node *node)
 	p += node->datalen;
 	memcpy(p, node->children, node->childlen);
 
-	/* TDB should set errno, but doesn't even set ecode AFAICT. */
-	if (tdb_store(tdb_context(conn), key, data, TDB_REPLACE) != 0) {
+	if (conn && conn->transaction)
+		ret = transaction_store(conn->transaction, key, data);
+	else
+		ret = store_record(key, data);
+	if (!ret) {
 		corrupt(conn, "Write of %s failed", key.dptr);
 		goto error;
 	}
@@ -622,6 +733,45 @@ unsigned int get_strings(struct buffered_data *data,
 	return i;
 }
 
+/* Replies to the ops of an XS_MULTI, gathered up by send_reply(). */
+struct multi_reply
+{
+	char *buffer;
+	unsigned int len;
+
+	/* Set if the replies could not all be kept. */
+	int error;
+};
+
+static void add_multi_reply(struct connection *conn,
+			    enum xsd_sockmsg_type type,
+			    const void *data, unsigned int len)
+{
+	struct multi_reply *multi = conn->multi;
+	struct xsd_sockmsg hdr = conn->in->hdr.msg;
+	unsigned int newlen = multi->len + sizeof(hdr) + len;
+	char *buffer;
+
+	if (multi->error)
+		return;
+	if (newlen > XENSTORE_PAYLOAD_MAX) {
+		multi->error = E2BIG;
+		return;
+	}
+	buffer = talloc_realloc(multi, multi->buffer, char, newlen);
+	if (!buffer) {
+		multi->error = ENOMEM;
+		return;
+	}
+
+	hdr.type = type;
+	hdr.len = len;
+	memcpy(buffer + multi->len, &hdr, sizeof(hdr));
+	memcpy(buffer + multi->len + sizeof(hdr), data, len);
+	multi->buffer = buffer;
+	multi->len = newlen;
+}
+
 void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 		const void *data, unsigned int len)
 {
@@ -632,6 +782,11 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 		return;
 	}
 
+	if (conn->multi && type != XS_WATCH_EVENT) {
+		add_multi_reply(conn, type, data, len);
+		return;
+	}
+
 	/* Message is a child of the connection context for auto-cleanup. */
 	bdata = new_buffer(conn);
 	bdata->buffer = talloc_array(bdata, char, len);
@@ -651,6 +806,7 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 
 	/* Queue for later transmission. */
 	list_add_tail(&bdata->list, &conn->out_list);
+	conn_mark_ready(conn);
 }
 
 /* Some routines (write, mkdir, etc) just need a non-error return */
@@ -754,32 +910,60 @@ bool check_event_node(const char *node)
 	return true;
 }
 
-static void send_directory(struct connection *conn, const char *name)
-{
-	struct node *node;
-
-	name = canonicalize(conn, name);
-	node = get_node(conn, name, XS_PERM_READ);
-	if (!node) {
-		send_error(conn, errno);
-		return;
+/*
+ * XS_DIRECTORY, XS_READ and XS_GET_PERMS: find the reply, allocated off
+ * "in", or return an errno.  This only allocates off "in" and reads the
+ * store, so outside a transaction it may run on a read pool thread.
+ */
+static int read_only_op(struct connection *conn, struct buffered_data *in,
+			const void **data, unsigned int *len)
+{
+	struct node *node, peeked;
+	const char *name;
+
+	/* The common case: a readable node in the memory store. */
+	name = canonicalize(conn, onearg(in));
+	if (name && is_valid_nodename(name) && peek_node(conn, name, &peeked) &&
+	    (perm_for_conn(conn, peeked.perms, peeked.num_perms) &
+	     XS_PERM_READ))
+		node = &peeked;
+	else {
+		/* Anything else goes the long way, to get errno right. */
+		node = get_node(conn, name, XS_PERM_READ);
+		if (!node)
+			return errno;
 	}
 
-	send_reply(conn, XS_DIRECTORY, node->children, node->childlen);
+	switch (in->hdr.msg.type) {
+	case XS_DIRECTORY:
+		*data = node->children;
+		*len = node->childlen;
+		break;
+	case XS_READ:
+		*data = node->data;
+		*len = node->datalen;
+		break;
+	default:
+		*data = perms_to_strings(in, node->perms, node->num_perms,
+					 len);
+		if (!*data)
+			return errno;
+		break;
+	}
+	return 0;
 }
 
-static void do_read(struct connection *conn, const char *name)
+static void do_read_only(struct connection *conn, struct buffered_data *in)
 {
-	struct node *node;
-
-	name = canonicalize(conn, name);
-	node = get_node(conn, name, XS_PERM_READ);
-	if (!node) {
-		send_error(conn, errno);
-		return;
-	}
+	const void *data;
+	unsigned int len;
+	int err;
 
-	send_reply(conn, XS_READ, node->data, node->datalen);
+	err = read_only_op(conn, in, &data, &len);
+	if (err)
+		send_error(conn, err);
+	else
+		send_reply(conn, in->hdr.msg.type, data, len);
 }
 
 static void delete_node_single(struct connection *conn, struct node *node)
@@ -789,7 +973,7 @@ static void delete_node_single(struct connection *conn, struct node *node)
 	key.dptr = (void *)node->name;
 	key.dsize = strlen(node->name);
 
-	if (tdb_delete(tdb_context(conn), key) != 0) {
+	if (!remove_record(conn ? conn->transaction : NULL, key)) {
 		corrupt(conn, "Could not delete '%s'", node->name);
 		return;
 	}
@@ -830,7 +1014,7 @@ static struct node *construct_node(struct connection *conn, const char *name)
 
 	/* Allocate node */
 	node = talloc(name, struct node);
-	node->tdb = tdb_context(conn);
+	node->trans = conn ? conn->transaction : NULL;
 	node->name = talloc_strdup(node, name);
 
 	/* Inherit permissions, except unprivileged domains own what they create */
@@ -859,7 +1043,7 @@ static int destroy_node(void *_node)
 	key.dptr = (void *)node->name;
 	key.dsize = strlen(node->name);
 
-	tdb_delete(node->tdb, key);
+	remove_record(node->trans, key);
 	return 0;
 }
 
@@ -1087,26 +1271,6 @@ static void do_rm(struct connection *conn, const char *name)
 }
 
 
-static void do_get_perms(struct connection *conn, const char *name)
-{
-	struct node *node;
-	char *strings;
-	unsigned int len;
-
-	name = canonicalize(conn, name);
-	node = get_node(conn, name, XS_PERM_READ);
-	if (!node) {
-		send_error(conn, errno);
-		return;
-	}
-
-	strings = perms_to_strings(node, node->perms, node->num_perms, &len);
-	if (!strings)
-		send_error(conn, errno);
-	else
-		send_reply(conn, XS_GET_PERMS, strings, len);
-}
-
 static void do_set_perms(struct connection *conn, struct buffered_data *in)
 {
 	unsigned int num;
@@ -1160,6 +1324,133 @@ static void do_set_perms(struct connection *conn, struct buffered_data *in)
 	send_ack(conn, XS_SET_PERMS);
 }
 
+/* Only requests which just read or change nodes may be batched. */
+static bool multi_op_allowed(uint32_t type)
+{
+	switch (type) {
+	case XS_READ:
+	case XS_DIRECTORY:
+	case XS_GET_PERMS:
+	case XS_WRITE:
+	case XS_MKDIR:
+	case XS_RM:
+	case XS_SET_PERMS:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Carry out one op of an XS_MULTI, starting at offset off in "in". */
+static void do_multi_op(struct connection *conn, struct buffered_data *in,
+			unsigned int off)
+{
+	struct buffered_data *op;
+
+	op = new_buffer(in);
+	if (!op) {
+		send_error(conn, ENOMEM);
+		return;
+	}
+	memcpy(&op->hdr.msg, in->buffer + off, sizeof(op->hdr.msg));
+	op->buffer = talloc_memdup(op, in->buffer + off + sizeof(op->hdr.msg),
+				   op->hdr.msg.len);
+	if (!op->buffer) {
+		talloc_free(op);
+		send_error(conn, ENOMEM);
+		return;
+	}
+	op->used = op->hdr.msg.len;
+	op->inhdr = false;
+
+	/* Replies echo the header of conn->in. */
+	conn->in = op;
+	switch (op->hdr.msg.type) {
+	case XS_READ:
+	case XS_DIRECTORY:
+	case XS_GET_PERMS:
+		do_read_only(conn, op);
+		break;
+	case XS_WRITE:
+		do_write(conn, op);
+		break;
+	case XS_MKDIR:
+		do_mkdir(conn, onearg(op));
+		break;
+	case XS_RM:
+		do_rm(conn, onearg(op));
+		break;
+	case XS_SET_PERMS:
+		do_set_perms(conn, op);
+		break;
+	}
+	conn->in = in;
+	talloc_free(op);
+}
+
+/*
+ * A batch of ops, each a header and payload, replied to with the header
+ * and payload of each reply.  Outside a transaction the ops are made in a
+ * transaction of our own: nothing else can happen while they are carried
+ * out, so it cannot fail, but it means they are all seen at once.
+ */
+static void do_multi(struct connection *conn, struct buffered_data *in)
+{
+	struct xsd_sockmsg hdr;
+	struct transaction *trans = NULL;
+	struct multi_reply *multi;
+	unsigned int off;
+	int err;
+
+	/* Check every op is well formed before carrying any out. */
+	for (off = 0; off < in->used; off += sizeof(hdr) + hdr.len) {
+		if (in->used - off < sizeof(hdr)) {
+			send_error(conn, EINVAL);
+			return;
+		}
+		memcpy(&hdr, in->buffer + off, sizeof(hdr));
+		if (hdr.len > in->used - off - sizeof(hdr) ||
+		    !multi_op_allowed(hdr.type)) {
+			send_error(conn, EINVAL);
+			return;
+		}
+	}
+
+	multi = talloc_zero(in, struct multi_reply);
+	if (!multi) {
+		send_error(conn, ENOMEM);
+		return;
+	}
+	if (!conn->transaction) {
+		trans = transaction_new(in);
+		if (!trans) {
+			send_error(conn, ENOMEM);
+			return;
+		}
+		conn->transaction = trans;
+	}
+
+	conn->multi = multi;
+	for (off = 0; off < in->used; off += sizeof(hdr) + hdr.len) {
+		memcpy(&hdr, in->buffer + off, sizeof(hdr));
+		do_multi_op(conn, in, off);
+	}
+	conn->multi = NULL;
+
+	err = multi->error;
+	if (trans) {
+		conn->transaction = NULL;
+		if (!err)
+			err = transaction_commit(conn, trans);
+		talloc_free(trans);
+	}
+
+	if (err)
+		send_error(conn, err);
+	else
+		send_reply(conn, XS_MULTI, multi->buffer, multi->len);
+}
+
 static void do_debug(struct connection *conn, struct buffered_data *in)
 {
 	int num;
@@ -1182,6 +1473,13 @@ static void do_debug(struct connection *conn, struct buffered_data *in)
 	if (streq(in->buffer, "check"))
 		check_store();
 
+	if (streq(in->buffer, "watch-stats")) {
+		char *stats = watch_stats(in);
+
+		send_reply(conn, XS_DEBUG, stats, strlen(stats) + 1);
+		return;
+	}
+
 	send_ack(conn, XS_DEBUG);
 }
 
@@ -1203,11 +1501,9 @@ static void process_message(struct connection *conn, struct buffered_data *in)
 
 	switch (in->hdr.msg.type) {
 	case XS_DIRECTORY:
-		send_directory(conn, onearg(in));
-		break;
-
 	case XS_READ:
-		do_read(conn, onearg(in));
+	case XS_GET_PERMS:
+		do_read_only(conn, in);
 		break;
 
 	case XS_WRITE:
@@ -1222,10 +1518,6 @@ static void process_message(struct connection *conn, struct buffered_data *in)
 		do_rm(conn, onearg(in));
 		break;
 
-	case XS_GET_PERMS:
-		do_get_perms(conn, onearg(in));
-		break;
-
 	case XS_SET_PERMS:
 		do_set_perms(conn, in);
 		break;
@@ -1278,6 +1570,10 @@ static void process_message(struct connection *conn, struct buffered_data *in)
 		do_reset_watches(conn);
 		break;
 
+	case XS_MULTI:
+		do_multi(conn, in);
+		break;
+
 	default:
 		eprintf("Client unknown operation %i", in->hdr.msg.type);
 		send_error(conn, ENOSYS);
@@ -1287,6 +1583,96 @@ static void process_message(struct connection *conn, struct buffered_data *in)
 	conn->transaction = NULL;
 }
 
+/* A read handed to the read pool, and its result. */
+struct read_request
+{
+	struct connection *conn;
+	const void *data;
+	unsigned int len;
+	int error;
+};
+
+static unsigned int read_threads;
+static struct read_request **read_requests;
+static unsigned int nr_read_requests, max_read_requests;
+
+/* Hand a read-only request to the read pool, if that is allowed. */
+static bool queue_read(struct connection *conn)
+{
+	struct xsd_sockmsg *msg = &conn->in->hdr.msg;
+	struct read_request *req, **new;
+
+	if (!read_threads || msg->tx_id != 0)
+		return false;
+	if (msg->type != XS_READ && msg->type != XS_DIRECTORY &&
+	    msg->type != XS_GET_PERMS)
+		return false;
+
+	if (nr_read_requests == max_read_requests) {
+		new = talloc_realloc(talloc_autofree_context(), read_requests,
+				     struct read_request *,
+				     max_read_requests + 64);
+		if (!new)
+			return false;
+		read_requests = new;
+		max_read_requests += 64;
+	}
+	req = talloc_zero(conn->in, struct read_request);
+	if (!req)
+		return false;
+
+	/* Keep conn alive, and hold off its input, until it is answered. */
+	req->conn = conn;
+	talloc_increase_ref_count(conn);
+	conn->read_pending = true;
+	read_requests[nr_read_requests++] = req;
+	return true;
+}
+
+static void read_worker(void *arg)
+{
+	struct read_request *req = arg;
+
+	req->error = read_only_op(req->conn, req->conn->in,
+				  &req->data, &req->len);
+}
+
+/*
+ * Answer the queued reads, in parallel.  The main thread does nothing
+ * else meanwhile, so they all see the same state of the store, and each
+ * thread only allocates off the request it is working on.
+ */
+static void run_read_pool(void)
+{
+	struct read_request *req;
+	struct connection *conn;
+	unsigned int i;
+
+	if (!nr_read_requests)
+		return;
+
+	workers_run(read_worker, (void **)read_requests, nr_read_requests);
+
+	for (i = 0; i < nr_read_requests; i++) {
+		req = read_requests[i];
+		conn = req->conn;
+		/* Unless domain_conn_reset() threw the request away... */
+		if (!conn->in->inhdr) {
+			if (req->error)
+				send_error(conn, req->error);
+			else
+				send_reply(conn, conn->in->hdr.msg.type,
+					   req->data, req->len);
+		}
+		conn->read_pending = false;
+		talloc_free(conn->in);
+		conn->in = new_buffer(conn);
+		conn_mark_ready(conn);
+		talloc_free(conn);
+	}
+	nr_read_requests = 0;
+}
+
 static void consider_message(struct connection *conn)
 {
 	if (verbose)
@@ -1294,6 +1680,9 @@ static void consider_message(struct connection *conn)
 			sockmsg_string(conn->in->hdr.msg.type),
 			conn->in->hdr.msg.len, conn);
 
+	if (queue_read(conn))
+		return;
+
 	process_message(conn, conn->in);
 
 	talloc_free(conn->in);
@@ -1307,6 +1696,10 @@ static void handle_input(struct connection *conn)
 	int bytes;
 	struct buffered_data *in = conn->in;
 
+	/* Still waiting for the read pool to answer the last request? */
+	if (conn->read_pending)
+		return;
+
 	/* Not finished header yet? */
 	if (in->inhdr) {
 		bytes = conn->read(conn, in->hdr.raw + in->used,
@@ -1368,6 +1761,7 @@ struct connection *new_connection(connwritefn_t *write, connreadfn_t *read)
 	new->read = read;
 	new->can_write = true;
 	new->transaction_started = 0;
+	INIT_LIST_HEAD(&new->ready_list);
 	INIT_LIST_HEAD(&new->out_list);
 	INIT_LIST_HEAD(&new->watches);
 	INIT_LIST_HEAD(&new->transaction_list);
@@ -1384,6 +1778,12 @@ struct connection *new_connection(connwritefn_t *write, connreadfn_t *read)
 	return new;
 }
 
+void conn_mark_ready(struct connection *conn)
+{
+	if (use_fd_watcher && list_empty(&conn->ready_list))
+		list_add_tail(&conn->ready_list, &ready_connections);
+}
+
 #ifdef NO_SOCKETS
 static void accept_connection(int sock, bool canwrite)
 {
@@ -1440,6 +1840,9 @@ static void accept_connection(int sock, bool canwrite)
 	if (conn) {
 		conn->fd = fd;
 		conn->can_write = canwrite;
+		if (use_fd_watcher &&
+		    !fd_watcher_add(fd, conn, POLLIN|POLLPRI))
+			talloc_free(conn);
 	} else
 		close(fd);
 }
@@ -1466,15 +1869,45 @@ static void manual_node(const char *name, const char *child)
 	talloc_free(node);
 }
 
+/* Resume generation counting above anything already in the store. */
+static int init_generation_(TDB_DATA key, TDB_DATA val, void *private)
+{
+	struct xs_tdb_record_hdr *hdr = (void *)val.dptr;
+
+	if (val.dsize >= sizeof(*hdr) && hdr->generation > generation)
+		generation = hdr->generation;
+	return 0;
+}
+
+/* Does the memory store hold a root node, ie. was it recovered? */
+static bool memstore_has_root(void)
+{
+	TDB_DATA key, data;
+
+	key.dptr = (void *)"/";
+	key.dsize = 1;
+	data = memstore_fetch(NULL, key);
+	talloc_free(data.dptr);
+	return data.dptr != NULL;
+}
+
 static void setup_structure(void)
 {
 	char *tdbname;
+	bool existing;
 	tdbname = talloc_strdup(talloc_autofree_context(), xs_daemon_tdb());
 
-	if (!(tdb_flags & TDB_INTERNAL))
-		tdb_ctx = tdb_open(tdbname, 0, tdb_flags, O_RDWR, 0);
+	if (memory_store) {
+		memstore_init((tdb_flags & TDB_INTERNAL) ? NULL : tdbname,
+			      snapshot_interval);
+		existing = memstore_has_root();
+	} else {
+		if (!(tdb_flags & TDB_INTERNAL))
+			tdb_ctx = tdb_open(tdbname, 0, tdb_flags, O_RDWR, 0);
+		existing = tdb_ctx != NULL;
+	}
 
-	if (tdb_ctx) {
+	if (existing) {
 		/* XXX When we make xenstored able to restart, this will have
 		   to become cleverer, checking for existing domains and not
 		   removing the corresponding entries, but for now xenstored
@@ -1491,6 +1924,7 @@ static void setup_structure(void)
 		*/
 		char *tlocal = talloc_strdup(NULL, "/local");
 
+		traverse_store(&init_generation_, NULL);
 		check_store();
 
 		if (remove_local) {
@@ -1503,10 +1937,13 @@ static void setup_structure(void)
 		talloc_free(tlocal);
 	}
 	else {
-		tdb_ctx = tdb_open(tdbname, 7919, tdb_flags, O_RDWR|O_CREAT,
-				   0640);
-		if (!tdb_ctx)
-			barf_perror("Could not create tdb file %s", tdbname);
+		if (!memory_store) {
+			tdb_ctx = tdb_open(tdbname, 7919, tdb_flags,
+					   O_RDWR|O_CREAT, 0640);
+			if (!tdb_ctx)
+				barf_perror("Could not create tdb file %s",
+					    tdbname);
+		}
 
 		manual_node("/", "tool");
 		manual_node("/tool", "xenstored");
@@ -1517,7 +1954,7 @@ static void setup_structure(void)
 }
 
 
-static unsigned int hash_from_key_fn(void *k)
+unsigned int hash_from_key_fn(void *k)
 {
 	char *str = k;
 	unsigned int hash = 5381;
@@ -1530,7 +1967,7 @@ static unsigned int hash_from_key_fn(void *k)
 }
 
 
-static int keys_equal_fn(void *key1, void *key2)
+int keys_equal_fn(void *key1, void *key2)
 {
 	return 0 == strcmp((char *)key1, (char *)key2);
 }
@@ -1634,8 +2071,7 @@ static void check_store_(const char *name, struct hashtable *reachable)
 /**
  * Helper to clean_store below.
  */
-static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
-			void *private)
+static int clean_store_(TDB_DATA key, TDB_DATA val, void *private)
 {
 	struct hashtable *reachable = private;
 	char * name = talloc_strndup(NULL, key.dptr, key.dsize);
@@ -1643,7 +2079,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
 	if (!hashtable_search(reachable, name)) {
 		log("clean_store: '%s' is orphaned!", name);
 		if (recovery) {
-			tdb_delete(tdb, key);
+			delete_record(key);
 		}
 	}
 
@@ -1659,7 +2095,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
  */
 static void clean_store(struct hashtable *reachable)
 {
-	tdb_traverse(tdb_ctx, &clean_store_, reachable);
+	traverse_store(&clean_store_, reachable);
 }
 
 
@@ -1774,6 +2210,12 @@ static void usage(void)
 "  --no-recovery       to request that no recovery should be attempted when\n"
 "                      the store is corrupted (debug only),\n"
 "  --internal-db       store database in memory, not on disk\n"
+"  --memory-store      keep nodes in memory, only writing the database\n"
+"                      file as a periodic snapshot,\n"
+"  --snapshot-interval <secs> seconds between snapshots of the memory\n"
+"                      store (default 60, 0 to disable),\n"
+"  --read-threads <nb> answer reads outside transactions on <nb> threads\n"
+"                      (needs --memory-store),\n"
 "  --preserve-local    to request that /local is preserved on start-up,\n"
 "  --verbose           to request verbose execution.\n");
 }
@@ -1794,6 +2236,9 @@ static struct option options[] = {
 	{ "no-recovery", 0, NULL, 'R' },
 	{ "preserve-local", 0, NULL, 'L' },
 	{ "internal-db", 0, NULL, 'I' },
+	{ "memory-store", 0, NULL, 'M' },
+	{ "snapshot-interval", 1, NULL, 'i' },
+	{ "read-threads", 1, NULL, 'r' },
 	{ "verbose", 0, NULL, 'V' },
 	{ "watch-nb", 1, NULL, 'W' },
 	{ NULL, 0, NULL, 0 } };
@@ -1802,6 +2247,147 @@ extern void dump_conn(struct connection *conn);
 int dom0_event = 0;
 int priv_domid = 0;
 
+/* After servicing a connection, arrange for it to be serviced again. */
+static void update_conn_events(struct connection *conn)
+{
+	bool want_out;
+
+	if (conn->domain) {
+		if (domain_can_read(conn) ||
+		    (domain_can_write(conn) && !list_empty(&conn->out_list)))
+			conn_mark_ready(conn);
+		return;
+	}
+
+	want_out = !list_empty(&conn->out_list);
+	if (want_out == conn->want_out)
+		return;
+	conn->want_out = want_out;
+	if (!fd_watcher_mod(conn->fd, conn,
+			    POLLIN|POLLPRI|(want_out ? POLLOUT : 0)))
+		talloc_free(conn);
+}
+
+/* Tags for the fds which are not connections. */
+static char sock_tag, ro_sock_tag, log_pipe_tag, xce_tag;
+
+static void watch_fd(int fd, void *tag)
+{
+	if (!fd_watcher_add(fd, tag, POLLIN|POLLPRI))
+		barf_perror("Could not watch fd %d", fd);
+}
+
+/*
+ * Main loop using the fd watcher.  Unlike the poll() loop, the work done
+ * each time round is proportional to the number of connections with
+ * something to do, not to the number of connections: socket connections
+ * are reported by the watcher, and domain connections are queued on
+ * ready_connections when their event channel fires or a reply is queued.
+ */
+static void event_loop(int sock, int ro_sock)
+{
+	struct fd_event ev[64];
+	struct connection *conn;
+	LIST_HEAD(ready);
+	int i, n, timeout;
+	short revents;
+
+	if (sock != -1)
+		watch_fd(sock, &sock_tag);
+	if (ro_sock != -1)
+		watch_fd(ro_sock, &ro_sock_tag);
+	if (reopen_log_pipe[0] != -1)
+		watch_fd(reopen_log_pipe[0], &log_pipe_tag);
+	if (xce_handle != NULL)
+		watch_fd(xc_evtchn_fd(xce_handle), &xce_tag);
+
+	for (;;) {
+		timeout = list_empty(&ready_connections) ? -1 : 0;
+		n = fd_watcher_wait(ev, ARRAY_SIZE(ev),
+				    memstore_poll_timeout(timeout));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			barf_perror("Poll failed");
+		}
+
+		memstore_snapshot();
+
+		for (i = 0; i < n; i++) {
+			revents = ev[i].revents;
+			if (ev[i].data == &log_pipe_tag) {
+				if (revents & ~POLLIN) {
+					close(reopen_log_pipe[0]);
+					close(reopen_log_pipe[1]);
+					init_pipe(reopen_log_pipe);
+					watch_fd(reopen_log_pipe[0],
+						 &log_pipe_tag);
+				} else if (revents & POLLIN) {
+					char c;
+					if (read(reopen_log_pipe[0], &c, 1) != 1)
+						barf_perror("read failed");
+					reopen_log();
+				}
+			} else if (ev[i].data == &sock_tag) {
+				if (revents & ~POLLIN)
+					barf_perror("sock poll failed");
+				accept_connection(sock, true);
+			} else if (ev[i].data == &ro_sock_tag) {
+				if (revents & ~POLLIN)
+					barf_perror("ro sock poll failed");
+				accept_connection(ro_sock, false);
+			} else if (ev[i].data == &xce_tag) {
+				if (revents & ~POLLIN)
+					barf_perror("xce_handle poll failed");
+				handle_event();
+			} else {
+				conn = ev[i].data;
+				conn->revents = revents;
+				conn_mark_ready(conn);
+			}
+		}
+
+		/*
+		 * Connections queued while we work through this batch wait
+		 * for the next one.  A connection destroyed meanwhile takes
+		 * itself off the list.
+		 */
+		list_splice_init(&ready_connections, &ready);
+		while (!list_empty(&ready)) {
+			conn = list_entry(ready.next, typeof(*conn),
+					  ready_list);
+			list_del_init(&conn->ready_list);
+			revents = conn->revents;
+			conn->revents = 0;
+
+			talloc_increase_ref_count(conn);
+			if (conn->domain) {
+				if (domain_can_read(conn))
+					handle_input(conn);
+			} else if (revents & ~(POLLIN|POLLOUT))
+				talloc_free(conn);
+			else if (revents & POLLIN)
+				handle_input(conn);
+			if (talloc_free(conn) == 0)
+				continue;
+
+			talloc_increase_ref_count(conn);
+			if (conn->domain) {
+				if (domain_can_write(conn) &&
+				    !list_empty(&conn->out_list))
+					handle_output(conn);
+			} else if (revents & POLLOUT)
+				handle_output(conn);
+			if (talloc_free(conn) == 0)
+				continue;
+
+			update_conn_events(conn);
+		}
+
+		run_read_pool();
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	int opt, *sock, *ro_sock;
@@ -1812,7 +2398,7 @@ int main(int argc, char *argv[])
 	const char *pidfile = NULL;
 	int timeout;
 
-	while ((opt = getopt_long(argc, argv, "DE:F:HNPS:t:T:RLVW:", options,
+	while ((opt = getopt_long(argc, argv, "DE:F:HNPS:t:T:RLVW:Mi:r:", options,
 				  NULL)) != -1) {
 		switch (opt) {
 		case 'D':
@@ -1851,6 +2437,15 @@ int main(int argc, char *argv[])
 		case 'I':
 			tdb_flags = TDB_INTERNAL|TDB_NOLOCK;
 			break;
+		case 'M':
+			memory_store = true;
+			break;
+		case 'i':
+			snapshot_interval = strtol(optarg, NULL, 10);
+			break;
+		case 'r':
+			read_threads = strtol(optarg, NULL, 10);
+			break;
 		case 'V':
 			verbose = true;
 			break;
@@ -1867,6 +2462,9 @@ int main(int argc, char *argv[])
 	}
 	if (optind != argc)
 		barf("%s: No arguments desired", argv[0]);
+	/* Only the memory store can be read from several threads at once. */
+	if (read_threads && !memory_store)
+		barf("%s: --read-threads needs --memory-store", argv[0]);
 
 	reopen_log();
 
@@ -1891,6 +2489,9 @@ int main(int argc, char *argv[])
 
 	init_sockets(&sock, &ro_sock);
 	init_pipe(reopen_log_pipe);
+	use_fd_watcher = fd_watcher_init();
+	if (read_threads && !workers_init(read_threads - 1))
+		barf_perror("Could not start read threads");
 
 	/* Setup the database */
 	setup_structure();
@@ -1920,7 +2521,10 @@ int main(int argc, char *argv[])
 	/* Tell the kernel we're up and running. */
 	xenbus_notify_running();
 
-	/* Main loop. */
+	if (use_fd_watcher)
+		event_loop(*sock, *ro_sock);
+
+	/* Main loop, for systems without an fd watcher. */
 	for (;;) {
 		struct connection *conn, *next;
 
@@ -1930,6 +2534,8 @@ int main(int argc, char *argv[])
 			barf_perror("Poll failed");
 		}
 
+		memstore_snapshot();
+
 		if (reopen_log_pipe0_pollfd_idx != -1) {
 			if (fds[reopen_log_pipe0_pollfd_idx].revents
 			    & ~POLLIN) {
@@ -2028,6 +2634,8 @@ int main(int argc, char *argv[])
 			}
 		}
 
+		run_read_pool();
+
 		initialize_fds(*sock, &sock_pollfd_idx, *ro_sock,
 			       &ro_sock_pollfd_idx, &timeout);
 	}
@@ -51,6 +51,7 @@ struct buffered_data
 };
 
 struct connection;
+struct multi_reply;
 typedef int connwritefn_t(struct connection *, const void *, unsigned int);
 typedef int connreadfn_t(struct connection *, void *, unsigned int);
 
@@ -63,6 +64,23 @@ struct connection
 	/* The index of pollfd in global pollfd array */
 	int pollfd_idx;
 
+	/* Entry in the list of connections needing service, used by the
+	 * fd watcher loop; empty if not queued. */
+	struct list_head ready_list;
+
+	/* Is the fd watcher asked to report POLLOUT for fd? */
+	bool want_out;
+
+	/* Events reported by the fd watcher, not yet handled. */
+	short revents;
+
+	/* Replies being gathered up for an XS_MULTI (NULL if none). */
+	struct multi_reply *multi;
+
+	/* Is a request with the read pool?  No input is read until it is
+	 * answered, so replies go out in order. */
+	bool read_pending;
+
 	/* Who am I? 0 for socket connections. */
 	unsigned int id;
 
@@ -98,11 +116,21 @@ struct connection
 };
 extern struct list_head connections;
 
+/* Header of a node record in the tdb: followed by perms, data, children. */
+struct xs_tdb_record_hdr {
+	/* Bumped on every write to the store, used by transactions. */
+	uint64_t generation;
+	uint32_t num_perms;
+	uint32_t datalen;
+	uint32_t childlen;
+	struct xs_permissions perms[0];
+};
+
 struct node {
 	const char *name;
 
-	/* Database I came from */
-	TDB_CONTEXT *tdb;
+	/* Transaction I came from (NULL for the store itself) */
+	struct transaction *trans;
 
 	/* Parent (optional) */
 	struct node *parent;
@@ -147,17 +175,26 @@ struct node *get_node(struct connection *conn,
 		      const char *name,
 		      enum xs_perm_type perm);
 
-/* Get TDB context for this connection */
-TDB_CONTEXT *tdb_context(struct connection *conn);
+/* Raw record access to the store, bypassing transactions: set errno.
+ * Fetched records are allocated off ctx. */
+TDB_DATA fetch_record(const void *ctx, TDB_DATA key);
+bool store_record(TDB_DATA key, TDB_DATA data);
+bool delete_record(TDB_DATA key);
 
-/* Destructor for tdbs: required for transaction code */
-int destroy_tdb(void *_tdb);
+/* Call fn on every record in the store until it returns non-zero. */
+typedef int store_traverse_fn(TDB_DATA key, TDB_DATA val, void *private);
+void traverse_store(store_traverse_fn *fn, void *private);
 
-/* Replace the tdb: required for transaction code */
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb);
+/* Hash functions for string-keyed hashtables. */
+unsigned int hash_from_key_fn(void *k);
+int keys_equal_fn(void *key1, void *key2);
 
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read);
 
+/* Queue a connection for service by the main loop: used for domain
+ * connections when their event channel fires. */
+void conn_mark_ready(struct connection *conn);
+
 
 /* Is this a valid node name? */
 bool is_valid_nodename(const char *node);
@@ -194,6 +231,22 @@ void finish_daemonize(void);
 /* Open a pipe for signal handling */
 void init_pipe(int reopen_log_pipe[2]);
 
+/*
+ * Scalable fd readiness notification (epoll on Linux), reporting poll()
+ * event bits.  If fd_watcher_init() fails the main loop falls back to
+ * rebuilding a pollfd array each time round, and the other calls are
+ * never made.
+ */
+struct fd_event {
+	void *data;
+	short revents;
+};
+bool fd_watcher_init(void);
+bool fd_watcher_add(int fd, void *data, short events);
+bool fd_watcher_mod(int fd, void *data, short events);
+void fd_watcher_del(int fd);
+int fd_watcher_wait(struct fd_event *ev, unsigned int num, int timeout);
+
 xc_gnttab **xcg_handle;
 
 #endif /* _XENSTORED_CORE_H */
@@ -18,6 +18,7 @@
 */
 
 #include <stdio.h>
+#include <poll.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -185,6 +186,30 @@ static void unmap_interface(void *interface)
 		munmap(interface, getpagesize());
 }
 
+/* Local event channel port -> domain, so events go straight to the domain. */
+static struct domain **port_domains;
+static unsigned int nr_port_domains;
+
+static void set_port_domain(evtchn_port_t port, struct domain *domain)
+{
+	struct domain **new;
+	unsigned int nr;
+
+	if (port >= nr_port_domains) {
+		if (!domain)
+			return;
+		nr = (port + 64) & ~63;
+		new = talloc_realloc(talloc_autofree_context(), port_domains, struct domain *, nr);
+		if (!new)
+			barf_perror("Could not grow port table");
+		memset(new + nr_port_domains, 0,
+		       (nr - nr_port_domains) * sizeof(*new));
+		port_domains = new;
+		nr_port_domains = nr;
+	}
+	port_domains[port] = domain;
+}
+
 static int destroy_domain(void *_domain)
 {
 	struct domain *domain = _domain;
@@ -192,6 +217,7 @@ static int destroy_domain(void *_domain)
 	list_del(&domain->list);
 
 	if (domain->port) {
+		set_port_domain(domain->port, NULL);
 		if (xc_evtchn_unbind(xce_handle, domain->port) == -1)
 			eprintf("> Unbinding port %i failed!\n", domain->port);
 	}
@@ -236,19 +262,33 @@ static void domain_cleanup(void)
 		fire_watches(NULL, "@releaseDomain", false);
 }
 
-/* We scan all domains rather than use the information given here. */
+/*
+ * Drain every pending port, queueing the connection of each domain which
+ * notified us.  VIRQ_DOM_EXC makes us scan all domains, but only once
+ * however many times it fired.
+ */
 void handle_event(void)
 {
+	struct pollfd pfd = { .fd = xc_evtchn_fd(xce_handle),
+			      .events = POLLIN };
 	evtchn_port_t port;
+	bool cleanup = false;
 
-	if ((port = xc_evtchn_pending(xce_handle)) == -1)
-		barf_perror("Failed to read from event fd");
+	do {
+		if ((port = xc_evtchn_pending(xce_handle)) == -1)
+			barf_perror("Failed to read from event fd");
 
-	if (port == virq_port)
-		domain_cleanup();
+		if (port == virq_port)
+			cleanup = true;
+		else if (port < nr_port_domains && port_domains[port])
+			conn_mark_ready(port_domains[port]->conn);
 
-	if (xc_evtchn_unmask(xce_handle, port) == -1)
-		barf_perror("Failed to write to event fd");
+		if (xc_evtchn_unmask(xce_handle, port) == -1)
+			barf_perror("Failed to write to event fd");
+	} while (poll(&pfd, 1, 0) == 1);
+
+	if (cleanup)
+		domain_cleanup();
 }
 
 bool domain_can_read(struct connection *conn)
@@ -297,6 +337,10 @@ static struct domain *new_domain(void *context, unsigned int domid,
 	domain->conn = new_connection(writechn, readchn);
 	domain->conn->domain = domain;
 	domain->conn->id = domid;
+	set_port_domain(domain->port, domain);
+
+	/* There may be requests on the ring already. */
+	conn_mark_ready(domain->conn);
 
 	domain->remote_port = port;
 	domain->nbentry = 0;
@@ -393,11 +437,15 @@ void do_introduce(struct connection *conn, struct buffered_data *in)
 		fire_watches(NULL, "@introduceDomain", false);
 	} else if ((domain->mfn == mfn) && (domain->conn != conn)) {
 		/* Use XS_INTRODUCE for recreating the xenbus event-channel. */
-		if (domain->port)
+		if (domain->port) {
+			set_port_domain(domain->port, NULL);
 			xc_evtchn_unbind(xce_handle, domain->port);
+		}
 		rc = xc_evtchn_bind_interdomain(xce_handle, domid, port);
 		domain->port = (rc == -1) ? 0 : rc;
 		domain->remote_port = port;
+		if (domain->port)
+			set_port_domain(domain->port, domain);
 	} else {
 		send_error(conn, EINVAL);
 		return;
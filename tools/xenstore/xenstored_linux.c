@@ -14,7 +14,9 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <poll.h>
 #include <sys/mman.h>
+#include <sys/epoll.h>
 
 #include "xenstored_core.h"
 
@@ -71,3 +73,61 @@ void *xenbus_map(void)
 void xenbus_notify_running(void)
 {
 }
+
+static int epoll_fd = -1;
+
+bool fd_watcher_init(void)
+{
+	epoll_fd = epoll_create(64);
+	if (epoll_fd == -1)
+		return false;
+	fcntl(epoll_fd, F_SETFD, FD_CLOEXEC);
+	return true;
+}
+
+static bool fd_watcher_ctl(int op, int fd, void *data, short events)
+{
+	struct epoll_event ev;
+
+	ev.events = ((events & POLLIN) ? EPOLLIN : 0) |
+		    ((events & POLLPRI) ? EPOLLPRI : 0) |
+		    ((events & POLLOUT) ? EPOLLOUT : 0);
+	ev.data.ptr = data;
+	return epoll_ctl(epoll_fd, op, fd, &ev) == 0;
+}
+
+bool fd_watcher_add(int fd, void *data, short events)
+{
+	return fd_watcher_ctl(EPOLL_CTL_ADD, fd, data, events);
+}
+
+bool fd_watcher_mod(int fd, void *data, short events)
+{
+	return fd_watcher_ctl(EPOLL_CTL_MOD, fd, data, events);
+}
+
+void fd_watcher_del(int fd)
+{
+	struct epoll_event ev;
+
+	/* Pre-2.6.9 kernels insist on a non-NULL event. */
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+int fd_watcher_wait(struct fd_event *ev, unsigned int num, int timeout)
+{
+	struct epoll_event events[num];
+	int i, n;
+
+	n = epoll_wait(epoll_fd, events, num, timeout);
+	for (i = 0; i < n; i++) {
+		ev[i].data = events[i].data.ptr;
+		ev[i].revents =
+			((events[i].events & EPOLLIN) ? POLLIN : 0) |
+			((events[i].events & EPOLLPRI) ? POLLPRI : 0) |
+			((events[i].events & EPOLLOUT) ? POLLOUT : 0) |
+			((events[i].events & EPOLLERR) ? POLLERR : 0) |
+			((events[i].events & EPOLLHUP) ? POLLHUP : 0);
+	}
+	return n;
+}
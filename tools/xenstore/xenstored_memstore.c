@@ -0,0 +1,319 @@
+/*
+    In-memory node store for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+ * With --memory-store, node records live in a hashtable keyed by path
+ * rather than in the tdb, so reads cost a hash lookup and a copy instead
+ * of a tdb lookup under fcntl locks; plain reads, which only look at the
+ * record, do without the copy.  The tdb file is only used for crash
+ * recovery: it is loaded at start-up, and rewritten every so often by a
+ * forked child working on a copy-on-write image of the store, so taking a
+ * snapshot never stalls the daemon.
+ *
+ * The store is flat, keyed by the full path, rather than a tree of nodes
+ * with a child table each.  A tree would cost one lookup per path
+ * component where this costs one in all, and every request names its
+ * node by full path.  Keeping the tdb record as is costs nothing either:
+ * parse_node() only points into it, its children are already the
+ * XS_DIRECTORY reply, and a snapshot stores records as they stand, so
+ * the child serialises nothing and touches no more pages than it must.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <syslog.h>
+#include "talloc.h"
+#include "list.h"
+#include "hashtable.h"
+#include "utils.h"
+#include "xenstored_core.h"
+#include "xenstored_memstore.h"
+
+struct mem_node
+{
+	/* List of all nodes, for traversal and snapshots. */
+	struct list_head list;
+
+	/* Path of the node (also its key in the hashtable). */
+	char *name;
+
+	/* The node record, in the same format as in the tdb. */
+	TDB_DATA record;
+};
+
+static void *mem_ctx;
+static struct hashtable *mem_nodes;
+static LIST_HEAD(mem_node_list);
+
+/* Snapshot state: file to write, interval in seconds (0 = never). */
+static char *snapshot_file;
+static unsigned int snapshot_interval;
+static time_t last_snapshot;
+static bool dirty;
+static pid_t snapshot_pid = -1;
+
+bool memstore_enabled(void)
+{
+	return mem_nodes != NULL;
+}
+
+/* Keys are not nul-terminated: look them up through a bounded copy. */
+static struct mem_node *lookup(TDB_DATA key)
+{
+	char name[XENSTORE_ABS_PATH_MAX + 1];
+
+	if (key.dsize > XENSTORE_ABS_PATH_MAX)
+		return NULL;
+	memcpy(name, key.dptr, key.dsize);
+	name[key.dsize] = '\0';
+	return hashtable_search(mem_nodes, name);
+}
+
+TDB_DATA memstore_peek(TDB_DATA key)
+{
+	struct mem_node *n = lookup(key);
+	TDB_DATA data = { .dptr = NULL, .dsize = 0 };
+
+	if (!n) {
+		errno = ENOENT;
+		return data;
+	}
+	return n->record;
+}
+
+TDB_DATA memstore_fetch(const void *ctx, TDB_DATA key)
+{
+	TDB_DATA data = memstore_peek(key);
+
+	if (!data.dptr)
+		return data;
+
+	data.dptr = talloc_memdup(ctx, data.dptr, data.dsize);
+	if (!data.dptr)
+		errno = ENOMEM;
+	return data;
+}
+
+bool memstore_store(TDB_DATA key, TDB_DATA data)
+{
+	struct mem_node *n = lookup(key);
+	void *record;
+	char *hkey;
+
+	if (n) {
+		record = talloc_memdup(n, data.dptr, data.dsize);
+		if (!record) {
+			errno = ENOMEM;
+			return false;
+		}
+		talloc_free(n->record.dptr);
+		n->record.dptr = record;
+		n->record.dsize = data.dsize;
+		dirty = true;
+		return true;
+	}
+
+	n = talloc(mem_ctx, struct mem_node);
+	if (!n)
+		goto nomem;
+	n->name = talloc_strndup(n, (char *)key.dptr, key.dsize);
+	n->record.dptr = talloc_memdup(n, data.dptr, data.dsize);
+	n->record.dsize = data.dsize;
+	if (!n->name || !n->record.dptr)
+		goto nomem;
+
+	/* The hashtable frees its keys with free(). */
+	hkey = strdup(n->name);
+	if (!hkey || !hashtable_insert(mem_nodes, hkey, n)) {
+		free(hkey);
+		goto nomem;
+	}
+	list_add_tail(&n->list, &mem_node_list);
+	dirty = true;
+	return true;
+
+ nomem:
+	talloc_free(n);
+	errno = ENOMEM;
+	return false;
+}
+
+bool memstore_delete(TDB_DATA key)
+{
+	struct mem_node *n = lookup(key);
+
+	if (!n) {
+		errno = ENOENT;
+		return false;
+	}
+
+	hashtable_remove(mem_nodes, n->name);
+	list_del(&n->list);
+	talloc_free(n);
+	dirty = true;
+	return true;
+}
+
+int memstore_traverse(store_traverse_fn *fn, void *private)
+{
+	struct mem_node *n, *next;
+	TDB_DATA key;
+	int count = 0;
+
+	/* fn may delete the node it is given. */
+	list_for_each_entry_safe(n, next, &mem_node_list, list) {
+		key.dptr = (void *)n->name;
+		key.dsize = strlen(n->name);
+		count++;
+		if (fn(key, n->record, private))
+			break;
+	}
+	return count;
+}
+
+static int load_record(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
+		       void *private)
+{
+	if (!memstore_store(key, val))
+		barf_perror("Could not load node %.*s", (int)key.dsize,
+			    key.dptr);
+	return 0;
+}
+
+void memstore_init(const char *file, unsigned int interval)
+{
+	TDB_CONTEXT *tdb;
+
+	mem_ctx = talloc_new(talloc_autofree_context());
+	mem_nodes = create_hashtable(1024, hash_from_key_fn, keys_equal_fn);
+	if (!mem_ctx || !mem_nodes)
+		barf_perror("Could not create memory store");
+
+	snapshot_file = file ? talloc_strdup(talloc_autofree_context(), file)
+			     : NULL;
+	snapshot_interval = interval;
+	last_snapshot = time(NULL);
+
+	/* Recover from the last snapshot, if there is one. */
+	if (!snapshot_file)
+		return;
+	tdb = tdb_open(talloc_strdup(NULL, snapshot_file), 0, 0, O_RDONLY, 0);
+	if (!tdb)
+		return;
+	tdb_traverse(tdb, &load_record, NULL);
+	tdb_close(tdb);
+	dirty = false;
+}
+
+/* Runs in the forked child: write every node to a fresh tdb. */
+static int write_snapshot(void)
+{
+	struct mem_node *n;
+	TDB_CONTEXT *tdb;
+	TDB_DATA key;
+	char *tmpname;
+
+	tmpname = talloc_asprintf(NULL, "%s.snapshot", snapshot_file);
+	if (!tmpname)
+		return 1;
+	unlink(tmpname);
+	tdb = tdb_open(tmpname, 7919, TDB_NOLOCK, O_RDWR|O_CREAT|O_EXCL,
+		       0640);
+	if (!tdb)
+		return 1;
+
+	list_for_each_entry(n, &mem_node_list, list) {
+		key.dptr = (void *)n->name;
+		key.dsize = strlen(n->name);
+		if (tdb_store(tdb, key, n->record, TDB_REPLACE) != 0)
+			return 1;
+	}
+
+	if (tdb_close(tdb) != 0 || rename(tmpname, snapshot_file) != 0)
+		return 1;
+	return 0;
+}
+
+void memstore_snapshot(void)
+{
+	int status;
+
+	if (!memstore_enabled() || !snapshot_file)
+		return;
+
+	/* Reap the previous snapshot before starting another. */
+	if (snapshot_pid != -1) {
+		if (waitpid(snapshot_pid, &status, WNOHANG) == 0)
+			return;
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			syslog(LOG_ERR, "Snapshot of %s failed", snapshot_file);
+		snapshot_pid = -1;
+	}
+
+	if (!dirty || !snapshot_interval ||
+	    time(NULL) < last_snapshot + snapshot_interval)
+		return;
+
+	snapshot_pid = fork();
+	if (snapshot_pid == -1) {
+		syslog(LOG_ERR, "Could not fork for snapshot: %m");
+		return;
+	}
+	if (snapshot_pid == 0)
+		_exit(write_snapshot());
+
+	last_snapshot = time(NULL);
+	dirty = false;
+}
+
+int memstore_poll_timeout(int timeout)
+{
+	time_t now, due;
+	int ms;
+
+	if (!memstore_enabled() || !snapshot_file || !snapshot_interval)
+		return timeout;
+
+	/* Wake up to reap a running snapshot, or to take a pending one. */
+	if (snapshot_pid != -1)
+		ms = 1000;
+	else if (dirty) {
+		now = time(NULL);
+		due = last_snapshot + snapshot_interval;
+		ms = due > now ? (due - now) * 1000 : 0;
+	} else
+		return timeout;
+
+	return (timeout < 0 || ms < timeout) ? ms : timeout;
+}
+
+/*
+ * Local variables:
+ *  c-file-style: "linux"
+ *  indent-tabs-mode: t
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
@@ -0,0 +1,48 @@
+/*
+    In-memory node store for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _XENSTORED_MEMSTORE_H
+#define _XENSTORED_MEMSTORE_H
+
+#include "xenstored_core.h"
+
+/* Use the memory store, recovering from file (NULL for none) and writing
+ * a snapshot back to it every interval seconds (0 for never). */
+void memstore_init(const char *file, unsigned int interval);
+bool memstore_enabled(void);
+
+/* Same semantics as fetch_record() and friends: set errno on failure. */
+TDB_DATA memstore_fetch(const void *ctx, TDB_DATA key);
+bool memstore_store(TDB_DATA key, TDB_DATA data);
+bool memstore_delete(TDB_DATA key);
+
+/* The record itself rather than a copy: only valid until the store next
+ * changes, and must not be modified.  Sets errno on failure. */
+TDB_DATA memstore_peek(TDB_DATA key);
+
+/* Call fn on every record until it returns non-zero; fn may delete the
+ * record it is given.  Returns the number of records visited. */
+int memstore_traverse(store_traverse_fn *fn, void *private);
+
+/* Start a background snapshot if one is due; reap finished ones. */
+void memstore_snapshot(void);
+
+/* Shorten a poll() timeout so a pending snapshot is not delayed. */
+int memstore_poll_timeout(int timeout);
+
+#endif /* _XENSTORED_MEMSTORE_H */
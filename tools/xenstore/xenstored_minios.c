@@ -20,6 +20,7 @@
 #include <sys/mman.h>
 #include <xenctrl.h>
 #include "xenstored_core.h"
+#include "xenstored_workers.h"
 #include <xen/grant_table.h>
 
 void write_pidfile(const char *pidfile)
@@ -60,3 +61,43 @@ void unmap_xenbus(void *interface)
 	xc_gnttab_munmap(*xcg_handle, interface, 1);
 }
 
+/* No scalable fd watcher here: the main loop uses poll(). */
+bool fd_watcher_init(void)
+{
+	return false;
+}
+
+bool fd_watcher_add(int fd, void *data, short events)
+{
+	return false;
+}
+
+bool fd_watcher_mod(int fd, void *data, short events)
+{
+	return false;
+}
+
+void fd_watcher_del(int fd)
+{
+}
+
+int fd_watcher_wait(struct fd_event *ev, unsigned int num, int timeout)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+/* No threads either: the read pool runs on the main thread. */
+bool workers_init(unsigned int nr)
+{
+	errno = ENOSYS;
+	return nr == 0;
+}
+
+void workers_run(void (*fn)(void *item), void *items[], unsigned int nr)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+		fn(items[i]);
+}
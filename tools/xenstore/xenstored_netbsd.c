@@ -71,3 +71,29 @@ void *xenbus_map(void)
 void xenbus_notify_running(void)
 {
 }
+
+/* No scalable fd watcher here: the main loop uses poll(). */
+bool fd_watcher_init(void)
+{
+	return false;
+}
+
+bool fd_watcher_add(int fd, void *data, short events)
+{
+	return false;
+}
+
+bool fd_watcher_mod(int fd, void *data, short events)
+{
+	return false;
+}
+
+void fd_watcher_del(int fd)
+{
+}
+
+int fd_watcher_wait(struct fd_event *ev, unsigned int num, int timeout)
+{
+	errno = ENOSYS;
+	return -1;
+}
@@ -166,3 +166,29 @@ out:
 	 */
 	asm("nop");
 }
+
+/* No scalable fd watcher here: the main loop uses poll(). */
+bool fd_watcher_init(void)
+{
+	return false;
+}
+
+bool fd_watcher_add(int fd, void *data, short events)
+{
+	return false;
+}
+
+bool fd_watcher_mod(int fd, void *data, short events)
+{
+	return false;
+}
+
+void fd_watcher_del(int fd)
+{
+}
+
+int fd_watcher_wait(struct fd_event *ev, unsigned int num, int timeout)
+{
+	errno = ENOSYS;
+	return -1;
+}
@@ -28,7 +28,9 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <string.h>
 #include "talloc.h"
+#include "hashtable.h"
 #include "list.h"
 #include "xenstored_transaction.h"
 #include "xenstored_watch.h"
@@ -36,6 +38,45 @@
 #include "xenstore_lib.h"
 #include "utils.h"
 
+/*
+ * Transactions do not copy the store.  Instead, every node touched by a
+ * transaction is recorded in an overlay keyed by path, together with the
+ * generation count the node had in the store proper when it was first
+ * accessed (0 if it did not exist).  Nodes written or deleted inside the
+ * transaction live only in the overlay until commit.
+ *
+ * On commit, each accessed node is checked against the store: if any
+ * generation changed, somebody else modified something we depended on and
+ * the transaction fails with EAGAIN.  Otherwise the modified nodes are
+ * written back.  Starting a transaction is thus O(1) and committing is
+ * O(nodes touched), independent of the size of the store.
+ *
+ * The store has no transactions of its own, so the write-back keeps the
+ * previous record of every node it overwrites and puts them back if a
+ * later write fails: either all of the changes are applied or none are.
+ */
+
+struct accessed_node
+{
+	/* List of all accessed nodes in the context of this transaction. */
+	struct list_head list;
+
+	/* The name of the node (also the overlay key). */
+	char *node;
+
+	/* Generation of the node in the store when first accessed. */
+	uint64_t generation;
+
+	/* Was the node written or deleted by this transaction? */
+	bool modified;
+
+	/* Node record if modified: NULL dptr means deleted. */
+	TDB_DATA data;
+
+	/* Record in the store when committing, to undo a failed write-back. */
+	TDB_DATA old;
+};
+
 struct changed_node
 {
 	/* List of all changed nodes in the context of this transaction. */
@@ -68,12 +109,11 @@ struct transaction
 	/* Connection-local identifier for this transaction. */
 	uint32_t id;
 
-	/* Generation when transaction started. */
-	unsigned int generation;
+	/* List of nodes read or written, in order of first access. */
+	struct list_head accessed;
 
-	/* TDB to work on, and filename */
-	TDB_CONTEXT *tdb;
-	char *tdb_name;
+	/* Index of accessed nodes by name. */
+	struct hashtable *overlay;
 
 	/* List of changed nodes. */
 	struct list_head changes;
@@ -83,12 +123,120 @@ struct transaction
 };
 
 extern int quota_max_transaction;
-static unsigned int generation;
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans)
+/* Generation of a record in the store proper: 0 if it does not exist. */
+static uint64_t store_generation(TDB_DATA key)
 {
-	return trans->tdb;
+	TDB_DATA data;
+	uint64_t gen;
+
+	data = fetch_record(NULL, key);
+	if (!data.dptr)
+		return 0;
+
+	gen = ((struct xs_tdb_record_hdr *)data.dptr)->generation;
+	talloc_free(data.dptr);
+	return gen;
+}
+
+/* Find the overlay entry for this node, creating it on first access. */
+static struct accessed_node *access_node(struct transaction *trans,
+					 TDB_DATA key)
+{
+	struct accessed_node *i;
+	char *name;
+
+	name = talloc_strndup(trans, (char *)key.dptr, key.dsize);
+	if (!name)
+		return NULL;
+
+	i = hashtable_search(trans->overlay, name);
+	if (i) {
+		talloc_free(name);
+		return i;
+	}
+
+	i = talloc_zero(trans, struct accessed_node);
+	if (!i) {
+		talloc_free(name);
+		return NULL;
+	}
+	i->node = talloc_steal(i, name);
+	i->generation = store_generation(key);
+
+	/* The hashtable frees its keys with free(). */
+	name = strdup(i->node);
+	if (!name || !hashtable_insert(trans->overlay, name, i)) {
+		free(name);
+		talloc_free(i);
+		return NULL;
+	}
+	list_add_tail(&i->list, &trans->accessed);
+	return i;
+}
+
+TDB_DATA transaction_fetch(struct transaction *trans, TDB_DATA key)
+{
+	struct accessed_node *i;
+	TDB_DATA data = { .dptr = NULL, .dsize = 0 };
+
+	i = access_node(trans, key);
+	if (!i) {
+		errno = ENOMEM;
+		return data;
+	}
+
+	if (!i->modified)
+		return fetch_record(NULL, key);
+
+	if (!i->data.dptr) {
+		errno = ENOENT;
+		return data;
+	}
+
+	/* Callers take ownership of the record, so hand out a copy. */
+	data.dptr = talloc_memdup(trans, i->data.dptr, i->data.dsize);
+	if (!data.dptr) {
+		errno = ENOMEM;
+		return data;
+	}
+	data.dsize = i->data.dsize;
+	return data;
+}
+
+bool transaction_store(struct transaction *trans, TDB_DATA key, TDB_DATA data)
+{
+	struct accessed_node *i;
+	void *copy;
+
+	i = access_node(trans, key);
+	if (!i)
+		return false;
+
+	copy = talloc_memdup(i, data.dptr, data.dsize);
+	if (!copy)
+		return false;
+
+	talloc_free(i->data.dptr);
+	i->data.dptr = copy;
+	i->data.dsize = data.dsize;
+	i->modified = true;
+	return true;
+}
+
+bool transaction_delete(struct transaction *trans, TDB_DATA key)
+{
+	struct accessed_node *i;
+
+	i = access_node(trans, key);
+	if (!i)
+		return false;
+
+	talloc_free(i->data.dptr);
+	i->data.dptr = NULL;
+	i->data.dsize = 0;
+	i->modified = true;
+	return true;
 }
 
 /* Callers get a change node (which can fail) and only commit after they've
@@ -98,8 +246,8 @@ void add_change_node(struct transaction *trans, const char *node, bool recurse)
 	struct changed_node *i;
 
 	if (!trans) {
-		/* They're changing the global database. */
-		generation++;
+		/* They're changing the global database: generation counts
+		 * of the written nodes tell transactions about it. */
 		return;
 	}
 
@@ -118,9 +266,8 @@ static int destroy_transaction(void *_transaction)
 	struct transaction *trans = _transaction;
 
 	trace_destroy(trans, "transaction");
-	if (trans->tdb)
-		tdb_close(trans->tdb);
-	unlink(trans->tdb_name);
+	/* Values are talloc children of trans: only free the keys. */
+	hashtable_destroy(trans->overlay, 0);
 	return 0;
 }
 
@@ -138,6 +285,26 @@ struct transaction *transaction_lookup(struct connection *conn, uint32_t id)
 	return ERR_PTR(-ENOENT);
 }
 
+struct transaction *transaction_new(const void *ctx)
+{
+	struct transaction *trans;
+
+	trans = talloc(ctx, struct transaction);
+	if (!trans)
+		return NULL;
+	INIT_LIST_HEAD(&trans->accessed);
+	INIT_LIST_HEAD(&trans->changes);
+	INIT_LIST_HEAD(&trans->changed_domains);
+	trans->id = 0;
+	trans->overlay = create_hashtable(16, hash_from_key_fn, keys_equal_fn);
+	if (!trans->overlay) {
+		talloc_free(trans);
+		return NULL;
+	}
+	talloc_set_destructor(trans, destroy_transaction);
+	return trans;
+}
+
 void do_transaction_start(struct connection *conn, struct buffered_data *in)
 {
 	struct transaction *trans, *exists;
@@ -155,19 +322,11 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 	}
 
 	/* Attach transaction to input for autofree until it's complete */
-	trans = talloc(in, struct transaction);
-	INIT_LIST_HEAD(&trans->changes);
-	INIT_LIST_HEAD(&trans->changed_domains);
-	trans->generation = generation;
-	trans->tdb_name = talloc_asprintf(trans, "%s.%p",
-					  xs_daemon_tdb(), trans);
-	trans->tdb = tdb_copy(tdb_context(conn), trans->tdb_name);
-	if (!trans->tdb) {
-		send_error(conn, errno);
+	trans = transaction_new(in);
+	if (!trans) {
+		send_error(conn, ENOMEM);
 		return;
 	}
-	/* Make it close if we go away. */
-	talloc_steal(trans, trans->tdb);
 
 	/* Pick an unused transaction identifier. */
 	do {
@@ -178,18 +337,111 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 	/* Now we own it. */
 	list_add_tail(&trans->list, &conn->transaction_list);
 	talloc_steal(conn, trans);
-	talloc_set_destructor(trans, destroy_transaction);
 	conn->transaction_started++;
 
 	snprintf(id_str, sizeof(id_str), "%u", trans->id);
 	send_reply(conn, XS_TRANSACTION_START, id_str, strlen(id_str)+1);
 }
 
-void do_transaction_end(struct connection *conn, const char *arg)
+/* Write a node's record back to the store, or delete it. */
+static bool writeback_record(TDB_DATA key, TDB_DATA data)
+{
+	if (data.dptr)
+		return store_record(key, data);
+	return delete_record(key) || errno == ENOENT;
+}
+
+/* Put back the records overwritten before the write-back of @last failed. */
+static void undo_writeback(struct transaction *trans,
+			   struct accessed_node *last)
+{
+	struct accessed_node *i;
+	TDB_DATA key;
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		if (i == last)
+			break;
+		if (!i->modified)
+			continue;
+
+		key.dptr = (void *)i->node;
+		key.dsize = strlen(i->node);
+		if (!writeback_record(key, i->old))
+			eprintf("> transaction %u: cannot restore %s: %s\n",
+				trans->id, i->node, strerror(errno));
+	}
+}
+
+/*
+ * Check nobody modified what we accessed, then write back our changes.
+ * Returns 0 or an errno value.
+ */
+static int finalize_transaction(struct transaction *trans)
+{
+	struct accessed_node *i;
+	TDB_DATA key;
+	uint64_t gen;
+
+	/* FIXME: Merge, rather failing on any change. */
+	list_for_each_entry(i, &trans->accessed, list) {
+		key.dptr = (void *)i->node;
+		key.dsize = strlen(i->node);
+
+		if (!i->modified) {
+			if (store_generation(key) != i->generation)
+				return EAGAIN;
+			continue;
+		}
+
+		i->old = fetch_record(trans, key);
+		if (!i->old.dptr && errno != ENOENT)
+			return EIO;
+
+		gen = i->old.dptr ?
+		      ((struct xs_tdb_record_hdr *)i->old.dptr)->generation : 0;
+		if (gen != i->generation)
+			return EAGAIN;
+	}
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		if (!i->modified)
+			continue;
+
+		key.dptr = (void *)i->node;
+		key.dsize = strlen(i->node);
+		if (!writeback_record(key, i->data)) {
+			undo_writeback(trans, i);
+			return EIO;
+		}
+	}
+
+	return 0;
+}
+
+int transaction_commit(struct connection *conn, struct transaction *trans)
 {
 	struct changed_node *i;
 	struct changed_domain *d;
+	int ret;
+
+	ret = finalize_transaction(trans);
+	if (ret)
+		return ret;
+
+	/* fix domain entry for each changed domain */
+	list_for_each_entry(d, &trans->changed_domains, list)
+		domain_entry_fix(d->domid, d->nbentry);
+
+	/* Fire off the watches for everything that changed. */
+	list_for_each_entry(i, &trans->changes, list)
+		fire_watches(conn, i->node, i->recurse);
+	return 0;
+}
+
+void do_transaction_end(struct connection *conn, const char *arg)
+{
 	struct transaction *trans;
+	int ret;
 
 	if (!arg || (!streq(arg, "T") && !streq(arg, "F"))) {
 		send_error(conn, EINVAL);
@@ -209,26 +461,11 @@ void do_transaction_end(struct connection *conn, const char *arg)
 	talloc_steal(arg, trans);
 
 	if (streq(arg, "T")) {
-		/* FIXME: Merge, rather failing on any change. */
-		if (trans->generation != generation) {
-			send_error(conn, EAGAIN);
-			return;
-		}
-		if (!replace_tdb(trans->tdb_name, trans->tdb)) {
-			send_error(conn, errno);
+		ret = transaction_commit(conn, trans);
+		if (ret) {
+			send_error(conn, ret);
 			return;
 		}
-		/* Don't close this: we won! */
-		trans->tdb = NULL;
-
-		/* fix domain entry for each changed domain */
-		list_for_each_entry(d, &trans->changed_domains, list)
-			domain_entry_fix(d->domid, d->nbentry);
-
-		/* Fire off the watches for everything that changed. */
-		list_for_each_entry(i, &trans->changes, list)
-			fire_watches(conn, i->node, i->recurse);
-		generation++;
 	}
 	send_ack(conn, XS_TRANSACTION_END);
 }
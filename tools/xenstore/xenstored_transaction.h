@@ -27,6 +27,14 @@ void do_transaction_end(struct connection *conn, const char *arg);
 
 struct transaction *transaction_lookup(struct connection *conn, uint32_t id);
 
+/* A transaction not known to the client, for making several changes at
+ * once: set conn->transaction to it while making them, then commit it or
+ * just free it. */
+struct transaction *transaction_new(const void *ctx);
+
+/* Write back trans and fire its watches: returns 0 or an errno value. */
+int transaction_commit(struct connection *conn, struct transaction *trans);
+
 /* inc/dec entry number local to trans while changing a node */
 void transaction_entry_inc(struct transaction *trans, unsigned int domid);
 void transaction_entry_dec(struct transaction *trans, unsigned int domid);
@@ -35,8 +43,10 @@ void transaction_entry_dec(struct transaction *trans, unsigned int domid);
 void add_change_node(struct transaction *trans, const char *node,
                      bool recurse);
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans);
+/* Access node records through the transaction overlay: set errno on error. */
+TDB_DATA transaction_fetch(struct transaction *trans, TDB_DATA key);
+bool transaction_store(struct transaction *trans, TDB_DATA key, TDB_DATA data);
+bool transaction_delete(struct transaction *trans, TDB_DATA key);
 
 void conn_delete_all_transactions(struct connection *conn);
 
@@ -24,7 +24,9 @@
 #include <sys/time.h>
 #include <time.h>
 #include <assert.h>
+#include <string.h>
 #include "talloc.h"
+#include "hashtable.h"
 #include "list.h"
 #include "xenstored_watch.h"
 #include "xenstore_lib.h"
@@ -33,11 +35,20 @@
 
 extern int quota_nb_watch_per_domain;
 
+struct watch_node;
+
 struct watch
 {
 	/* Watches on this connection */
 	struct list_head list;
 
+	/* Connection which owns this watch. */
+	struct connection *conn;
+
+	/* Watches registered on the same path, and that index entry. */
+	struct list_head index_list;
+	struct watch_node *index;
+
 	/* Current outstanding events applying to this watch. */
 	struct list_head events;
 
@@ -48,6 +59,116 @@ struct watch
 	char *node;
 };
 
+/*
+ * Watches are indexed by path, so that firing only visits the watches on
+ * the ancestors of the modified node (and on its descendants for a
+ * recursive change) rather than every watch of every connection.  Each
+ * path which has a watch, or which is an ancestor of one, has an entry in
+ * watch_index.  "@" event paths hang directly off "/".
+ */
+struct watch_node
+{
+	/* Full path of this entry (also its key in watch_index). */
+	char *path;
+
+	/* Parent entry, NULL for "/". */
+	struct watch_node *parent;
+
+	/* Entries for the immediate children of this path. */
+	struct list_head children;
+	struct list_head sibling;
+
+	/* Watches registered on exactly this path. */
+	struct list_head watches;
+};
+
+static struct hashtable *watch_index;
+
+/* Dispatch statistics, reported by XS_DEBUG "watch-stats": index entries
+ * visited and watches matched, against what a scan of every watch on every
+ * fire would have cost. */
+static unsigned int nr_watches;
+static unsigned long nr_fires, nr_visited, nr_matched, nr_scan_equiv;
+
+static char *watch_parent_path(const void *ctx, const char *path)
+{
+	char *slash = strrchr(path + 1, '/');
+
+	if (!slash)
+		return talloc_strdup(ctx, "/");
+	return talloc_strndup(ctx, path, slash - path);
+}
+
+static struct watch_node *find_watch_node(const char *path)
+{
+	if (!watch_index)
+		return NULL;
+	return hashtable_search(watch_index, (void *)path);
+}
+
+/* Get the index entry for path, creating it and its ancestors if needed. */
+static struct watch_node *get_watch_node(const char *path)
+{
+	struct watch_node *wn, *parent = NULL;
+	char *key;
+
+	if (!watch_index) {
+		watch_index = create_hashtable(64, hash_from_key_fn,
+					       keys_equal_fn);
+		if (!watch_index)
+			return NULL;
+	}
+
+	wn = find_watch_node(path);
+	if (wn)
+		return wn;
+
+	if (!streq(path, "/")) {
+		char *ppath = watch_parent_path(NULL, path);
+
+		parent = ppath ? get_watch_node(ppath) : NULL;
+		talloc_free(ppath);
+		if (!parent)
+			return NULL;
+	}
+
+	wn = talloc(talloc_autofree_context(), struct watch_node);
+	if (!wn)
+		return NULL;
+	wn->path = talloc_strdup(wn, path);
+	wn->parent = parent;
+	INIT_LIST_HEAD(&wn->children);
+	INIT_LIST_HEAD(&wn->watches);
+
+	/* The hashtable frees its keys with free(). */
+	key = strdup(path);
+	if (!wn->path || !key || !hashtable_insert(watch_index, key, wn)) {
+		free(key);
+		talloc_free(wn);
+		return NULL;
+	}
+	if (parent)
+		list_add_tail(&wn->sibling, &parent->children);
+	else
+		INIT_LIST_HEAD(&wn->sibling);
+
+	return wn;
+}
+
+/* Drop index entries which no longer lead to any watch. */
+static void put_watch_node(struct watch_node *wn)
+{
+	struct watch_node *parent;
+
+	while (wn && list_empty(&wn->watches) && list_empty(&wn->children)) {
+		parent = wn->parent;
+		list_del(&wn->sibling);
+		hashtable_remove(watch_index, wn->path);
+		talloc_free(wn);
+		wn = parent;
+	}
+}
+
 static void add_event(struct connection *conn,
 		      struct watch *watch,
 		      const char *name)
@@ -86,28 +207,93 @@ static void add_event(struct connection *conn,
 	talloc_free(data);
 }
 
-void fire_watches(struct connection *conn, const char *name, bool recurse)
+/* Fire every watch registered on exactly this path. */
+static void fire_watch_node(struct watch_node *wn, const char *name)
 {
-	struct connection *i;
 	struct watch *watch;
 
+	nr_visited++;
+	list_for_each_entry(watch, &wn->watches, index_list) {
+		nr_matched++;
+		add_event(watch->conn, watch, name);
+	}
+}
+
+/* Fire every watch below wn, for a recursive change. */
+static void fire_watch_subtree(struct watch_node *wn)
+{
+	struct watch_node *child;
+	struct watch *watch;
+
+	list_for_each_entry(child, &wn->children, sibling) {
+		nr_visited++;
+		list_for_each_entry(watch, &child->watches, index_list) {
+			nr_matched++;
+			add_event(watch->conn, watch, watch->node);
+		}
+		fire_watch_subtree(child);
+	}
+}
+
+void fire_watches(struct connection *conn, const char *name, bool recurse)
+{
+	struct watch_node *wn;
+	char *path, *p;
+
 	/* During transactions, don't fire watches. */
 	if (conn && conn->transaction)
 		return;
 
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		list_for_each_entry(watch, &i->watches, list) {
-			if (is_child(name, watch->node))
-				add_event(i, watch, name);
-			else if (recurse && is_child(watch->node, name))
-				add_event(i, watch, watch->node);
-		}
+	wn = find_watch_node("/");
+	if (!wn)
+		return;
+
+	nr_fires++;
+	nr_scan_equiv += nr_watches;
+
+	/* Create an event for each watch on name or one of its parents.
+	 * Ancestors of indexed paths are always indexed, so stop at the
+	 * first missing one. */
+	fire_watch_node(wn, name);
+	if (streq(name, "/"))
+		return;
+
+	path = talloc_strdup(NULL, name);
+	for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		wn = find_watch_node(path);
+		*p = '/';
+		if (!wn)
+			break;
+		fire_watch_node(wn, name);
 	}
+	talloc_free(path);
+
+	wn = p ? NULL : find_watch_node(name);
+	if (!wn)
+		return;
+	fire_watch_node(wn, name);
+	if (recurse)
+		fire_watch_subtree(wn);
+}
+
+char *watch_stats(const void *ctx)
+{
+	return talloc_asprintf(ctx,
+			       "watches %u paths %u fires %lu "
+			       "visited %lu matched %lu scan-equivalent %lu\n",
+			       nr_watches,
+			       watch_index ? hashtable_count(watch_index) : 0,
+			       nr_fires, nr_visited, nr_matched, nr_scan_equiv);
 }
 
 static int destroy_watch(void *_watch)
 {
+	struct watch *watch = _watch;
+
+	list_del(&watch->index_list);
+	put_watch_node(watch->index);
+	nr_watches--;
 	trace_destroy(_watch, "watch");
 	return 0;
 }
@@ -154,6 +340,7 @@ void do_watch(struct connection *conn, struct buffered_data *in)
 	}
 
 	watch = talloc(conn, struct watch);
+	watch->conn = conn;
 	watch->node = talloc_strdup(watch, vec[0]);
 	watch->token = talloc_strdup(watch, vec[1]);
 	if (relative)
@@ -161,10 +348,19 @@ void do_watch(struct connection *conn, struct buffered_data *in)
 	else
 		watch->relative_path = NULL;
 
+	watch->index = get_watch_node(watch->node);
+	if (!watch->index) {
+		talloc_free(watch);
+		send_error(conn, ENOMEM);
+		return;
+	}
+
 	INIT_LIST_HEAD(&watch->events);
 
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
+	list_add_tail(&watch->index_list, &watch->index->watches);
+	nr_watches++;
 	trace_create(watch, "watch");
 	talloc_set_destructor(watch, destroy_watch);
 	send_ack(conn, XS_WATCH);
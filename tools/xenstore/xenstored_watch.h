@@ -30,6 +30,9 @@ void fire_watches(struct connection *conn, const char *name, bool recurse);
 
 void dump_watches(struct connection *conn);
 
+/* Return a description of watch dispatch statistics. */
+char *watch_stats(const void *ctx);
+
 void conn_delete_all_watches(struct connection *conn);
 
 #endif /* _XENSTORED_WATCH_H */
@@ -0,0 +1,156 @@
+/*
+    Worker threads for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+ * The workers sleep until workers_run() hands them a batch, then take
+ * items from it one at a time until it is used up.  Nothing else in the
+ * daemon is thread-safe: it is up to the caller to make sure the items
+ * can be worked on at the same time, and that the main thread does
+ * nothing else while they are.
+ *
+ * The memory store forks to take snapshots.  fork() waits for the
+ * workers to be idle, and the child, which only has the calling
+ * thread, does all of its work inline.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include "xenstored_workers.h"
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int nr_workers;
+
+/* The current batch, protected by lock. */
+static void (*batch_fn)(void *item);
+static void **batch_items;
+static unsigned int batch_nr, batch_next, batch_done;
+static unsigned int batch_seq;
+
+/* Work on the current batch until it is all taken.  Called with lock held. */
+static void work(void)
+{
+	void *item;
+
+	while (batch_next < batch_nr) {
+		item = batch_items[batch_next++];
+		pthread_mutex_unlock(&lock);
+		batch_fn(item);
+		pthread_mutex_lock(&lock);
+		if (++batch_done == batch_nr)
+			pthread_cond_signal(&done_cond);
+	}
+}
+
+/* Keep the workers out of the way of fork(): see above. */
+static void prepare_fork(void)
+{
+	pthread_mutex_lock(&lock);
+	while (batch_done != batch_nr)
+		pthread_cond_wait(&done_cond, &lock);
+}
+
+static void parent_fork(void)
+{
+	pthread_mutex_unlock(&lock);
+}
+
+static void child_fork(void)
+{
+	nr_workers = 0;
+	pthread_mutex_unlock(&lock);
+}
+
+static void *worker(void *arg)
+{
+	unsigned int seq = 0;
+
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (batch_seq == seq)
+			pthread_cond_wait(&work_cond, &lock);
+		seq = batch_seq;
+		work();
+	}
+	return NULL;
+}
+
+bool workers_init(unsigned int nr)
+{
+	sigset_t all, old;
+	pthread_t thread;
+	int err = 0;
+
+	if (!nr_workers && nr) {
+		err = pthread_atfork(prepare_fork, parent_fork, child_fork);
+		if (err) {
+			errno = err;
+			return false;
+		}
+	}
+
+	/* Leave signals to the main thread. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (; nr_workers < nr; nr_workers++) {
+		err = pthread_create(&thread, NULL, worker, NULL);
+		if (err)
+			break;
+		pthread_detach(thread);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	errno = err;
+	return err == 0;
+}
+
+void workers_run(void (*fn)(void *item), void *items[], unsigned int nr)
+{
+	unsigned int i;
+
+	if (!nr_workers || nr == 1) {
+		for (i = 0; i < nr; i++)
+			fn(items[i]);
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	batch_fn = fn;
+	batch_items = items;
+	batch_nr = nr;
+	batch_next = batch_done = 0;
+	batch_seq++;
+	pthread_cond_broadcast(&work_cond);
+
+	work();
+	while (batch_done != batch_nr)
+		pthread_cond_wait(&done_cond, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Local variables:
+ *  c-file-style: "linux"
+ *  indent-tabs-mode: t
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
@@ -0,0 +1,32 @@
+/*
+    Worker threads for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _XENSTORED_WORKERS_H
+#define _XENSTORED_WORKERS_H
+
+#include <stdbool.h>
+
+/* Start nr threads to help the main thread out in workers_run().  Returns
+ * false (and sets errno) if that is not possible. */
+bool workers_init(unsigned int nr);
+
+/* Call fn on each of the items, spread over the main thread and the
+ * workers, returning once all the calls are done. */
+void workers_run(void (*fn)(void *item), void *items[], unsigned int nr);
+
+#endif /* _XENSTORED_WORKERS_H */
@@ -970,6 +970,191 @@ bool xs_transaction_end(struct xs_handle *h, xs_transaction_t t,
 	return xs_bool(xs_single(h, t, XS_TRANSACTION_END, abortstr, NULL));
 }
 
+/* Room for the replies to a batch: "OK" or an error, and their headers. */
+#define XS_MULTI_MAX_OPS (XENSTORE_PAYLOAD_MAX / (sizeof(struct xsd_sockmsg) + 16))
+
+struct xs_multi {
+	struct xs_handle *h;
+	xs_transaction_t t;
+
+	/* Ops not yet sent, each a header and payload. */
+	char buffer[XENSTORE_PAYLOAD_MAX];
+	unsigned int len, num_ops;
+
+	/* How many ops sent so far failed. */
+	int failed;
+};
+
+struct xs_multi *xs_multi_start(struct xs_handle *h, xs_transaction_t t)
+{
+	struct xs_multi *m;
+
+	m = malloc(sizeof(*m));
+	if (!m)
+		return NULL;
+	m->h = h;
+	m->t = t;
+	m->len = m->num_ops = 0;
+	m->failed = 0;
+	return m;
+}
+
+/* Send the ops one at a time, for daemons which do not know XS_MULTI. */
+static bool multi_send_singly(struct xs_multi *m)
+{
+	struct xsd_sockmsg msg;
+	struct iovec iovec;
+	unsigned int off;
+	void *reply;
+
+	for (off = 0; off < m->len; off += sizeof(msg) + msg.len) {
+		memcpy(&msg, m->buffer + off, sizeof(msg));
+		iovec.iov_base = m->buffer + off + sizeof(msg);
+		iovec.iov_len = msg.len;
+		reply = xs_talkv(m->h, m->t, msg.type, &iovec, 1, NULL);
+		if (reply)
+			free(reply);
+		else if (m->h->fd == -1)
+			return false;
+		else
+			m->failed++;
+	}
+	return true;
+}
+
+static bool multi_send(struct xs_multi *m)
+{
+	struct xsd_sockmsg msg;
+	struct iovec iovec;
+	unsigned int off, len;
+	char *reply;
+	bool ret = true;
+
+	if (!m->num_ops)
+		return true;
+
+	iovec.iov_base = m->buffer;
+	iovec.iov_len = m->len;
+	reply = xs_talkv(m->h, m->t, XS_MULTI, &iovec, 1, &len);
+	if (reply) {
+		for (off = 0; off + sizeof(msg) <= len;
+		     off += sizeof(msg) + msg.len) {
+			memcpy(&msg, reply + off, sizeof(msg));
+			if (msg.type == XS_ERROR)
+				m->failed++;
+		}
+		free(reply);
+	} else if (errno == ENOSYS && m->t != XBT_NULL && m->h->fd != -1)
+		/* Only a transaction keeps the ops together then. */
+		ret = multi_send_singly(m);
+	else
+		ret = false;
+
+	m->len = m->num_ops = 0;
+	return ret;
+}
+
+static bool multi_add(struct xs_multi *m, enum xsd_sockmsg_type type,
+		      const struct iovec *iovec, unsigned int num_vecs)
+{
+	struct xsd_sockmsg msg;
+	unsigned int i;
+
+	msg.type = type;
+	msg.req_id = 0;
+	msg.tx_id = 0;
+	msg.len = 0;
+	for (i = 0; i < num_vecs; i++)
+		msg.len += iovec[i].iov_len;
+
+	if (sizeof(msg) + msg.len > sizeof(m->buffer)) {
+		errno = E2BIG;
+		return false;
+	}
+	if (m->len + sizeof(msg) + msg.len > sizeof(m->buffer) ||
+	    m->num_ops == XS_MULTI_MAX_OPS) {
+		/* In a transaction, nobody sees the changes before the end
+		 * anyway, so we can send what we have. */
+		if (m->t == XBT_NULL) {
+			errno = E2BIG;
+			return false;
+		}
+		if (!multi_send(m))
+			return false;
+	}
+
+	memcpy(m->buffer + m->len, &msg, sizeof(msg));
+	m->len += sizeof(msg);
+	for (i = 0; i < num_vecs; i++) {
+		memcpy(m->buffer + m->len, iovec[i].iov_base, iovec[i].iov_len);
+		m->len += iovec[i].iov_len;
+	}
+	m->num_ops++;
+	return true;
+}
+
+bool xs_multi_write(struct xs_multi *m, const char *path,
+		    const void *data, unsigned int len)
+{
+	struct iovec iovec[2];
+
+	iovec[0].iov_base = (void *)path;
+	iovec[0].iov_len = strlen(path) + 1;
+	iovec[1].iov_base = (void *)data;
+	iovec[1].iov_len = len;
+
+	return multi_add(m, XS_WRITE, iovec, ARRAY_SIZE(iovec));
+}
+
+bool xs_multi_mkdir(struct xs_multi *m, const char *path)
+{
+	struct iovec iovec;
+
+	iovec.iov_base = (void *)path;
+	iovec.iov_len = strlen(path) + 1;
+	return multi_add(m, XS_MKDIR, &iovec, 1);
+}
+
+bool xs_multi_rm(struct xs_multi *m, const char *path)
+{
+	struct iovec iovec;
+
+	iovec.iov_base = (void *)path;
+	iovec.iov_len = strlen(path) + 1;
+	return multi_add(m, XS_RM, &iovec, 1);
+}
+
+bool xs_multi_set_permissions(struct xs_multi *m, const char *path,
+			      struct xs_permissions *perms,
+			      unsigned int num_perms)
+{
+	char buffer[num_perms][MAX_STRLEN(unsigned int)+1];
+	struct iovec iov[1+num_perms];
+	unsigned int i;
+
+	iov[0].iov_base = (void *)path;
+	iov[0].iov_len = strlen(path) + 1;
+
+	for (i = 0; i < num_perms; i++) {
+		if (!xs_perm_to_string(&perms[i], buffer[i], sizeof(buffer[i])))
+			return false;
+		iov[i+1].iov_base = buffer[i];
+		iov[i+1].iov_len = strlen(buffer[i]) + 1;
+	}
+
+	return multi_add(m, XS_SET_PERMS, iov, 1+num_perms);
+}
+
+int xs_multi_end(struct xs_multi *m, bool abort)
+{
+	int ret = -1;
+
+	if (abort || multi_send(m))
+		ret = m->failed;
+	free_no_errno(m);
+	return ret;
+}
+
 /* Introduce a new domain.
  * This tells the store daemon about a shared memory page and event channel
  * associated with a domain: the domain uses these to communicate.
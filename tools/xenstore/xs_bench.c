@@ -0,0 +1,141 @@
+/*
+ * Simple xenstore load generator: each of a number of threads opens its own
+ * connection, standing in for one domain, and reads (and optionally
+ * writes) keys under a scratch directory as fast as it can.  Reports the
+ * aggregate and per-connection operations per second.
+ */
+#include <err.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <xenstore.h>
+
+struct client {
+	pthread_t thread;
+	struct xs_handle *xsh;
+	unsigned int seed;
+	unsigned long ops;
+	unsigned long errors;
+};
+
+static const char *base = "/xs_bench";
+static unsigned int nr_keys = 100;
+static unsigned int write_percent;
+static volatile bool stop;
+
+static void *run_client(void *arg)
+{
+	struct client *c = arg;
+	char path[64];
+	unsigned int len, key;
+	void *val;
+
+	while (!stop) {
+		key = rand_r(&c->seed) % nr_keys;
+		snprintf(path, sizeof(path), "%s/%u", base, key);
+		if (rand_r(&c->seed) % 100 < write_percent) {
+			if (!xs_write(c->xsh, XBT_NULL, path, "value", 5))
+				c->errors++;
+		} else {
+			val = xs_read(c->xsh, XBT_NULL, path, &len);
+			if (!val)
+				c->errors++;
+			free(val);
+		}
+		c->ops++;
+	}
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-c connections] [-t seconds] [-k keys] "
+		"[-w write-percent] [-p path]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nr_clients = 8, seconds = 5, i;
+	unsigned long total = 0, errors = 0, min = ~0UL, max = 0;
+	struct client *clients;
+	struct xs_handle *xsh;
+	char path[64];
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:t:k:w:p:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			nr_clients = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			seconds = strtoul(optarg, NULL, 10);
+			break;
+		case 'k':
+			nr_keys = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			write_percent = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			base = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || !nr_clients || !nr_keys || write_percent > 100)
+		usage(argv[0]);
+
+	xsh = xs_open(0);
+	if (!xsh)
+		err(1, "xs_open");
+	for (i = 0; i < nr_keys; i++) {
+		snprintf(path, sizeof(path), "%s/%u", base, i);
+		if (!xs_write(xsh, XBT_NULL, path, "value", 5))
+			err(1, "writing %s", path);
+	}
+
+	clients = calloc(nr_clients, sizeof(*clients));
+	if (!clients)
+		err(1, "calloc");
+	for (i = 0; i < nr_clients; i++) {
+		clients[i].xsh = xs_open(0);
+		if (!clients[i].xsh)
+			err(1, "xs_open");
+		clients[i].seed = i;
+	}
+	for (i = 0; i < nr_clients; i++)
+		if (pthread_create(&clients[i].thread, NULL, run_client,
+				   &clients[i]))
+			errx(1, "pthread_create failed");
+
+	sleep(seconds);
+	stop = true;
+
+	for (i = 0; i < nr_clients; i++) {
+		pthread_join(clients[i].thread, NULL);
+		xs_close(clients[i].xsh);
+		total += clients[i].ops;
+		errors += clients[i].errors;
+		if (clients[i].ops < min)
+			min = clients[i].ops;
+		if (clients[i].ops > max)
+			max = clients[i].ops;
+	}
+
+	xs_rm(xsh, XBT_NULL, base);
+	xs_close(xsh);
+
+	printf("%u connections, %u%% writes: %lu ops in %us, %.0f ops/s "
+	       "(per connection %.0f-%.0f ops/s), %lu errors\n",
+	       nr_clients, write_percent, total, seconds,
+	       (double)total / seconds, (double)min / seconds,
+	       (double)max / seconds, errors);
+	return errors ? 1 : 0;
+}
@@ -116,7 +116,9 @@ static void idle_loop(void)
     {
         if ( cpu_is_offline(smp_processor_id()) )
             play_dead();
-        (*pm_idle)();
+        /* Scrub freed memory before going to sleep. */
+        if ( !cpu_is_haltable(smp_processor_id()) || !scrub_free_pages() )
+            (*pm_idle)();
         do_tasklet();
         do_softirq();
     }
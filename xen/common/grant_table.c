@@ -48,8 +48,10 @@ integer_param("gnttab_max_nr_frames", max_nr_grant_frames);
 /* The maximum number of grant mappings is defined as a multiplier of the
  * maximum number of grant table entries. This defines the multiplier used.
  * Pretty arbitrary. [POLICY]
+ * It counts maptrack frames, so it was doubled when struct grant_mapping
+ * grew to 16 bytes, keeping the number of handles the same.
  */
-#define MAX_MAPTRACK_TO_GRANTS_RATIO 8
+#define MAX_MAPTRACK_TO_GRANTS_RATIO 16
 
 /*
  * The first two members of a grant entry are updated as a combined pair.
@@ -109,6 +111,9 @@ static unsigned inline int max_nr_maptrack_frames(void)
 
 #define MAPTRACK_TAIL (~0u)
 
+/* Maptrack frames added at once when a vCPU runs out of handles. [POLICY] */
+#define MAPTRACK_GROW_FRAMES 4
+
 #define SHGNT_PER_PAGE_V1 (PAGE_SIZE / sizeof(grant_entry_v1_t))
 #define shared_entry_v1(t, e) \
     ((t)->shared_v1[(e)/SHGNT_PER_PAGE_V1][(e)%SHGNT_PER_PAGE_V1])
@@ -141,12 +146,86 @@ struct active_grant_entry {
                                in the page.                           */
     unsigned      length:16; /* For sub-page grants, the length of the
                                 grant.                                */
+    spinlock_t    lock;      /* Lock protecting updates to this entry. */
 };
 
 #define ACGNT_PER_PAGE (PAGE_SIZE / sizeof(struct active_grant_entry))
 #define active_entry(t, e) \
     ((t)->active[(e)/ACGNT_PER_PAGE][(e)%ACGNT_PER_PAGE])
 
+/*
+ * Grant table locking.  The per-domain table lock is a rwlock: it is
+ * taken for reading by everything that only looks up entries (map, unmap,
+ * copy, transfer) and for writing by the few operations that change the
+ * table's size or version.  Under the read lock, an active entry and its
+ * shared/status entry may only be modified while holding the active
+ * entry's own lock, taken with active_entry_acquire().
+ *
+ * The wrappers below count acquisitions and the number of times the lock
+ * was already held by someone else, see the grant_* perf counters.
+ */
+static inline void grant_read_lock(struct grant_table *gt)
+{
+    perfc_incr(grant_lock_read);
+    if ( !read_trylock(&gt->lock) )
+    {
+        perfc_incr(grant_lock_read_contended);
+        read_lock(&gt->lock);
+    }
+}
+
+static inline void grant_read_unlock(struct grant_table *gt)
+{
+    read_unlock(&gt->lock);
+}
+
+static inline void grant_write_lock(struct grant_table *gt)
+{
+    perfc_incr(grant_lock_write);
+    if ( !write_trylock(&gt->lock) )
+    {
+        perfc_incr(grant_lock_write_contended);
+        write_lock(&gt->lock);
+    }
+}
+
+static inline void grant_write_unlock(struct grant_table *gt)
+{
+    write_unlock(&gt->lock);
+}
+
+static inline struct active_grant_entry *
+active_entry_acquire(struct grant_table *gt, grant_ref_t ref)
+{
+    struct active_grant_entry *act;
+
+    ASSERT(rw_is_locked(&gt->lock));
+
+    act = &active_entry(gt, ref);
+    perfc_incr(grant_active_lock);
+    if ( !spin_trylock(&act->lock) )
+    {
+        perfc_incr(grant_active_lock_contended);
+        spin_lock(&act->lock);
+    }
+
+    return act;
+}
+
+static inline void active_entry_release(struct active_grant_entry *act)
+{
+    spin_unlock(&act->lock);
+}
+
+static void active_entries_init(struct active_grant_entry *page)
+{
+    unsigned int i;
+
+    clear_page(page);
+    for ( i = 0; i < ACGNT_PER_PAGE; i++ )
+        spin_lock_init(&page[i].lock);
+}
+
 static inline unsigned int
 num_act_frames_from_sha_frames(const unsigned int num)
 {
@@ -206,94 +285,206 @@ static int __get_paged_frame(unsigned long gfn, unsigned long *frame, struct pag
     return rc;
 }
 
+/*
+ * Only needed for the IOMMU bookkeeping in map/unmap: mapcount() walks the
+ * local maptrack and reads remote active entries without taking their
+ * per-entry locks, so both tables are write locked.
+ */
 static inline void
 double_gt_lock(struct grant_table *lgt, struct grant_table *rgt)
 {
     if ( lgt < rgt )
     {
-        spin_lock(&lgt->lock);
-        spin_lock(&rgt->lock);
+        grant_write_lock(lgt);
+        grant_write_lock(rgt);
     }
     else
     {
         if ( lgt != rgt )
-            spin_lock(&rgt->lock);
-        spin_lock(&lgt->lock);
+            grant_write_lock(rgt);
+        grant_write_lock(lgt);
     }
 }
 
 static inline void
 double_gt_unlock(struct grant_table *lgt, struct grant_table *rgt)
 {
-    spin_unlock(&lgt->lock);
+    grant_write_unlock(lgt);
     if ( lgt != rgt )
-        spin_unlock(&rgt->lock);
+        grant_write_unlock(rgt);
 }
 
+/*
+ * Maptrack handles live on per-vCPU free lists so that vCPUs mapping and
+ * unmapping concurrently don't contend on a shared list.  A handle goes
+ * back to the list of the vCPU recorded in its entry.  Each list always
+ * keeps one entry, so puts can append at the tail while gets take from
+ * the head.  The per-vCPU lock is normally only taken by its owner.
+ */
 static inline int
 __get_maptrack_handle(
-    struct grant_table *t)
+    struct grant_table *t, struct vcpu *v)
+{
+    unsigned int head, next;
+
+    spin_lock(&v->maptrack_freelist_lock);
+
+    head = v->maptrack_head;
+    if ( unlikely(head == MAPTRACK_TAIL) )
+        goto empty;
+
+    next = maptrack_entry(t, head).ref;
+    if ( unlikely(next == MAPTRACK_TAIL) )
+        goto empty;
+
+    v->maptrack_head = next;
+
+    spin_unlock(&v->maptrack_freelist_lock);
+
+    return head;
+
+ empty:
+    spin_unlock(&v->maptrack_freelist_lock);
+    return -1;
+}
+
+/*
+ * Take a free handle from another vCPU of the domain.  Stolen entries
+ * are handed over to the thief, so the free entries migrate towards the
+ * vCPUs that actually use them.
+ */
+static int
+steal_maptrack_handle(
+    struct grant_table *t, struct vcpu *curr)
 {
-    unsigned int h;
-    if ( unlikely((h = t->maptrack_head) == MAPTRACK_TAIL) )
-        return -1;
-    t->maptrack_head = maptrack_entry(t, h).ref;
-    return h;
+    struct domain *d = curr->domain;
+    unsigned int i = curr->vcpu_id;
+    int handle;
+
+    do {
+        if ( ++i >= d->max_vcpus )
+            i = 0;
+        if ( d->vcpu[i] == NULL || d->vcpu[i] == curr )
+            continue;
+
+        handle = __get_maptrack_handle(t, d->vcpu[i]);
+        if ( handle != -1 )
+        {
+            perfc_incr(grant_maptrack_steal);
+            maptrack_entry(t, handle).vcpu = curr->vcpu_id;
+            return handle;
+        }
+    } while ( i != curr->vcpu_id );
+
+    return -1;
 }
 
 static inline void
 put_maptrack_handle(
     struct grant_table *t, int handle)
 {
-    spin_lock(&t->lock);
-    maptrack_entry(t, handle).ref = t->maptrack_head;
-    t->maptrack_head = handle;
-    spin_unlock(&t->lock);
+    struct domain *d = current->domain;
+    struct vcpu *v;
+
+    maptrack_entry(t, handle).ref = MAPTRACK_TAIL;
+
+    v = d->vcpu[maptrack_entry(t, handle).vcpu];
+
+    spin_lock(&v->maptrack_freelist_lock);
+    maptrack_entry(t, v->maptrack_tail).ref = handle;
+    v->maptrack_tail = handle;
+    spin_unlock(&v->maptrack_freelist_lock);
 }
 
 static inline int
 get_maptrack_handle(
     struct grant_table *lgt)
 {
-    int                   i;
-    grant_handle_t        handle;
+    struct vcpu          *curr = current;
+    unsigned int          i, nr_frames, nr_new, limit, new_limit;
+    int                   handle;
     struct grant_mapping *new_mt;
-    unsigned int          new_mt_limit, nr_frames;
 
-    spin_lock(&lgt->lock);
+    handle = __get_maptrack_handle(lgt, curr);
+    if ( likely(handle != -1) )
+        return handle;
 
-    while ( unlikely((handle = __get_maptrack_handle(lgt)) == -1) )
-    {
-        nr_frames = nr_maptrack_frames(lgt);
-        if ( nr_frames >= max_nr_maptrack_frames() )
-            break;
+    spin_lock(&lgt->maptrack_lock);
 
-        new_mt = alloc_xenheap_page();
-        if ( !new_mt )
+    nr_frames = nr_maptrack_frames(lgt);
+    nr_new = min_t(unsigned int, MAPTRACK_GROW_FRAMES,
+                   max_nr_maptrack_frames() - nr_frames);
+    for ( i = 0; i < nr_new; i++ )
+    {
+        if ( (new_mt = alloc_xenheap_page()) == NULL )
             break;
-
         clear_page(new_mt);
+        lgt->maptrack[nr_frames + i] = new_mt;
+    }
+    nr_new = i;
 
-        new_mt_limit = lgt->maptrack_limit + MAPTRACK_PER_PAGE;
+    if ( nr_new == 0 )
+    {
+        /*
+         * Out of frames (or memory): fall back to another vCPU's free
+         * entries.  A vCPU that has never mapped anything first needs an
+         * entry to act as its list's tail.
+         */
+        spin_unlock(&lgt->maptrack_lock);
 
-        for ( i = 1; i < MAPTRACK_PER_PAGE; i++ )
-            new_mt[i - 1].ref = lgt->maptrack_limit + i;
-        new_mt[i - 1].ref = lgt->maptrack_head;
-        lgt->maptrack_head = lgt->maptrack_limit;
+        if ( curr->maptrack_tail == MAPTRACK_TAIL )
+        {
+            handle = steal_maptrack_handle(lgt, curr);
+            if ( handle == -1 )
+                return -1;
+            maptrack_entry(lgt, handle).ref = MAPTRACK_TAIL;
+            spin_lock(&curr->maptrack_freelist_lock);
+            curr->maptrack_head = curr->maptrack_tail = handle;
+            spin_unlock(&curr->maptrack_freelist_lock);
+        }
 
-        lgt->maptrack[nr_frames] = new_mt;
-        smp_wmb();
-        lgt->maptrack_limit      = new_mt_limit;
+        return steal_maptrack_handle(lgt, curr);
+    }
 
-        gdprintk(XENLOG_INFO, "Increased maptrack size to %u frames\n",
-                 nr_frames + 1);
+    /* Hand out the first new entry and put the rest on our own list. */
+    limit = lgt->maptrack_limit;
+    new_limit = limit + nr_new * MAPTRACK_PER_PAGE;
+    for ( i = limit; i < new_limit; i++ )
+    {
+        maptrack_entry(lgt, i).ref = i + 1;
+        maptrack_entry(lgt, i).vcpu = curr->vcpu_id;
     }
+    handle = limit;
+
+    spin_lock(&curr->maptrack_freelist_lock);
+    if ( curr->maptrack_tail == MAPTRACK_TAIL )
+    {
+        maptrack_entry(lgt, new_limit - 1).ref = MAPTRACK_TAIL;
+        curr->maptrack_tail = new_limit - 1;
+    }
+    else
+        maptrack_entry(lgt, new_limit - 1).ref = curr->maptrack_head;
+    curr->maptrack_head = limit + 1;
+    spin_unlock(&curr->maptrack_freelist_lock);
 
-    spin_unlock(&lgt->lock);
+    smp_wmb();
+    lgt->maptrack_limit = new_limit;
+
+    spin_unlock(&lgt->maptrack_lock);
+
+    gdprintk(XENLOG_INFO, "Increased maptrack size to %u frames\n",
+             nr_frames + nr_new);
 
     return handle;
 }
 
+void grant_table_init_vcpu(struct vcpu *v)
+{
+    spin_lock_init(&v->maptrack_freelist_lock);
+    v->maptrack_head = MAPTRACK_TAIL;
+    v->maptrack_tail = MAPTRACK_TAIL;
+}
+
 /* Number of grant table entries. Caller must hold d's grant table lock. */
 static unsigned int nr_grant_entries(struct grant_table *gt)
 {
@@ -519,6 +710,7 @@ __gnttab_map_grant_ref(
     u32            old_pin;
     u32            act_pin;
     unsigned int   cache_flags;
+    bool_t         iommu_update;
     struct active_grant_entry *act = NULL;
     struct grant_mapping *mt;
     grant_entry_v1_t *sha1;
@@ -570,7 +762,7 @@ __gnttab_map_grant_ref(
     }
 
     rgt = rd->grant_table;
-    spin_lock(&rgt->lock);
+    grant_read_lock(rgt);
 
     if ( rgt->gt_version == 0 )
         PIN_FAIL(unlock_out, GNTST_general_error,
@@ -580,7 +772,7 @@ __gnttab_map_grant_ref(
     if ( unlikely(op->ref >= nr_grant_entries(rgt)))
         PIN_FAIL(unlock_out, GNTST_bad_gntref, "Bad ref (%d).\n", op->ref);
 
-    act = &active_entry(rgt, op->ref);
+    act = active_entry_acquire(rgt, op->ref);
     shah = shared_entry_header(rgt, op->ref);
     if (rgt->gt_version == 1) {
         sha1 = &shared_entry_v1(rgt, op->ref);
@@ -597,7 +789,7 @@ __gnttab_map_grant_ref(
          ((act->domid != ld->domain_id) ||
           (act->pin & 0x80808080U) != 0 ||
           (act->is_sub_page)) )
-        PIN_FAIL(unlock_out, GNTST_general_error,
+        PIN_FAIL(act_release_out, GNTST_general_error,
                  "Bad domain (%d != %d), or risk of counter overflow %08x, or subpage %d\n",
                  act->domid, ld->domain_id, act->pin, act->is_sub_page);
 
@@ -608,7 +800,7 @@ __gnttab_map_grant_ref(
         if ( (rc = _set_status(rgt->gt_version, ld->domain_id,
                                op->flags & GNTMAP_readonly,
                                1, shah, act, status) ) != GNTST_okay )
-             goto unlock_out;
+             goto act_release_out;
 
         if ( !act->pin )
         {
@@ -643,7 +835,8 @@ __gnttab_map_grant_ref(
 
     cache_flags = (shah->flags & (GTF_PAT | GTF_PWT | GTF_PCD) );
 
-    spin_unlock(&rgt->lock);
+    active_entry_release(act);
+    grant_read_unlock(rgt);
 
     /* pg may be set, with a refcount included, from __get_paged_frame */
     if ( !pg )
@@ -719,9 +912,8 @@ __gnttab_map_grant_ref(
         goto undo_out;
     }
 
-    double_gt_lock(lgt, rgt);
-
-    if ( !is_hvm_domain(ld) && need_iommu(ld) )
+    iommu_update = !is_hvm_domain(ld) && need_iommu(ld);
+    if ( iommu_update )
     {
         unsigned int wrc, rdc;
         int err = 0;
@@ -729,6 +921,7 @@ __gnttab_map_grant_ref(
         BUG_ON(paging_mode_translate(ld));
         /* We're not translated, so we know that gmfns and mfns are
            the same things, so the IOMMU entry is always 1-to-1. */
+        double_gt_lock(lgt, rgt);
         mapcount(lgt, rd, frame, &wrc, &rdc);
         if ( (act_pin & (GNTPIN_hstw_mask|GNTPIN_devw_mask)) &&
              !(old_pin & (GNTPIN_hstw_mask|GNTPIN_devw_mask)) )
@@ -752,12 +945,19 @@ __gnttab_map_grant_ref(
 
     TRACE_1D(TRC_MEM_PAGE_GRANT_MAP, op->dom);
 
+    /*
+     * Users of a maptrack entry check its flags before looking at the
+     * other fields, so publishing the flags last is enough unless
+     * mapcount() may be walking the table concurrently.
+     */
     mt = &maptrack_entry(lgt, handle);
     mt->domid = op->dom;
     mt->ref   = op->ref;
-    mt->flags = op->flags;
+    wmb();
+    write_atomic(&mt->flags, op->flags);
 
-    double_gt_unlock(lgt, rgt);
+    if ( iommu_update )
+        double_gt_unlock(lgt, rgt);
 
     op->dev_bus_addr = (u64)frame << PAGE_SHIFT;
     op->handle       = handle;
@@ -780,10 +980,9 @@ __gnttab_map_grant_ref(
         put_page(pg);
     }
 
-    spin_lock(&rgt->lock);
+    grant_read_lock(rgt);
 
-    act = &active_entry(rgt, op->ref);
-    shah = shared_entry_header(rgt, op->ref);
+    act = active_entry_acquire(rgt, op->ref);
 
     if ( op->flags & GNTMAP_device_map )
         act->pin -= (op->flags & GNTMAP_readonly) ?
@@ -800,8 +999,11 @@ __gnttab_map_grant_ref(
     if ( !act->pin )
         gnttab_clear_flag(_GTF_reading, status);
 
+ act_release_out:
+    active_entry_release(act);
+
  unlock_out:
-    spin_unlock(&rgt->lock);
+    grant_read_unlock(rgt);
     op->status = rc;
     put_maptrack_handle(lgt, handle);
     rcu_unlock_domain(rd);
@@ -833,6 +1035,7 @@ __gnttab_unmap_common(
     struct gnttab_unmap_common *op)
 {
     domid_t          dom;
+    grant_ref_t      ref;
     struct domain   *ld, *rd;
     struct grant_table *lgt, *rgt;
     struct active_grant_entry *act;
@@ -851,18 +1054,15 @@ __gnttab_unmap_common(
     }
 
     op->map = &maptrack_entry(lgt, op->handle);
-    spin_lock(&lgt->lock);
 
-    if ( unlikely(!op->map->flags) )
+    if ( unlikely(!read_atomic(&op->map->flags)) )
     {
-        spin_unlock(&lgt->lock);
         gdprintk(XENLOG_INFO, "Zero flags for handle (%d).\n", op->handle);
         op->status = GNTST_bad_handle;
         return;
     }
 
     dom = op->map->domid;
-    spin_unlock(&lgt->lock);
 
     if ( unlikely((rd = rcu_lock_domain_by_id(dom)) == NULL) )
     {
@@ -883,18 +1083,34 @@ __gnttab_unmap_common(
     TRACE_1D(TRC_MEM_PAGE_GRANT_UNMAP, dom);
 
     rgt = rd->grant_table;
-    double_gt_lock(lgt, rgt);
+    grant_read_lock(rgt);
 
-    op->flags = op->map->flags;
-    if ( unlikely(!op->flags) || unlikely(op->map->domid != dom) )
+    /*
+     * The mapping's flags are only updated under the lock of the active
+     * entry it refers to, so sample them once that is held and make sure
+     * the handle wasn't recycled for another grant in the meantime.
+     */
+    ref = op->map->ref;
+    if ( unlikely(rgt->gt_version == 0) ||
+         unlikely(ref >= nr_grant_entries(rgt)) )
     {
         gdprintk(XENLOG_WARNING, "Unstable handle %u\n", op->handle);
         rc = GNTST_bad_handle;
         goto unmap_out;
     }
 
+    act = active_entry_acquire(rgt, ref);
+
+    op->flags = read_atomic(&op->map->flags);
+    if ( unlikely(!op->flags) || unlikely(op->map->domid != dom) ||
+         unlikely(op->map->ref != ref) )
+    {
+        gdprintk(XENLOG_WARNING, "Unstable handle %u\n", op->handle);
+        rc = GNTST_bad_handle;
+        goto act_release_out;
+    }
+
     op->rd = rd;
-    act = &active_entry(rgt, op->map->ref);
 
     if ( op->frame == 0 )
     {
@@ -903,7 +1119,7 @@ __gnttab_unmap_common(
     else
     {
         if ( unlikely(op->frame != act->frame) )
-            PIN_FAIL(unmap_out, GNTST_general_error,
+            PIN_FAIL(act_release_out, GNTST_general_error,
                      "Bad frame number doesn't match gntref. (%lx != %lx)\n",
                      op->frame, act->frame);
         if ( op->flags & GNTMAP_device_map )
@@ -922,7 +1138,7 @@ __gnttab_unmap_common(
         if ( (rc = replace_grant_host_mapping(op->host_addr,
                                               op->frame, op->new_addr, 
                                               op->flags)) < 0 )
-            goto unmap_out;
+            goto act_release_out;
 
         ASSERT(act->pin & (GNTPIN_hstw_mask | GNTPIN_hstr_mask));
         op->map->flags &= ~GNTMAP_host_map;
@@ -932,29 +1148,31 @@ __gnttab_unmap_common(
             act->pin -= GNTPIN_hstw_inc;
     }
 
-    if ( !is_hvm_domain(ld) && need_iommu(ld) )
+ act_release_out:
+    active_entry_release(act);
+ unmap_out:
+    grant_read_unlock(rgt);
+
+    if ( rc == GNTST_okay && !is_hvm_domain(ld) && need_iommu(ld) )
     {
         unsigned int wrc, rdc;
         int err = 0;
         BUG_ON(paging_mode_translate(ld));
+        double_gt_lock(lgt, rgt);
         mapcount(lgt, rd, op->frame, &wrc, &rdc);
         if ( (wrc + rdc) == 0 )
             err = iommu_unmap_page(ld, op->frame);
         else if ( wrc == 0 )
             err = iommu_map_page(ld, op->frame, op->frame, IOMMUF_readable);
+        double_gt_unlock(lgt, rgt);
         if ( err )
-        {
             rc = GNTST_general_error;
-            goto unmap_out;
-        }
     }
 
     /* If just unmapped a writable mapping, mark as dirtied */
-    if ( !(op->flags & GNTMAP_readonly) )
+    if ( rc == GNTST_okay && !(op->flags & GNTMAP_readonly) )
          gnttab_mark_dirty(rd, op->frame);
 
- unmap_out:
-    double_gt_unlock(lgt, rgt);
     op->status = rc;
     rcu_unlock_domain(rd);
 }
@@ -984,12 +1202,12 @@ __gnttab_unmap_common_complete(struct gnttab_unmap_common *op)
 
     rcu_lock_domain(rd);
     rgt = rd->grant_table;
-    spin_lock(&rgt->lock);
+    grant_read_lock(rgt);
 
     if ( rgt->gt_version == 0 )
-        goto unmap_out;
+        goto unlock_out;
 
-    act = &active_entry(rgt, op->map->ref);
+    act = active_entry_acquire(rgt, op->map->ref);
     sha = shared_entry_header(rgt, op->map->ref);
 
     if ( rgt->gt_version == 1 )
@@ -1049,7 +1267,9 @@ __gnttab_unmap_common_complete(struct gnttab_unmap_common *op)
         gnttab_clear_flag(_GTF_reading, status);
 
  unmap_out:
-    spin_unlock(&rgt->lock);
+    active_entry_release(act);
+ unlock_out:
+    grant_read_unlock(rgt);
     if ( put_handle )
     {
         op->map->flags = 0;
@@ -1238,7 +1458,7 @@ gnttab_unpopulate_status_frames(struct domain *d, struct grant_table *gt)
 int
 gnttab_grow_table(struct domain *d, unsigned int req_nr_frames)
 {
-    /* d's grant table lock must be held by the caller */
+    /* d's grant table write lock must be held by the caller */
 
     struct grant_table *gt = d->grant_table;
     unsigned int i;
@@ -1255,7 +1475,7 @@ gnttab_grow_table(struct domain *d, unsigned int req_nr_frames)
     {
         if ( (gt->active[i] = alloc_xenheap_page()) == NULL )
             goto active_alloc_failed;
-        clear_page(gt->active[i]);
+        active_entries_init(gt->active[i]);
     }
 
     /* Shared */
@@ -1343,7 +1563,7 @@ gnttab_setup_table(
     }
 
     gt = d->grant_table;
-    spin_lock(&gt->lock);
+    grant_write_lock(gt);
 
     if ( gt->gt_version == 0 )
         gt->gt_version = 1;
@@ -1371,7 +1591,7 @@ gnttab_setup_table(
     }
 
  out3:
-    spin_unlock(&gt->lock);
+    grant_write_unlock(gt);
  out2:
     rcu_unlock_domain(d);
  out1:
@@ -1413,13 +1633,13 @@ gnttab_query_size(
         goto query_out_unlock;
     }
 
-    spin_lock(&d->grant_table->lock);
+    grant_read_lock(d->grant_table);
 
     op.nr_frames     = nr_grant_frames(d->grant_table);
     op.max_nr_frames = max_nr_grant_frames;
     op.status        = GNTST_okay;
 
-    spin_unlock(&d->grant_table->lock);
+    grant_read_unlock(d->grant_table);
 
  
  query_out_unlock:
@@ -1441,11 +1661,12 @@ gnttab_prepare_for_transfer(
     struct domain *rd, struct domain *ld, grant_ref_t ref)
 {
     struct grant_table *rgt = rd->grant_table;
+    struct active_grant_entry *act;
     grant_entry_header_t *sha;
     union grant_combo   scombo, prev_scombo, new_scombo;
     int                 retries = 0;
 
-    spin_lock(&rgt->lock);
+    grant_read_lock(rgt);
 
     if ( rgt->gt_version == 0 )
     {
@@ -1463,6 +1684,7 @@ gnttab_prepare_for_transfer(
         goto fail;
     }
 
+    act = active_entry_acquire(rgt, ref);
     sha = shared_entry_header(rgt, ref);
     
     scombo.word = *(u32 *)&sha->flags;
@@ -1476,7 +1698,7 @@ gnttab_prepare_for_transfer(
                     "(NB. expected dom %d)\n",
                     scombo.shorts.flags, scombo.shorts.domid,
                     ld->domain_id);
-            goto fail;
+            goto act_release_out;
         }
 
         new_scombo = scombo;
@@ -1490,17 +1712,20 @@ gnttab_prepare_for_transfer(
         if ( retries++ == 4 )
         {
             gdprintk(XENLOG_WARNING, "Shared grant entry is unstable.\n");
-            goto fail;
+            goto act_release_out;
         }
 
         scombo = prev_scombo;
     }
 
-    spin_unlock(&rgt->lock);
+    active_entry_release(act);
+    grant_read_unlock(rgt);
     return 1;
 
+ act_release_out:
+    active_entry_release(act);
  fail:
-    spin_unlock(&rgt->lock);
+    grant_read_unlock(rgt);
     return 0;
 }
 
@@ -1511,6 +1736,7 @@ gnttab_transfer(
     struct domain *d = current->domain;
     struct domain *e;
     struct page_info *page;
+    struct active_grant_entry *act;
     int i;
     struct gnttab_transfer gop;
     unsigned long mfn;
@@ -1692,7 +1918,8 @@ gnttab_transfer(
         TRACE_1D(TRC_MEM_PAGE_GRANT_TRANSFER, e->domain_id);
 
         /* Tell the guest about its new page frame. */
-        spin_lock(&e->grant_table->lock);
+        grant_read_lock(e->grant_table);
+        act = active_entry_acquire(e->grant_table, gop.ref);
 
         if ( e->grant_table->gt_version == 1 )
         {
@@ -1710,7 +1937,8 @@ gnttab_transfer(
         shared_entry_header(e->grant_table, gop.ref)->flags |=
             GTF_transfer_completed;
 
-        spin_unlock(&e->grant_table->lock);
+        active_entry_release(act);
+        grant_read_unlock(e->grant_table);
 
         rcu_unlock_domain(e);
 
@@ -1748,9 +1976,9 @@ __release_grant_for_copy(
     released_read = 0;
     released_write = 0;
 
-    spin_lock(&rgt->lock);
+    grant_read_lock(rgt);
 
-    act = &active_entry(rgt, gref);
+    act = active_entry_acquire(rgt, gref);
     sha = shared_entry_header(rgt, gref);
     r_frame = act->frame;
 
@@ -1789,7 +2017,8 @@ __release_grant_for_copy(
         released_read = 1;
     }
 
-    spin_unlock(&rgt->lock);
+    active_entry_release(act);
+    grant_read_unlock(rgt);
 
     if ( td != rd )
     {
@@ -1806,7 +2035,7 @@ __release_grant_for_copy(
 
 /* The status for a grant indicates that we're taking more access than
    the pin requires.  Fix up the status to match the pin.  Called
-   under the domain's grant table lock. */
+   under the active grant entry's lock. */
 /* Only safe on transitive grants.  Even then, note that we don't
    attempt to drop any pin on the referent grant. */
 static void __fixup_status_for_copy_pin(const struct active_grant_entry *act,
@@ -1847,7 +2076,7 @@ __acquire_grant_for_copy(
 
     *page = NULL;
 
-    spin_lock(&rgt->lock);
+    grant_read_lock(rgt);
 
     if ( rgt->gt_version == 0 )
         PIN_FAIL(unlock_out, GNTST_general_error,
@@ -1857,7 +2086,7 @@ __acquire_grant_for_copy(
         PIN_FAIL(unlock_out, GNTST_bad_gntref,
                  "Bad grant reference %ld\n", gref);
 
-    act = &active_entry(rgt, gref);
+    act = active_entry_acquire(rgt, gref);
     shah = shared_entry_header(rgt, gref);
     if ( rgt->gt_version == 1 )
     {
@@ -1874,7 +2103,7 @@ __acquire_grant_for_copy(
 
     /* If already pinned, check the active domid and avoid refcnt overflow. */
     if ( act->pin && ((act->domid != ldom) || (act->pin & 0x80808080U) != 0) )
-        PIN_FAIL(unlock_out, GNTST_general_error,
+        PIN_FAIL(act_release_out, GNTST_general_error,
                  "Bad domain (%d != %d), or risk of counter overflow %08x\n",
                  act->domid, ldom, act->pin);
 
@@ -1885,7 +2114,7 @@ __acquire_grant_for_copy(
         if ( (rc = _set_status(rgt->gt_version, ldom,
                                readonly, 0, shah, act,
                                status) ) != GNTST_okay )
-             goto unlock_out;
+             goto act_release_out;
 
         td = rd;
         trans_gref = gref;
@@ -1916,17 +2145,20 @@ __acquire_grant_for_copy(
                 PIN_FAIL(unlock_out_clear, GNTST_general_error,
                          "transitive grant referenced bad domain %d\n",
                          trans_domid);
-            spin_unlock(&rgt->lock);
+            active_entry_release(act);
+            grant_read_unlock(rgt);
 
             rc = __acquire_grant_for_copy(td, trans_gref, rd->domain_id,
                                           readonly, &grant_frame, page,
                                           &trans_page_off, &trans_length, 0);
 
-            spin_lock(&rgt->lock);
+            grant_read_lock(rgt);
+            act = active_entry_acquire(rgt, gref);
             if ( rc != GNTST_okay ) {
                 __fixup_status_for_copy_pin(act, status);
                 rcu_unlock_domain(td);
-                spin_unlock(&rgt->lock);
+                active_entry_release(act);
+                grant_read_unlock(rgt);
                 return rc;
             }
 
@@ -1938,7 +2170,8 @@ __acquire_grant_for_copy(
             {
                 __fixup_status_for_copy_pin(act, status);
                 rcu_unlock_domain(td);
-                spin_unlock(&rgt->lock);
+                active_entry_release(act);
+                grant_read_unlock(rgt);
                 put_page(*page);
                 return __acquire_grant_for_copy(rd, gref, ldom, readonly,
                                                 frame, page, page_off, length,
@@ -2006,7 +2239,8 @@ __acquire_grant_for_copy(
     *length = act->length;
     *frame = act->frame;
 
-    spin_unlock(&rgt->lock);
+    active_entry_release(act);
+    grant_read_unlock(rgt);
     return rc;
  
  unlock_out_clear:
@@ -2017,8 +2251,11 @@ __acquire_grant_for_copy(
     if ( !act->pin )
         gnttab_clear_flag(_GTF_reading, status);
 
+ act_release_out:
+    active_entry_release(act);
+
  unlock_out:
-    spin_unlock(&rgt->lock);
+    grant_read_unlock(rgt);
     return rc;
 }
 
@@ -2192,7 +2429,7 @@ gnttab_set_version(XEN_GUEST_HANDLE_PARAM(gnttab_set_version_t) uop)
     if ( gt->gt_version == op.version )
         goto out;
 
-    spin_lock(&gt->lock);
+    grant_write_lock(gt);
     /* Make sure that the grant table isn't currently in use when we
        change the version number, except for the first 8 entries which
        are allowed to be in use (xenstore/xenconsole keeps them mapped).
@@ -2278,7 +2515,7 @@ gnttab_set_version(XEN_GUEST_HANDLE_PARAM(gnttab_set_version_t) uop)
     gt->gt_version = op.version;
 
 out_unlock:
-    spin_unlock(&gt->lock);
+    grant_write_unlock(gt);
 
 out:
     op.version = gt->gt_version;
@@ -2334,7 +2571,7 @@ gnttab_get_status_frames(XEN_GUEST_HANDLE_PARAM(gnttab_get_status_frames_t) uop,
 
     op.status = GNTST_okay;
 
-    spin_lock(&gt->lock);
+    grant_read_lock(gt);
 
     for ( i = 0; i < op.nr_frames; i++ )
     {
@@ -2343,7 +2580,7 @@ gnttab_get_status_frames(XEN_GUEST_HANDLE_PARAM(gnttab_get_status_frames_t) uop,
             op.status = GNTST_bad_virt_addr;
     }
 
-    spin_unlock(&gt->lock);
+    grant_read_unlock(gt);
 out2:
     rcu_unlock_domain(d);
 out1:
@@ -2392,7 +2629,7 @@ __gnttab_swap_grant_ref(grant_ref_t ref_a, grant_ref_t ref_b)
     struct active_grant_entry *act;
     s16 rc = GNTST_okay;
 
-    spin_lock(&gt->lock);
+    grant_write_lock(gt);
 
     /* Bounds check on the grant refs */
     if ( unlikely(ref_a >= nr_grant_entries(d->grant_table)))
@@ -2432,7 +2669,7 @@ __gnttab_swap_grant_ref(grant_ref_t ref_a, grant_ref_t ref_b)
     }
 
 out:
-    spin_unlock(&gt->lock);
+    grant_write_unlock(gt);
 
     rcu_unlock_domain(d);
 
@@ -2620,7 +2857,8 @@ grant_table_create(
         goto no_mem_0;
 
     /* Simple stuff. */
-    spin_lock_init(&t->lock);
+    rwlock_init(&t->lock);
+    spin_lock_init(&t->maptrack_lock);
     t->nr_grant_frames = INITIAL_NR_GRANT_FRAMES;
 
     /* Active grant table. */
@@ -2632,20 +2870,13 @@ grant_table_create(
     {
         if ( (t->active[i] = alloc_xenheap_page()) == NULL )
             goto no_mem_2;
-        clear_page(t->active[i]);
+        active_entries_init(t->active[i]);
     }
 
-    /* Tracking of mapped foreign frames table */
+    /* Tracking of mapped foreign frames table, populated on demand */
     if ( (t->maptrack = xzalloc_array(struct grant_mapping *,
                                       max_nr_maptrack_frames())) == NULL )
         goto no_mem_2;
-    if ( (t->maptrack[0] = alloc_xenheap_page()) == NULL )
-        goto no_mem_3;
-    clear_page(t->maptrack[0]);
-    t->maptrack_limit = MAPTRACK_PER_PAGE;
-    for ( i = 1; i < MAPTRACK_PER_PAGE; i++ )
-        t->maptrack[0][i - 1].ref = i;
-    t->maptrack[0][i - 1].ref = MAPTRACK_TAIL;
 
     /* Shared grant table. */
     if ( (t->shared_raw = xzalloc_array(void *, max_nr_grant_frames)) == NULL )
@@ -2677,7 +2908,6 @@ grant_table_create(
         free_xenheap_page(t->shared_raw[i]);
     xfree(t->shared_raw);
  no_mem_3:
-    free_xenheap_page(t->maptrack[0]);
     xfree(t->maptrack);
  no_mem_2:
     for ( i = 0;
@@ -2727,9 +2957,9 @@ gnttab_release_mappings(
         }
 
         rgt = rd->grant_table;
-        spin_lock(&rgt->lock);
+        grant_read_lock(rgt);
 
-        act = &active_entry(rgt, ref);
+        act = active_entry_acquire(rgt, ref);
         sha = shared_entry_header(rgt, ref);
         if (rgt->gt_version == 1)
             status = &sha->flags;
@@ -2787,7 +3017,8 @@ gnttab_release_mappings(
         if ( act->pin == 0 )
             gnttab_clear_flag(_GTF_reading, status);
 
-        spin_unlock(&rgt->lock);
+        active_entry_release(act);
+        grant_read_unlock(rgt);
 
         rcu_unlock_domain(rd);
 
@@ -2835,7 +3066,7 @@ static void gnttab_usage_print(struct domain *rd)
     printk("      -------- active --------       -------- shared --------\n");
     printk("[ref] localdom mfn      pin          localdom gmfn     flags\n");
 
-    spin_lock(&gt->lock);
+    grant_read_lock(gt);
 
     if ( gt->gt_version == 0 )
         goto out;
@@ -2849,9 +3080,12 @@ static void gnttab_usage_print(struct domain *rd)
         uint16_t status;
         uint64_t frame;
 
-        act = &active_entry(gt, ref);
+        act = active_entry_acquire(gt, ref);
         if ( !act->pin )
+        {
+            active_entry_release(act);
             continue;
+        }
 
         sha = shared_entry_header(gt, ref);
 
@@ -2881,10 +3115,11 @@ static void gnttab_usage_print(struct domain *rd)
         printk("[%3d]    %5d 0x%06lx 0x%08x      %5d 0x%06"PRIx64" 0x%02x\n",
                ref, act->domid, act->frame, act->pin,
                sha->domid, frame, status);
+        active_entry_release(act);
     }
 
  out:
-    spin_unlock(&gt->lock);
+    grant_read_unlock(gt);
 
     if ( first )
         printk("grant-table for remote domain:%5d ... "
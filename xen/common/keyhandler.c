@@ -310,16 +310,20 @@ static void dump_domains(unsigned char key)
     {
         for_each_vcpu ( d, v )
         {
-            printk("Notifying guest %d:%d (virq %d, port %d, stat %d/%d/%d)\n",
-                   d->domain_id, v->vcpu_id,
-                   VIRQ_DEBUG, v->virq_to_evtchn[VIRQ_DEBUG],
-                   test_bit(v->virq_to_evtchn[VIRQ_DEBUG], 
-                            &shared_info(d, evtchn_pending)),
-                   test_bit(v->virq_to_evtchn[VIRQ_DEBUG], 
-                            &shared_info(d, evtchn_mask)),
-                   test_bit(v->virq_to_evtchn[VIRQ_DEBUG] /
-                            BITS_PER_EVTCHN_WORD(d),
-                            &vcpu_info(v, evtchn_pending_sel)));
+            unsigned int port = v->virq_to_evtchn[VIRQ_DEBUG];
+            const struct evtchn *chn;
+
+            printk("Notifying guest %d:%d (virq %d, port %d",
+                   d->domain_id, v->vcpu_id, VIRQ_DEBUG, port);
+            if ( port && port_is_valid(d, port) )
+            {
+                chn = evtchn_from_port(d, port);
+                printk(", stat %d/%d/",
+                       !!evtchn_port_is_pending(d, chn),
+                       !!evtchn_port_is_masked(d, chn));
+                evtchn_port_print_state(d, chn);
+            }
+            printk(")\n");
             send_guest_vcpu_virq(v, VIRQ_DEBUG);
         }
     }
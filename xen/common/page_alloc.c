@@ -26,6 +26,7 @@
 #include <xen/types.h>
 #include <xen/lib.h>
 #include <xen/sched.h>
+#include <xen/cpu.h>
 #include <xen/spinlock.h>
 #include <xen/mm.h>
 #include <xen/irq.h>
@@ -270,11 +271,50 @@ static heap_by_zone_and_order_t *_heap[MAX_NUMNODES];
 static unsigned long *avail[MAX_NUMNODES];
 static long total_avail_pages;
 
+/*
+ * Free pages per node which still hold a dying domain's data.  Such pages
+ * are scrubbed by idle CPUs (scrub_free_pages()) or when allocated.
+ */
+static unsigned long node_need_scrub[MAX_NUMNODES];
+
+/* Bumped whenever a free page is offlined; see scrub_free_pages(). */
+static unsigned long offline_gen;
+
 /* TMEM: Reserve a fraction of memory for mid-size (0<order<9) allocations.*/
 static long midsize_alloc_zone_pages;
 #define MIDSIZE_ALLOC_FRAC 128
 
 static DEFINE_SPINLOCK(heap_lock);
+
+static inline void lock_heap(void)
+{
+    perfc_incr(heap_lock);
+    if ( !spin_trylock(&heap_lock) )
+    {
+        perfc_incr(heap_lock_contended);
+        spin_lock(&heap_lock);
+    }
+}
+
+/*
+ * Put a free chunk on its heap list.  Clean chunks go to the head, where
+ * allocations look first; chunks with dirty pages go to the tail, where
+ * the idle scrubber looks for them.
+ */
+static void page_list_add_scrub(struct page_info *pg, unsigned int node,
+                                unsigned int zone, unsigned int order,
+                                unsigned int first_dirty)
+{
+    BUILD_BUG_ON((1UL << MAX_ORDER) >= INVALID_DIRTY_IDX);
+
+    PFN_ORDER(pg) = order;
+    pg->u.free.first_dirty = first_dirty;
+
+    if ( first_dirty != INVALID_DIRTY_IDX )
+        page_list_add_tail(pg, &heap(node, zone, order));
+    else
+        page_list_add(pg, &heap(node, zone, order));
+}
 static long outstanding_claims; /* total outstanding claims by all domains */
 
 unsigned long domain_adjust_tot_pages(struct domain *d, long pages)
@@ -292,7 +332,7 @@ unsigned long domain_adjust_tot_pages(struct domain *d, long pages)
     if ( !d->outstanding_pages )
         goto out;
 
-    spin_lock(&heap_lock);
+    lock_heap();
     /* adjust domain outstanding pages; may not go negative */
     dom_before = d->outstanding_pages;
     dom_after = dom_before - pages;
@@ -310,18 +350,22 @@ out:
     return d->tot_pages;
 }
 
+static unsigned long page_cache_drain_all(void);
+
 int domain_set_outstanding_pages(struct domain *d, unsigned long pages)
 {
     int ret = -ENOMEM;
     unsigned long claim, avail_pages;
+    bool_t drained = 0;
 
+ retry:
     /*
      * take the domain's page_alloc_lock, else all d->tot_page adjustments
      * must always take the global heap_lock rather than only in the much
      * rarer case that d->outstanding_pages is non-zero
      */
     spin_lock(&d->page_alloc_lock);
-    spin_lock(&heap_lock);
+    lock_heap();
 
     /* pages==0 means "unset" the claim. */
     if ( pages == 0 )
@@ -367,7 +411,19 @@ int domain_set_outstanding_pages(struct domain *d, unsigned long pages)
      */
     claim = pages - d->tot_pages;
     if ( claim > avail_pages )
+    {
+        /* Pages in the per-CPU caches aren't counted: give them back. */
+        if ( !drained )
+        {
+            spin_unlock(&heap_lock);
+            spin_unlock(&d->page_alloc_lock);
+            drained = 1;
+            if ( page_cache_drain_all() )
+                goto retry;
+            return ret;
+        }
         goto out;
+    }
 
     /* yay, claim fits in available memory, stake the claim, success! */
     d->outstanding_pages = claim;
@@ -382,7 +438,7 @@ out:
 
 void get_outstanding_claims(uint64_t *free_pages, uint64_t *outstanding_pages)
 {
-    spin_lock(&heap_lock);
+    lock_heap();
     *outstanding_pages = outstanding_claims;
     *free_pages =  avail_domheap_pages();
     spin_unlock(&heap_lock);
@@ -557,42 +613,441 @@ static void check_low_mem_virq(void)
     }
 }
 
+/*
+ * Take a free 2^@order chunk from @node's heap for @zone, splitting a larger
+ * one if need be.  Returns NULL if there is none.  Requires heap_lock.
+ */
+static struct page_info *remove_heap_chunk(
+    unsigned int node, unsigned int zone, unsigned int order)
+{
+    unsigned int j, first_dirty;
+    unsigned long request = 1UL << order;
+    struct page_info *pg;
+
+    ASSERT(spin_is_locked(&heap_lock));
+
+    /* Check if target node can support the allocation. */
+    if ( !avail[node] || (avail[node][zone] < request) )
+        return NULL;
+
+    /* Find smallest order which can satisfy the request. */
+    for ( j = order; j <= MAX_ORDER; j++ )
+        if ( (pg = page_list_remove_head(&heap(node, zone, j))) )
+            break;
+    if ( j > MAX_ORDER )
+        return NULL;
+
+    first_dirty = pg->u.free.first_dirty;
+
+    /* We may have to halve the chunk a number of times. */
+    while ( j != order )
+    {
+        j--;
+        page_list_add_scrub(pg, node, zone, j,
+                            (first_dirty < (1U << j)) ?
+                            first_dirty : INVALID_DIRTY_IDX);
+        pg += 1 << j;
+
+        /* Any dirty page of the lower half may be followed by more. */
+        if ( first_dirty != INVALID_DIRTY_IDX )
+            first_dirty = (first_dirty >= (1U << j)) ?
+                          first_dirty - (1U << j) : 0;
+    }
+
+    ASSERT(avail[node][zone] >= request);
+    avail[node][zone] -= request;
+    total_avail_pages -= request;
+    ASSERT(total_avail_pages >= 0);
+
+    return pg;
+}
+
+/* Track the most recent safety TLB flush a freed page still requires. */
+static inline void accumulate_tlbflush(const struct page_info *pg,
+                                       bool_t *need_tlbflush,
+                                       uint32_t *tlbflush_timestamp)
+{
+    if ( pg->u.free.need_tlbflush &&
+         (pg->tlbflush_timestamp <= tlbflush_current_time()) &&
+         (!*need_tlbflush || (pg->tlbflush_timestamp > *tlbflush_timestamp)) )
+    {
+        *need_tlbflush = 1;
+        *tlbflush_timestamp = pg->tlbflush_timestamp;
+    }
+}
+
+static void filtered_flush_tlb(uint32_t tlbflush_timestamp)
+{
+    cpumask_t mask = cpu_online_map;
+
+    tlbflush_filter(mask, tlbflush_timestamp);
+    if ( !cpumask_empty(&mask) )
+    {
+        perfc_incr(need_flush_tlb_flush);
+        flush_tlb_mask(&mask);
+    }
+}
+
+/*
+ * Per-CPU page caches.
+ *
+ * Most heap allocations and frees are of single pages (p2m and shadow
+ * pages, xenheap, domain memory populated page by page), and would all
+ * serialise on heap_lock.  Each CPU therefore keeps a small cache of free
+ * chunks, per order up to PAGE_CACHE_MAX_ORDER, taken from its own node.
+ * It is refilled from and drained to the heap PAGE_CACHE_BATCH pages at a
+ * time, under a single acquisition of heap_lock.
+ *
+ * As far as the heap is concerned cached chunks are allocated: they are in
+ * PGC_state_inuse with no owner, and are not counted in avail[] or
+ * total_avail_pages.  Their u.free TLB-flush information is kept valid.
+ * A cache's lock is only contended when another CPU drains it, and nests
+ * outside heap_lock.
+ */
+#define PAGE_CACHE_MAX_ORDER 2
+/* Pages moved between a cache and the heap at a time. */
+#define PAGE_CACHE_BATCH     8
+/* Pages a cache may hold, per order, before a batch is drained. */
+#define PAGE_CACHE_HIGH      (4 * PAGE_CACHE_BATCH)
+
+struct page_cache {
+    spinlock_t lock;
+    bool_t ready;
+    unsigned int node;
+    unsigned int count[PAGE_CACHE_MAX_ORDER + 1]; /* chunks per order */
+    struct page_list_head list[PAGE_CACHE_MAX_ORDER + 1];
+};
+
+static DEFINE_PER_CPU(struct page_cache, page_cache);
+
+static void free_heap_chunk(
+    struct page_info *pg, unsigned int order, bool_t need_scrub);
+
+/* Move a batch of 2^@order chunks from the heap to @pc.  Returns how many. */
+static unsigned int page_cache_refill(
+    struct page_cache *pc, unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int order)
+{
+    struct page_info *pg;
+    unsigned int i, n, zone, dirty_cnt = 0;
+
+    ASSERT(spin_is_locked(&pc->lock));
+
+    lock_heap();
+
+    for ( n = 0; n < (PAGE_CACHE_BATCH >> order); n++ )
+    {
+        /* Leave claimed memory to the slow path, which accounts for it. */
+        if ( outstanding_claims + (1UL << order) > total_avail_pages )
+            break;
+
+        pg = NULL;
+        zone = zone_hi;
+        do {
+            if ( (pg = remove_heap_chunk(pc->node, zone, order)) )
+                break;
+        } while ( zone-- > zone_lo );
+        if ( pg == NULL )
+            break;
+
+        for ( i = 0; i < (1 << order); i++ )
+        {
+            BUG_ON((pg[i].count_info & ~PGC_need_scrub) != PGC_state_free);
+            if ( pg[i].count_info & PGC_need_scrub )
+                dirty_cnt++;
+            pg[i].count_info = PGC_state_inuse |
+                               (pg[i].count_info & PGC_need_scrub);
+        }
+
+        page_list_add_tail(pg, &pc->list[order]);
+        pc->count[order]++;
+    }
+
+    if ( n )
+        check_low_mem_virq();
+
+    ASSERT(node_need_scrub[pc->node] >= dirty_cnt);
+    node_need_scrub[pc->node] -= dirty_cnt;
+
+    spin_unlock(&heap_lock);
+
+    perfc_incr(page_cache_refill);
+
+    /* Atomically: offline_page() may update count_info concurrently. */
+    if ( dirty_cnt )
+        page_list_for_each ( pg, &pc->list[order] )
+            for ( i = 0; i < (1 << order); i++ )
+                if ( pg[i].count_info & PGC_need_scrub )
+                {
+                    scrub_one_page(&pg[i]);
+                    clear_bit(_PGC_need_scrub, &pg[i].count_info);
+                }
+
+    return n;
+}
+
+/* Return up to @nr of @pc's coldest 2^@order chunks to the heap. */
+static void page_cache_drain(
+    struct page_cache *pc, unsigned int order, unsigned int nr)
+{
+    struct page_info *pg;
+
+    ASSERT(spin_is_locked(&pc->lock));
+
+    lock_heap();
+
+    while ( nr-- && !page_list_empty(&pc->list[order]) )
+    {
+        pg = page_list_last(&pc->list[order]);
+        page_list_del(pg, &pc->list[order]);
+        pc->count[order]--;
+        free_heap_chunk(pg, order, 0);
+    }
+
+    spin_unlock(&heap_lock);
+
+    perfc_incr(page_cache_drain);
+}
+
+static struct page_info *page_cache_alloc(
+    unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int order, unsigned int memflags, struct domain *d)
+{
+    struct page_cache *pc = &this_cpu(page_cache);
+    unsigned int i, zone, node = (uint8_t)((memflags >> _MEMF_node) - 1);
+    struct page_info *pg = NULL, *cur;
+    bool_t need_tlbflush = 0;
+    uint32_t tlbflush_timestamp = 0;
+
+    if ( !pc->ready || opt_tmem )
+        return NULL;
+
+    /* Only memory local to this CPU is cached. */
+    if ( (node != NUMA_NO_NODE) ? (node != pc->node)
+                                : (d != NULL &&
+                                   !node_isset(pc->node, d->node_affinity)) )
+        return NULL;
+
+    spin_lock(&pc->lock);
+
+    if ( page_list_empty(&pc->list[order]) &&
+         !page_cache_refill(pc, zone_lo, zone_hi, order) )
+    {
+        spin_unlock(&pc->lock);
+        return NULL;
+    }
+
+    /* Skip chunks from zones the caller cannot use. */
+    page_list_for_each ( cur, &pc->list[order] )
+    {
+        zone = page_to_zone(cur);
+        if ( (zone >= zone_lo) && (zone <= zone_hi) )
+        {
+            pg = cur;
+            break;
+        }
+    }
+
+    /* None fit: leave it to the heap. */
+    if ( pg == NULL )
+    {
+        spin_unlock(&pc->lock);
+        return NULL;
+    }
+
+    page_list_del(pg, &pc->list[order]);
+    pc->count[order]--;
+
+    spin_unlock(&pc->lock);
+
+    /* Offlining may have been requested while the chunk was cached. */
+    for ( i = 0; i < (1 << order); i++ )
+        if ( !page_state_is(&pg[i], inuse) )
+        {
+            lock_heap();
+            free_heap_chunk(pg, order, 0);
+            spin_unlock(&heap_lock);
+            return NULL;
+        }
+
+    for ( i = 0; i < (1 << order); i++ )
+    {
+        accumulate_tlbflush(&pg[i], &need_tlbflush, &tlbflush_timestamp);
+        pg[i].u.inuse.type_info = 0;
+    }
+
+    if ( d != NULL )
+        d->last_alloc_node = pc->node;
+
+    perfc_incr(page_cache_alloc);
+
+    if ( need_tlbflush )
+        filtered_flush_tlb(tlbflush_timestamp);
+
+    return pg;
+}
+
+/* Returns 0 if the chunk cannot be cached and must go back to the heap. */
+static bool_t page_cache_free(struct page_info *pg, unsigned int order)
+{
+    struct page_cache *pc = &this_cpu(page_cache);
+    unsigned long x, nx;
+    unsigned int i;
+
+    if ( !pc->ready || opt_tmem ||
+         (phys_to_nid(page_to_maddr(pg)) != pc->node) )
+        return 0;
+
+    for ( i = 0; i < (1 << order); i++ )
+        if ( (pg[i].count_info & (PGC_state | PGC_broken)) != PGC_state_inuse )
+            return 0;
+
+    /* Drop everything but the state, which offline_page() may yet change. */
+    for ( i = 0; i < (1 << order); i++ )
+    {
+        do {
+            x = pg[i].count_info;
+            nx = x & (PGC_state | PGC_broken);
+        } while ( cmpxchg(&pg[i].count_info, x, nx) != x );
+    }
+
+    spin_lock(&pc->lock);
+
+    page_list_add(pg, &pc->list[order]);
+    if ( ++pc->count[order] > (PAGE_CACHE_HIGH >> order) )
+        page_cache_drain(pc, order, PAGE_CACHE_BATCH >> order);
+
+    spin_unlock(&pc->lock);
+
+    perfc_incr(page_cache_free);
+
+    return 1;
+}
+
+/* Return the contents of every CPU's cache to the heap. */
+static unsigned long page_cache_drain_all(void)
+{
+    unsigned int cpu, order;
+    unsigned long nr = 0;
+
+    for_each_online_cpu ( cpu )
+    {
+        struct page_cache *pc = &per_cpu(page_cache, cpu);
+
+        if ( !pc->ready )
+            continue;
+
+        spin_lock(&pc->lock);
+        for ( order = 0; order <= PAGE_CACHE_MAX_ORDER; order++ )
+        {
+            if ( !pc->count[order] )
+                continue;
+            nr += pc->count[order];
+            page_cache_drain(pc, order, pc->count[order]);
+        }
+        spin_unlock(&pc->lock);
+    }
+
+    return nr;
+}
+
+static int cpu_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+    unsigned int order;
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        spin_lock_init(&pc->lock);
+        for ( order = 0; order <= PAGE_CACHE_MAX_ORDER; order++ )
+        {
+            INIT_PAGE_LIST_HEAD(&pc->list[order]);
+            pc->count[order] = 0;
+        }
+        pc->node = cpu_to_node(cpu);
+        pc->ready = 1;
+        break;
+    case CPU_UP_CANCELED:
+    case CPU_DEAD:
+        spin_lock(&pc->lock);
+        for ( order = 0; order <= PAGE_CACHE_MAX_ORDER; order++ )
+            if ( pc->count[order] )
+                page_cache_drain(pc, order, pc->count[order]);
+        pc->ready = 0;
+        spin_unlock(&pc->lock);
+        break;
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cpu_nfb = {
+    .notifier_call = cpu_callback
+};
+
+static int __init page_cache_init(void)
+{
+    void *cpu = (void *)(long)smp_processor_id();
+
+    cpu_callback(&cpu_nfb, CPU_UP_PREPARE, cpu);
+    register_cpu_notifier(&cpu_nfb);
+    return 0;
+}
+presmp_initcall(page_cache_init);
+
 /* Allocate 2^@order contiguous pages. */
 static struct page_info *alloc_heap_pages(
     unsigned int zone_lo, unsigned int zone_hi,
     unsigned int order, unsigned int memflags,
     struct domain *d)
 {
-    unsigned int first_node, i, j, zone = 0, nodemask_retry = 0;
+    unsigned int first_node, start_node, i, zone = 0, nodemask_retry = 0;
     unsigned int node = (uint8_t)((memflags >> _MEMF_node) - 1);
     unsigned long request = 1UL << order;
     struct page_info *pg;
-    nodemask_t nodemask = (d != NULL ) ? d->node_affinity : node_online_map;
-    bool_t need_tlbflush = 0;
+    nodemask_t nodemask;
+    bool_t need_tlbflush = 0, drained = 0;
     uint32_t tlbflush_timestamp = 0;
+    unsigned int dirty_cnt = 0;
+
+    ASSERT(zone_lo <= zone_hi);
+    ASSERT(zone_hi < NR_ZONES);
+
+    if ( unlikely(order > MAX_ORDER) )
+        return NULL;
+
+    /* Small allocations are preferably served from this CPU's page cache. */
+    if ( order <= PAGE_CACHE_MAX_ORDER &&
+         (pg = page_cache_alloc(zone_lo, zone_hi, order, memflags, d)) )
+        return pg;
 
     if ( node == NUMA_NO_NODE )
     {
         memflags &= ~MEMF_exact_node;
         if ( d != NULL )
         {
-            node = next_node(d->last_alloc_node, nodemask);
+            node = next_node(d->last_alloc_node, d->node_affinity);
             if ( node >= MAX_NUMNODES )
-                node = first_node(nodemask);
+                node = first_node(d->node_affinity);
         }
         if ( node >= MAX_NUMNODES )
             node = cpu_to_node(smp_processor_id());
     }
-    first_node = node;
+    start_node = node;
 
     ASSERT(node >= 0);
-    ASSERT(zone_lo <= zone_hi);
-    ASSERT(zone_hi < NR_ZONES);
 
-    if ( unlikely(order > MAX_ORDER) )
-        return NULL;
+ retry:
+    first_node = node = start_node;
+    nodemask = (d != NULL ) ? d->node_affinity : node_online_map;
+    nodemask_retry = 0;
 
-    spin_lock(&heap_lock);
+    lock_heap();
 
     /*
      * Claimed memory is considered unavailable unless the request
@@ -623,14 +1078,8 @@ static struct page_info *alloc_heap_pages(
     {
         zone = zone_hi;
         do {
-            /* Check if target node can support the allocation. */
-            if ( !avail[node] || (avail[node][zone] < request) )
-                continue;
-
-            /* Find smallest order which can satisfy the request. */
-            for ( j = order; j <= MAX_ORDER; j++ )
-                if ( (pg = page_list_remove_head(&heap(node, zone, j))) )
-                    goto found;
+            if ( (pg = remove_heap_chunk(node, zone, order)) )
+                goto found;
         } while ( zone-- > zone_lo ); /* careful: unsigned zone may wrap */
 
         if ( memflags & MEMF_exact_node )
@@ -669,24 +1118,19 @@ static struct page_info *alloc_heap_pages(
     }
 
  not_found:
-    /* No suitable memory blocks. Fail the request. */
     spin_unlock(&heap_lock);
-    return NULL;
 
- found: 
-    /* We may have to halve the chunk a number of times. */
-    while ( j != order )
+    /* Give back what the per-CPU caches hold before failing the request. */
+    if ( !drained && page_cache_drain_all() )
     {
-        PFN_ORDER(pg) = --j;
-        page_list_add_tail(pg, &heap(node, zone, j));
-        pg += 1 << j;
+        drained = 1;
+        goto retry;
     }
 
-    ASSERT(avail[node][zone] >= request);
-    avail[node][zone] -= request;
-    total_avail_pages -= request;
-    ASSERT(total_avail_pages >= 0);
+    /* No suitable memory blocks. Fail the request. */
+    return NULL;
 
+ found: 
     check_low_mem_virq();
 
     if ( d != NULL )
@@ -695,36 +1139,41 @@ static struct page_info *alloc_heap_pages(
     for ( i = 0; i < (1 << order); i++ )
     {
         /* Reference count must continuously be zero for free pages. */
-        BUG_ON(pg[i].count_info != PGC_state_free);
-        pg[i].count_info = PGC_state_inuse;
+        BUG_ON((pg[i].count_info & ~PGC_need_scrub) != PGC_state_free);
 
-        if ( pg[i].u.free.need_tlbflush &&
-             (pg[i].tlbflush_timestamp <= tlbflush_current_time()) &&
-             (!need_tlbflush ||
-              (pg[i].tlbflush_timestamp > tlbflush_timestamp)) )
-        {
-            need_tlbflush = 1;
-            tlbflush_timestamp = pg[i].tlbflush_timestamp;
-        }
+        /* Keep PGC_need_scrub until the page is scrubbed, below. */
+        if ( pg[i].count_info & PGC_need_scrub )
+            dirty_cnt++;
+        pg[i].count_info = PGC_state_inuse |
+                           (pg[i].count_info & PGC_need_scrub);
+
+        accumulate_tlbflush(&pg[i], &need_tlbflush, &tlbflush_timestamp);
 
         /* Initialise fields which have other uses for free pages. */
         pg[i].u.inuse.type_info = 0;
         page_set_owner(&pg[i], NULL);
     }
 
+    ASSERT(node_need_scrub[node] >= dirty_cnt);
+    node_need_scrub[node] -= dirty_cnt;
+
     spin_unlock(&heap_lock);
 
-    if ( need_tlbflush )
+    /* Scrub on demand whatever the idle scrubber has not got to yet. */
+    for ( i = 0; dirty_cnt && i < (1 << order); i++ )
     {
-        cpumask_t mask = cpu_online_map;
-        tlbflush_filter(mask, tlbflush_timestamp);
-        if ( !cpumask_empty(&mask) )
+        if ( pg[i].count_info & PGC_need_scrub )
         {
-            perfc_incr(need_flush_tlb_flush);
-            flush_tlb_mask(&mask);
+            scrub_one_page(&pg[i]);
+            /* Atomically: offline_page() may update count_info. */
+            clear_bit(_PGC_need_scrub, &pg[i].count_info);
+            dirty_cnt--;
         }
     }
 
+    if ( need_tlbflush )
+        filtered_flush_tlb(tlbflush_timestamp);
+
     return pg;
 }
 
@@ -735,6 +1184,8 @@ static int reserve_offlined_page(struct page_info *head)
     int zone = page_to_zone(head), i, head_order = PFN_ORDER(head), count = 0;
     struct page_info *cur_head;
     int cur_order;
+    unsigned int first_dirty = (head->u.free.first_dirty != INVALID_DIRTY_IDX)
+                               ? 0 : INVALID_DIRTY_IDX;
 
     ASSERT(spin_is_locked(&heap_lock));
 
@@ -776,8 +1227,8 @@ static int reserve_offlined_page(struct page_info *head)
             {
             merge:
                 /* We don't consider merging outside the head_order. */
-                page_list_add_tail(cur_head, &heap(node, zone, cur_order));
-                PFN_ORDER(cur_head) = cur_order;
+                page_list_add_scrub(cur_head, node, zone, cur_order,
+                                    first_dirty);
                 cur_head += (1 << cur_order);
                 break;
             }
@@ -793,6 +1244,13 @@ static int reserve_offlined_page(struct page_info *head)
         total_avail_pages--;
         ASSERT(total_avail_pages >= 0);
 
+        /* A dirty page stays so until online_page() brings it back. */
+        if ( cur_head->count_info & PGC_need_scrub )
+        {
+            ASSERT(node_need_scrub[node]);
+            node_need_scrub[node]--;
+        }
+
         page_list_add_tail(cur_head,
                            test_bit(_PGC_broken, &cur_head->count_info) ?
                            &page_broken_list : &page_offlined_list);
@@ -803,18 +1261,70 @@ static int reserve_offlined_page(struct page_info *head)
     return count;
 }
 
-/* Free 2^@order set of pages. */
-static void free_heap_pages(
-    struct page_info *pg, unsigned int order)
+/*
+ * Put a free 2^@order chunk, already counted in avail[], on its heap list,
+ * merging it with its free buddies as far as possible.  Returns the head
+ * of the merged chunk.  Requires heap_lock.
+ */
+static struct page_info *merge_heap_chunk(
+    struct page_info *pg, unsigned int node, unsigned int zone,
+    unsigned int order, unsigned int first_dirty)
+{
+    unsigned long mask;
+
+    ASSERT(spin_is_locked(&heap_lock));
+
+    /* Merge chunks as far as possible. */
+    while ( order < MAX_ORDER )
+    {
+        mask = 1UL << order;
+
+        if ( (page_to_mfn(pg) & mask) )
+        {
+            /* Merge with predecessor block? */
+            if ( !mfn_valid(page_to_mfn(pg-mask)) ||
+                 !page_state_is(pg-mask, free) ||
+                 (PFN_ORDER(pg-mask) != order) ||
+                 (phys_to_nid(page_to_maddr(pg-mask)) != node) )
+                break;
+            pg -= mask;
+            page_list_del(pg, &heap(node, zone, order));
+            if ( pg->u.free.first_dirty != INVALID_DIRTY_IDX )
+                first_dirty = pg->u.free.first_dirty;
+            else if ( first_dirty != INVALID_DIRTY_IDX )
+                first_dirty += mask;
+        }
+        else
+        {
+            /* Merge with successor block? */
+            if ( !mfn_valid(page_to_mfn(pg+mask)) ||
+                 !page_state_is(pg+mask, free) ||
+                 (PFN_ORDER(pg+mask) != order) ||
+                 (phys_to_nid(page_to_maddr(pg+mask)) != node) )
+                break;
+            page_list_del(pg + mask, &heap(node, zone, order));
+            if ( first_dirty == INVALID_DIRTY_IDX &&
+                 (pg + mask)->u.free.first_dirty != INVALID_DIRTY_IDX )
+                first_dirty = (pg + mask)->u.free.first_dirty + mask;
+        }
+
+        order++;
+    }
+
+    page_list_add_scrub(pg, node, zone, order, first_dirty);
+
+    return pg;
+}
+
+/* Return a 2^@order chunk to the heap, merging it.  Requires heap_lock. */
+static void free_heap_chunk(
+    struct page_info *pg, unsigned int order, bool_t need_scrub)
 {
-    unsigned long mask, mfn = page_to_mfn(pg);
     unsigned int i, node = phys_to_nid(page_to_maddr(pg)), tainted = 0;
     unsigned int zone = page_to_zone(pg);
+    unsigned int first_dirty = INVALID_DIRTY_IDX, dirty_cnt = 0;
 
-    ASSERT(order <= MAX_ORDER);
-    ASSERT(node >= 0);
-
-    spin_lock(&heap_lock);
+    ASSERT(spin_is_locked(&heap_lock));
 
     for ( i = 0; i < (1 << order); i++ )
     {
@@ -836,60 +1346,64 @@ static void free_heap_pages(
               ? PGC_state_offlined : PGC_state_free));
         if ( page_state_is(&pg[i], offlined) )
             tainted = 1;
-
-        /* If a page has no owner it will need no safety TLB flush. */
-        pg[i].u.free.need_tlbflush = (page_get_owner(&pg[i]) != NULL);
-        if ( pg[i].u.free.need_tlbflush )
-            pg[i].tlbflush_timestamp = tlbflush_current_time();
-
-        /* This page is not a guest frame any more. */
-        page_set_owner(&pg[i], NULL); /* set_gpfn_from_mfn snoops pg owner */
-        set_gpfn_from_mfn(mfn + i, INVALID_M2P_ENTRY);
+        if ( need_scrub )
+        {
+            pg[i].count_info |= PGC_need_scrub;
+            dirty_cnt++;
+        }
     }
 
     avail[node][zone] += 1 << order;
     total_avail_pages += 1 << order;
 
+    if ( dirty_cnt )
+    {
+        node_need_scrub[node] += dirty_cnt;
+        first_dirty = 0;
+    }
+
     if ( opt_tmem )
         midsize_alloc_zone_pages = max(
             midsize_alloc_zone_pages, total_avail_pages / MIDSIZE_ALLOC_FRAC);
 
-    /* Merge chunks as far as possible. */
-    while ( order < MAX_ORDER )
-    {
-        mask = 1UL << order;
+    pg = merge_heap_chunk(pg, node, zone, order, first_dirty);
 
-        if ( (page_to_mfn(pg) & mask) )
-        {
-            /* Merge with predecessor block? */
-            if ( !mfn_valid(page_to_mfn(pg-mask)) ||
-                 !page_state_is(pg-mask, free) ||
-                 (PFN_ORDER(pg-mask) != order) ||
-                 (phys_to_nid(page_to_maddr(pg-mask)) != node) )
-                break;
-            pg -= mask;
-            page_list_del(pg, &heap(node, zone, order));
-        }
-        else
-        {
-            /* Merge with successor block? */
-            if ( !mfn_valid(page_to_mfn(pg+mask)) ||
-                 !page_state_is(pg+mask, free) ||
-                 (PFN_ORDER(pg+mask) != order) ||
-                 (phys_to_nid(page_to_maddr(pg+mask)) != node) )
-                break;
-            page_list_del(pg + mask, &heap(node, zone, order));
-        }
+    if ( tainted )
+        reserve_offlined_page(pg);
+}
 
-        order++;
-    }
+/*
+ * Free 2^@order set of pages.  With @need_scrub the pages are marked as
+ * dirty and left for scrub_free_pages() or the next allocation to clear.
+ */
+static void free_heap_pages(
+    struct page_info *pg, unsigned int order, bool_t need_scrub)
+{
+    unsigned long mfn = page_to_mfn(pg);
+    unsigned int i;
 
-    PFN_ORDER(pg) = order;
-    page_list_add_tail(pg, &heap(node, zone, order));
+    ASSERT(order <= MAX_ORDER);
+    ASSERT(phys_to_nid(page_to_maddr(pg)) >= 0);
 
-    if ( tainted )
-        reserve_offlined_page(pg);
+    for ( i = 0; i < (1 << order); i++ )
+    {
+        /* If a page has no owner it will need no safety TLB flush. */
+        pg[i].u.free.need_tlbflush = (page_get_owner(&pg[i]) != NULL);
+        if ( pg[i].u.free.need_tlbflush )
+            pg[i].tlbflush_timestamp = tlbflush_current_time();
+
+        /* This page is not a guest frame any more. */
+        page_set_owner(&pg[i], NULL); /* set_gpfn_from_mfn snoops pg owner */
+        set_gpfn_from_mfn(mfn + i, INVALID_M2P_ENTRY);
+    }
+
+    /* Dirty pages go straight to the heap, for the idle scrubber. */
+    if ( !need_scrub && (order <= PAGE_CACHE_MAX_ORDER) &&
+         page_cache_free(pg, order) )
+        return;
 
+    lock_heap();
+    free_heap_chunk(pg, order, need_scrub);
     spin_unlock(&heap_lock);
 }
 
@@ -999,12 +1513,13 @@ int offline_page(unsigned long mfn, int broken, uint32_t *status)
         return 0;
     }
 
-    spin_lock(&heap_lock);
+    lock_heap();
 
     old_info = mark_page_offline(pg, broken);
 
     if ( page_state_is(pg, offlined) )
     {
+        offline_gen++;
         reserve_heap_page(pg);
 
         spin_unlock(&heap_lock);
@@ -1067,6 +1582,7 @@ unsigned int online_page(unsigned long mfn, uint32_t *status)
     unsigned long x, nx, y;
     struct page_info *pg;
     int ret;
+    bool_t dirty = 0;
 
     if ( !mfn_valid(mfn) )
     {
@@ -1076,7 +1592,7 @@ unsigned int online_page(unsigned long mfn, uint32_t *status)
 
     pg = mfn_to_page(mfn);
 
-    spin_lock(&heap_lock);
+    lock_heap();
 
     y = pg->count_info;
     do {
@@ -1089,10 +1605,16 @@ unsigned int online_page(unsigned long mfn, uint32_t *status)
             break;
         }
 
+        x = y;
+        nx = (x & ~PGC_state) | PGC_state_inuse;
+
         if ( (y & PGC_state) == PGC_state_offlined )
         {
             page_list_del(pg, &page_offlined_list);
             *status = PG_ONLINE_ONLINED;
+            /* Only a free page can be dirty; it goes back to the heap so. */
+            dirty = !!(x & PGC_need_scrub);
+            nx &= ~PGC_need_scrub;
         }
         else if ( (y & PGC_state) == PGC_state_offlining )
         {
@@ -1102,15 +1624,12 @@ unsigned int online_page(unsigned long mfn, uint32_t *status)
         {
             break;
         }
-
-        x = y;
-        nx = (x & ~PGC_state) | PGC_state_inuse;
     } while ( (y = cmpxchg(&pg->count_info, x, nx)) != x );
 
     spin_unlock(&heap_lock);
 
     if ( (y & PGC_state) == PGC_state_offlined )
-        free_heap_pages(pg, 0);
+        free_heap_pages(pg, 0, dirty);
 
     return ret;
 }
@@ -1126,7 +1645,7 @@ int query_page_offline(unsigned long mfn, uint32_t *status)
     }
 
     *status = 0;
-    spin_lock(&heap_lock);
+    lock_heap();
 
     pg = mfn_to_page(mfn);
 
@@ -1179,7 +1698,7 @@ static void init_heap_pages(
             nr_pages -= n;
         }
 
-        free_heap_pages(pg+i, 0);
+        free_heap_pages(pg+i, 0, 0);
     }
 }
 
@@ -1280,7 +1799,7 @@ void __init scrub_heap_pages(void)
         if ( (mfn % ((100*1024*1024)/PAGE_SIZE)) == 0 )
             printk(".");
 
-        spin_lock(&heap_lock);
+        lock_heap();
 
         /* Re-check page status with lock held. */
         if ( page_state_is(pg, free) )
@@ -1352,7 +1871,7 @@ void free_xenheap_pages(void *v, unsigned int order)
 
     memguard_guard_range(v, 1 << (order + PAGE_SHIFT));
 
-    free_heap_pages(virt_to_page(v), order);
+    free_heap_pages(virt_to_page(v), order, 0);
 }
 
 #else
@@ -1406,7 +1925,7 @@ void free_xenheap_pages(void *v, unsigned int order)
     for ( i = 0; i < (1u << order); i++ )
         pg[i].count_info &= ~PGC_xen_heap;
 
-    free_heap_pages(pg, order);
+    free_heap_pages(pg, order, 0);
 }
 
 #endif
@@ -1507,7 +2026,7 @@ struct page_info *alloc_domheap_pages(
 
     if ( (d != NULL) && assign_pages(d, pg, order, memflags) )
     {
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, 0);
         return NULL;
     }
     
@@ -1553,25 +2072,22 @@ void free_domheap_pages(struct page_info *pg, unsigned int order)
         /*
          * Normally we expect a domain to clear pages before freeing them, if 
          * it cares about the secrecy of their contents. However, after a 
-         * domain has died we assume responsibility for erasure.
+         * domain has died we assume responsibility for erasure.  This is
+         * deferred to idle time (or the next allocation) so that tearing
+         * down a large domain is not held up by it.
          */
-        if ( unlikely(d->is_dying) )
-            for ( i = 0; i < (1 << order); i++ )
-                scrub_one_page(&pg[i]);
-
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, d->is_dying);
     }
     else if ( unlikely(d == dom_cow) )
     {
         ASSERT(order == 0); 
-        scrub_one_page(pg);
-        free_heap_pages(pg, 0);
+        free_heap_pages(pg, 0, 1);
         drop_dom_ref = 0;
     }
     else
     {
         /* Freeing anonymous domain-heap pages. */
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, 0);
         drop_dom_ref = 0;
     }
 
@@ -1593,11 +2109,34 @@ unsigned long avail_domheap_pages_region(
     return avail_heap_pages(zone_lo, zone_hi, node);
 }
 
+/*
+ * Pages sitting in the per-CPU caches, which avail[] doesn't count.  The
+ * counts are read without the caches' locks, so this is only a snapshot.
+ */
+static unsigned long page_cache_pages(void)
+{
+    unsigned int cpu, order;
+    unsigned long nr = 0;
+
+    for_each_online_cpu ( cpu )
+    {
+        struct page_cache *pc = &per_cpu(page_cache, cpu);
+
+        if ( !pc->ready )
+            continue;
+
+        for ( order = 0; order <= PAGE_CACHE_MAX_ORDER; order++ )
+            nr += (unsigned long)read_atomic(&pc->count[order]) << order;
+    }
+
+    return nr;
+}
+
 unsigned long avail_domheap_pages(void)
 {
     return avail_heap_pages(MEMZONE_XEN + 1,
                             NR_ZONES - 1,
-                            -1);
+                            -1) + page_cache_pages();
 }
 
 unsigned long avail_node_heap_pages(unsigned int nodeid)
@@ -1667,6 +2206,149 @@ void scrub_one_page(struct page_info *pg)
     unmap_domain_page(p);
 }
 
+/*
+ * Scrubbing a dirty page costs about as much as looking at this many
+ * clean ones; a single pass does SCRUB_BUDGET worth of work before
+ * letting the idle loop look for real work again.
+ */
+#define SCRUB_PAGE_COST 100
+#define SCRUB_BUDGET    800
+
+/* Pages taken off the heap per pass: SCRUB_BUDGET / SCRUB_PAGE_COST. */
+#define SCRUB_CHUNK_ORDER 3
+
+/* PFN_ORDER() of a chunk taken off the heap to be scrubbed: never merged. */
+#define SCRUB_BUSY_ORDER (MAX_ORDER + 1)
+
+static unsigned int node_to_scrub(void)
+{
+    unsigned int node = cpu_to_node(smp_processor_id());
+
+    if ( node_need_scrub[node] )
+        return node;
+
+    /* Help out nodes which have memory but no CPUs of their own. */
+    for_each_online_node ( node )
+        if ( node_need_scrub[node] &&
+             cpumask_empty(&node_to_cpumask(node)) )
+            return node;
+
+    return NUMA_NO_NODE;
+}
+
+/*
+ * Scrub some of the dirty free pages of this CPU's node.  Called from the
+ * idle loop; returns non-zero if there is more to do.
+ *
+ * Under heap_lock, a dirty chunk is split down to the 2^SCRUB_CHUNK_ORDER
+ * pages holding its first dirty page, which alone are taken off the heap
+ * and out of the avail counts; the rest of the chunk stays allocatable.
+ * The small chunk is scrubbed with the lock dropped, so that CPUs of
+ * several nodes (or several CPUs of one) scrub at once, and merged back
+ * afterwards.  While it is off the heap its order is set to
+ * SCRUB_BUSY_ORDER, which keeps its buddies from merging with it.  A page
+ * of it offlined meanwhile cannot be reserved straight away, as it isn't
+ * on a list; offline_gen tells us to do that when the chunk goes back.
+ */
+bool_t scrub_free_pages(void)
+{
+    struct page_info *pg;
+    unsigned int node, zone, order, i, first_dirty, cnt = 0;
+    unsigned long scrubbed, gen;
+    bool_t more;
+
+    node = node_to_scrub();
+    if ( node == NUMA_NO_NODE || !avail[node] )
+        return 0;
+
+    lock_heap();
+
+    while ( cnt < SCRUB_BUDGET && node_need_scrub[node] )
+    {
+        /* Dirty chunks are at the tail of each list. */
+        for ( zone = 0; zone < NR_ZONES; zone++ )
+            for ( order = MAX_ORDER + 1; order-- > 0; )
+            {
+                if ( page_list_empty(&heap(node, zone, order)) )
+                    continue;
+                pg = page_list_last(&heap(node, zone, order));
+                if ( pg->u.free.first_dirty != INVALID_DIRTY_IDX )
+                    goto found;
+            }
+
+        /* Nothing left on the lists: don't keep the idle loop spinning. */
+        break;
+
+    found:
+        page_list_del(pg, &heap(node, zone, order));
+        first_dirty = pg->u.free.first_dirty;
+
+        /* Give back the halves we won't get to in this pass. */
+        while ( order > SCRUB_CHUNK_ORDER )
+        {
+            order--;
+            if ( first_dirty < (1U << order) )
+                /* Any dirty page of the lower half may be followed by more. */
+                page_list_add_scrub(pg + (1U << order), node, zone, order, 0);
+            else
+            {
+                page_list_add_scrub(pg, node, zone, order, INVALID_DIRTY_IDX);
+                pg += 1U << order;
+                first_dirty -= 1U << order;
+            }
+        }
+
+        avail[node][zone] -= 1UL << order;
+        total_avail_pages -= 1UL << order;
+        PFN_ORDER(pg) = SCRUB_BUSY_ORDER;
+        gen = offline_gen;
+
+        spin_unlock(&heap_lock);
+
+        scrubbed = 0;
+        for ( i = first_dirty; i < (1U << order); )
+        {
+            if ( test_bit(_PGC_need_scrub, &pg[i].count_info) &&
+                 page_state_is(&pg[i], free) )
+            {
+                scrub_one_page(&pg[i]);
+                clear_bit(_PGC_need_scrub, &pg[i].count_info);
+                scrubbed++;
+                cnt += SCRUB_PAGE_COST;
+            }
+            else
+                cnt++;
+
+            /* Carry on from the next page next time. */
+            if ( ++i < (1U << order) && cnt >= SCRUB_BUDGET )
+                break;
+        }
+
+        lock_heap();
+
+        ASSERT(node_need_scrub[node] >= scrubbed);
+        node_need_scrub[node] -= scrubbed;
+        avail[node][zone] += 1UL << order;
+        total_avail_pages += 1UL << order;
+        pg = merge_heap_chunk(pg, node, zone, order,
+                              i < (1U << order) ? i : INVALID_DIRTY_IDX);
+        order = PFN_ORDER(pg);
+
+        if ( unlikely(offline_gen != gen) )
+            for ( i = 0; i < (1U << order); i++ )
+                if ( page_state_is(&pg[i], offlined) )
+                {
+                    reserve_offlined_page(pg);
+                    break;
+                }
+    }
+
+    more = (node_need_scrub[node] != 0);
+    spin_unlock(&heap_lock);
+
+    return more;
+}
+
 static void dump_heap(unsigned char key)
 {
     s_time_t      now = NOW();
@@ -1682,6 +2364,18 @@ static void dump_heap(unsigned char key)
         for ( j = 0; j < NR_ZONES; j++ )
             printk("heap[node=%d][zone=%d] -> %lu pages\n",
                    i, j, avail[i][j]);
+        printk("heap[node=%d] -> %lu pages need scrubbing\n",
+               i, node_need_scrub[i]);
+    }
+
+    for_each_online_cpu ( i )
+    {
+        const struct page_cache *pc = &per_cpu(page_cache, i);
+
+        for ( j = 0; j <= PAGE_CACHE_MAX_ORDER; j++ )
+            if ( pc->count[j] )
+                printk("page_cache[cpu=%d][order=%d] -> %u chunks\n",
+                       i, j, pc->count[j]);
     }
 }
 
@@ -758,7 +758,8 @@ static long do_poll(struct sched_poll *sched_poll)
             goto out;
 
         rc = 0;
-        if ( test_bit(port, &shared_info(d, evtchn_pending)) )
+        if ( port_is_valid(d, port) &&
+             evtchn_port_is_pending(d, evtchn_from_port(d, port)) )
             goto out;
     }
 
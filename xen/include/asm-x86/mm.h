@@ -83,7 +83,13 @@ struct page_info
         /* Page is on a free list: ((count_info & PGC_count_mask) == 0). */
         struct {
             /* Do TLBs need flushing for safety before next page use? */
-            bool_t need_tlbflush;
+            unsigned long need_tlbflush:1;
+            /*
+             * Index of the first page of this free chunk which may still
+             * need scrubbing, or INVALID_DIRTY_IDX if it is all clean.
+             */
+#define INVALID_DIRTY_IDX ((1UL << 24) - 1)
+            unsigned long first_dirty:24;
         } free;
 
     } u;
@@ -204,6 +210,9 @@ struct page_info
  /* Cleared when the owning guest 'frees' this page. */
 #define _PGC_allocated    PG_shift(1)
 #define PGC_allocated     PG_mask(1, 1)
+ /* Free page still holding a dying domain's data (free pages only)? */
+#define _PGC_need_scrub   _PGC_allocated
+#define PGC_need_scrub    PGC_allocated
  /* Page is Xen heap? */
 #define _PGC_xen_heap     PG_shift(2)
 #define PGC_xen_heap      PG_mask(1, 2)
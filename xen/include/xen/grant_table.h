@@ -62,6 +62,8 @@ struct grant_mapping {
     u32      ref;           /* grant ref */
     u16      flags;         /* 0-4: GNTMAP_* ; 5-15: unused */
     domid_t  domid;         /* granting domain */
+    u32      vcpu;          /* vcpu whose free list owns this entry */
+    u32      pad;           /* round size to a power of 2 */
 };
 
 /* Fairly arbitrary. [POLICY] */
@@ -85,10 +87,16 @@ struct grant_table {
     struct active_grant_entry **active;
     /* Mapping tracking table. */
     struct grant_mapping **maptrack;
-    unsigned int          maptrack_head;
     unsigned int          maptrack_limit;
-    /* Lock protecting updates to active and shared grant tables. */
-    spinlock_t            lock;
+    /* Lock serialising maptrack growth. Free lists are per vcpu. */
+    spinlock_t            maptrack_lock;
+    /*
+     * Lock protecting the grant table layout (size, version, frame lists).
+     * Map, unmap and copy only take it for reading and serialise on the
+     * per-entry lock of each active grant entry they touch; anything that
+     * grows the table or changes its version takes it for writing.
+     */
+    rwlock_t              lock;
     /* The defined versions are 1 and 2.  Set to 0 if we don't know
        what version to use yet. */
     unsigned              gt_version;
@@ -99,6 +107,7 @@ int grant_table_create(
     struct domain *d);
 void grant_table_destroy(
     struct domain *d);
+void grant_table_init_vcpu(struct vcpu *v);
 
 /* Domain death release of granted mappings of other domains' memory. */
 void
@@ -106,7 +115,7 @@ gnttab_release_mappings(
     struct domain *d);
 
 /* Increase the size of a domain's grant table.
- * Caller must hold d's grant table lock.
+ * Caller must hold d's grant table write lock.
  */
 int
 gnttab_grow_table(struct domain *d, unsigned int req_nr_frames);
@@ -6,6 +6,7 @@
 #include <xen/spinlock.h>
 #include <xen/time.h>
 #include <xen/list.h>
+#include <public/event_channel.h>
 #include <asm/regs.h>
 #include <asm/hardirq.h>
 
@@ -108,7 +109,7 @@ struct vcpu;
 
 struct pirq {
     int pirq;
-    u16 evtchn;
+    evtchn_port_t evtchn;
     bool_t masked;
     struct rcu_head rcu_head;
     struct arch_pirq arch;
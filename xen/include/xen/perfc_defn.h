@@ -53,4 +53,21 @@ PERFCOUNTER(vcpu_hot,               "csched: vcpu_hot")
 
 PERFCOUNTER(need_flush_tlb_flush,   "PG_need_flush tlb flushes")
 
+/* heap allocator counters */
+PERFCOUNTER(heap_lock,              "heap: heap_lock acquisitions")
+PERFCOUNTER(heap_lock_contended,    "heap: heap_lock contended")
+PERFCOUNTER(page_cache_alloc,       "heap: page cache allocations")
+PERFCOUNTER(page_cache_free,        "heap: page cache frees")
+PERFCOUNTER(page_cache_refill,      "heap: page cache refills")
+PERFCOUNTER(page_cache_drain,       "heap: page cache drains")
+
+/* grant table lock counters */
+PERFCOUNTER(grant_lock_read,            "grant: table read locks")
+PERFCOUNTER(grant_lock_read_contended,  "grant: table read lock contended")
+PERFCOUNTER(grant_lock_write,           "grant: table write locks")
+PERFCOUNTER(grant_lock_write_contended, "grant: table write lock contended")
+PERFCOUNTER(grant_active_lock,          "grant: active entry locks")
+PERFCOUNTER(grant_active_lock_contended, "grant: active entry lock contended")
+PERFCOUNTER(grant_maptrack_steal,       "grant: maptrack handles stolen")
+
 /*#endif*/ /* __XEN_PERFC_DEFN_H__ */
@@ -24,6 +24,7 @@
 #include <public/sysctl.h>
 #include <public/vcpu.h>
 #include <public/mem_event.h>
+#include <public/event_channel.h>
 
 #ifdef CONFIG_COMPAT
 #include <compat/vcpu.h>
@@ -50,9 +51,18 @@ extern struct domain *dom0;
 #else
 #define BITS_PER_EVTCHN_WORD(d) (has_32bit_shinfo(d) ? 32 : BITS_PER_XEN_ULONG)
 #endif
-#define MAX_EVTCHNS(d) (BITS_PER_EVTCHN_WORD(d) * BITS_PER_EVTCHN_WORD(d))
+#define MAX_EVTCHNS(d) ((d)->evtchn_fifo ? EVTCHN_FIFO_NR_CHANNELS : \
+                        BITS_PER_EVTCHN_WORD(d) * BITS_PER_EVTCHN_WORD(d))
+
+/*
+ * Event channels are allocated in buckets of EVTCHNS_PER_BUCKET; the
+ * bucket pointers are in turn held in page-sized groups, so that the
+ * FIFO ABI's port space does not bloat struct domain.
+ */
 #define EVTCHNS_PER_BUCKET 128
-#define NR_EVTCHN_BUCKETS  (NR_EVENT_CHANNELS / EVTCHNS_PER_BUCKET)
+#define BUCKETS_PER_GROUP  (PAGE_SIZE / sizeof(struct evtchn *))
+#define EVTCHNS_PER_GROUP  (BUCKETS_PER_GROUP * EVTCHNS_PER_BUCKET)
+#define NR_EVTCHN_GROUPS   DIV_ROUND_UP(EVTCHN_FIFO_NR_CHANNELS, EVTCHNS_PER_GROUP)
 
 struct evtchn
 {
@@ -71,16 +81,21 @@ struct evtchn
             domid_t remote_domid;
         } unbound;     /* state == ECS_UNBOUND */
         struct {
-            u16            remote_port;
+            evtchn_port_t  remote_port;
             struct domain *remote_dom;
         } interdomain; /* state == ECS_INTERDOMAIN */
         struct {
             u16            irq;
-            u16            next_port;
-            u16            prev_port;
+            evtchn_port_t  next_port;
+            evtchn_port_t  prev_port;
         } pirq;        /* state == ECS_PIRQ */
         u16 virq;      /* state == ECS_VIRQ */
     } u;
+    evtchn_port_t port;    /* This channel's own port number. */
+    u8  priority;          /* FIFO ABI: queue to link onto when raised. */
+    u8  last_priority;     /* FIFO ABI: queue it was last linked onto. */
+    u16 last_vcpu_id;      /* FIFO ABI: VCPU whose queue that was. */
+    bool_t pending;        /* FIFO ABI: raised before its event word existed. */
 #ifdef FLASK_ENABLE
     void *ssid;
 #endif
@@ -171,7 +186,7 @@ struct vcpu
     atomic_t         pause_count;
 
     /* IRQ-safe virq_lock protects against delivering VIRQ to stale evtchn. */
-    u16              virq_to_evtchn[NR_VIRQS];
+    evtchn_port_t    virq_to_evtchn[NR_VIRQS];
     spinlock_t       virq_lock;
 
     /* Bitmask of CPUs on which this VCPU may run. */
@@ -195,6 +210,14 @@ struct vcpu
     /* Guest-specified relocation of vcpu_info. */
     unsigned long vcpu_info_mfn;
 
+    /* FIFO event channel queues, see event_fifo.c. */
+    struct evtchn_fifo_vcpu *evtchn_fifo;
+
+    /* Maptrack free list of the domain's grant table, see grant_table.c. */
+    spinlock_t       maptrack_freelist_lock;
+    unsigned int     maptrack_head;
+    unsigned int     maptrack_tail;
+
     struct arch_vcpu arch;
 };
 
@@ -269,8 +292,10 @@ struct domain
     spinlock_t       rangesets_lock;
 
     /* Event channel information. */
-    struct evtchn   *evtchn[NR_EVTCHN_BUCKETS];
+    struct evtchn  **evtchn_group[NR_EVTCHN_GROUPS];
     spinlock_t       event_lock;
+    const struct evtchn_port_ops *evtchn_port_ops;
+    struct evtchn_fifo_domain *evtchn_fifo;
 
     struct grant_table *grant_table;
 